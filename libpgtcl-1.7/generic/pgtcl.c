@@ -61,23 +61,43 @@
 /* END STUBS MUMBO JUMBO */
 
 
+/* guards the process-wide setup done in Pgtcl_Init */
+TCL_DECLARE_MUTEX(pgtclInitMutex)
+static int pgtclEnvDone = 0;
 
 typedef struct {
     char *name;                 /* Name of command. */
     char *name2;                /* Name of command, in ::pg namespace. */
     Tcl_ObjCmdProc *objProc;    /* Command's object-based procedure. */
     int protocol;    /* version 2 or version 3 (>=7.4) of PG protocol */
+    Tcl_ObjCmdProc *nreProc;    /* non-recursive version, or NULL */
 } PgCmd;
 
 static PgCmd commands[] = {
     {"pg_conndefaults", "::pg::conndefaults", Pg_conndefaults, 2},
     {"pg_connect", "::pg::connect", Pg_connect,2},
     {"pg_disconnect", "::pg::disconnect", Pg_disconnect,2},
+#ifdef PGTCL_USE_NRE
+    {"pg_exec", "::pg::sqlexec", Pg_exec,2, Pg_exec_nr},
+#else
     {"pg_exec", "::pg::sqlexec", Pg_exec,2},
+#endif
     {"pg_exec_prepared", "::pg::exec_prepared", Pg_exec_prepared,3},
+#ifdef PGTCL_USE_NRE
+    {"pg_select", "::pg::select", Pg_select,2, Pg_select_nr},
+#else
     {"pg_select", "::pg::select", Pg_select,2},
+#endif
+#ifdef PGTCL_USE_NRE
+    {"pg_result", "::pg::result", Pg_result,2, Pg_result_nr},
+#else
     {"pg_result", "::pg::result", Pg_result,2},
+#endif
+#ifdef PGTCL_USE_NRE
+    {"pg_execute", "::pg::execute", Pg_execute,2, Pg_execute_nr},
+#else
     {"pg_execute", "::pg::execute", Pg_execute,2},
+#endif
     {"pg_lo_open", "::pg::lo_open", Pg_lo_open,2},
     {"pg_lo_close", "::pg::lo_close", Pg_lo_close,2},
     {"pg_lo_read", "::pg::lo_read", Pg_lo_read,2},
@@ -89,6 +109,11 @@ static PgCmd commands[] = {
     {"pg_lo_unlink", "::pg::lo_unlink", Pg_lo_unlink,2},
     {"pg_lo_import", "::pg::lo_import", Pg_lo_import,2},
     {"pg_lo_export", "::pg::lo_export", Pg_lo_export,2},
+    {"pg_lo_channel", "::pg::lo_channel", Pg_lo_channel,2},
+    {"pg_stats", "::pg::stats", Pg_stats,2},
+    {"pg_trace", "::pg::trace", Pg_trace,2},
+    {"pg_untrace", "::pg::untrace", Pg_untrace,2},
+    {"pg_notices", "::pg::notices", Pg_notices,2},
     {"pg_listen", "::pg::listen", Pg_listen,2},
     {"pg_sendquery", "::pg::sendquery", Pg_sendquery,2},
     {"pg_sendquery_prepared", "::pg::sendquery_prepared", Pg_sendquery_prepared,3},
@@ -100,10 +125,12 @@ static PgCmd commands[] = {
     {"pg_on_connection_loss", "::pg::on_connection_loss", Pg_on_connection_loss,2},
     {"pg_quote", "::pg::quote", Pg_quote,2},
     {"pg_escape_string", "::pg::escape_string", Pg_quote,2},
+    {"pg_format", "::pg::format", Pg_format,2},
     {"pg_escape_bytea", "::pg::escape_bytea", Pg_escapeBytea,2},
     {"pg_unescape_bytea", "::pg::unescape_bytea", Pg_unescapeBytea,2},
     {"pg_dbinfo", "::pg::dbinfo", Pg_dbinfo,2},
     {"pg_getdata", "::pg::getdata", Pg_getdata,2},
+    {"pg_pool", "::pg::pool", Pg_pool,2},
     {NULL, NULL, NULL, 0}
 };
 
@@ -127,8 +154,13 @@ Pgtcl_Init(Tcl_Interp *interp)
         #endif
 
 #ifdef USE_TCL_STUBS
+#ifdef PGTCL_USE_NRE
+	if (Tcl_InitStubs(interp, "8.6", 0) == NULL)
+		return TCL_ERROR;
+#else
 	if (Tcl_InitStubs(interp, "8.1", 0) == NULL)
 		return TCL_ERROR;
+#endif
 #endif
 
         #ifdef WIN32X
@@ -181,20 +213,46 @@ Pgtcl_Init(Tcl_Interp *interp)
 	if (Tcl_GetDoubleFromObj(interp, tclVersionObj, &tclversion) == TCL_ERROR)
 		return TCL_ERROR;
 
-	if (tclversion >= 8.1)
+	/*
+	 * The environment is process-wide, so only set it the first time we
+	 * are loaded, whichever thread that happens in.
+	 */
+	Tcl_MutexLock(&pgtclInitMutex);
+	if (tclversion >= 8.1 && !pgtclEnvDone)
+	{
 		Tcl_PutEnv("PGCLIENTENCODING=UNICODE");
+		pgtclEnvDone = 1;
+	}
+	Tcl_MutexUnlock(&pgtclInitMutex);
 
 	/* register all pgtcl commands */
 
 
     for (cmdPtr = commands; cmdPtr->name != NULL; cmdPtr++) {
 
+#ifdef PGTCL_USE_NRE
+        if (cmdPtr->nreProc != NULL) {
+            Tcl_NRCreateCommand(interp, cmdPtr->name, cmdPtr->objProc,
+                 cmdPtr->nreProc, (ClientData) "::", NULL);
+            Tcl_NRCreateCommand(interp, cmdPtr->name2, cmdPtr->objProc,
+                 cmdPtr->nreProc, (ClientData) "::pg::", NULL);
+            continue;
+        }
+#endif
+
         Tcl_CreateObjCommand(interp, cmdPtr->name, 
              cmdPtr->objProc, (ClientData) "::",NULL);
          Tcl_CreateObjCommand(interp, cmdPtr->name2, 
              cmdPtr->objProc, (ClientData) "::pg::",NULL);
     }
 
+    /*
+     * for the test suite and benchmarks only, so not in the table, and
+     * in a namespace of its own that namespace export * leaves alone
+     */
+    Tcl_CreateObjCommand(interp, "::pg::internal::synthetic_result",
+         Pg_synthetic_result, (ClientData) "::pg::", NULL);
+
 
     if (Tcl_Eval(interp, "namespace eval ::pg namespace export *") == TCL_ERROR)
         return TCL_ERROR;
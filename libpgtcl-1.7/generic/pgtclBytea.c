@@ -0,0 +1,226 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgtclBytea.c
+ *
+ *	Conversion between bytea values in the server's hex format
+ *	("\x" followed by two hex digits per byte) and Tcl byte arrays.
+ *	The digits are decoded straight into the byte array's buffer and
+ *	encoded straight into the string's, sixteen bytes at a time with
+ *	SSE2 where the compiler offers it, else one byte at a time.
+ *
+ *	Values in the older escape format, which servers before 9.0 send,
+ *	are left to PQunescapeBytea, as is hex that isn't well formed, which
+ *	it decodes as best it can rather than failing.
+ *
+ * IDENTIFICATION
+ *	  $Id$
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <libpq-fe.h>
+
+#include "pgtclCmds.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PGTCL_HEX_SSE2
+#include <emmintrin.h>
+#endif
+
+/* value of each hex digit, -1 for anything else */
+static const signed char hexValue[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static const char hexDigits[] = "0123456789abcdef";
+
+#ifdef PGTCL_HEX_SSE2
+/*
+ * Decode 32 hex digits into 16 bytes.  Returns 0, leaving dst alone, if
+ * any of them isn't a hex digit.
+ */
+static int
+PgHexDecode32(const char *src, unsigned char *dst)
+{
+	__m128i		lo = _mm_loadu_si128((const __m128i *) src);
+	__m128i		hi = _mm_loadu_si128((const __m128i *) (src + 16));
+	__m128i		bytes[2];
+	int			i;
+
+	for (i = 0; i < 2; i++)
+	{
+		__m128i		c = i ? hi : lo;
+		__m128i		lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+		__m128i		digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+										  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+		__m128i		alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+										  _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+		__m128i		nibbles;
+
+		if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xFFFF)
+			return 0;
+
+		nibbles = _mm_or_si128(
+			_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+			_mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+		/* each 16-bit lane holds a high nibble, then a low one */
+		bytes[i] = _mm_or_si128(
+			_mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00FF)), 4),
+			_mm_srli_epi16(nibbles, 8));
+	}
+
+	_mm_storeu_si128((__m128i *) dst, _mm_packus_epi16(bytes[0], bytes[1]));
+	return 1;
+}
+
+/*
+ * Encode 16 bytes as 32 hex digits.
+ */
+static void
+PgHexEncode16(const unsigned char *src, char *dst)
+{
+	__m128i		b = _mm_loadu_si128((const __m128i *) src);
+	__m128i		mask = _mm_set1_epi8(0x0F);
+	__m128i		nine = _mm_set1_epi8(9);
+	__m128i		hi = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+	__m128i		lo = _mm_and_si128(b, mask);
+
+	/* '0' + n, plus the gap up to 'a' for n > 9 */
+	hi = _mm_add_epi8(_mm_add_epi8(hi, _mm_set1_epi8('0')),
+					  _mm_and_si128(_mm_cmpgt_epi8(hi, nine), _mm_set1_epi8('a' - '0' - 10)));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, _mm_set1_epi8('0')),
+					  _mm_and_si128(_mm_cmpgt_epi8(lo, nine), _mm_set1_epi8('a' - '0' - 10)));
+
+	_mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *) (dst + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#endif   /* PGTCL_HEX_SSE2 */
+
+/*
+ * Decode the hex digits at src, which may be separated by white space
+ * between bytes as byteain allows.  Returns the number of bytes stored
+ * at dst, which must have room for len / 2, or -1 if src isn't valid.
+ */
+int
+PgHexDecode(const char *src, int len, unsigned char *dst)
+{
+	const char *end = src + len;
+	unsigned char *start = dst;
+	int			hi,
+				lo;
+
+	while (src < end)
+	{
+#ifdef PGTCL_HEX_SSE2
+		if (end - src >= 32 && PgHexDecode32(src, dst))
+		{
+			src += 32;
+			dst += 16;
+			continue;
+		}
+#endif
+		if (*src == ' ' || *src == '\t' || *src == '\n' || *src == '\r')
+		{
+			src++;
+			continue;
+		}
+
+		if (end - src < 2 ||
+			(hi = hexValue[(unsigned char) src[0]]) < 0 ||
+			(lo = hexValue[(unsigned char) src[1]]) < 0)
+			return -1;
+
+		*dst++ = (unsigned char) ((hi << 4) | lo);
+		src += 2;
+	}
+
+	return (int) (dst - start);
+}
+
+/*
+ * Store the 2 * len hex digits for the bytes at src at dst.
+ */
+void
+PgHexEncode(const unsigned char *src, int len, char *dst)
+{
+	int			i = 0;
+
+#ifdef PGTCL_HEX_SSE2
+	for (; i + 16 <= len; i += 16)
+		PgHexEncode16(src + i, dst + 2 * i);
+#endif
+	for (; i < len; i++)
+	{
+		dst[2 * i] = hexDigits[src[i] >> 4];
+		dst[2 * i + 1] = hexDigits[src[i] & 0x0F];
+	}
+}
+
+/*
+ * Turn a bytea value as the server sends it into a byte array object.
+ * Returns NULL if it can't be decoded.  Hex with an odd digit or a stray
+ * character comes out as PQunescapeBytea has always made it.
+ */
+Tcl_Obj *
+PgByteaToObj(const char *value, int length)
+{
+	Tcl_Obj    *obj;
+	unsigned char *bytes;
+	size_t		byteLen;
+	int			n;
+
+	if (length >= 2 && value[0] == '\\' && value[1] == 'x')
+	{
+		obj = Tcl_NewByteArrayObj(NULL, 0);
+		bytes = Tcl_SetByteArrayLength(obj, (length - 2) / 2);
+		if ((n = PgHexDecode(value + 2, length - 2, bytes)) >= 0)
+		{
+			Tcl_SetByteArrayLength(obj, n);
+			return obj;
+		}
+		Tcl_DecrRefCount(obj);
+	}
+
+	/* the escape format, or hex PgHexDecode won't take */
+	if ((bytes = PQunescapeBytea((const unsigned char *) value, &byteLen)) == NULL)
+		return NULL;
+	obj = Tcl_NewByteArrayObj(bytes, (int) byteLen);
+	PQfreemem(bytes);
+	return obj;
+}
+
+/*
+ * Make a bytea literal in the hex format for the bytes at src, quoted
+ * for use in a string constant: prefix is "\\x", or "\x" where
+ * standard_conforming_strings is on.
+ */
+Tcl_Obj *
+PgByteaHexObj(const unsigned char *src, int len, const char *prefix)
+{
+	Tcl_Obj    *obj = Tcl_NewObj();
+	int			prefixLen = (int) strlen(prefix);
+	char	   *dst;
+
+	Tcl_SetObjLength(obj, prefixLen + 2 * len);
+	dst = Tcl_GetString(obj);
+	memcpy(dst, prefix, prefixLen);
+	PgHexEncode(src, len, dst + prefixLen);
+	return obj;
+}
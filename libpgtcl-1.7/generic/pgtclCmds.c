@@ -28,210 +28,276 @@
 /*
  * Local function forward declarations
  */
-static int execute_put_values(Tcl_Interp *interp, CONST84 char *array_varname,
-				   PGresult *result, char *nullString, int tupno);
+static int execute_put_values(Tcl_Interp *interp, Tcl_Obj *arrayObj,
+				   Tcl_Obj **columnNameObjs, PGresult *result,
+				   char *nullString, int decode, int tupno);
+static Tcl_Obj **PgColumnNameObjs(PGresult *result, int ncols);
+static void PgColumnNameObjsFree(Tcl_Obj **columnNameObjs, int ncols);
+static int PgExecResult(Tcl_Interp *interp, Pg_ConnectionId *connid,
+				   CONST84 char *connString, CONST84 char *execString,
+				   PGresult *result);
+static int PgExecute(ClientData cData, Tcl_Interp *interp, int objc,
+				   Tcl_Obj *CONST objv[]);
+static int PgExecuteArgs(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+				   Tcl_Obj **arrayObjPtr, Tcl_Obj **oidObjPtr,
+				   Tcl_Obj **paramsObjPtr, Tcl_Obj **preparedObjPtr);
+static int PgExecuteResult(Tcl_Interp *interp, Pg_ConnectionId *connid,
+				   PGresult *result, Tcl_Obj *arrayObj, Tcl_Obj *oidObj,
+				   CONST84 char *queryString, Tcl_Obj *evalObj);
+static int PgSelect(ClientData cData, Tcl_Interp *interp, int objc,
+				   Tcl_Obj *CONST objv[]);
+static int PgSelectArgs(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+				   Tcl_Obj **paramsObjPtr, Tcl_Obj **preparedObjPtr);
+static int PgSelectResult(Tcl_Interp *interp, Pg_ConnectionId *connid,
+				   PGresult *result, Tcl_Obj *varNameObj,
+				   Tcl_Obj *procStringObj);
+
+typedef struct Pg_Query_s Pg_Query;
+static int PgQueryInit(Tcl_Interp *interp, Pg_Query *query, Tcl_Obj *queryObj,
+				   Tcl_Obj *preparedObj, Tcl_Obj *paramsObj);
+static PGresult *PgQueryExec(Pg_ConnectionId *connid, Pg_Query *query,
+				   int family);
+static void PgQueryFree(Pg_Query *query);
+
+/* what runs a row loop, which decides how the rows are bound */
+enum Pg_LoopKind
+{
+	PG_LOOP_EXECUTE, PG_LOOP_SELECT, PG_LOOP_FOREACH
+};
+
+typedef struct Pg_Loop_s Pg_Loop;
+static Pg_Loop *PgLoopNew(Pg_ConnectionId *connid, PGresult *result,
+				   Tcl_Obj *varNameObj, Tcl_Obj *bodyObj, int kind);
+static Pg_Loop *PgLoopForeach(Tcl_Interp *interp, Pg_resultid *resultid,
+				   PGresult *result, Tcl_Obj *varListObj, Tcl_Obj *arrayObj,
+				   Tcl_Obj *bodyObj);
+static int PgLoopRun(Tcl_Interp *interp, Pg_Loop *loop);
+static int PgResult(ClientData cData, Tcl_Interp *interp, int objc,
+				   Tcl_Obj *CONST objv[]);
+
+typedef struct Pg_Slice_s Pg_Slice;
+static int PgSliceInit(Tcl_Interp *interp, PGresult *result, int objc,
+				   Tcl_Obj *CONST objv[], int first, int allowColumns,
+				   Pg_Slice *slice);
+static void PgSliceFree(Pg_Slice *slice);
+static int PgColumnIndex(Tcl_Interp *interp, PGresult *result,
+				   Tcl_Obj *columnObj, int *columnPtr);
+static int PgResultIndex(Tcl_Interp *interp, Pg_resultid *resultid,
+				   PGresult *result, Tcl_Obj *columnsObj);
+static int PgResultLookup(Tcl_Interp *interp, Pg_resultid *resultid,
+				   PGresult *result, Tcl_Obj *keyObj, int asDict);
+static int PgResultAssignLazy(Tcl_Interp *interp, Pg_resultid *resultid,
+				   PGresult *result, Tcl_Obj *arrayObj, Pg_Slice *slice);
+
 
+/*
+ * PgArrayDelimiter()
+ *
+ * If columns of this type hold arrays, return the delimiter between
+ * their elements, else 0.  Built-in array types are known.  Types
+ * created in the database can't be told apart without asking the
+ * catalog: a domain, an enum or a composite may well have values
+ * starting with '{'.  So they are only taken for arrays if decode asks
+ * for PGTCL_DECODE_USER_ARRAYS, and then the parser decides.
+ */
 
-#ifdef TCL_ARRAYS
+#define PG_FIRST_NORMAL_OID	16384
+#define PG_ARRAY_MAXDIM		6
 
-#define ISOCTAL(c)		(((c) >= '0') && ((c) <= '7'))
-#define DIGIT(c)		((c) - '0')
+static char
+PgArrayDelimiter(Oid type, int decode)
+{
+	switch (type)
+	{
+		case 1020:				/* box[] is the odd one out */
+			return ';';
+
+		case 143:   case 199:   case 271:   case 629:   case 651:
+		case 719:   case 775:   case 791:   case 1000:  case 1001:
+		case 1002:  case 1003:  case 1005:  case 1006:  case 1007:
+		case 1008:  case 1009:  case 1010:  case 1011:  case 1012:
+		case 1013:  case 1014:  case 1015:  case 1016:  case 1017:
+		case 1018:  case 1019:  case 1021:  case 1022:  case 1027:
+		case 1028:  case 1034:  case 1040:  case 1041:  case 1115:
+		case 1182:  case 1183:  case 1185:  case 1187:  case 1231:
+		case 1263:  case 1270:  case 1561:  case 1563:  case 2201:
+		case 2207:  case 2208:  case 2209:  case 2210:  case 2211:
+		case 2949:  case 2951:  case 3221:  case 3643:  case 3645:
+		case 3735:  case 3770:  case 3807:  case 3905:  case 3907:
+		case 3909:  case 3911:  case 3913:  case 3927:  case 4073:
+		case 4090:  case 4097:  case 4192:
+			return ',';
 
+		default:
+			return ((decode & PGTCL_DECODE_USER_ARRAYS) &&
+					type >= PG_FIRST_NORMAL_OID) ? ',' : 0;
+	}
+}
 
 /*
- * translate_escape()
+ * PgArrayScan()
  *
- * This function performs in-place translation of a single C-style
- * escape sequence pointed by p. Curly braces { } and double-quote
- * are left escaped if they appear inside an array.
- * The value returned is the pointer to the last character (the one
- * just before the rest of the buffer).
+ * Collect the characters of an array element up to the first one in
+ * stops (which must include the backslash), undoing backslash quoting
+ * on the way.  Runs of plain characters are copied in one go.
  */
 
-static inline char *
-translate_escape(char *p, int isArray)
+static Tcl_Obj *
+PgArrayScan(CONST char **pp, CONST char *stops)
 {
-	char		c,
-			   *q,
-			   *s;
+	CONST char *p = *pp;
+	Tcl_Obj    *obj = NULL;
+	size_t		n;
 
-#ifdef TCL_ARRAYS_DEBUG_ESCAPE
-	printf("   escape = '%s'\n", p);
-#endif
-	/* Address of the first character after the escape sequence */
-	s = p + 2;
-	switch (c = *(p + 1))
-	{
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-			c = DIGIT(c);
-			if (ISOCTAL(*s))
-				c = (c << 3) + DIGIT(*s++);
-			if (ISOCTAL(*s))
-				c = (c << 3) + DIGIT(*s++);
-			*p = c;
-			break;
-		case 'b':
-			*p = '\b';
-			break;
-		case 'f':
-			*p = '\f';
-			break;
-		case 'n':
-			*p = '\n';
-			break;
-		case 'r':
-			*p = '\r';
-			break;
-		case 't':
-			*p = '\t';
-			break;
-		case 'v':
-			*p = '\v';
+	for (;;)
+	{
+		n = strcspn(p, stops);
+		if (p[n] != '\\')
 			break;
-		case '\\':
-		case '{':
-		case '}':
-		case '"':
 
-			/*
-			 * Backslahes, curly braces and double-quotes are left escaped
-			 * if they appear inside an array. They will be unescaped by
-			 * Tcl in Tcl_AppendElement. The buffer position is advanced
-			 * by 1 so that the this character is not processed again by
-			 * the caller.
-			 */
-			if (isArray)
-				return p + 1;
-			else
-				*p = c;
-			break;
-		case '\0':
+		if (obj == NULL)
+			obj = Tcl_NewStringObj(p, n);
+		else
+			Tcl_AppendToObj(obj, p, n);
 
-			/*
-			 * This means a backslash at the end of the string. It should
-			 * never happen but in that case replace the \ with a \0 but
-			 * don't shift the rest of the buffer so that the caller can
-			 * see the end of the string and terminate.
-			 */
-			*p = c;
-			return p;
+		if (p[n + 1] == '\0')
+		{
+			p += n + 1;
+			n = 0;
 			break;
-		default:
+		}
+		Tcl_AppendToObj(obj, p + n + 1, 1);
+		p += n + 2;
+	}
 
-			/*
-			 * Default case, store the escaped character over the
-			 * backslash and shift the buffer over itself.
-			 */
-			*p = c;
-	}
-	/* Shift the rest of the buffer over itself after the current char */
-	q = p + 1;
-	for (; *s;)
-		*q++ = *s++;
-	*q = '\0';
-#ifdef TCL_ARRAYS_DEBUG_ESCAPE
-	printf("   after  = '%s'\n", p);
-#endif
-	return p;
+	if (obj == NULL)
+		obj = Tcl_NewStringObj(p, n);
+	else
+		Tcl_AppendToObj(obj, p, n);
+	*pp = p + n;
+	return obj;
 }
 
 /*
- * tcl_value()
+ * PgArrayParse()
  *
- * This function does in-line conversion of a value returned by libpq
- * into a tcl string or into a tcl list if the value looks like the
- * representation of a postgres array.
+ * Turn the array literal at *pp, which starts with '{', into a Tcl
+ * list, with a sublist for each inner dimension.  Leaves *pp after the
+ * closing '}'.  Returns NULL if it isn't a well-formed array.
  */
 
-static char *
-tcl_value(char *value)
+static Tcl_Obj *
+PgArrayParse(CONST char **pp, char delim, CONST char *nullString, int depth)
 {
-	int			literal,
-				last;
-	char	   *p;
+	CONST char *p = *pp;
+	Tcl_Obj    *listObj;
+	Tcl_Obj    *elemObj;
+	char		stops[4];
 
-	if (!value)
+	if (*p != '{' || depth > PG_ARRAY_MAXDIM)
 		return NULL;
 
+	stops[0] = delim;
+	stops[1] = '}';
+	stops[2] = '\\';
+	stops[3] = '\0';
 
-#ifdef TCL_ARRAYS_DEBUG
-	printf("pq_value  = '%s'\n", value);
-#endif
-	last = strlen(value) - 1;
-	if ((last >= 1) && (value[0] == '{') && (value[last] == '}'))
-	{
-		/* Looks like an array, replace ',' with spaces */
-		/* Remove the outer pair of { }, the last first! */
-		value[last] = '\0';
-		value++;
-		literal = 0;
-		for (p = value; *p; p++)
+	listObj = Tcl_NewListObj(0, NULL);
+	p++;
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p == '}')
+	{
+		*pp = p + 1;
+		return listObj;
+	}
+
+	for (;;)
+	{
+		while (isspace((unsigned char)*p))
+			p++;
+
+		if (*p == '{')
+		{
+			if ((elemObj = PgArrayParse(&p, delim, nullString, depth + 1)) == NULL)
+				goto bad;
+		}
+		else if (*p == '"')
 		{
-			if (!literal)
+			p++;
+			elemObj = PgArrayScan(&p, "\"\\");
+			if (*p != '"')
 			{
-				/* We are at the list level, look for ',' and '"' */
-				switch (*p)
-				{
-					case '"':	/* beginning of literal */
-						literal = 1;
-						break;
-					case ',':	/* replace the ',' with space */
-						*p = ' ';
-						break;
-				}
+				Tcl_DecrRefCount(elemObj);
+				goto bad;
 			}
-			else
-			{
-				/* We are inside a C string */
-				switch (*p)
-				{
-					case '"':	/* end of literal */
-						literal = 0;
-						break;
-					case '\\':
+			p++;
+		}
+		else if (strncmp(p, "NULL", 4) == 0 &&
+				 (p[4] == delim || p[4] == '}' || isspace((unsigned char)p[4])))
+		{
+			elemObj = Tcl_NewStringObj(nullString ? nullString : "", -1);
+			p += 4;
+		}
+		else
+		{
+			elemObj = PgArrayScan(&p, stops);
+		}
 
-						/*
-						 * escape sequence, translate it
-						 */
-						p = translate_escape(p, 1);
-						break;
-				}
-			}
-			if (!*p)
-				break;
+		Tcl_ListObjAppendElement(NULL, listObj, elemObj);
+
+		while (isspace((unsigned char)*p))
+			p++;
+		if (*p == delim)
+		{
+			p++;
+			continue;
 		}
-	}
-	else
-	{
-		/* Looks like a normal scalar value */
-		for (p = value; *p; p++)
+		if (*p == '}')
 		{
-			if (*p == '\\')
-			{
-				/*
-				 * escape sequence, translate it
-				 */
-				p = translate_escape(p, 0);
-			}
-			if (!*p)
-				break;
+			*pp = p + 1;
+			return listObj;
 		}
+		goto bad;
 	}
-#ifdef TCL_ARRAYS_DEBUG
-	printf("tcl_value = '%s'\n\n", value);
-#endif
-	return value;
+
+bad:
+	Tcl_DecrRefCount(listObj);
+	return NULL;
+}
+
+/*
+ * PgArrayToObj()
+ *
+ * Convert an array value, as sent by the server, into nested Tcl lists.
+ * NULL elements become nullString.  Returns NULL if the value isn't an
+ * array after all.
+ */
+
+static Tcl_Obj *
+PgArrayToObj(CONST char *value, char delim, CONST char *nullString)
+{
+	CONST char *p = value;
+	Tcl_Obj    *listObj;
+
+	/* skip the bounds decoration of arrays not starting at 1 */
+	if (*p == '[')
+	{
+		if ((p = strchr(p, '=')) == NULL)
+			return NULL;
+		p++;
+	}
+
+	if ((listObj = PgArrayParse(&p, delim, nullString, 1)) == NULL)
+		return NULL;
+
+	if (*p != '\0')
+	{
+		Tcl_DecrRefCount(listObj);
+		return NULL;
+	}
+	return listObj;
 }
-#else    /* TCL_ARRAYS */
-#define tcl_value(x) x
-#endif   /* TCL_ARRAYS */
 
 /*
  * PGgetvalue()
@@ -242,9 +308,7 @@ tcl_value(char *value)
  * the returned field is actually null and, if so, the null string value
  * associated with the connection is returned.
  *
- * If array-into-list processing has been defined, it is also performed,
- * which is probably a bad idea, since it can be tricked by legitimate
- * data, but that's tcl_value's fault, if TCL_ARRAYS is defined.
+ * The string belongs to the PGresult and is never modified.
  */
 
 static char *
@@ -271,7 +335,101 @@ PGgetvalue ( PGresult *result, char *nullString, int tupno, int fieldNumber )
 	}
 
 	/* string is not empty */
-	return tcl_value (string);
+	return string;
+}
+
+/*
+ * PGgetvalueObj()
+ *
+ * Like PGgetvalue, but returns a new Tcl object.  decode says which
+ * values are converted: with PGTCL_DECODE_ARRAYS, an array becomes a
+ * list with a sublist for each inner dimension (with
+ * PGTCL_DECODE_USER_ARRAYS, so does any value of a type created in the
+ * database that parses as one), and with PGTCL_DECODE_BYTEA, a bytea
+ * value becomes a byte array.
+ */
+
+#define PG_BYTEA_OID	17
+
+static Tcl_Obj *
+PGgetvalueObj(PGresult *result, char *nullString, int decode,
+			  int tupno, int fieldNumber)
+{
+	char	   *string;
+	int			length;
+	char		delim;
+	Tcl_Obj    *listObj;
+
+	if (PQgetisnull(result, tupno, fieldNumber))
+		return Tcl_NewStringObj(nullString != NULL ? nullString : "", -1);
+
+	/* libpq knows the length, so the value needn't be scanned for it */
+	string = PQgetvalue(result, tupno, fieldNumber);
+	length = PQgetlength(result, tupno, fieldNumber);
+
+	if ((decode & PGTCL_DECODE_BYTEA) &&
+		PQftype(result, fieldNumber) == PG_BYTEA_OID)
+	{
+		Tcl_Obj    *bytesObj;
+
+		if (PQfformat(result, fieldNumber) == 1)
+			return Tcl_NewByteArrayObj((unsigned char *)string, length);
+
+		bytesObj = PgByteaToObj(string, length);
+		if (bytesObj != NULL)
+			return bytesObj;
+		return Tcl_NewStringObj(string, length);
+	}
+
+	if ((decode & PGTCL_DECODE_ARRAYS) && (*string == '{' || *string == '[') &&
+		(delim = PgArrayDelimiter(PQftype(result, fieldNumber), decode)) != 0 &&
+		(listObj = PgArrayToObj(string, delim, nullString)) != NULL)
+	{
+		return listObj;
+	}
+
+	return Tcl_NewStringObj(string, length);
+}
+
+/*
+ * PgSetNumberRep()
+ *
+ * If valueObj is a value of an integer or floating point column, parse
+ * it now as a wide integer or a double, so that arithmetic on it later
+ * needn't.  The text stays as the server sent it, so nothing is lost,
+ * even for numeric.  Values that aren't numbers, such as NULLs, stay
+ * strings.
+ */
+
+#define PG_INT8_OID		20
+#define PG_INT2_OID		21
+#define PG_INT4_OID		23
+#define PG_OID_OID		26
+#define PG_FLOAT4_OID	700
+#define PG_FLOAT8_OID	701
+#define PG_NUMERIC_OID	1700
+
+static void
+PgSetNumberRep(Tcl_Obj *valueObj, Oid type)
+{
+	Tcl_WideInt wide;
+	double		d;
+
+	switch (type)
+	{
+		case PG_INT8_OID:
+		case PG_INT2_OID:
+		case PG_INT4_OID:
+		case PG_OID_OID:
+			Tcl_GetWideIntFromObj(NULL, valueObj, &wide);
+			break;
+
+		case PG_FLOAT4_OID:
+		case PG_FLOAT8_OID:
+		case PG_NUMERIC_OID:
+			Tcl_GetDoubleFromObj(NULL, valueObj, &d);
+			break;
+	}
 }
 
 /**********************************
@@ -357,6 +515,18 @@ Pg_conndefaults(ClientData cData, Tcl_Interp *interp, int objc,
  *    pg_connect -conninfo "dbname=myydb host=myhost ..."
  *    pg_connect -connlist [list dbname mydb host myhost ...]
  *    pg_connect -connhandle myhandle
+ *    pg_connect ... -autoreconnect 1 ?-maxretries n?
+ *    pg_connect ... -background callback
+ *
+ *    With -autoreconnect, a lost connection is reset in the background
+ *    with backoff, under the same handle, and its LISTENs and PREPAREd
+ *    statements are restored (see the reconnect code in pgtclId.c).
+ *    After -maxretries failed attempts, if not 0, it gives up and
+ *    reports a background error.
+ *
+ *    With -background, the connection is made on a worker thread and
+ *    pg_connect returns at once.  callback is then called with "ok" and
+ *    the handle, or "error" and the error message, appended.
  *
  * Results:
  *    the return result is either an error message or a handle for 
@@ -375,19 +545,22 @@ Pg_connect(ClientData cData, Tcl_Interp *interp, int objc,
     Tcl_DString     ds;
     Tcl_Obj         *tresult;
     int             async = 0;
+    int             autoreconnect = 0;
+    int             maxretries = 0;
+    Tcl_Obj         *callback = NULL;
         
 
     static CONST84 char *options[] = {
     	"-host", "-port", "-tty", "-options", "-user", 
         "-password", "-conninfo", "-connlist", "-connhandle",
-        "-async", (char *)NULL
+        "-async", "-autoreconnect", "-maxretries", "-background", (char *)NULL
     };
 
     enum options
     {
     	OPT_HOST, OPT_PORT, OPT_TTY, OPT_OPTIONS, OPT_USER, 
         OPT_PASSWORD, OPT_CONNINFO, OPT_CONNLIST, OPT_CONNHANDLE,
-        OPT_ASYNC
+        OPT_ASYNC, OPT_AUTORECONNECT, OPT_MAXRETRIES, OPT_BACKGROUND
     };
 
     Tcl_DStringInit(&ds);
@@ -510,6 +683,42 @@ Pg_connect(ClientData cData, Tcl_Interp *interp, int objc,
                  }
                 i += 2;
                 skip = 1;
+                break;
+            }
+            case OPT_AUTORECONNECT:
+            {
+                if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &autoreconnect) != TCL_OK)
+                {
+                    Tcl_DStringFree(&ds);
+                    return TCL_ERROR;
+                }
+                i += 2;
+                skip = 1;
+                break;
+            }
+            case OPT_MAXRETRIES:
+            {
+                if (Tcl_GetIntFromObj(interp, objv[i + 1], &maxretries) != TCL_OK)
+                {
+                    Tcl_DStringFree(&ds);
+                    return TCL_ERROR;
+                }
+                if (maxretries < 0)
+                {
+                    Tcl_SetResult(interp, "pg_connect: -maxretries can't be negative", TCL_STATIC);
+                    Tcl_DStringFree(&ds);
+                    return TCL_ERROR;
+                }
+                i += 2;
+                skip = 1;
+                break;
+            }
+            case OPT_BACKGROUND:
+            {
+                callback = objv[i + 1];
+                i += 2;
+                skip = 1;
+                break;
             }
         } /** end switch **/
 
@@ -541,6 +750,15 @@ Pg_connect(ClientData cData, Tcl_Interp *interp, int objc,
     }
 
 
+    if (callback != NULL)
+    {
+        int rc = PgBackgroundConnect(interp, callback, Tcl_DStringValue(&ds),
+                                     connhandle, autoreconnect, maxretries);
+
+        Tcl_DStringFree(&ds);
+        return rc;
+    }
+
     if (async)
     {
         conn = PQconnectStart(Tcl_DStringValue(&ds));
@@ -565,6 +783,13 @@ Pg_connect(ClientData cData, Tcl_Interp *interp, int objc,
     {
         if (PgSetConnectionId(interp, conn, connhandle))
         {
+            if (autoreconnect)
+            {
+                Pg_ConnectionId *connid;
+
+                PgGetConnectionId(interp, Tcl_GetStringResult(interp), &connid);
+                PgSetAutoReconnect(connid, maxretries);
+            }
             return TCL_OK;
         }
 
@@ -650,10 +875,14 @@ Pg_disconnect(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST obj
  send a query string to the backend connection
 
  syntax:
- pg_exec connection query [var1] [var2]...
+ pg_exec ?-background callback? connection query [var1] [var2]...
 
  the return result is either an error message or a handle for a query
  result.  Handles start with the prefix "pgsql"
+
+ With -background, the query runs on a worker thread and pg_exec
+ returns at once.  When it is done, callback is called with "ok" and
+ the result handle, or "error" and the error message, appended.
  **********************************/
 
 int
@@ -665,33 +894,42 @@ Pg_exec(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 	CONST84 char	   *connString;
 	const char *execString;
 	const char **paramValues = NULL;
-
-	/* THIS CODE IS REPLICATED IN Pg_sendquery AND SHOULD BE FACTORED */
+	Tcl_Obj    *callback = NULL;
+	int         a = 1;		/* index of the connection argument */
+	Tcl_WideInt start;
 #ifdef HAVE_PQEXECPARAMS
 	int         nParams;
+#endif
 
-	if (objc < 3)
+	if (objc > 3 && strcmp(Tcl_GetStringFromObj(objv[1], NULL), "-background") == 0)
+	{
+		callback = objv[2];
+		a = 3;
+	}
+
+	/* THIS CODE IS REPLICATED IN Pg_sendquery AND SHOULD BE FACTORED */
+#ifdef HAVE_PQEXECPARAMS
+	if (objc < a + 2)
 	{
-		Tcl_WrongNumArgs(interp, 1, objv, "connection queryString ?parm...?");
+		Tcl_WrongNumArgs(interp, 1, objv, "?-background callback? connection queryString ?parm...?");
 		return TCL_ERROR;
 	}
 
 	/* extra params will substitute for $1, $2, etc, in the statement */
-	/* objc must be 3 or greater at this point */
-	nParams = objc - 3;
+	nParams = objc - a - 2;
 
 	/* If there are any extra params, allocate paramValues and fill it
 	 * with the string representations of all of the extra parameters
 	 * substituted on the command line.  Otherwise nParams will be 0,
 	 * and PQexecParams will work just like PQexec (no $-substitutions).
 	 */
-	if (nParams > 0) {
+	if (nParams > 0 && callback == NULL) {
 	    int param;
 
 	    paramValues = (const char **)ckalloc (nParams * sizeof (char *));
 
 	    for (param = 0; param < nParams; param++) {
-		paramValues[param] = Tcl_GetStringFromObj(objv[3+param], NULL);
+		paramValues[param] = Tcl_GetStringFromObj(objv[a+2+param], NULL);
 		if (strcmp(paramValues[param], "NULL") == 0)
                 {
                     paramValues[param] = '\0';
@@ -699,27 +937,43 @@ Pg_exec(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 	    }
 	}
 #else /* HAVE_PQEXECPARAMS */
-	if (objc != 3)
+	if (objc != a + 2)
 	{
-		Tcl_WrongNumArgs(interp, 1, objv, "connection queryString");
+		Tcl_WrongNumArgs(interp, 1, objv, "?-background callback? connection queryString");
 		return TCL_ERROR;
 	}
 #endif /* HAVE_PQEXECPARAMS */
 
 	/* figure out the connect string and get the connection ID */
 
-	connString = Tcl_GetStringFromObj(objv[1], NULL);
+	connString = Tcl_GetStringFromObj(objv[a], NULL);
 	conn = PgGetConnectionId(interp, connString, &connid);
 	if (conn == NULL)
+	{
+		if (paramValues != NULL)
+			ckfree ((void *)paramValues);
 		return TCL_ERROR;
+	}
 
 	if (connid->res_copyStatus != RES_COPY_NONE)
 	{
+		if (paramValues != NULL)
+			ckfree ((void *)paramValues);
 		Tcl_SetResult(interp, "Attempt to query while COPY in progress", TCL_STATIC);
 		return TCL_ERROR;
 	}
 
-	execString = Tcl_GetStringFromObj(objv[2], NULL);
+	execString = Tcl_GetStringFromObj(objv[a+1], NULL);
+
+	if (callback != NULL)
+	{
+#ifdef HAVE_PQEXECPARAMS
+		return PgBackgroundExec(interp, connid, callback, execString,
+								nParams, objv + a + 2);
+#else
+		return PgBackgroundExec(interp, connid, callback, execString, 0, NULL);
+#endif
+	}
 
 	/* we could call PQexecParams when nParams is 0, but PQexecParams
 	 * will not accept more than one SQL statement per call, while
@@ -727,21 +981,42 @@ Pg_exec(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 	 * are included, we maintain compatibility for code that doesn't
 	 * use params and might have had multiple statements in a single 
 	 * request */
+	start = PgStatsClock();
 #ifdef HAVE_PQEXECPARAMS
 	if (nParams == 0) {
 #endif
 	    result = PQexec(conn, execString);
+	    PgStatsQuery(connid, PG_STATS_EXEC, execString, 0, NULL);
 #ifdef HAVE_PQEXECPARAMS
 	} else {
 	    result = PQexecParams(conn, execString, nParams, NULL, paramValues, NULL, NULL, 0);
+	    PgStatsQuery(connid, PG_STATS_EXEC, execString, nParams, paramValues);
 	    ckfree ((void *)paramValues);
 	}
 #endif
+	PgStatsResult(connid, result, PgStatsClock() - start);
+
+	return PgExecResult(interp, connid, connString, execString, result);
+}
 
+/*
+ * What pg_exec does with the result of its query, however it was
+ * waited for: make a result handle of it.
+ */
+static int
+PgExecResult(Tcl_Interp *interp, Pg_ConnectionId *connid,
+			 CONST84 char *connString, CONST84 char *execString,
+			 PGresult *result)
+{
 	/* REPLICATED IN pg_exec_prepared -- NEEDS TO BE FACTORED */
 	/* Transfer any notify events from libpq to Tcl event queue. */
 	PgNotifyTransferEvents(connid);
 
+	/* remember PREPAREs, they have to be redone after a reconnect */
+	if (connid->autoreconnect && result &&
+		PQresultStatus(result) == PGRES_COMMAND_OK)
+		PgTrackPrepared(connid, execString);
+
 	if (result)
 	{
 		int	rId = PgSetResultId(interp, connString, result);
@@ -760,7 +1035,7 @@ Pg_exec(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 	else
 	{
 		/* error occurred during the query */
-		Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(conn), -1));
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(connid->conn), -1));
 		return TCL_ERROR;
 	}
 }
@@ -786,6 +1061,7 @@ Pg_exec_prepared(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST
 	CONST84 char	   *connString;
 	const char *statementNameString;
 	const char **paramValues = NULL;
+	Tcl_WideInt start;
 
 	int         nParams;
 
@@ -843,7 +1119,10 @@ Pg_exec_prepared(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST
 
 	statementNameString = Tcl_GetStringFromObj(objv[2], NULL);
 
+	start = PgStatsClock();
 	result = PQexecPrepared(conn, statementNameString, nParams, paramValues, NULL, NULL, 0);
+	PgStatsQuery(connid, PG_STATS_PREPARED, statementNameString, nParams, paramValues);
+	PgStatsResult(connid, result, PgStatsClock() - start);
 
 	if (paramValues != (const char **)NULL) {
 	    ckfree ((void *)paramValues);
@@ -876,43 +1155,738 @@ Pg_exec_prepared(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST
 }
 
 
-/**********************************
- * pg_result
- get information about the results of a query
+/*-------------------------------------------
+  Slices of results
 
- syntax:
+  -list, -llist, -dict, -assign and -column can build just some of the
+  rows, given by -rows start count, and some of the columns, given by
+  -columns with names or numbers, in the order wanted.  The rows are
+  clamped to the result as lrange does, so paging past the end gives
+  nothing rather than an error.
+  ------------------------------------------*/
 
-	pg_result result ?option?
+struct Pg_Slice_s
+{
+	int			tupStart;		/* the rows from tupStart */
+	int			tupEnd;			/* to before tupEnd */
+	int			ncols;			/* columns[0 .. ncols - 1] of them */
+	int		   *columns;
+};
 
- the options are:
+/*
+ * Find a column by its name or, failing that, its number.  Names are
+ * matched exactly, unlike PQfnumber, which folds them to lower case.
+ */
+static int
+PgColumnIndex(Tcl_Interp *interp, PGresult *result, Tcl_Obj *columnObj,
+			  int *columnPtr)
+{
+	char	   *name = Tcl_GetStringFromObj(columnObj, NULL);
+	int			ncols = PQnfields(result);
+	int			column;
 
-	-status the status of the result
+	for (column = 0; column < ncols; column++)
+	{
+		if (strcmp(PQfname(result, column), name) == 0)
+		{
+			*columnPtr = column;
+			return TCL_OK;
+		}
+	}
 
-	-error	the error message, if the status indicates error; otherwise
-		an empty string
+	if (Tcl_GetIntFromObj(NULL, columnObj, &column) == TCL_OK &&
+		column >= 0 && column < ncols)
+	{
+		*columnPtr = column;
+		return TCL_OK;
+	}
 
-	-conn	the connection that produced the result
+	Tcl_ResetResult(interp);
+	Tcl_AppendResult(interp, "no column \"", name, "\" in the result",
+					 (char *)NULL);
+	return TCL_ERROR;
+}
 
-	-oid	if command was an INSERT, the OID of the inserted tuple
+/*
+ * Fill in slice from the -rows and -columns in objv[first] on, or make
+ * it all of the result.  allowColumns is 0 if -columns can't be used.
+ * A slice that was filled in must be freed with PgSliceFree.
+ */
+static int
+PgSliceInit(Tcl_Interp *interp, PGresult *result, int objc,
+			Tcl_Obj *CONST objv[], int first, int allowColumns,
+			Pg_Slice *slice)
+{
+	static CONST84 char *modifiers[] = {"-rows", "-columns", (char *)NULL};
+	enum modifiers
+	{
+		MOD_ROWS, MOD_COLUMNS
+	};
+	int			ntup = PQntuples(result);
+	int			mod;
+	int			i,
+				column,
+				start,
+				count,
+				ncolumnObjs;
+	Tcl_WideInt end;
+	Tcl_Obj   **columnObjs;
+
+	slice->tupStart = 0;
+	slice->tupEnd = ntup;
+	slice->ncols = PQnfields(result);
+	slice->columns = NULL;
+
+	for (i = first; i < objc; i++)
+	{
+		if (Tcl_GetIndexFromObj(interp, objv[i], modifiers, "modifier",
+								TCL_EXACT, &mod) != TCL_OK)
+			goto error;
+		if (mod == MOD_COLUMNS && !allowColumns)
+		{
+			Tcl_SetResult(interp, "-columns can't be used here", TCL_STATIC);
+			goto error;
+		}
 
-	-numTuples	the number of tuples in the query
+		switch ((enum modifiers) mod)
+		{
+			case MOD_ROWS:
+				if (i + 2 >= objc)
+				{
+					Tcl_SetResult(interp, "-rows needs a start and a count",
+								  TCL_STATIC);
+					goto error;
+				}
+				if (Tcl_GetIntFromObj(interp, objv[i + 1], &start) != TCL_OK ||
+					Tcl_GetIntFromObj(interp, objv[i + 2], &count) != TCL_OK)
+					goto error;
+				if (count < 0)
+				{
+					Tcl_SetResult(interp, "-rows count can't be negative",
+								  TCL_STATIC);
+					goto error;
+				}
+				end = (Tcl_WideInt) start + count;
+				if (start < 0)
+					start = 0;
+				if (start > ntup)
+					start = ntup;
+				slice->tupStart = start;
+				slice->tupEnd = (end < start) ? start : (end > ntup) ? ntup : (int) end;
+				i += 2;
+				break;
 
-	-cmdTuples	Same as -numTuples, but for DELETE and UPDATE
+			case MOD_COLUMNS:
+				if (i + 1 >= objc)
+				{
+					Tcl_SetResult(interp, "-columns needs a list of columns",
+								  TCL_STATIC);
+					goto error;
+				}
+				if (Tcl_ListObjGetElements(interp, objv[++i], &ncolumnObjs,
+										   &columnObjs) != TCL_OK)
+					goto error;
+				if (slice->columns != NULL)
+					ckfree((void *)slice->columns);
+				slice->columns = (int *)ckalloc(sizeof(int) * (ncolumnObjs + 1));
+				slice->ncols = ncolumnObjs;
+				for (column = 0; column < ncolumnObjs; column++)
+				{
+					if (PgColumnIndex(interp, result, columnObjs[column],
+									  &slice->columns[column]) != TCL_OK)
+						goto error;
+				}
+				break;
+		}
+	}
 
-	-numAttrs	returns the number of attributes returned by the query
+	if (slice->columns == NULL)
+	{
+		slice->columns = (int *)ckalloc(sizeof(int) * (slice->ncols + 1));
+		for (column = 0; column < slice->ncols; column++)
+			slice->columns[column] = column;
+	}
+	return TCL_OK;
 
-	-assign arrayName
-		assign the results to an array, using subscripts of the form
-			(tupno,attributeName)
+error:
+	if (slice->columns != NULL)
+		ckfree((void *)slice->columns);
+	slice->columns = NULL;
+	return TCL_ERROR;
+}
 
-	-assignbyidx arrayName ?appendstr?
-		assign the results to an array using the first field's value
-		as a key.
-		All but the first field of each tuple are stored, using
-		subscripts of the form (field0value,attributeNameappendstr)
+static void
+PgSliceFree(Pg_Slice *slice)
+{
+	ckfree((void *)slice->columns);
+}
 
-	-getTuple tupleNumber
-		returns the values of the tuple in a list
+
+/*-------------------------------------------
+  Indexes of results
+
+  pg_result -index hashes the rows of a result by the values of some of
+  its columns, once, and keeps the table with the result handle, so
+  that -lookup finds the rows with a key without building the others.
+  The table holds the first row of each key, and indexNext chains the
+  later ones, in order.  A key of one column is its value as the server
+  sent it, and a key of several is the list of their values.  Rows with
+  a NULL in a key column aren't indexed, as NULL matches nothing in SQL.
+  ------------------------------------------*/
+
+static void
+PgResultIndexFree(Pg_resultid *resultid)
+{
+	if (resultid->index == NULL)
+		return;
+
+	Tcl_DeleteHashTable(resultid->index);
+	ckfree((void *)resultid->index);
+	ckfree((void *)resultid->indexNext);
+	ckfree((void *)resultid->indexColumns);
+	resultid->index = NULL;
+	resultid->indexNext = NULL;
+	resultid->indexColumns = NULL;
+	resultid->nIndexColumns = 0;
+}
+
+/*
+ * The key of a row, in the result or in ds, or NULL if a key column
+ * is NULL.
+ */
+static CONST char *
+PgIndexKey(PGresult *result, int *columns, int ncols, int tupno,
+		   Tcl_DString *ds)
+{
+	int			i;
+
+	if (ncols == 1)
+		return PQgetisnull(result, tupno, columns[0]) ?
+			NULL : PQgetvalue(result, tupno, columns[0]);
+
+	Tcl_DStringSetLength(ds, 0);
+	for (i = 0; i < ncols; i++)
+	{
+		if (PQgetisnull(result, tupno, columns[i]))
+			return NULL;
+		Tcl_DStringAppendElement(ds, PQgetvalue(result, tupno, columns[i]));
+	}
+	return Tcl_DStringValue(ds);
+}
+
+/*
+ * Index the result by the columns in columnsObj, unless it already is,
+ * and return the number of keys.
+ */
+static int
+PgResultIndex(Tcl_Interp *interp, Pg_resultid *resultid, PGresult *result,
+			  Tcl_Obj *columnsObj)
+{
+	Tcl_Obj   **columnObjs;
+	int			ncols,
+				i,
+				tupno,
+				isNew;
+	int		   *columns;
+	CONST char *key;
+	Tcl_DString ds;
+	Tcl_HashEntry *entry;
+
+	if (Tcl_ListObjGetElements(interp, columnsObj, &ncols, &columnObjs) != TCL_OK)
+		return TCL_ERROR;
+	if (ncols == 0)
+	{
+		Tcl_SetResult(interp, "-index needs at least one column", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	columns = (int *)ckalloc(sizeof(int) * ncols);
+	for (i = 0; i < ncols; i++)
+	{
+		if (PgColumnIndex(interp, result, columnObjs[i], &columns[i]) != TCL_OK)
+		{
+			ckfree((void *)columns);
+			return TCL_ERROR;
+		}
+	}
+
+	/* the same index again costs nothing */
+	if (resultid->index != NULL && resultid->nIndexColumns == ncols &&
+		memcmp(resultid->indexColumns, columns, sizeof(int) * ncols) == 0)
+	{
+		ckfree((void *)columns);
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(resultid->index->numEntries));
+		return TCL_OK;
+	}
+
+	PgResultIndexFree(resultid);
+	resultid->index = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+	Tcl_InitHashTable(resultid->index, TCL_STRING_KEYS);
+	resultid->indexNext = (int *)ckalloc(sizeof(int) * (PQntuples(result) + 1));
+	resultid->indexColumns = columns;
+	resultid->nIndexColumns = ncols;
+
+	/* backwards, so that each chain comes out in the order of the rows */
+	Tcl_DStringInit(&ds);
+	for (tupno = PQntuples(result) - 1; tupno >= 0; tupno--)
+	{
+		resultid->indexNext[tupno] = -1;
+		if ((key = PgIndexKey(result, columns, ncols, tupno, &ds)) == NULL)
+			continue;
+
+		entry = Tcl_CreateHashEntry(resultid->index, key, &isNew);
+		if (!isNew)
+			resultid->indexNext[tupno] = (int)(long) Tcl_GetHashValue(entry);
+		Tcl_SetHashValue(entry, (ClientData)(long) tupno);
+	}
+	Tcl_DStringFree(&ds);
+
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(resultid->index->numEntries));
+	return TCL_OK;
+}
+
+/*
+ * Return the rows with key keyObj, a list of them each a list of its
+ * values, or, if asDict, a dict of them by row number as -dict makes.
+ */
+static int
+PgResultLookup(Tcl_Interp *interp, Pg_resultid *resultid, PGresult *result,
+			   Tcl_Obj *keyObj, int asDict)
+{
+	Tcl_HashEntry *entry;
+	Tcl_DString ds;
+	Tcl_Obj   **keyObjs;
+	Tcl_Obj   **valueObjs;
+	Tcl_Obj   **columnNameObjs = NULL;
+	Tcl_Obj    *resultObj;
+	int			nkeys,
+				ncols,
+				column,
+				tupno;
+
+	if (resultid->index == NULL)
+	{
+		Tcl_SetResult(interp, "the result has no -index to look up",
+					  TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if (resultid->nIndexColumns == 1)
+		entry = Tcl_FindHashEntry(resultid->index,
+								  Tcl_GetStringFromObj(keyObj, NULL));
+	else
+	{
+		if (Tcl_ListObjGetElements(interp, keyObj, &nkeys, &keyObjs) != TCL_OK)
+			return TCL_ERROR;
+		if (nkeys != resultid->nIndexColumns)
+		{
+			Tcl_SetResult(interp, "the key needs a value for each column of the -index",
+						  TCL_STATIC);
+			return TCL_ERROR;
+		}
+
+		Tcl_DStringInit(&ds);
+		for (column = 0; column < nkeys; column++)
+			Tcl_DStringAppendElement(&ds, Tcl_GetStringFromObj(keyObjs[column], NULL));
+		entry = Tcl_FindHashEntry(resultid->index, Tcl_DStringValue(&ds));
+		Tcl_DStringFree(&ds);
+	}
+
+	resultObj = asDict ? Tcl_NewObj() : Tcl_NewListObj(0, NULL);
+	if (entry == NULL)
+	{
+		Tcl_SetObjResult(interp, resultObj);
+		return TCL_OK;
+	}
+
+	ncols = PQnfields(result);
+	if (asDict)
+		columnNameObjs = PgColumnNameObjs(result, ncols);
+	valueObjs = (Tcl_Obj **)ckalloc(sizeof(Tcl_Obj *) * (ncols + 1));
+
+	for (tupno = (int)(long) Tcl_GetHashValue(entry); tupno >= 0;
+		 tupno = resultid->indexNext[tupno])
+	{
+		for (column = 0; column < ncols; column++)
+			valueObjs[column] = PGgetvalueObj(result, resultid->nullValueString,
+											  resultid->decode, tupno, column);
+		if (!asDict)
+		{
+			Tcl_ListObjAppendElement(NULL, resultObj,
+									 Tcl_NewListObj(ncols, valueObjs));
+			continue;
+		}
+
+#ifdef HAVE_TCL_NEWDICTOBJ
+		{
+			Tcl_Obj    *rowObj = Tcl_NewDictObj();
+
+			for (column = 0; column < ncols; column++)
+				Tcl_DictObjPut(NULL, rowObj, columnNameObjs[column],
+							   valueObjs[column]);
+			Tcl_DictObjPut(NULL, resultObj, Tcl_NewIntObj(tupno), rowObj);
+		}
+#endif
+	}
+
+	ckfree((void *)valueObjs);
+	if (columnNameObjs != NULL)
+		PgColumnNameObjsFree(columnNameObjs, ncols);
+	Tcl_SetObjResult(interp, resultObj);
+	return TCL_OK;
+}
+
+
+/*-------------------------------------------
+  Lazy arrays
+
+  pg_result -assign arrayName -lazy sets no elements: a trace on the
+  array makes each (tupno,attrName) element from the result the first
+  time it is read, and the array command makes all of those left, so
+  that array names, size and get see what -assign would have set.  An
+  element once made, set or unset by the script is left alone after.
+
+  The result is shared by its handle and the lazy arrays reading it (and
+  any pg_result -foreach loop over it), and cleared when the last of
+  them goes, so the handle can be cleared while arrays still read from
+  it.  When every element has been made, or the
+  array is unset, the trace goes and the array lets go of the result.
+  ------------------------------------------*/
+
+struct Pg_LazyResult_s
+{
+	PGresult   *result;
+	int			refCount;		/* the handle, each lazy array and each
+								 * -foreach loop */
+};
+
+typedef struct Pg_LazyArray_s
+{
+	Pg_LazyResult *shared;
+	char	   *nullValueString;
+	int			decode;
+	Pg_Slice	slice;
+	Tcl_HashTable columns;		/* attrName -> position in the slice */
+	unsigned char *made;		/* a bit per element made, set or unset */
+	int			left;			/* elements not made yet */
+} Pg_LazyArray;
+
+#define PG_LAZY_TRACE_FLAGS \
+	(TCL_TRACE_READS | TCL_TRACE_WRITES | TCL_TRACE_UNSETS | TCL_TRACE_ARRAY)
+
+static void
+PgLazyResultRelease(Pg_LazyResult *shared)
+{
+	if (--shared->refCount > 0)
+		return;
+
+	PQclear(shared->result);
+	ckfree((void *)shared);
+}
+
+/*
+ * Share the result of a handle, taking a reference for the caller.
+ */
+static Pg_LazyResult *
+PgResultShare(Pg_resultid *resultid, PGresult *result)
+{
+	if (resultid->lazy == NULL)
+	{
+		resultid->lazy = (Pg_LazyResult *)ckalloc(sizeof(Pg_LazyResult));
+		resultid->lazy->result = result;
+		resultid->lazy->refCount = 1;
+	}
+	resultid->lazy->refCount++;
+	return resultid->lazy;
+}
+
+/*
+ * Let go of the result of a handle being deleted: free its index, and
+ * clear it unless lazy arrays still read it.
+ */
+void
+PgResultRelease(Pg_resultid *resultid, PGresult *result)
+{
+	PgResultIndexFree(resultid);
+
+	if (resultid->lazy == NULL)
+	{
+		PQclear(result);
+		return;
+	}
+	PgLazyResultRelease(resultid->lazy);
+	resultid->lazy = NULL;
+}
+
+static void
+PgLazyArrayFree(Pg_LazyArray *lazy)
+{
+	PgLazyResultRelease(lazy->shared);
+	if (lazy->nullValueString != NULL)
+		ckfree(lazy->nullValueString);
+	PgSliceFree(&lazy->slice);
+	Tcl_DeleteHashTable(&lazy->columns);
+	ckfree((void *)lazy->made);
+	ckfree((void *)lazy);
+}
+
+/*
+ * Mark the element at cell made, returning 0 if it already was.
+ */
+static int
+PgLazyMark(Pg_LazyArray *lazy, int cell)
+{
+	unsigned char bit = (unsigned char)(1 << (cell & 7));
+
+	if (lazy->made[cell >> 3] & bit)
+		return 0;
+	lazy->made[cell >> 3] |= bit;
+	lazy->left--;
+	return 1;
+}
+
+/*
+ * The cell of an element name, tupno,attrName with tupno written as
+ * -assign writes it, or -1 if it isn't one of the array's.
+ */
+static int
+PgLazyCell(Pg_LazyArray *lazy, CONST char *name)
+{
+	Tcl_HashEntry *entry;
+	CONST char *p;
+	long		tupno = 0;
+
+	if (name == NULL || name[0] < '0' || name[0] > '9' ||
+		(name[0] == '0' && name[1] != ','))
+		return -1;
+
+	for (p = name; *p >= '0' && *p <= '9'; p++)
+	{
+		tupno = tupno * 10 + (*p - '0');
+		if (tupno >= lazy->slice.tupEnd)
+			return -1;
+	}
+	if (*p != ',' || tupno < lazy->slice.tupStart)
+		return -1;
+
+	if ((entry = Tcl_FindHashEntry(&lazy->columns, p + 1)) == NULL)
+		return -1;
+
+	return (int)(tupno - lazy->slice.tupStart) * lazy->slice.ncols +
+		(int)(long) Tcl_GetHashValue(entry);
+}
+
+/*
+ * Set the element at cell in the array name1, as -assign does.
+ */
+static int
+PgLazySet(Tcl_Interp *interp, Pg_LazyArray *lazy, CONST char *name1,
+		  int flags, int cell)
+{
+	PGresult   *result = lazy->shared->result;
+	int			tupno = lazy->slice.tupStart + cell / lazy->slice.ncols;
+	int			column = lazy->slice.columns[cell % lazy->slice.ncols];
+	Tcl_Obj    *fieldNameObj;
+	Tcl_Obj    *valueObj;
+
+	fieldNameObj = Tcl_NewIntObj(tupno);
+	Tcl_AppendToObj(fieldNameObj, ",", 1);
+	Tcl_AppendToObj(fieldNameObj, PQfname(result, column), -1);
+	Tcl_IncrRefCount(fieldNameObj);
+
+	valueObj = Tcl_SetVar2Ex(interp, name1, Tcl_GetString(fieldNameObj),
+							 PGgetvalueObj(result, lazy->nullValueString,
+										   lazy->decode, tupno, column),
+							 flags | TCL_LEAVE_ERR_MSG);
+	Tcl_DecrRefCount(fieldNameObj);
+	return (valueObj == NULL) ? TCL_ERROR : TCL_OK;
+}
+
+/*
+ * Make every element not made yet, with the trace already gone, and
+ * free the array's hold on the result.
+ */
+static int
+PgLazyFill(Tcl_Interp *interp, Pg_LazyArray *lazy, CONST char *name1,
+		   int flags)
+{
+	int			ncells = (lazy->slice.tupEnd - lazy->slice.tupStart) *
+		lazy->slice.ncols;
+	int			cell;
+	int			code = TCL_OK;
+
+	for (cell = 0; cell < ncells && lazy->left > 0 && code == TCL_OK; cell++)
+	{
+		if (PgLazyMark(lazy, cell))
+			code = PgLazySet(interp, lazy, name1, flags, cell);
+	}
+	PgLazyArrayFree(lazy);
+	return code;
+}
+
+static char *
+PgLazyTraceProc(ClientData cData, Tcl_Interp *interp, CONST84 char *name1,
+				CONST84 char *name2, int flags)
+{
+	Pg_LazyArray *lazy = (Pg_LazyArray *) cData;
+	int			scope = flags & (TCL_GLOBAL_ONLY | TCL_NAMESPACE_ONLY);
+	int			cell;
+
+	if (flags & (TCL_TRACE_DESTROYED | TCL_INTERP_DESTROYED))
+	{
+		PgLazyArrayFree(lazy);
+		return NULL;
+	}
+
+	/* the array command sees the whole array */
+	if (flags & TCL_TRACE_ARRAY)
+	{
+		Tcl_UntraceVar2(interp, name1, NULL, scope | PG_LAZY_TRACE_FLAGS,
+						PgLazyTraceProc, cData);
+		if (PgLazyFill(interp, lazy, name1, scope) != TCL_OK)
+			return "can't make the elements of the lazy array";
+		return NULL;
+	}
+
+	if ((cell = PgLazyCell(lazy, name2)) < 0)
+		return NULL;
+
+	/* the element itself is being traced, so setting it here is quiet */
+	if (PgLazyMark(lazy, cell) && (flags & TCL_TRACE_READS) &&
+		PgLazySet(interp, lazy, name1, scope, cell) != TCL_OK)
+		return "can't make the element of the lazy array";
+
+	if (lazy->left == 0)
+	{
+		Tcl_UntraceVar2(interp, name1, NULL, scope | PG_LAZY_TRACE_FLAGS,
+						PgLazyTraceProc, cData);
+		PgLazyArrayFree(lazy);
+	}
+	return NULL;
+}
+
+/*
+ * pg_result -assign arrayName -lazy: trace arrayName to make the
+ * elements of slice from the result as they are read.
+ */
+static int
+PgResultAssignLazy(Tcl_Interp *interp, Pg_resultid *resultid,
+				   PGresult *result, Tcl_Obj *arrayObj, Pg_Slice *slice)
+{
+	CONST char *arrayName = Tcl_GetString(arrayObj);
+	Pg_LazyArray *lazy;
+	ClientData	cData;
+	Tcl_HashEntry *entry;
+	int			ncells = (slice->tupEnd - slice->tupStart) * slice->ncols;
+	int			isNew;
+	int			i;
+
+	/* an earlier lazy -assign into the array is made now, as it would be */
+	while ((cData = Tcl_VarTraceInfo2(interp, arrayName, NULL, 0,
+									  PgLazyTraceProc, NULL)) != NULL)
+	{
+		Tcl_UntraceVar2(interp, arrayName, NULL, PG_LAZY_TRACE_FLAGS,
+						PgLazyTraceProc, cData);
+		if (PgLazyFill(interp, (Pg_LazyArray *) cData, arrayName, 0) != TCL_OK)
+		{
+			PgSliceFree(slice);
+			return TCL_ERROR;
+		}
+	}
+
+	if (ncells == 0)
+	{
+		PgSliceFree(slice);
+		return TCL_OK;
+	}
+
+	/*
+	 * Reading an element of an array that isn't there yet fails without
+	 * a trace, so make the array, empty.  A scalar fails here, as it
+	 * would for -assign.
+	 */
+	if (Tcl_GetVar2Ex(interp, arrayName, "", 0) == NULL)
+	{
+		if (Tcl_SetVar2Ex(interp, arrayName, "", Tcl_NewObj(),
+						  TCL_LEAVE_ERR_MSG) == NULL)
+		{
+			PgSliceFree(slice);
+			return TCL_ERROR;
+		}
+		Tcl_UnsetVar2(interp, arrayName, "", 0);
+	}
+
+	lazy = (Pg_LazyArray *)ckalloc(sizeof(Pg_LazyArray));
+	lazy->shared = PgResultShare(resultid, result);
+	lazy->nullValueString = NULL;
+	if (resultid->nullValueString != NULL)
+	{
+		lazy->nullValueString = ckalloc(strlen(resultid->nullValueString) + 1);
+		strcpy(lazy->nullValueString, resultid->nullValueString);
+	}
+	lazy->decode = resultid->decode;
+	lazy->slice = *slice;
+	lazy->made = (unsigned char *)ckalloc(ncells / 8 + 1);
+	memset(lazy->made, 0, ncells / 8 + 1);
+	lazy->left = ncells;
+
+	/* a name that comes twice is the later column, as -assign sets it */
+	Tcl_InitHashTable(&lazy->columns, TCL_STRING_KEYS);
+	for (i = 0; i < slice->ncols; i++)
+	{
+		entry = Tcl_CreateHashEntry(&lazy->columns,
+									PQfname(result, slice->columns[i]), &isNew);
+		Tcl_SetHashValue(entry, (ClientData)(long) i);
+	}
+
+	if (Tcl_TraceVar2(interp, arrayName, NULL, PG_LAZY_TRACE_FLAGS,
+					  PgLazyTraceProc, (ClientData) lazy) != TCL_OK)
+	{
+		PgLazyArrayFree(lazy);
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+
+/**********************************
+ * pg_result
+ get information about the results of a query
+
+ syntax:
+
+	pg_result result ?option?
+
+ the options are:
+
+	-status the status of the result
+
+	-error	the error message, if the status indicates error; otherwise
+		an empty string
+
+	-conn	the connection that produced the result
+
+	-oid	if command was an INSERT, the OID of the inserted tuple
+
+	-numTuples	the number of tuples in the query
+
+	-cmdTuples	Same as -numTuples, but for DELETE and UPDATE
+
+	-numAttrs	returns the number of attributes returned by the query
+
+	-assign arrayName ?-lazy? ?-rows start count? ?-columns columns?
+		assign the results to an array, using subscripts of the form
+			(tupno,attributeName)
+		-lazy makes each element when it is first read
+
+	-assignbyidx arrayName ?appendstr?
+		assign the results to an array using the first field's value
+		as a key.
+		All but the first field of each tuple are stored, using
+		subscripts of the form (field0value,attributeNameappendstr)
+
+	-getTuple tupleNumber
+		returns the values of the tuple in a list
 
 	-tupleArray tupleNumber arrayName
 		stores the values of the tuple in array arrayName, indexed
@@ -925,6 +1899,12 @@ Pg_exec_prepared(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST
 		by the attributes returned.  If a value is null, unsets the
 		field from the array.
 
+	-foreach varList body
+	-foreach -array arrayName body
+		runs body for each tuple, with the variables in varList set
+		to its values in turn, or with array arrayName set as by
+		-tupleArray.  break and continue work as in foreach.
+
 	-attributes
 		returns a list of the name/type pairs of the tuple attributes
 
@@ -932,12 +1912,38 @@ Pg_exec_prepared(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST
 		returns a list of the {name type len} entries of the tuple
 		attributes
 
-        -list
+        -list ?-rows start count? ?-columns columns?
                 returns one list of all of the data
 
-        -llist  returns a list of lists, where each embedded list represents 
+        -llist ?-rows start count? ?-columns columns?
+                returns a list of lists, where each embedded list represents 
                 a tuple in the result
 
+	-dict ?-rows start count? ?-columns columns?
+		returns a dict of the tuples by number, each a dict of
+		the attributes
+
+	-column column ?-rows start count?
+		returns the values of one column, by name or number
+
+	-columnar ?-typed? ?-rows start count? ?-columns columns?
+		returns a dict of a list of values for each attribute.
+		With -typed, the values of number columns are parsed
+		as numbers now
+
+	-rows and -columns build only count tuples from start, and
+	the attributes named or numbered in columns, in that order
+
+	-index ?columns?
+		hashes the tuples by the values of the columns, once, for
+		-lookup, and returns the number of keys; without columns,
+		returns the columns indexed
+
+	-lookup key ?-list|-dict?
+		returns the tuples with key, the value of the -index column
+		or a list of the values of its columns, as a list of lists
+		or as -dict does
+
 	-clear	clear the result buffer. Do not reuse after this
 
 	-null_value_string	Set the value returned for fields that are null
@@ -946,6 +1952,26 @@ Pg_exec_prepared(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST
  **********************************/
 int
 Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+#ifdef PGTCL_USE_NRE
+	/* only the body of -foreach needs the non-recursive engine */
+	if (objc > 2 && strcmp(Tcl_GetStringFromObj(objv[2], NULL), "-foreach") == 0)
+		return Tcl_NRCallObjProc(interp, Pg_result_nr, cData, objc, objv);
+#endif
+	return PgResult(cData, interp, objc, objv);
+}
+
+#ifdef PGTCL_USE_NRE
+int
+Pg_result_nr(ClientData cData, Tcl_Interp *interp, int objc,
+			 Tcl_Obj *CONST objv[])
+{
+	return PgResult(cData, interp, objc, objv);
+}
+#endif
+
+static int
+PgResult(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
 	PGresult   *result;
 	int			i;
@@ -972,7 +1998,9 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 		"-status", "-error", "-conn", "-oid",
 		"-numTuples", "-cmdTuples", "-numAttrs", "-assign", "-assignbyidx",
 		"-getTuple", "-tupleArray", "-tupleArrayWithoutNulls", "-attributes", "-lAttributes",
-		"-clear", "-list", "-llist", "-dict", "-null_value_string", (char *)NULL
+		"-clear", "-list", "-llist", "-dict", "-null_value_string", "-arrays",
+		"-bytea", "-foreach", "-column", "-columnar", "-index", "-lookup",
+		(char *)NULL
 	};
 
 	enum options
@@ -980,7 +2008,9 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 		OPT_STATUS, OPT_ERROR, OPT_CONN, OPT_OID,
 		OPT_NUMTUPLES, OPT_CMDTUPLES, OPT_NUMATTRS, OPT_ASSIGN, OPT_ASSIGNBYIDX,
 		OPT_GETTUPLE, OPT_TUPLEARRAY, OPT_TUPLEARRAY_WITHOUT_NULLS, OPT_ATTRIBUTES, OPT_LATTRIBUTES,
-		OPT_CLEAR, OPT_LIST, OPT_LLIST, OPT_DICT, OPT_NULL_VALUE_STRING
+		OPT_CLEAR, OPT_LIST, OPT_LLIST, OPT_DICT, OPT_NULL_VALUE_STRING,
+		OPT_ARRAYS, OPT_BYTEA, OPT_FOREACH, OPT_COLUMN, OPT_COLUMNAR,
+		OPT_INDEX, OPT_LOOKUP
 	};
 
 	static CONST84 char *errorOptions[] = {
@@ -1004,7 +2034,7 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 		PG_DIAG_SOURCE_FUNCTION
 	};
 
-	if (objc < 3 || objc > 5)
+	if (objc < 3 || objc > 10)
 	{
 		Tcl_WrongNumArgs(interp, 1, objv, "");
 		goto Pg_result_errReturn;		/* append help info */
@@ -1028,10 +2058,11 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 		return TCL_ERROR;
 
 #ifndef HAVE_TCL_NEWDICTOBJ
-    if ((enum options) optIndex == OPT_DICT)
+    if ((enum options) optIndex == OPT_DICT ||
+        (enum options) optIndex == OPT_COLUMNAR)
     {
         Tcl_SetObjResult(interp, Tcl_NewStringObj(
-          "You need a Tcl version (8.5+) that supports dicts in order to use the -dict option", -1));
+          "You need a Tcl version (8.5+) that supports dicts in order to use the -dict and -columnar options", -1));
 	    return TCL_ERROR;
     }
 
@@ -1157,26 +2188,37 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 		case OPT_ASSIGN:
 			{
 				Tcl_Obj    *fieldNameObj;
+				Pg_Slice	slice;
+				int			code = TCL_OK;
+				int			lazy;
 
-				if (objc != 4)
+				if (objc < 4)
 				{
-					Tcl_WrongNumArgs(interp, 3, objv, "arrayName");
+					Tcl_WrongNumArgs(interp, 3, objv,
+						"arrayName ?-lazy? ?-rows start count? ?-columns columns?");
 					return TCL_ERROR;
 				}
 
 				arrVarObj = objv[3];
-				arrVar = Tcl_GetStringFromObj(arrVarObj, NULL);
-				fieldNameObj = Tcl_NewObj ();
+				lazy = (objc > 4 && strcmp(Tcl_GetString(objv[4]), "-lazy") == 0);
+				if (PgSliceInit(interp, result, objc, objv, 4 + lazy, 1, &slice) != TCL_OK)
+					return TCL_ERROR;
+
+				/* elements made as they are read, from a trace */
+				if (lazy)
+					return PgResultAssignLazy(interp, resultid, result,
+											  arrVarObj, &slice);
 
 				/*
 				 * this assignment assigns the table of result tuples into
 				 * a giant array with the name given in the argument. The
 				 * indices of the array are of the form (tupno,attrName).
 				 */
-				for (tupno = 0; tupno < PQntuples(result); tupno++)
+				for (tupno = slice.tupStart; tupno < slice.tupEnd && code == TCL_OK; tupno++)
 				{
-					for (i = 0; i < PQnfields(result); i++)
+					for (i = 0; i < slice.ncols; i++)
 					{
+						int			column = slice.columns[i];
 
 						/*
 						 * construct the array element name consisting
@@ -1184,34 +2226,35 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 						 * name.
 						 * this is a little kludgey -- we set the obj
 						 * to an int but the append following will force a
-						 * string conversion.
+						 * string conversion.  A new element name each
+						 * time: the array may keep the one it was given
+						 * as the key of the element.
 						 */
-						Tcl_SetIntObj(fieldNameObj, tupno);
+						fieldNameObj = Tcl_NewIntObj(tupno);
 						Tcl_AppendToObj(fieldNameObj, ",", 1);
-						Tcl_AppendToObj(fieldNameObj, PQfname(result, i), -1);
-
+						Tcl_AppendToObj(fieldNameObj, PQfname(result, column), -1);
+						Tcl_IncrRefCount(fieldNameObj);
 
 						if (Tcl_ObjSetVar2(interp, arrVarObj, fieldNameObj,
-										   Tcl_NewStringObj(
-											 PGgetvalue(result, resultid->nullValueString, tupno, i),
-											 -1), TCL_LEAVE_ERR_MSG) == NULL) {
+										   PGgetvalueObj(result, resultid->nullValueString,
+														 resultid->decode, tupno, column),
+										   TCL_LEAVE_ERR_MSG) == NULL) {
 							Tcl_DecrRefCount (fieldNameObj);
-							return TCL_ERROR;
+							code = TCL_ERROR;
+							break;
 						}
+						Tcl_DecrRefCount (fieldNameObj);
 					}
 				}
-				Tcl_DecrRefCount (fieldNameObj);
-				return TCL_OK;
+				PgSliceFree(&slice);
+				return code;
 			}
 
 		case OPT_ASSIGNBYIDX:
 			{
-				fieldNameObj = Tcl_NewObj();
-
 				if ((objc != 4) && (objc != 5))
 				{
 					Tcl_WrongNumArgs(interp, 3, objv, "arrayName ?append_string?");
-					Tcl_DecrRefCount(fieldNameObj);
 					return TCL_ERROR;
 				}
 
@@ -1238,23 +2281,25 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 
 					for (i = 1; i < PQnfields(result); i++)
 					{
-						Tcl_SetStringObj(fieldNameObj, field0, -1);
+						/* a new name each time, as for -assign */
+						fieldNameObj = Tcl_NewStringObj(field0, -1);
 						Tcl_AppendToObj(fieldNameObj, ",", 1);
 						Tcl_AppendToObj(fieldNameObj, PQfname(result, i), -1);
 
 						if (appendstrObj != NULL)
 							Tcl_AppendObjToObj(fieldNameObj, appendstrObj);
+						Tcl_IncrRefCount(fieldNameObj);
 
 						if (Tcl_ObjSetVar2(interp, arrVarObj, fieldNameObj,
-										   Tcl_NewStringObj( PGgetvalue(result, resultid->nullValueString, tupno, i), -1), TCL_LEAVE_ERR_MSG) == NULL)
+										   PGgetvalueObj(result, resultid->nullValueString, resultid->decode, tupno, i), TCL_LEAVE_ERR_MSG) == NULL)
 						{
                             
 							Tcl_DecrRefCount(fieldNameObj);
 							return TCL_ERROR;
 						}
+						Tcl_DecrRefCount(fieldNameObj);
 					}
 				}
-				Tcl_DecrRefCount(fieldNameObj);
 				return TCL_OK;
 			}
 
@@ -1290,11 +2335,9 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 				/* build up a return list, Tcl-object-style */
 				for (i = 0; i < PQnfields(result); i++)
 				{
-					char	   *value;
-
-					value = PGgetvalue(result, resultid->nullValueString, tupno, i);
 					if (Tcl_ListObjAppendElement(interp, resultObj,
-							   Tcl_NewStringObj(value, -1)) == TCL_ERROR)
+							   PGgetvalueObj(result, resultid->nullValueString,
+											 resultid->decode, tupno, i)) == TCL_ERROR)
 						return TCL_ERROR;
 				}
                 Tcl_SetObjResult(interp, resultObj);
@@ -1332,9 +2375,9 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 					 */
 					for (i = 0; i < PQnfields(result); i++)
 					{
-						if (Tcl_SetVar2(interp, arrayName, PQfname(result, i),
-							 PGgetvalue(result, resultid->nullValueString, 
-								 tupno, i), TCL_LEAVE_ERR_MSG) == NULL)
+						if (Tcl_SetVar2Ex(interp, arrayName, PQfname(result, i),
+							 PGgetvalueObj(result, resultid->nullValueString, 
+								 resultid->decode, tupno, i), TCL_LEAVE_ERR_MSG) == NULL)
 						return TCL_ERROR;
 					}
 				} else
@@ -1355,8 +2398,9 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 							}
 						}
 
-						if (Tcl_SetVar2(interp, arrayName, PQfname(result, i),
-									 string,
+						if (Tcl_SetVar2Ex(interp, arrayName, PQfname(result, i),
+									 PGgetvalueObj(result, resultid->nullValueString,
+												   resultid->decode, tupno, i),
 										TCL_LEAVE_ERR_MSG) == NULL)
 							return TCL_ERROR;
 					}
@@ -1423,7 +2467,11 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 
 		case OPT_LIST: 
 		{
- 	
+			Pg_Slice	slice;
+
+			if (PgSliceInit(interp, result, objc, objv, 3, 1, &slice) != TCL_OK)
+				return TCL_ERROR;
+
 			listObj = Tcl_NewListObj(0, (Tcl_Obj **) NULL);
 
 			/*
@@ -1433,28 +2481,22 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 			**	This option appends all of the attributes
 			**	for each tuple to the same list
 			*/
-			for (tupno = 0; tupno < PQntuples(result); tupno++)
+			for (tupno = slice.tupStart; tupno < slice.tupEnd; tupno++)
 			{
 
 				/*
 				**	Loop over the attributes for the tuple, 
 				**	and append them to the list
 				*/
-				for (i = 0; i < PQnfields(result); i++)
+				for (i = 0; i < slice.ncols; i++)
 				{
-				    fieldObj = Tcl_NewObj();
-
-				    Tcl_SetStringObj(fieldObj, PGgetvalue(result, resultid->nullValueString, tupno, i), -1);
-				    if (Tcl_ListObjAppendElement(interp, listObj, fieldObj) != TCL_OK)
-					{
-						Tcl_DecrRefCount(listObj);
-						Tcl_DecrRefCount(fieldObj);
-						return TCL_ERROR;
-					}
-	
+				    fieldObj = PGgetvalueObj(result, resultid->nullValueString,
+											 resultid->decode, tupno, slice.columns[i]);
+				    Tcl_ListObjAppendElement(interp, listObj, fieldObj);
 				}
 			}
 	
+			PgSliceFree(&slice);
 			Tcl_SetObjResult(interp, listObj);
 			
 			return TCL_OK;
@@ -1462,6 +2504,11 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 		}
 		case OPT_LLIST: 
 		{
+			Pg_Slice	slice;
+
+			if (PgSliceInit(interp, result, objc, objv, 3, 1, &slice) != TCL_OK)
+				return TCL_ERROR;
+
 			listObj = Tcl_NewListObj(0, (Tcl_Obj **) NULL);
 	
 			/*
@@ -1473,7 +2520,7 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 			**	appends that to the main list.
 			**	This is a list of lists
 			*/
-			for (tupno = 0; tupno < PQntuples(result); tupno++)
+			for (tupno = slice.tupStart; tupno < slice.tupEnd; tupno++)
 			{
 				subListObj = Tcl_NewListObj(0, (Tcl_Obj **) NULL);
 	
@@ -1481,29 +2528,16 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 				**	This is the inner list. This contains
 				**	the actual row values
 				*/
-				for (i = 0; i < PQnfields(result); i++)
+				for (i = 0; i < slice.ncols; i++)
 				{
-	
-					fieldObj = Tcl_NewObj();
-
-					Tcl_SetStringObj(fieldObj, PGgetvalue(result, resultid->nullValueString, tupno, i), -1);
-	
-					if (Tcl_ListObjAppendElement(interp, subListObj, fieldObj) != TCL_OK)
-					{
-						Tcl_DecrRefCount(listObj);
-						Tcl_DecrRefCount(fieldObj);
-						return TCL_ERROR;
-					}
-	
-				}
-				if (Tcl_ListObjAppendElement(interp, listObj, subListObj) != TCL_OK)
-				{
-					Tcl_DecrRefCount(listObj);
-					Tcl_DecrRefCount(fieldObj);
-					return TCL_ERROR;
+					fieldObj = PGgetvalueObj(result, resultid->nullValueString,
+											 resultid->decode, tupno, slice.columns[i]);
+					Tcl_ListObjAppendElement(interp, subListObj, fieldObj);
 				}
+				Tcl_ListObjAppendElement(interp, listObj, subListObj);
 			}
 	
+			PgSliceFree(&slice);
 			Tcl_SetObjResult(interp, listObj);
 		
 			return TCL_OK;
@@ -1513,6 +2547,20 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
                 {
 
 #ifdef HAVE_TCL_NEWDICTOBJ
+			Pg_Slice	slice;
+			Tcl_Obj   **columnNameObjs;
+
+			if (PgSliceInit(interp, result, objc, objv, 3, 1, &slice) != TCL_OK)
+				return TCL_ERROR;
+
+			/* the keys of every row, made once */
+			columnNameObjs = (Tcl_Obj **)ckalloc(sizeof(Tcl_Obj *) * (slice.ncols + 1));
+			for (i = 0; i < slice.ncols; i++)
+			{
+				columnNameObjs[i] = Tcl_NewStringObj(PQfname(result, slice.columns[i]), -1);
+				Tcl_IncrRefCount(columnNameObjs[i]);
+			}
+
 			listObj = Tcl_NewDictObj();
 	
 			/*
@@ -1524,7 +2572,7 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 			**	appends that to the main list.
 			**	This is a list of lists
 			*/
-			for (tupno = 0; tupno < PQntuples(result); tupno++)
+			for (tupno = slice.tupStart; tupno < slice.tupEnd; tupno++)
 			{
 				subListObj = Tcl_NewDictObj();
 	
@@ -1532,36 +2580,145 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 				**	This is the inner list. This contains
 				**	the actual row values
 				*/
-				for (i = 0; i < PQnfields(result); i++)
+				for (i = 0; i < slice.ncols; i++)
+				{
+					fieldObj = PGgetvalueObj(result, resultid->nullValueString,
+											 resultid->decode, tupno, slice.columns[i]);
+					Tcl_DictObjPut(interp, subListObj, columnNameObjs[i], fieldObj);
+				}
+				Tcl_DictObjPut(interp, listObj, Tcl_NewIntObj(tupno), subListObj);
+			}
+	
+			PgColumnNameObjsFree(columnNameObjs, slice.ncols);
+			PgSliceFree(&slice);
+			Tcl_SetObjResult(interp, listObj);
+			return TCL_OK;
+
+#endif /* HAVE_TCL_NEWDICTOBJ */
+                }
+
+		case OPT_COLUMNAR:
+			{
+#ifdef HAVE_TCL_NEWDICTOBJ
+				Pg_Slice	slice;
+				Tcl_Obj   **valueObjs;
+				int			typed = 0;
+				int			column,
+							n;
+
+				if (objc > 3 &&
+					strcmp(Tcl_GetStringFromObj(objv[3], NULL), "-typed") == 0)
+					typed = 1;
+
+				if (PgSliceInit(interp, result, objc, objv, 3 + typed, 1,
+								&slice) != TCL_OK)
+					return TCL_ERROR;
+
+				/*
+				 * One list for each column, made at its size from the
+				 * values gathered for it.
+				 */
+				listObj = Tcl_NewDictObj();
+				valueObjs = (Tcl_Obj **)ckalloc(sizeof(Tcl_Obj *) *
+										(slice.tupEnd - slice.tupStart + 1));
+				for (i = 0; i < slice.ncols; i++)
+				{
+					column = slice.columns[i];
+					n = 0;
+					for (tupno = slice.tupStart; tupno < slice.tupEnd; tupno++)
+					{
+						fieldObj = PGgetvalueObj(result, resultid->nullValueString,
+												 resultid->decode, tupno, column);
+						if (typed && !PQgetisnull(result, tupno, column))
+							PgSetNumberRep(fieldObj, PQftype(result, column));
+						valueObjs[n++] = fieldObj;
+					}
+					Tcl_DictObjPut(interp, listObj,
+								   Tcl_NewStringObj(PQfname(result, column), -1),
+								   Tcl_NewListObj(n, valueObjs));
+				}
+
+				ckfree((void *)valueObjs);
+				PgSliceFree(&slice);
+				Tcl_SetObjResult(interp, listObj);
+				return TCL_OK;
+#endif /* HAVE_TCL_NEWDICTOBJ */
+			}
+
+		case OPT_INDEX:
+			{
+				if (objc == 3)
 				{
-	
-					fieldObj = Tcl_NewObj();
-					fieldNameObj = Tcl_NewObj();
+					/* the columns of the index there is */
+					Tcl_Obj    *resultObj = Tcl_NewListObj(0, NULL);
 
-					Tcl_SetStringObj(fieldNameObj, PQfname(result, i), -1);
-					Tcl_SetStringObj(fieldObj, PGgetvalue(result, resultid->nullValueString, tupno, i), -1);
-	
-					if (Tcl_DictObjPut(interp, subListObj, fieldNameObj, fieldObj) != TCL_OK)
-					{
-						Tcl_DecrRefCount(listObj);
-						Tcl_DecrRefCount(fieldObj);
-						return TCL_ERROR;
-					}
-	
+					for (i = 0; i < resultid->nIndexColumns; i++)
+						Tcl_ListObjAppendElement(interp, resultObj, Tcl_NewStringObj(
+							PQfname(result, resultid->indexColumns[i]), -1));
+					Tcl_SetObjResult(interp, resultObj);
+					return TCL_OK;
 				}
-				if (Tcl_DictObjPut(interp, listObj, Tcl_NewIntObj(tupno), subListObj) != TCL_OK)
+				if (objc != 4)
 				{
-					Tcl_DecrRefCount(listObj);
-					Tcl_DecrRefCount(fieldObj);
+					Tcl_WrongNumArgs(interp, 3, objv, "?columns?");
 					return TCL_ERROR;
 				}
+				return PgResultIndex(interp, resultid, result, objv[3]);
 			}
-	
-			Tcl_SetObjResult(interp, listObj);
-			return TCL_OK;
 
-#endif /* HAVE_TCL_NEWDICTOBJ */
-                }
+		case OPT_LOOKUP:
+			{
+				static CONST84 char *lookupModes[] = {
+					"-list", "-dict", (char *)NULL
+				};
+				int			asDict = 0;
+
+				if (objc != 4 && objc != 5)
+				{
+					Tcl_WrongNumArgs(interp, 3, objv, "key ?-list|-dict?");
+					return TCL_ERROR;
+				}
+				if (objc == 5 &&
+					Tcl_GetIndexFromObj(interp, objv[4], lookupModes, "mode",
+										TCL_EXACT, &asDict) != TCL_OK)
+					return TCL_ERROR;
+#ifndef HAVE_TCL_NEWDICTOBJ
+				if (asDict)
+				{
+					Tcl_SetResult(interp, "You need a Tcl version (8.5+) that supports dicts in order to use -lookup -dict", TCL_STATIC);
+					return TCL_ERROR;
+				}
+#endif
+				return PgResultLookup(interp, resultid, result, objv[3], asDict);
+			}
+
+		case OPT_COLUMN:
+			{
+				Pg_Slice	slice;
+				int			column;
+
+				if (objc < 4)
+				{
+					Tcl_WrongNumArgs(interp, 3, objv, "column ?-rows start count?");
+					return TCL_ERROR;
+				}
+
+				if (PgColumnIndex(interp, result, objv[3], &column) != TCL_OK ||
+					PgSliceInit(interp, result, objc, objv, 4, 0, &slice) != TCL_OK)
+					return TCL_ERROR;
+
+				listObj = Tcl_NewListObj(0, (Tcl_Obj **) NULL);
+				for (tupno = slice.tupStart; tupno < slice.tupEnd; tupno++)
+				{
+					Tcl_ListObjAppendElement(interp, listObj,
+							PGgetvalueObj(result, resultid->nullValueString,
+										  resultid->decode, tupno, column));
+				}
+
+				PgSliceFree(&slice);
+				Tcl_SetObjResult(interp, listObj);
+				return TCL_OK;
+			}
 
 		case OPT_NULL_VALUE_STRING:
 			{
@@ -1601,6 +2758,84 @@ Pg_result(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 				return TCL_OK;
 			}
 
+		case OPT_ARRAYS:
+		case OPT_BYTEA:
+			{
+				static CONST84 char *arraysModes[] = {
+					"string", "list", "guess", (char *)NULL
+				};
+				static CONST int arraysBits[] = {
+					0, PGTCL_DECODE_ARRAYS,
+					PGTCL_DECODE_ARRAYS | PGTCL_DECODE_USER_ARRAYS
+				};
+				static CONST84 char *byteaModes[] = {
+					"text", "binary", (char *)NULL
+				};
+				static CONST int byteaBits[] = {
+					0, PGTCL_DECODE_BYTEA
+				};
+				CONST84 char **modes;
+				CONST int  *bits;
+				int			mask;
+				int			mode;
+
+				if (optIndex == OPT_ARRAYS)
+				{
+					modes = arraysModes;
+					bits = arraysBits;
+					mask = PGTCL_DECODE_ARRAYS | PGTCL_DECODE_USER_ARRAYS;
+				}
+				else
+				{
+					modes = byteaModes;
+					bits = byteaBits;
+					mask = PGTCL_DECODE_BYTEA;
+				}
+
+				if ((objc < 3) || (objc > 4))
+				{
+					Tcl_WrongNumArgs(interp, 3, objv, optIndex == OPT_ARRAYS ?
+									 "?string|list|guess?" : "?text|binary?");
+					return TCL_ERROR;
+				}
+
+				if (objc == 4)
+				{
+					if (Tcl_GetIndexFromObj(interp, objv[3], modes, "mode",
+											TCL_EXACT, &mode) != TCL_OK)
+						return TCL_ERROR;
+					resultid->decode = (resultid->decode & ~mask) | bits[mode];
+				}
+
+				for (mode = 0; bits[mode] != (resultid->decode & mask); mode++)
+					;
+				Tcl_SetObjResult(interp, Tcl_NewStringObj(modes[mode], -1));
+				return TCL_OK;
+			}
+
+		case OPT_FOREACH:
+			{
+				Pg_Loop    *loop;
+
+				if (objc == 5)
+					loop = PgLoopForeach(interp, resultid, result, objv[3],
+										 NULL, objv[4]);
+				else if (objc == 6 &&
+						 strcmp(Tcl_GetStringFromObj(objv[3], NULL), "-array") == 0)
+					loop = PgLoopForeach(interp, resultid, result, NULL,
+										 objv[4], objv[5]);
+				else
+				{
+					Tcl_WrongNumArgs(interp, 3, objv,
+									 "varList|-array arrayName body");
+					return TCL_ERROR;
+				}
+
+				if (loop == NULL)
+					return TCL_ERROR;
+				return PgLoopRun(interp, loop);
+			}
+
 		default:
 			{
                 Tcl_SetObjResult(interp, Tcl_NewStringObj("Invalid option\n", -1));
@@ -1618,55 +2853,239 @@ Pg_result_errReturn:
 					 "\t-numTuples\n",
 					 "\t-cmdTuples\n",
 					 "\t-numAttrs\n"
-					 "\t-assign arrayVarName\n",
+					 "\t-assign arrayVarName ?-lazy? ?-rows start count? ?-columns columns?\n",
 					 "\t-assignbyidx arrayVarName ?appendstr?\n",
 					 "\t-getTuple tupleNumber\n",
 					 "\t-tupleArray tupleNumber arrayVarName\n",
+					 "\t-foreach varList|-array arrayVarName body\n",
 					 "\t-attributes\n"
 					 "\t-lAttributes\n"
-					 "\t-list\n",
-					 "\t-llist\n",
+					 "\t-list ?-rows start count? ?-columns columns?\n",
+					 "\t-llist ?-rows start count? ?-columns columns?\n",
 					 "\t-clear\n",
-					 "\t-dict\n",
+					 "\t-dict ?-rows start count? ?-columns columns?\n",
+					 "\t-column column ?-rows start count?\n",
+					 "\t-columnar ?-typed? ?-rows start count? ?-columns columns?\n",
+					 "\t-index ?columns?\n",
+					 "\t-lookup key ?-list|-dict?\n",
+					 "\t-null_value_string ?nullValueString?\n",
+					 "\t-arrays ?string|list|guess?\n",
+					 "\t-bytea ?text|binary?\n",
 					 (char *)NULL);
         Tcl_SetObjResult(interp, tresult);
 	return TCL_ERROR;
 }
 
 
+/*-------------------------------------------
+  Queries of pg_execute and pg_select
+
+  Both send either a query string or, with -prepared, the name of a
+  prepared statement, with the values of -params for its $1, $2 and so
+  on.  Without parameters a query string goes through PQexec, which
+  allows several statements in it, as it always has.
+  ------------------------------------------*/
+
+struct Pg_Query_s
+{
+	CONST84 char *query;		/* the query, or the statement's name */
+	int			prepared;
+	int			nParams;
+	const char **paramValues;	/* NULL if there are none */
+};
+
+/*
+ * Fill in query from the query string, or the -prepared name, and the
+ * -params list, either of which may be NULL.  "NULL" is sent as a NULL,
+ * as pg_exec does.
+ */
+static int
+PgQueryInit(Tcl_Interp *interp, Pg_Query *query, Tcl_Obj *queryObj,
+			Tcl_Obj *preparedObj, Tcl_Obj *paramsObj)
+{
+	Tcl_Obj   **paramObjs;
+	int			param;
+
+	query->prepared = (preparedObj != NULL);
+	query->query = Tcl_GetStringFromObj(query->prepared ? preparedObj : queryObj,
+										NULL);
+	query->nParams = 0;
+	query->paramValues = NULL;
+
+#ifndef HAVE_PQEXECPREPARED
+	if (query->prepared)
+	{
+		Tcl_SetResult(interp, "-prepared is unavailable with this version of the postgres libpq library", TCL_STATIC);
+		return TCL_ERROR;
+	}
+#endif
+
+	if (paramsObj == NULL)
+		return TCL_OK;
+
+#ifndef HAVE_PQEXECPARAMS
+	Tcl_SetResult(interp, "-params is unavailable with this version of the postgres libpq library", TCL_STATIC);
+	return TCL_ERROR;
+#else
+	if (Tcl_ListObjGetElements(interp, paramsObj, &query->nParams,
+							   &paramObjs) != TCL_OK)
+		return TCL_ERROR;
+
+	if (query->nParams > 0)
+	{
+		query->paramValues = (const char **)ckalloc(query->nParams * sizeof(char *));
+		for (param = 0; param < query->nParams; param++)
+		{
+			query->paramValues[param] = Tcl_GetStringFromObj(paramObjs[param], NULL);
+			if (strcmp(query->paramValues[param], "NULL") == 0)
+				query->paramValues[param] = NULL;
+		}
+	}
+	return TCL_OK;
+#endif
+}
+
+/*
+ * Run the query and wait for its result, counting it for pg_stats under
+ * family, or as a prepared statement.
+ */
+static PGresult *
+PgQueryExec(Pg_ConnectionId *connid, Pg_Query *query, int family)
+{
+	PGresult   *result;
+	Tcl_WideInt start = PgStatsClock();
+
+#ifdef HAVE_PQEXECPREPARED
+	if (query->prepared)
+	{
+		result = PQexecPrepared(connid->conn, query->query, query->nParams,
+								query->paramValues, NULL, NULL, 0);
+		family = PG_STATS_PREPARED;
+	}
+	else
+#endif
+#ifdef HAVE_PQEXECPARAMS
+	if (query->nParams > 0)
+		result = PQexecParams(connid->conn, query->query, query->nParams,
+							  NULL, query->paramValues, NULL, NULL, 0);
+	else
+#endif
+		result = PQexec(connid->conn, query->query);
+
+	PgStatsQuery(connid, family, query->query, query->nParams, query->paramValues);
+	PgStatsResult(connid, result, PgStatsClock() - start);
+	return result;
+}
+
+static void
+PgQueryFree(Pg_Query *query)
+{
+	if (query->paramValues != NULL)
+		ckfree((void *)query->paramValues);
+	query->paramValues = NULL;
+}
+
 /**********************************
  * pg_execute
  send a query string to the backend connection and process the result
 
  syntax:
- pg_execute ?-array name? ?-oid varname? connection query ?loop_body?
+ pg_execute ?-array name? ?-oid varname? ?-params list? connection query
+	 ?loop_body?
+ pg_execute ?-array name? ?-oid varname? ?-params list? -prepared name
+	 connection ?loop_body?
 
  the return result is the number of tuples processed. If the query
  returns tuples (i.e. a SELECT statement), the result is placed into
  variables
+
+ -params gives values for $1, $2 and so on in the query, and -prepared
+ runs the prepared statement name with them instead of a query.  A
+ value of NULL is sent as a NULL, as by pg_exec.
  **********************************/
 
 int
 Pg_execute(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+#ifdef PGTCL_USE_NRE
+	/* the loop body runs in the non-recursive engine */
+	return Tcl_NRCallObjProc(interp, Pg_execute_nr, cData, objc, objv);
+#else
+	return PgExecute(cData, interp, objc, objv);
+#endif
+}
+
+/*
+ * pg_execute, waiting for the result of the query
+ */
+static int
+PgExecute(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
 	Pg_ConnectionId *connid;
 	PGconn	   *conn;
 	PGresult   *result;
+	Pg_Query	query;
 	int			i;
-	int			tupno;
-	int			ntup;
-	int			loop_rc;
-	CONST84 char	   *array_varname = NULL;
-	char	   *arg;
 	char	   *connString;
-	char	   *queryString;
 
-	Tcl_Obj    *oid_varnameObj = NULL;
-	Tcl_Obj    *evalObj;
-	Tcl_Obj    *resultObj;
+	Tcl_Obj    *arrayObj;
+	Tcl_Obj    *oid_varnameObj;
+	Tcl_Obj    *paramsObj;
+	Tcl_Obj    *preparedObj;
+
+	if ((i = PgExecuteArgs(interp, objc, objv, &arrayObj, &oid_varnameObj,
+						   &paramsObj, &preparedObj)) < 0)
+		return TCL_ERROR;
+
+	/*
+	 * Get the connection and make sure no COPY command is pending
+	 */
+	connString = Tcl_GetStringFromObj(objv[i++], NULL);
+	conn = PgGetConnectionId(interp, connString, &connid);
+	if (conn == NULL)
+		return TCL_ERROR;
+
+	if (connid->res_copyStatus != RES_COPY_NONE)
+	{
+            Tcl_SetObjResult(interp, 
+              Tcl_NewStringObj("Attempt to query while COPY in progress", -1));
+
+		return TCL_ERROR;
+	}
+
+	/*
+	 * Execute the query
+	 */
+	if (PgQueryInit(interp, &query, preparedObj == NULL ? objv[i++] : NULL,
+					preparedObj, paramsObj) != TCL_OK)
+		return TCL_ERROR;
+	result = PgQueryExec(connid, &query, PG_STATS_EXECUTE);
+	PgQueryFree(&query);
+
+	return PgExecuteResult(interp, connid, result, arrayObj, oid_varnameObj,
+						   query.prepared ? NULL : query.query,
+						   i < objc ? objv[i] : NULL);
+}
+
+/*
+ * Parse the options of pg_execute.  Returns the index of the connection
+ * argument, or -1 after leaving an error message.
+ */
+static int
+PgExecuteArgs(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+			  Tcl_Obj **arrayObjPtr, Tcl_Obj **oidObjPtr,
+			  Tcl_Obj **paramsObjPtr, Tcl_Obj **preparedObjPtr)
+{
+	int			i;
+	char	   *arg;
+
+	char	   *usage = "?-array arrayname? ?-oid varname? ?-params list? "
+	"?-prepared statementName? connection ?queryString? ?loop_body?";
 
-	char	   *usage = "?-array arrayname? ?-oid varname? "
-	"connection queryString ?loop_body?";
+	*arrayObjPtr = NULL;
+	*oidObjPtr = NULL;
+	*paramsObjPtr = NULL;
+	*preparedObjPtr = NULL;
 
 	/*
 	 * First we parse the options
@@ -1689,15 +3108,13 @@ Pg_execute(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]
 			if (i == objc)
 			{
 				Tcl_WrongNumArgs(interp, 1, objv, usage);
-				return TCL_ERROR;
+				return -1;
 			}
 
-			array_varname = Tcl_GetStringFromObj(objv[i++], NULL);
+			*arrayObjPtr = objv[i++];
 			continue;
 		}
 
-		arg = Tcl_GetStringFromObj(objv[i], NULL);
-
 		if (strcmp(arg, "-oid") == 0)
 		{
 			/*
@@ -1707,47 +3124,69 @@ Pg_execute(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]
 			if (i == objc)
 			{
 				Tcl_WrongNumArgs(interp, 1, objv, usage);
-				return TCL_ERROR;
+				return -1;
+			}
+			*oidObjPtr = objv[i++];
+			continue;
+		}
+
+		if (strcmp(arg, "-params") == 0)
+		{
+			/*
+			 * Values for $1, $2, ... in the query
+			 */
+			i++;
+			if (i == objc)
+			{
+				Tcl_WrongNumArgs(interp, 1, objv, usage);
+				return -1;
+			}
+			*paramsObjPtr = objv[i++];
+			continue;
+		}
+
+		if (strcmp(arg, "-prepared") == 0)
+		{
+			/*
+			 * Run a prepared statement, there is no query string
+			 */
+			i++;
+			if (i == objc)
+			{
+				Tcl_WrongNumArgs(interp, 1, objv, usage);
+				return -1;
 			}
-			oid_varnameObj = objv[i++];
+			*preparedObjPtr = objv[i++];
 			continue;
 		}
 
 		Tcl_WrongNumArgs(interp, 1, objv, usage);
-		return TCL_ERROR;
+		return -1;
 	}
 
 	/*
 	 * Check that after option parsing at least 'connection' and 'query'
-	 * are left
+	 * are left, or just 'connection' for a prepared statement
 	 */
-	if (objc - i < 2)
+	if (objc - i < (*preparedObjPtr == NULL ? 2 : 1))
 	{
 		Tcl_WrongNumArgs(interp, 1, objv, usage);
-		return TCL_ERROR;
+		return -1;
 	}
 
-	/*
-	 * Get the connection and make sure no COPY command is pending
-	 */
-	connString = Tcl_GetStringFromObj(objv[i++], NULL);
-	conn = PgGetConnectionId(interp, connString, &connid);
-	if (conn == NULL)
-		return TCL_ERROR;
-
-	if (connid->res_copyStatus != RES_COPY_NONE)
-	{
-            Tcl_SetObjResult(interp, 
-              Tcl_NewStringObj("Attempt to query while COPY in progress", -1));
-
-		return TCL_ERROR;
-	}
+	return i;
+}
 
-	/*
-	 * Execute the query
-	 */
-	queryString = Tcl_GetStringFromObj(objv[i++], NULL);
-	result = PQexec(conn, queryString);
+/*
+ * What pg_execute does with the result of its query: set the variables,
+ * and run the loop body for each row if there is one.
+ */
+static int
+PgExecuteResult(Tcl_Interp *interp, Pg_ConnectionId *connid,
+				PGresult *result, Tcl_Obj *arrayObj, Tcl_Obj *oid_varnameObj,
+				CONST84 char *queryString, Tcl_Obj *evalObj)
+{
+	Tcl_Obj    *resultObj;
 
 	/*
 	 * Transfer any notify events from libpq to Tcl event queue.
@@ -1759,7 +3198,7 @@ Pg_execute(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]
 	 */
 	if (result == NULL)
 	{
-            Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(conn), -1));
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(connid->conn), -1));
 
 		return TCL_ERROR;
 	}
@@ -1787,8 +3226,12 @@ Pg_execute(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]
 			/* fall through if we have tuples */
 			break;
 
-		case PGRES_EMPTY_QUERY:
 		case PGRES_COMMAND_OK:
+			if (connid->autoreconnect && queryString != NULL)
+				PgTrackPrepared(connid, queryString);
+			/* FALLTHROUGH */
+
+		case PGRES_EMPTY_QUERY:
 		case PGRES_COPY_IN:
 		case PGRES_COPY_OUT:
 		/* tell the number of affected tuples for non-SELECT queries */
@@ -1819,73 +3262,38 @@ Pg_execute(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]
 	/*
 	 * We reach here only for queries that returned tuples
 	 */
-	if (i == objc)
+	if (evalObj == NULL)
 	{
 		/*
-		 * We don't have a loop body. If we have at least one result row,
-		 * we set all the variables to the first one and return.
-		 */
-		if (PQntuples(result) > 0)
-		{
-			if (execute_put_values(interp, array_varname, result, connid->nullValueString, 0) != TCL_OK)
-			{
-				PQclear(result);
-				return TCL_ERROR;
-			}
-		}
-
-		Tcl_SetObjResult(interp, Tcl_NewIntObj(PQntuples(result)));
-		PQclear(result);
-		return TCL_OK;
-	}
-
-	/*
-	 * We have a loop body. For each row in the result set, put the values
-	 * into the Tcl variables and execute the body.
-	 */
-	ntup = PQntuples(result);
-	evalObj = objv[i];
-	for (tupno = 0; tupno < ntup; tupno++)
-	{
-		if (execute_put_values(interp, array_varname, result, connid->nullValueString, tupno) != TCL_OK)
-		{
-			PQclear(result);
-			return TCL_ERROR;
-		}
-
-		loop_rc = Tcl_EvalObjEx(interp, evalObj, 0);
-
-		/* The returncode of the loop body controls the loop execution */
-		if (loop_rc == TCL_OK || loop_rc == TCL_CONTINUE)
-		{
-			/* OK or CONTINUE means start next loop invocation */
-			continue;
-		}
-
-		if (loop_rc == TCL_RETURN)
-		{
-			/* RETURN means hand up the given interpreter result */
-			PQclear(result);
-			return TCL_RETURN;
-		}
-
-		if (loop_rc == TCL_BREAK)
+		 * We don't have a loop body. If we have at least one result row,
+		 * we set all the variables to the first one and return.
+		 */
+		if (PQntuples(result) > 0)
 		{
-			/* BREAK means leave the loop */
-			break;
+			int			ncols = PQnfields(result);
+			Tcl_Obj   **columnNameObjs = PgColumnNameObjs(result, ncols);
+			int			code;
+
+			code = execute_put_values(interp, arrayObj, columnNameObjs, result,
+								connid->nullValueString, connid->decode, 0);
+			PgColumnNameObjsFree(columnNameObjs, ncols);
+			if (code != TCL_OK)
+			{
+				PQclear(result);
+				return TCL_ERROR;
+			}
 		}
 
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(PQntuples(result)));
 		PQclear(result);
-		return TCL_ERROR;
+		return TCL_OK;
 	}
 
 	/*
-	 * At the end of the loop we put the number of rows we got into the
-	 * interpreter result and clear the result set.
+	 * We have a loop body. For each row in the result set, put the values
+	 * into the Tcl variables and execute the body.
 	 */
-	Tcl_SetObjResult(interp, Tcl_NewIntObj(ntup));
-	PQclear(result);
-	return TCL_OK;
+	return PgLoopRun(interp, PgLoopNew(connid, result, arrayObj, evalObj, PG_LOOP_EXECUTE));
 }
 
 
@@ -1894,15 +3302,16 @@ Pg_execute(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]
 
  Put the values of one tuple into Tcl variables named like the
  column names, or into an array indexed by the column names.
+ columnNameObjs are the names, from PgColumnNameObjs.
  **********************************/
 static int
-execute_put_values(Tcl_Interp *interp, CONST84 char *array_varname,
-				   PGresult *result, char *nullValueString, int tupno)
+execute_put_values(Tcl_Interp *interp, Tcl_Obj *arrayObj,
+				   Tcl_Obj **columnNameObjs, PGresult *result,
+				   char *nullValueString, int decode, int tupno)
 {
 	int			i;
 	int			n;
-	char	   *fname;
-	char	   *value;
+	Tcl_Obj    *value;
 
 	/*
 	 * For each column get the column name and value and put it into a Tcl
@@ -1911,24 +3320,385 @@ execute_put_values(Tcl_Interp *interp, CONST84 char *array_varname,
 	n = PQnfields(result);
 	for (i = 0; i < n; i++)
 	{
-		fname = PQfname(result, i);
-		value = PGgetvalue(result, nullValueString, tupno, i);
+		value = PGgetvalueObj(result, nullValueString, decode, tupno, i);
 
-		if (array_varname != NULL)
+		if (arrayObj != NULL)
 		{
-			if (Tcl_SetVar2(interp, array_varname, fname, value,
-							TCL_LEAVE_ERR_MSG) == NULL)
+			if (Tcl_ObjSetVar2(interp, arrayObj, columnNameObjs[i], value,
+							   TCL_LEAVE_ERR_MSG) == NULL)
 				return TCL_ERROR;
 		}
 		else
 		{
-			if (Tcl_SetVar(interp, fname, value, TCL_LEAVE_ERR_MSG) == NULL)
+			if (Tcl_ObjSetVar2(interp, columnNameObjs[i], NULL, value,
+							   TCL_LEAVE_ERR_MSG) == NULL)
 				return TCL_ERROR;
 		}
 	}
 	return TCL_OK;
 }
 
+/*
+ * PgColumnNameObjs()
+ *
+ * Make the column names of a result into Tcl objects, once for all its
+ * rows.  Setting variables by the same objects each row spares making
+ * them again, and once a name has been looked up as a local variable of
+ * a proc, its object remembers where the variable is.
+ */
+static Tcl_Obj **
+PgColumnNameObjs(PGresult *result, int ncols)
+{
+	Tcl_Obj   **columnNameObjs;
+	int			column;
+
+	columnNameObjs = (Tcl_Obj **)ckalloc(sizeof(Tcl_Obj *) * (ncols + 1));
+	for (column = 0; column < ncols; column++)
+	{
+		columnNameObjs[column] = Tcl_NewStringObj(PQfname(result, column), -1);
+		Tcl_IncrRefCount(columnNameObjs[column]);
+	}
+	return columnNameObjs;
+}
+
+static void
+PgColumnNameObjsFree(Tcl_Obj **columnNameObjs, int ncols)
+{
+	int			column;
+
+	for (column = 0; column < ncols; column++)
+		Tcl_DecrRefCount(columnNameObjs[column]);
+	ckfree((void *)columnNameObjs);
+}
+
+/*-------------------------------------------
+  Row loops
+
+  pg_execute, pg_select and pg_result -foreach run their body once per
+  row through the same loop.  Under Tcl 8.6 each turn is a callback of
+  the non-recursive engine rather than a nested Tcl_EvalObjEx, so the
+  body may nest as deep as plain Tcl code can, and may yield from a
+  coroutine between rows.  The loop holds references to everything it
+  needs, since whoever started it may be gone by the time it runs.  It
+  owns the result too, except for -foreach, where the result stays with
+  its handle and the body may clear it; the loop holds a share of it
+  (see Lazy arrays above), so it can tell its handle from a new one of
+  the same name.
+  ------------------------------------------*/
+
+struct Pg_Loop_s
+{
+	Pg_ConnectionId *connid;
+	PGresult   *result;
+	Tcl_Obj    *handleObj;		/* -foreach: the handle of the result */
+	Pg_LazyResult *shared;		/* -foreach: our share of the result */
+	Tcl_Obj    *varNameObj;		/* array for the row, or NULL */
+	Tcl_Obj    *bodyObj;
+	int			kind;			/* a Pg_LoopKind */
+	int			tupno;
+	int			ntup;
+	int			ncols;
+	Tcl_Obj   **columnNameObjs;
+	int			nvars;			/* -foreach: variables for the columns */
+	Tcl_Obj   **varObjs;
+	Tcl_Obj    *tupnoNameObj;	/* pg_select only: ".tupno", */
+	Tcl_Obj    *commandNameObj;	/* ".command" */
+	Tcl_Obj    *updateObj;		/* and "update" */
+};
+
+static Pg_Loop *
+PgLoopNew(Pg_ConnectionId *connid, PGresult *result, Tcl_Obj *varNameObj,
+		  Tcl_Obj *bodyObj, int kind)
+{
+	Pg_Loop    *loop = (Pg_Loop *) ckalloc(sizeof(Pg_Loop));
+
+	loop->connid = connid;
+	Tcl_Preserve((ClientData) connid);
+	loop->result = result;
+	loop->handleObj = NULL;
+	loop->shared = NULL;
+	loop->varNameObj = varNameObj;
+	if (varNameObj != NULL)
+		Tcl_IncrRefCount(varNameObj);
+	loop->bodyObj = bodyObj;
+	Tcl_IncrRefCount(bodyObj);
+	loop->kind = kind;
+	loop->tupno = -1;
+	loop->ntup = PQntuples(result);
+	loop->ncols = PQnfields(result);
+	loop->columnNameObjs = PgColumnNameObjs(result, loop->ncols);
+	loop->nvars = 0;
+	loop->varObjs = NULL;
+	loop->tupnoNameObj = NULL;
+	loop->commandNameObj = NULL;
+	loop->updateObj = NULL;
+	if (kind == PG_LOOP_SELECT)
+	{
+		loop->tupnoNameObj = Tcl_NewStringObj(".tupno", -1);
+		Tcl_IncrRefCount(loop->tupnoNameObj);
+		loop->commandNameObj = Tcl_NewStringObj(".command", -1);
+		Tcl_IncrRefCount(loop->commandNameObj);
+		loop->updateObj = Tcl_NewStringObj("update", -1);
+		Tcl_IncrRefCount(loop->updateObj);
+	}
+	return loop;
+}
+
+/*
+ * A loop for pg_result -foreach, over the result of a handle, setting
+ * the variables in varListObj to the columns in turn or, if that is NULL,
+ * the array arrayObj indexed by the column names.  Returns NULL, with an
+ * error in interp, if there are more variables than columns.
+ */
+static Pg_Loop *
+PgLoopForeach(Tcl_Interp *interp, Pg_resultid *resultid, PGresult *result,
+			  Tcl_Obj *varListObj, Tcl_Obj *arrayObj, Tcl_Obj *bodyObj)
+{
+	Pg_Loop    *loop;
+	Tcl_Obj   **varObjs = NULL;
+	int			nvars = 0;
+	int			i;
+
+	if (varListObj != NULL)
+	{
+		if (Tcl_ListObjGetElements(interp, varListObj, &nvars, &varObjs) != TCL_OK)
+			return NULL;
+		if (nvars > PQnfields(result))
+		{
+			Tcl_SetObjResult(interp, Tcl_NewStringObj(
+				"more variables than columns in the result", -1));
+			return NULL;
+		}
+	}
+
+	loop = PgLoopNew(resultid->connid, result, arrayObj, bodyObj,
+					 PG_LOOP_FOREACH);
+	loop->handleObj = resultid->str;
+	Tcl_IncrRefCount(loop->handleObj);
+	loop->shared = PgResultShare(resultid, result);
+
+	/* our own copy, as the body may change what the list is */
+	loop->nvars = nvars;
+	loop->varObjs = (Tcl_Obj **)ckalloc(sizeof(Tcl_Obj *) * (nvars + 1));
+	for (i = 0; i < nvars; i++)
+	{
+		loop->varObjs[i] = varObjs[i];
+		Tcl_IncrRefCount(varObjs[i]);
+	}
+	return loop;
+}
+
+static void
+PgLoopFree(Tcl_Interp *interp, Pg_Loop *loop)
+{
+	int			i;
+
+	if (loop->kind == PG_LOOP_SELECT)
+	{
+		Tcl_UnsetVar(interp, Tcl_GetStringFromObj(loop->varNameObj, NULL), 0);
+		Tcl_DecrRefCount(loop->tupnoNameObj);
+		Tcl_DecrRefCount(loop->commandNameObj);
+		Tcl_DecrRefCount(loop->updateObj);
+	}
+	PgColumnNameObjsFree(loop->columnNameObjs, loop->ncols);
+	if (loop->varObjs != NULL)
+	{
+		for (i = 0; i < loop->nvars; i++)
+			Tcl_DecrRefCount(loop->varObjs[i]);
+		ckfree((void *)loop->varObjs);
+	}
+	if (loop->varNameObj != NULL)
+		Tcl_DecrRefCount(loop->varNameObj);
+	Tcl_DecrRefCount(loop->bodyObj);
+	if (loop->handleObj != NULL)
+	{
+		Tcl_DecrRefCount(loop->handleObj);
+		PgLazyResultRelease(loop->shared);
+	}
+	else
+		PQclear(loop->result);
+	Tcl_Release((ClientData) loop->connid);
+	ckfree((char *)loop);
+}
+
+/*
+ * Put the values of the current row of pg_result -foreach where the
+ * body expects them, as the result handle says, if it is still there.
+ */
+static int
+PgLoopSetForeachRow(Tcl_Interp *interp, Pg_Loop *loop)
+{
+	Pg_resultid *resultid;
+	int			i;
+
+	/*
+	 * The handle is ours while it still has our share: a handle made
+	 * since, under the same name, has a share of its own if any.
+	 */
+	if (PgGetResultId(interp, Tcl_GetStringFromObj(loop->handleObj, NULL),
+					  &resultid) == NULL || resultid->lazy != loop->shared)
+	{
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, "result ",
+						 Tcl_GetStringFromObj(loop->handleObj, NULL),
+						 " was cleared by the -foreach body", (char *)NULL);
+		return TCL_ERROR;
+	}
+
+	if (loop->varNameObj != NULL)
+		return execute_put_values(interp, loop->varNameObj, loop->columnNameObjs,
+				 loop->result, resultid->nullValueString, resultid->decode,
+				 loop->tupno);
+
+	for (i = 0; i < loop->nvars; i++)
+	{
+		if (Tcl_ObjSetVar2(interp, loop->varObjs[i], NULL,
+						   PGgetvalueObj(loop->result, resultid->nullValueString,
+										 resultid->decode, loop->tupno, i),
+						   TCL_LEAVE_ERR_MSG) == NULL)
+			return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/*
+ * Put the values of the current row where the body expects them.
+ */
+static int
+PgLoopSetRow(Tcl_Interp *interp, Pg_Loop *loop)
+{
+	int			column;
+	char	   *nullValueString;
+
+	if (loop->kind == PG_LOOP_FOREACH)
+		return PgLoopSetForeachRow(interp, loop);
+
+	/* the body may have closed the connection */
+	nullValueString = loop->connid->conn ? loop->connid->nullValueString : NULL;
+
+	if (loop->kind == PG_LOOP_EXECUTE)
+		return execute_put_values(interp, loop->varNameObj, loop->columnNameObjs,
+				 loop->result, nullValueString, loop->connid->decode, loop->tupno);
+
+	Tcl_ObjSetVar2(interp, loop->varNameObj, loop->tupnoNameObj,
+				   Tcl_NewIntObj(loop->tupno), 0);
+
+	for (column = 0; column < loop->ncols; column++)
+	{
+		Tcl_Obj    *valueObj;
+
+		valueObj = PGgetvalueObj(loop->result, nullValueString,
+								 loop->connid->decode, loop->tupno, column);
+		Tcl_ObjSetVar2(interp, loop->varNameObj, loop->columnNameObjs[column],
+					   valueObj, 0);
+	}
+
+	Tcl_ObjSetVar2(interp, loop->varNameObj, loop->commandNameObj,
+				   loop->updateObj, 0);
+	return TCL_OK;
+}
+
+/*
+ * Act on the return code of the body (TCL_OK to start), and set up the
+ * next row.  Returns 1 if the body is to run again, or 0 once the loop
+ * is over, with the loop freed and *codePtr the code of the command.
+ */
+static int
+PgLoopNextRow(Tcl_Interp *interp, Pg_Loop *loop, int *codePtr)
+{
+	int			code = *codePtr;
+
+	/* The returncode of the loop body controls the loop execution */
+	if (code == TCL_OK || code == TCL_CONTINUE)
+	{
+		/* OK or CONTINUE means start next loop invocation */
+		if (++loop->tupno >= loop->ntup)
+			code = TCL_OK;
+		else if (PgLoopSetRow(interp, loop) == TCL_OK)
+			return 1;
+		else
+			code = TCL_ERROR;
+	}
+	else if (code == TCL_BREAK)
+	{
+		/* BREAK means leave the loop, but return TCL_OK */
+		code = TCL_OK;
+	}
+	else if (loop->kind != PG_LOOP_EXECUTE)
+	{
+		/* pg_select and -foreach hand up anything else */
+		if (code == TCL_ERROR)
+		{
+			char		msg[80];
+
+			sprintf(msg, "\n    (\"%s\" body line %d)",
+					loop->kind == PG_LOOP_SELECT ? "pg_select" : "pg_result -foreach",
+#ifdef PGTCL_USE_NRE
+					Tcl_GetErrorLine(interp));
+#else
+					interp->errorLine);
+#endif
+			Tcl_AddErrorInfo(interp, msg);
+		}
+	}
+	else if (code != TCL_RETURN)
+	{
+		/* pg_execute hands up RETURN, and makes anything else an error */
+		code = TCL_ERROR;
+	}
+
+	/*
+	 * At the end of the pg_execute loop we put the number of rows we got
+	 * into the interpreter result.  -foreach returns nothing, as foreach
+	 * does.
+	 */
+	if (code == TCL_OK && loop->kind == PG_LOOP_EXECUTE)
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(loop->ntup));
+	else if (code == TCL_OK && loop->kind == PG_LOOP_FOREACH)
+		Tcl_ResetResult(interp);
+
+	PgLoopFree(interp, loop);
+	*codePtr = code;
+	return 0;
+}
+
+#ifdef PGTCL_USE_NRE
+static int
+PgLoopCallback(ClientData data[], Tcl_Interp *interp, int result)
+{
+	Pg_Loop    *loop = (Pg_Loop *) data[0];
+
+	if (!PgLoopNextRow(interp, loop, &result))
+		return result;
+
+	Tcl_NRAddCallback(interp, PgLoopCallback, (ClientData) loop, NULL, NULL, NULL);
+	return Tcl_NREvalObj(interp, loop->bodyObj, 0);
+}
+
+/*
+ * Start the loop.  Must be called from a command running in the
+ * non-recursive engine; the body runs after the caller has returned.
+ */
+static int
+PgLoopRun(Tcl_Interp *interp, Pg_Loop *loop)
+{
+	ClientData	data[1];
+
+	data[0] = (ClientData) loop;
+	return PgLoopCallback(data, interp, TCL_OK);
+}
+#else
+static int
+PgLoopRun(Tcl_Interp *interp, Pg_Loop *loop)
+{
+	int			code = TCL_OK;
+
+	while (PgLoopNextRow(interp, loop, &code))
+		code = Tcl_EvalObjEx(interp, loop->bodyObj, 0);
+	return code;
+}
+#endif   /* PGTCL_USE_NRE */
+
 /**********************************
  * pg_lo_open
 	 open a large object
@@ -1947,8 +3717,6 @@ Pg_lo_open(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]
 	int			mode;
 	int			fd;
 	char	   *connString;
-	char	   *modeString;
-	int			modeStringLen;
 
 	if (objc != 4)
 	{
@@ -1964,49 +3732,8 @@ Pg_lo_open(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]
 	if (Tcl_GetIntFromObj(interp, objv[2], &lobjId) == TCL_ERROR)
 		return TCL_ERROR;
 
-	modeString = Tcl_GetStringFromObj(objv[3], &modeStringLen);
-	if ((modeStringLen < 1) || (modeStringLen > 2))
-	{
-
-        Tcl_SetObjResult(interp, 
-            Tcl_NewStringObj("mode argument must be 'r', 'w', or 'rw'", -1));
-
+	if (PgLoMode(interp, objv[3], &mode) != TCL_OK)
 		return TCL_ERROR;
-	}
-
-	switch (modeString[0])
-	{
-		case 'r':
-		case 'R':
-			mode = INV_READ;
-			break;
-		case 'w':
-		case 'W':
-			mode = INV_WRITE;
-			break;
-		default:
-            Tcl_SetObjResult(interp, 
-             Tcl_NewStringObj("mode argument must be 'r', 'w', or 'rw'", -1));
-			return TCL_ERROR;
-	}
-
-	switch (modeString[1])
-	{
-		case '\0':
-			break;
-		case 'r':
-		case 'R':
-			mode |= INV_READ;
-			break;
-		case 'w':
-		case 'W':
-			mode |= INV_WRITE;
-			break;
-		default:
-            Tcl_SetObjResult(interp, 
-             Tcl_NewStringObj("mode argument must be 'r', 'w', or 'rw'", -1));
-			return TCL_ERROR;
-	}
 
 	fd = lo_open(conn, lobjId, mode);
 	Tcl_SetObjResult(interp, Tcl_NewIntObj(fd));
@@ -2247,6 +3974,9 @@ Pg_lo_creat(ClientData cData, Tcl_Interp *interp, int objc,
 	PGconn	   *conn;
 	char	   *modeStr;
 	char	   *modeWord;
+	char	   *modeEnd;
+	int			modeLen,
+				wordLen;
 	int			mode;
 	char	   *connString;
         Tcl_Obj    *tresult;
@@ -2262,36 +3992,40 @@ Pg_lo_creat(ClientData cData, Tcl_Interp *interp, int objc,
 	if (conn == NULL)
 		return TCL_ERROR;
 
-	modeStr = Tcl_GetStringFromObj(objv[2], NULL);
-
-	modeWord = strtok(modeStr, "|");
-	if (strcmp(modeWord, "INV_READ") == 0)
-		mode = INV_READ;
-	else if (strcmp(modeWord, "INV_WRITE") == 0)
-		mode = INV_WRITE;
-	else
+	/*
+	 * split the words at '|' by pointer and length, strtok isn't
+	 * thread-safe and would write into the string of the object
+	 */
+	modeStr = Tcl_GetStringFromObj(objv[2], &modeLen);
+	modeEnd = modeStr + modeLen;
+	mode = 0;
+	for (modeWord = modeStr; modeWord < modeEnd; modeWord += wordLen + 1)
 	{
-            tresult = Tcl_NewStringObj("mode must be some OR'd combination of INV_READ, and INV_WRITE", -1);
-            Tcl_SetObjResult(interp, tresult);
+		char	   *bar = memchr(modeWord, '|', modeEnd - modeWord);
 
-	    return TCL_ERROR;
-	}
+		wordLen = (bar != NULL) ? bar - modeWord : modeEnd - modeWord;
+		if (wordLen == 0)
+			continue;
 
-	while ((modeWord = strtok(NULL, "|")) != NULL)
-	{
-		if (strcmp(modeWord, "INV_READ") == 0)
+		if (wordLen == 8 && strncmp(modeWord, "INV_READ", 8) == 0)
 			mode |= INV_READ;
-		else if (strcmp(modeWord, "INV_WRITE") == 0)
+		else if (wordLen == 9 && strncmp(modeWord, "INV_WRITE", 9) == 0)
 			mode |= INV_WRITE;
 		else
 		{
-                    tresult = Tcl_NewStringObj("mode must be some OR'd combination of INV_READ, and INV_WRITE", -1);
-                    Tcl_SetObjResult(interp, tresult);
-
-			return TCL_ERROR;
+			mode = 0;
+			break;
 		}
 	}
 
+	if (mode == 0)
+	{
+            tresult = Tcl_NewStringObj("mode must be some OR'd combination of INV_READ, and INV_WRITE", -1);
+            Tcl_SetObjResult(interp, tresult);
+
+	    return TCL_ERROR;
+	}
+
 	Tcl_SetObjResult(interp, Tcl_NewIntObj(lo_creat(conn, mode)));
 	return TCL_OK;
 }
@@ -2424,8 +4158,177 @@ Pg_lo_unlink(ClientData cData, Tcl_Interp *interp, int objc,
             return TCL_ERROR;
 	}
 
-	Tcl_SetObjResult(interp, Tcl_NewIntObj(retval));
-	return TCL_OK;
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(retval));
+	return TCL_OK;
+}
+
+/*
+ * Parse the options pg_lo_import and pg_lo_export share.  Returns the
+ * index of the first argument after them, or 0 if they are bad.
+ */
+static int
+PgLoTransferOptions(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+					Pg_LoTransfer *xfer, Tcl_Obj **progressPtr,
+					Tcl_Obj **callbackPtr)
+{
+	static CONST84 char *options[] = {
+		"-background", "-chunksize", "-pipeline", "-progress", (char *)NULL
+	};
+	enum options
+	{
+		OPT_BACKGROUND, OPT_CHUNKSIZE, OPT_PIPELINE, OPT_PROGRESS
+	};
+	int			optIndex;
+	int			i;
+
+	memset(xfer, 0, sizeof(Pg_LoTransfer));
+	xfer->chunkSize = PG_LO_CHUNK_SIZE;
+	xfer->pipeline = 1;
+	*progressPtr = NULL;
+	*callbackPtr = NULL;
+
+	for (i = 1; i < objc && Tcl_GetString(objv[i])[0] == '-'; i += 2)
+	{
+		if (Tcl_GetIndexFromObj(interp, objv[i], options, "option",
+								TCL_EXACT, &optIndex) != TCL_OK)
+			return 0;
+
+		if (i + 1 >= objc)
+		{
+			Tcl_Obj    *tresult = Tcl_NewStringObj("value for \"", -1);
+
+			Tcl_AppendStringsToObj(tresult, Tcl_GetString(objv[i]),
+								   "\" missing", NULL);
+			Tcl_SetObjResult(interp, tresult);
+			return 0;
+		}
+
+		switch ((enum options) optIndex)
+		{
+			case OPT_BACKGROUND:
+				*callbackPtr = objv[i + 1];
+				break;
+
+			case OPT_CHUNKSIZE:
+				if (Tcl_GetIntFromObj(interp, objv[i + 1], &xfer->chunkSize) != TCL_OK)
+					return 0;
+				/* a chunk goes in one bytea */
+				if (xfer->chunkSize < 1 || xfer->chunkSize > 0x3FFFFFFF)
+				{
+					Tcl_SetObjResult(interp,
+						Tcl_NewStringObj("chunk size must be between 1 and 1073741823", -1));
+					return 0;
+				}
+				break;
+
+			case OPT_PIPELINE:
+				if (Tcl_GetIntFromObj(interp, objv[i + 1], &xfer->pipeline) != TCL_OK)
+					return 0;
+				if (xfer->pipeline < 1 || xfer->pipeline > PG_LO_MAX_PIPELINE)
+				{
+					char		msg[64];
+
+					sprintf(msg, "pipeline must be between 1 and %d",
+							PG_LO_MAX_PIPELINE);
+					Tcl_SetObjResult(interp, Tcl_NewStringObj(msg, -1));
+					return 0;
+				}
+				break;
+
+			case OPT_PROGRESS:
+				*progressPtr = objv[i + 1];
+				break;
+		}
+	}
+
+	return i;
+}
+
+typedef struct
+{
+	Tcl_Interp *interp;
+	Pg_ConnectionId *connid;
+	Tcl_Obj    *callback;
+	int			code;			/* what the callback returned */
+}	Pg_LoProgress;
+
+/*
+ * progressProc for a transfer in the foreground: run the -progress
+ * callback with the bytes done so far and the total.  Anything but a
+ * normal return stops the transfer.
+ */
+static int
+PgLoProgressEval(Pg_LoTransfer *xfer)
+{
+	Pg_LoProgress *progress = (Pg_LoProgress *) xfer->clientData;
+	Tcl_Obj    *cmd;
+
+	cmd = Tcl_DuplicateObj(progress->callback);
+	Tcl_IncrRefCount(cmd);
+	Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewWideIntObj(xfer->done));
+	Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewWideIntObj(xfer->total));
+	progress->code = Tcl_EvalObjEx(progress->interp, cmd, TCL_EVAL_GLOBAL);
+	Tcl_DecrRefCount(cmd);
+
+	if (progress->code == TCL_ERROR)
+		Tcl_AddErrorInfo(progress->interp, "\n    (\"-progress\" callback)");
+
+	/* it may have closed the connection */
+	if (progress->connid->conn == NULL)
+	{
+		xfer->conn = NULL;
+		return 1;
+	}
+	return progress->code != TCL_OK;
+}
+
+/*
+ * Run an import, if filename is given, or an export of lobjId.  Either
+ * way the connection is off limits until it is done.
+ */
+static int
+PgLoTransferRun(Tcl_Interp *interp, Pg_ConnectionId *connid,
+				Pg_LoTransfer *xfer, Tcl_Obj *callback, Oid *lobjIdPtr,
+				CONST84 char *filename, int import)
+{
+	Pg_LoProgress progress;
+	int			ok;
+
+	xfer->conn = connid->conn;
+	if (callback != NULL)
+	{
+		progress.interp = interp;
+		progress.connid = connid;
+		progress.callback = callback;
+		progress.code = TCL_OK;
+		xfer->progressProc = PgLoProgressEval;
+		xfer->clientData = (ClientData) &progress;
+	}
+
+	Tcl_Preserve((ClientData) connid);
+	connid->lo_busy = 1;
+	if (import)
+		ok = ((*lobjIdPtr = PgLoImportFile(xfer, filename)) != InvalidOid);
+	else
+		ok = PgLoExportFile(xfer, *lobjIdPtr, filename);
+	connid->lo_busy = 0;
+	Tcl_Release((ClientData) connid);
+
+	if (ok)
+		return TCL_OK;
+
+	/* the callback's error is the error */
+	if (callback != NULL && progress.code == TCL_ERROR)
+		return TCL_ERROR;
+
+	Tcl_SetObjResult(interp, Tcl_NewObj());
+	if (import)
+		Tcl_AppendStringsToObj(Tcl_GetObjResult(interp), "import of '",
+							   filename, "' failed: ", xfer->errmsg, NULL);
+	else
+		Tcl_AppendStringsToObj(Tcl_GetObjResult(interp), "export failed: ",
+							   xfer->errmsg, NULL);
+	return TCL_ERROR;
 }
 
 /***********************************
@@ -2435,7 +4338,15 @@ Pg_lo_import
  returns InvalidOid upon failure
 
  syntax:
-   pg_lo_import conn filename
+   pg_lo_import ?-chunksize size? ?-pipeline n? ?-progress callback?
+		?-background callback? conn filename
+
+ The file goes over in chunks of size bytes, with n of them in flight
+ at a time if n is more than 1 and the server has lo_put.  The progress
+ callback is called after each chunk with the bytes done and the total.
+
+ With -background, callback is called with "ok" and the oid, or
+ "error" and a message, once the import is done.
 
 ***********************************/
 
@@ -2444,34 +4355,36 @@ Pg_lo_import(ClientData cData, Tcl_Interp *interp, int objc,
 			 Tcl_Obj *CONST objv[])
 {
 	PGconn	   *conn;
+	Pg_ConnectionId *connid;
 	const char	   *filename;
 	Oid			lobjId;
 	char	   *connString;
-        Tcl_Obj    *tresult;
+	Pg_LoTransfer xfer;
+	Tcl_Obj    *progress;
+	Tcl_Obj    *callback;
+	int         a;
 
-	if (objc != 3)
+	if ((a = PgLoTransferOptions(interp, objc, objv, &xfer, &progress, &callback)) == 0)
+		return TCL_ERROR;
+
+	if (objc != a + 2)
 	{
-		Tcl_WrongNumArgs(interp, 1, objv, "conn filename");
+		Tcl_WrongNumArgs(interp, 1, objv, "?-chunksize size? ?-pipeline n? ?-progress callback? ?-background callback? conn filename");
 		return TCL_ERROR;
 	}
 
-	connString = Tcl_GetStringFromObj(objv[1], NULL);
-	conn = PgGetConnectionId(interp, connString, NULL);
+	connString = Tcl_GetStringFromObj(objv[a], NULL);
+	conn = PgGetConnectionId(interp, connString, &connid);
 	if (conn == NULL)
 		return TCL_ERROR;
 
-	filename = Tcl_GetStringFromObj(objv[2], NULL);
+	filename = Tcl_GetStringFromObj(objv[a+1], NULL);
 
-	lobjId = lo_import(conn, filename);
-	if (lobjId == InvalidOid)
-	{
-            tresult = Tcl_NewStringObj("import of '", -1);
-            Tcl_AppendStringsToObj(tresult, filename, NULL);
-            Tcl_AppendStringsToObj(tresult, "' failed", NULL);
-            Tcl_SetObjResult(interp, tresult);
+	if (callback != NULL)
+		return PgBackgroundLoImport(interp, connid, callback, &xfer, progress, filename);
 
-            return TCL_ERROR;
-	}
+	if (PgLoTransferRun(interp, connid, &xfer, progress, &lobjId, filename, 1) != TCL_OK)
+		return TCL_ERROR;
 
 	Tcl_SetObjResult(interp, Tcl_NewLongObj((long)lobjId));
 	return TCL_OK;
@@ -2482,7 +4395,13 @@ Pg_lo_export
 	export an Inversion large object to a Unix file
 
  syntax:
-   pg_lo_export conn lobjId filename
+   pg_lo_export ?-chunksize size? ?-pipeline n? ?-progress callback?
+		?-background callback? conn lobjId filename
+
+ The options are those of pg_lo_import; the pipeline uses lo_get.
+
+ With -background, callback is called with "ok" and an empty string, or
+ "error" and a message, once the export is done.
 
 ***********************************/
 
@@ -2491,37 +4410,38 @@ Pg_lo_export(ClientData cData, Tcl_Interp *interp, int objc,
 			 Tcl_Obj *CONST objv[])
 {
 	PGconn	   *conn;
+	Pg_ConnectionId *connid;
 	const char	   *filename;
 	Oid			lobjId;
-	int			retval;
 	char	   *connString;
-        Tcl_Obj    *tresult;
+	Pg_LoTransfer xfer;
+	Tcl_Obj    *progress;
+	Tcl_Obj    *callback;
+	int         a;
 
-	if (objc != 4)
+	if ((a = PgLoTransferOptions(interp, objc, objv, &xfer, &progress, &callback)) == 0)
+		return TCL_ERROR;
+
+	if (objc != a + 3)
 	{
-		Tcl_WrongNumArgs(interp, 1, objv, "conn lobjId filename");
+		Tcl_WrongNumArgs(interp, 1, objv, "?-chunksize size? ?-pipeline n? ?-progress callback? ?-background callback? conn lobjId filename");
 		return TCL_ERROR;
 	}
 
-	connString = Tcl_GetStringFromObj(objv[1], NULL);
-	conn = PgGetConnectionId(interp, connString, NULL);
+	connString = Tcl_GetStringFromObj(objv[a], NULL);
+	conn = PgGetConnectionId(interp, connString, &connid);
 	if (conn == NULL)
 		return TCL_ERROR;
 
-	if (Tcl_GetIntFromObj(interp, objv[2], &lobjId) == TCL_ERROR)
+	if (Tcl_GetIntFromObj(interp, objv[a+1], (int *)&lobjId) == TCL_ERROR)
 		return TCL_ERROR;
 
-	filename = Tcl_GetStringFromObj(objv[3], NULL);
+	filename = Tcl_GetStringFromObj(objv[a+2], NULL);
 
-	retval = lo_export(conn, lobjId, filename);
-	if (retval == -1)
-	{
-            tresult = Tcl_NewStringObj("export failed", -1);
-            Tcl_SetObjResult(interp, tresult);
+	if (callback != NULL)
+		return PgBackgroundLoExport(interp, connid, callback, &xfer, progress, lobjId, filename);
 
-            return TCL_ERROR;
-	}
-	return TCL_OK;
+	return PgLoTransferRun(interp, connid, &xfer, progress, &lobjId, filename, 0);
 }
 
 /**********************************
@@ -2529,7 +4449,8 @@ Pg_lo_export(ClientData cData, Tcl_Interp *interp, int objc,
  send a select query string to the backend connection
 
  syntax:
- pg_select connection query var proc
+ pg_select ?-params list? connection query var proc
+ pg_select ?-params list? -prepared name connection var proc
 
  The query must be a select statement
  The var is used in the proc as an array
@@ -2541,120 +4462,671 @@ Pg_lo_export(ClientData cData, Tcl_Interp *interp, int objc,
  try to write a simplified table lookup and update function to make
  that task a little easier.
 
+ -params and -prepared are as for pg_execute.
+
  The return is either TCL_OK, TCL_ERROR or TCL_RETURN and interp->result
  may contain more information.
  **********************************/
 
 int
 Pg_select(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+#ifdef PGTCL_USE_NRE
+	/* the loop body runs in the non-recursive engine */
+	return Tcl_NRCallObjProc(interp, Pg_select_nr, cData, objc, objv);
+#else
+	return PgSelect(cData, interp, objc, objv);
+#endif
+}
+
+/*
+ * pg_select, waiting for the result of the query
+ */
+static int
+PgSelect(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
 	Pg_ConnectionId *connid;
 	PGconn	   *conn;
 	PGresult   *result;
-	int			r,
-				retval;
-	int			tupno,
-				column,
-				ncols;
+	Pg_Query	query;
 	char	   *connString;
-	char	   *queryString;
+	Tcl_Obj    *paramsObj;
+	Tcl_Obj    *preparedObj;
+	int			i;
+
+	if ((i = PgSelectArgs(interp, objc, objv, &paramsObj, &preparedObj)) < 0)
+		return TCL_ERROR;
+
+	connString = Tcl_GetStringFromObj(objv[i++], NULL);
+
+	conn = PgGetConnectionId(interp, connString, &connid);
+	if (conn == NULL)
+		return TCL_ERROR;
+
+	if (PgQueryInit(interp, &query, preparedObj == NULL ? objv[i++] : NULL,
+					preparedObj, paramsObj) != TCL_OK)
+		return TCL_ERROR;
+	result = PgQueryExec(connid, &query, PG_STATS_SELECT);
+	PgQueryFree(&query);
+
+	return PgSelectResult(interp, connid, result, objv[i], objv[i + 1]);
+}
+
+/*
+ * Parse the options of pg_select.  Returns the index of the connection
+ * argument, or -1 after leaving an error message.
+ */
+static int
+PgSelectArgs(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+			 Tcl_Obj **paramsObjPtr, Tcl_Obj **preparedObjPtr)
+{
+	static CONST84 char *options[] = {
+		"-params", "-prepared", (char *)NULL
+	};
+	int			optIndex;
+	int			i;
+
+	*paramsObjPtr = NULL;
+	*preparedObjPtr = NULL;
+
+	for (i = 1; i < objc - 1; i += 2)
+	{
+		if (Tcl_GetStringFromObj(objv[i], NULL)[0] != '-')
+			break;
+		if (Tcl_GetIndexFromObj(interp, objv[i], options, "option",
+								TCL_EXACT, &optIndex) != TCL_OK)
+			return -1;
+		if (optIndex == 0)
+			*paramsObjPtr = objv[i + 1];
+		else
+			*preparedObjPtr = objv[i + 1];
+	}
+
+	/* the query is the prepared statement's name if there is one */
+	if (objc - i != (*preparedObjPtr == NULL ? 4 : 3))
+	{
+		Tcl_WrongNumArgs(interp, 1, objv,
+			"?-params list? ?-prepared statementName? connection ?queryString? var proc");
+		return -1;
+	}
+	return i;
+}
+
+/*
+ * What pg_select does with the result of its query: run the proc for
+ * each row, with the values in the array.
+ */
+static int
+PgSelectResult(Tcl_Interp *interp, Pg_ConnectionId *connid,
+			   PGresult *result, Tcl_Obj *varNameObj, Tcl_Obj *procStringObj)
+{
+	int			ncols;
 	char	   *varNameString;
-	Tcl_Obj    *varNameObj;
-	Tcl_Obj    *procStringObj;
 	Tcl_Obj    *columnListObj;
-	Tcl_Obj   **columnNameObjs;
+	Pg_Loop    *loop;
+
+	varNameString = Tcl_GetStringFromObj(varNameObj, NULL);
+
+	if (result == NULL)
+	{
+		/* error occurred sending the query */
+		Tcl_SetResult(interp, PQerrorMessage(connid->conn), TCL_VOLATILE);
+		return TCL_ERROR;
+	}
+
+	/* Transfer any notify events from libpq to Tcl event queue. */
+	PgNotifyTransferEvents(connid);
+
+	if (PQresultStatus(result) != PGRES_TUPLES_OK)
+	{
+		/* query failed, or it wasn't SELECT */
+		Tcl_SetResult(interp, (char *)PQresultErrorMessage(result),
+					  TCL_VOLATILE);
+		PQclear(result);
+		return TCL_ERROR;
+	}
+
+	loop = PgLoopNew(connid, result, varNameObj, procStringObj, PG_LOOP_SELECT);
+	ncols = loop->ncols;
+	columnListObj = Tcl_NewListObj(ncols, loop->columnNameObjs);
+
+	Tcl_SetVar2Ex(interp, varNameString, ".headers", columnListObj, 0);
+	Tcl_SetVar2Ex(interp, varNameString, ".numcols", Tcl_NewIntObj(ncols), 0);
+
+	return PgLoopRun(interp, loop);
+}
+
+#ifdef PGTCL_USE_NRE
+/*-------------------------------------------
+  Coroutine-aware queries
+
+  Called inside a coroutine, pg_exec, pg_execute and pg_select don't
+  block in PQexec.  They send the query with PQsendQuery, watch the
+  socket and yield.  Once the whole result is in, the socket handler
+  resumes the coroutine, and the command carries on through the same
+  PgExecResult, PgExecuteResult or PgSelectResult as the blocking
+  version, so the outcome is the same either way.
+
+  While the coroutine waits, the connection is taken: other commands
+  get a "busy" error rather than blocking the thread on the query.  If
+  there is C code between the command and the coroutine, so that it
+  can't yield, it simply waits for the result.
+  ------------------------------------------*/
+
+typedef int (Pg_CoroDoneProc) (Tcl_Interp *interp, Pg_ConnectionId *connid,
+							  PGresult *result, Tcl_Obj *CONST args[]);
+
+typedef struct Pg_CoroWait_s
+{
+	Tcl_Interp *interp;
+	Pg_ConnectionId *connid;
+	Tcl_Obj    *resume;			/* command resuming the coroutine */
+	int			ready;			/* the whole result has arrived */
+	int			watching;		/* the socket handler is set up */
+	Pg_CoroDoneProc *done;		/* carries on with the result */
+	int			nargs;
+	Tcl_Obj    *args[4];		/* kept for done, may be NULL */
+	Tcl_WideInt start;			/* when the query was sent */
+} Pg_CoroWait;
+
+static int	PgCoroResume(ClientData data[], Tcl_Interp *interp, int result);
+
+/*
+ * "::info coroutine", kept for every query to ask, so that it is
+ * compiled once rather than parsed each time.  A Tcl_Obj can't be
+ * shared between threads, so each thread has its own.
+ */
+typedef struct
+{
+	Tcl_Obj    *infoCoroutine;
+} Pg_CoroThreadData;
+
+static Tcl_ThreadDataKey coroDataKey;
+
+static void
+PgCoroThreadExit(ClientData cData)
+{
+	Pg_CoroThreadData *tsdPtr = (Pg_CoroThreadData *)
+		Tcl_GetThreadData(&coroDataKey, sizeof(Pg_CoroThreadData));
+
+	Tcl_DecrRefCount(tsdPtr->infoCoroutine);
+	tsdPtr->infoCoroutine = NULL;
+}
+
+/*
+ * The name of the coroutine we are running in, with a reference held,
+ * or NULL if we aren't in one.  Called as a command starts, so the
+ * interpreter's result is free to use.
+ */
+static Tcl_Obj *
+PgCurrentCoroutine(Tcl_Interp *interp)
+{
+	Pg_CoroThreadData *tsdPtr = (Pg_CoroThreadData *)
+		Tcl_GetThreadData(&coroDataKey, sizeof(Pg_CoroThreadData));
+	Tcl_Obj    *coro = NULL;
+
+	if (tsdPtr->infoCoroutine == NULL)
+	{
+		tsdPtr->infoCoroutine = Tcl_NewStringObj("::info coroutine", -1);
+		Tcl_IncrRefCount(tsdPtr->infoCoroutine);
+		Tcl_CreateThreadExitHandler(PgCoroThreadExit, NULL);
+	}
+
+	if (Tcl_EvalObjEx(interp, tsdPtr->infoCoroutine, TCL_EVAL_GLOBAL) == TCL_OK &&
+		Tcl_GetCharLength(Tcl_GetObjResult(interp)) > 0)
+	{
+		coro = Tcl_GetObjResult(interp);
+		Tcl_IncrRefCount(coro);
+	}
+	Tcl_ResetResult(interp);
+	return coro;
+}
+
+/*
+ * Did the yield fail because there is C code on the stack?
+ */
+static int
+PgCoroCantYield(Tcl_Interp *interp, int result)
+{
+	Tcl_Obj    *options;
+	Tcl_Obj    *key;
+	Tcl_Obj    *code = NULL;
+	int			cant = 0;
+
+	if (result != TCL_ERROR)
+		return 0;
+
+	options = Tcl_GetReturnOptions(interp, result);
+	key = Tcl_NewStringObj("-errorcode", -1);
+	Tcl_IncrRefCount(options);
+	Tcl_IncrRefCount(key);
+	if (Tcl_DictObjGet(NULL, options, key, &code) == TCL_OK && code != NULL)
+		cant = (strstr(Tcl_GetStringFromObj(code, NULL), "CANT_YIELD") != NULL);
+	Tcl_DecrRefCount(key);
+	Tcl_DecrRefCount(options);
+	return cant;
+}
+
+static void
+PgCoroReadable(ClientData cData, int mask);
+
+static void
+PgCoroUnwatch(Pg_CoroWait *wait)
+{
+	/* a closed connection took its channel and handlers with it */
+	if (wait->watching && wait->connid->conn != NULL)
+		Tcl_DeleteChannelHandler(wait->connid->notifier_channel,
+								 PgCoroReadable, (ClientData) wait);
+	wait->watching = 0;
+}
+
+/*
+ * Socket handler: read what's there, and once the result is complete,
+ * resume the coroutine.
+ */
+static void
+PgCoroReadable(ClientData cData, int mask)
+{
+	Pg_CoroWait *wait = (Pg_CoroWait *) cData;
+	Tcl_Interp *interp = wait->interp;
+	Tcl_Obj    *resume = wait->resume;
+
+	if (PQconsumeInput(wait->connid->conn) && PQisBusy(wait->connid->conn))
+		return;
+
+	PgCoroUnwatch(wait);
+	wait->ready = 1;
+
+	/* resuming frees wait */
+	Tcl_Preserve((ClientData) interp);
+	Tcl_IncrRefCount(resume);
+	if (Tcl_EvalObjEx(interp, resume, TCL_EVAL_GLOBAL) != TCL_OK)
+		Tcl_BackgroundError(interp);
+	Tcl_DecrRefCount(resume);
+	Tcl_Release((ClientData) interp);
+}
+
+static int
+PgCoroYield(Tcl_Interp *interp, Pg_CoroWait *wait)
+{
+	Tcl_NRAddCallback(interp, PgCoroResume, (ClientData) wait, NULL, NULL, NULL);
+	return Tcl_NREvalObj(interp, Tcl_NewStringObj("::yield", -1), 0);
+}
+
+/*
+ * The query has been sent.  Yield until its result is in, then hand it
+ * to done.  Takes over the reference to coro.
+ */
+static int
+PgCoroWaitForResult(Tcl_Interp *interp, Pg_ConnectionId *connid,
+					Tcl_Obj *coro, Pg_CoroDoneProc *done,
+					int nargs, Tcl_Obj *CONST args[])
+{
+	Pg_CoroWait *wait = (Pg_CoroWait *) ckalloc(sizeof(Pg_CoroWait));
+	int			i;
+
+	wait->interp = interp;
+	wait->connid = connid;
+	wait->resume = Tcl_NewListObj(1, &coro);
+	Tcl_IncrRefCount(wait->resume);
+	Tcl_DecrRefCount(coro);
+	wait->ready = 0;
+	wait->start = PgStatsClock();
+	wait->done = done;
+	wait->nargs = nargs;
+	for (i = 0; i < nargs; i++)
+	{
+		wait->args[i] = args[i];
+		if (args[i] != NULL)
+			Tcl_IncrRefCount(args[i]);
+	}
+
+	Tcl_Preserve((ClientData) connid);
+	connid->coro_busy = 1;
+
+	/* our handler reads the socket now, not the notifier */
+	PgSuspendNotifyEventSource(connid);
+	Tcl_CreateChannelHandler(connid->notifier_channel, TCL_READABLE,
+							 PgCoroReadable, (ClientData) wait);
+	wait->watching = 1;
+
+	return PgCoroYield(interp, wait);
+}
+
+static int
+PgCoroResume(ClientData data[], Tcl_Interp *interp, int result)
+{
+	Pg_CoroWait *wait = (Pg_CoroWait *) data[0];
+	Pg_ConnectionId *connid = wait->connid;
+	PGconn	   *conn = connid->conn;
+	PGresult   *res;
+	PGresult   *last = NULL;
+	int			done = 0;
+	int			rc,
+				i;
+
+	if (conn == NULL)
+	{
+		Tcl_SetResult(interp, "connection closed while waiting for the query", TCL_STATIC);
+		rc = TCL_ERROR;
+	}
+	else if (result != TCL_OK && !PgCoroCantYield(interp, result))
+	{
+		/* the coroutine is going away: abandon the query */
+		PgCoroUnwatch(wait);
+		PQrequestCancel(conn);
+		while ((res = PQgetResult(conn)) != NULL)
+			PQclear(res);
+		rc = result;
+	}
+	else
+	{
+		if (result == TCL_OK && !wait->ready &&
+			PQconsumeInput(conn) && PQisBusy(conn))
+		{
+			/* resumed by somebody else, keep waiting */
+			return PgCoroYield(interp, wait);
+		}
+
+		PgCoroUnwatch(wait);
+		Tcl_ResetResult(interp);
+
+		/* like PQexec: the last result counts, and COPY ends it */
+		while ((res = PQgetResult(conn)) != NULL)
+		{
+			ExecStatusType status = PQresultStatus(res);
+
+			if (last != NULL)
+				PQclear(last);
+			last = res;
+			if (status == PGRES_COPY_IN || status == PGRES_COPY_OUT ||
+				PQstatus(conn) == CONNECTION_BAD)
+				break;
+		}
+
+		PgStatsResult(connid, last, PgStatsClock() - wait->start);
+		done = 1;
+		rc = TCL_OK;
+	}
+
+	/* the connection is free again, for done as for anybody */
+	connid->coro_busy = 0;
+	if (connid->conn != NULL)
+		PgStartNotifyEventSource(connid);
+
+	if (done)
+		rc = wait->done(interp, connid, last, wait->args);
+
+	for (i = 0; i < wait->nargs; i++)
+		if (wait->args[i] != NULL)
+			Tcl_DecrRefCount(wait->args[i]);
+	Tcl_DecrRefCount(wait->resume);
+	Tcl_Release((ClientData) connid);
+	ckfree((char *)wait);
+	return rc;
+}
+
+/*
+ * Look up the connection for a coroutine-aware command.  Returns NULL,
+ * with or without an error message in interp, if the blocking version
+ * should handle it instead.
+ */
+static Pg_ConnectionId *
+PgCoroConnection(Tcl_Interp *interp, Tcl_Obj *connObj, int *errorPtr)
+{
+	Pg_ConnectionId *connid;
+
+	*errorPtr = 0;
+	if (PgGetConnectionId(interp, Tcl_GetStringFromObj(connObj, NULL), &connid) == NULL)
+	{
+		*errorPtr = 1;
+		return NULL;
+	}
+
+	/* no socket channel to watch, or a COPY to complain about */
+	if (connid->notifier_channel == NULL ||
+		connid->res_copyStatus != RES_COPY_NONE)
+		return NULL;
+
+	return connid;
+}
+
+static int
+PgExecCoroDone(Tcl_Interp *interp, Pg_ConnectionId *connid,
+			   PGresult *result, Tcl_Obj *CONST args[])
+{
+	return PgExecResult(interp, connid, Tcl_GetStringFromObj(args[0], NULL),
+						Tcl_GetStringFromObj(args[1], NULL), result);
+}
+
+static int
+PgExecuteCoroDone(Tcl_Interp *interp, Pg_ConnectionId *connid,
+				  PGresult *result, Tcl_Obj *CONST args[])
+{
+	return PgExecuteResult(interp, connid, result, args[0], args[1],
+						   args[2] == NULL ? NULL : Tcl_GetStringFromObj(args[2], NULL),
+						   args[3]);
+}
+
+static int
+PgSelectCoroDone(Tcl_Interp *interp, Pg_ConnectionId *connid,
+				 PGresult *result, Tcl_Obj *CONST args[])
+{
+	return PgSelectResult(interp, connid, result, args[0], args[1]);
+}
+
+/*
+ * Send the query of pg_execute or pg_select, counting it as PgQueryExec
+ * does.  Returns 0 if it couldn't be sent, or -1 if this libpq can't
+ * send it without waiting.
+ */
+static int
+PgQuerySend(Pg_ConnectionId *connid, Pg_Query *query, int family)
+{
+	int			sent;
+
+	if (query->prepared)
+	{
+#ifdef HAVE_PQSENDQUERYPREPARED
+		sent = PQsendQueryPrepared(connid->conn, query->query, query->nParams,
+								   query->paramValues, NULL, NULL, 0);
+		family = PG_STATS_PREPARED;
+#else
+		return -1;
+#endif
+	}
+	else if (query->nParams > 0)
+	{
+#ifdef HAVE_PQSENDQUERYPARAMS
+		sent = PQsendQueryParams(connid->conn, query->query, query->nParams,
+								 NULL, query->paramValues, NULL, NULL, 0);
+#else
+		return -1;
+#endif
+	}
+	else
+		sent = PQsendQuery(connid->conn, query->query);
+
+	PgStatsQuery(connid, family, query->query, query->nParams, query->paramValues);
+	return sent;
+}
+
+/*
+ * pg_exec, as called by the non-recursive engine
+ */
+int
+Pg_exec_nr(ClientData cData, Tcl_Interp *interp, int objc,
+		   Tcl_Obj *CONST objv[])
+{
+	Pg_ConnectionId *connid;
+	Tcl_Obj    *coro;
+	CONST84 char *query;
+	int			nParams = objc - 3;
+	int			error,
+				sent;
+
+	/* usage errors and -background are the blocking version's business */
+	if (objc < 3 || Tcl_GetStringFromObj(objv[1], NULL)[0] == '-')
+		return Pg_exec(cData, interp, objc, objv);
+
+#ifndef HAVE_PQSENDQUERYPARAMS
+	if (nParams > 0)
+		return Pg_exec(cData, interp, objc, objv);
+#endif
 
-	if (objc != 5)
+	if ((coro = PgCurrentCoroutine(interp)) == NULL)
+		return Pg_exec(cData, interp, objc, objv);
+
+	if ((connid = PgCoroConnection(interp, objv[1], &error)) == NULL)
 	{
-		Tcl_WrongNumArgs(interp, 1, objv, "connection queryString var proc");
-		return TCL_ERROR;
+		Tcl_DecrRefCount(coro);
+		return error ? TCL_ERROR : Pg_exec(cData, interp, objc, objv);
 	}
 
-	connString = Tcl_GetStringFromObj(objv[1], NULL);
-	queryString = Tcl_GetStringFromObj(objv[2], NULL);
-
-	varNameObj = objv[3];
-	varNameString = Tcl_GetStringFromObj(varNameObj, NULL);
-
-	procStringObj = objv[4];
+	query = Tcl_GetStringFromObj(objv[2], NULL);
 
-	conn = PgGetConnectionId(interp, connString, &connid);
-	if (conn == NULL)
-		return TCL_ERROR;
+#ifdef HAVE_PQSENDQUERYPARAMS
+	if (nParams > 0)
+	{
+		const char **paramValues;
+		int			param;
 
-	if ((result = PQexec(conn, queryString)) == 0)
+		paramValues = (const char **)ckalloc(nParams * sizeof(char *));
+		for (param = 0; param < nParams; param++)
+		{
+			paramValues[param] = Tcl_GetStringFromObj(objv[3 + param], NULL);
+			if (strcmp(paramValues[param], "NULL") == 0)
+				paramValues[param] = NULL;
+		}
+		sent = PQsendQueryParams(connid->conn, query, nParams, NULL,
+								 paramValues, NULL, NULL, 0);
+		PgStatsQuery(connid, PG_STATS_EXEC, query, nParams, paramValues);
+		ckfree((void *)paramValues);
+	}
+	else
+#endif
 	{
-		/* error occurred sending the query */
-		Tcl_SetResult(interp, PQerrorMessage(conn), TCL_VOLATILE);
-		return TCL_ERROR;
+		sent = PQsendQuery(connid->conn, query);
+		PgStatsQuery(connid, PG_STATS_EXEC, query, 0, NULL);
 	}
 
-	/* Transfer any notify events from libpq to Tcl event queue. */
-	PgNotifyTransferEvents(connid);
-
-	if (PQresultStatus(result) != PGRES_TUPLES_OK)
+	if (!sent)
 	{
-		/* query failed, or it wasn't SELECT */
-		Tcl_SetResult(interp, (char *)PQresultErrorMessage(result),
-					  TCL_VOLATILE);
-		PQclear(result);
+		Tcl_DecrRefCount(coro);
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(connid->conn), -1));
 		return TCL_ERROR;
 	}
 
-	ncols = PQnfields(result);
-	columnNameObjs = (Tcl_Obj **)ckalloc(sizeof(Tcl_Obj) * ncols);
-
-	for (column = 0; column < ncols; column++)
-		columnNameObjs[column] = Tcl_NewStringObj(PQfname(result, column), -1);
-
-	columnListObj = Tcl_NewListObj(ncols, columnNameObjs);
+	return PgCoroWaitForResult(interp, connid, coro, PgExecCoroDone, 2, objv + 1);
+}
 
-	Tcl_SetVar2Ex(interp, varNameString, ".headers", columnListObj, 0);
-	Tcl_SetVar2Ex(interp, varNameString, ".numcols", Tcl_NewIntObj(ncols), 0);
+/*
+ * pg_execute, as called by the non-recursive engine
+ */
+int
+Pg_execute_nr(ClientData cData, Tcl_Interp *interp, int objc,
+			  Tcl_Obj *CONST objv[])
+{
+	Pg_ConnectionId *connid;
+	Pg_Query	query;
+	Tcl_Obj    *coro;
+	Tcl_Obj    *args[4];
+	Tcl_Obj    *paramsObj;
+	Tcl_Obj    *preparedObj;
+	int			i,
+				error,
+				sent;
+
+	if ((i = PgExecuteArgs(interp, objc, objv, &args[0], &args[1],
+						   &paramsObj, &preparedObj)) < 0)
+		return TCL_ERROR;
 
-	retval = TCL_OK;
+	if ((coro = PgCurrentCoroutine(interp)) == NULL)
+		return PgExecute(cData, interp, objc, objv);
 
-	for (tupno = 0; tupno < PQntuples(result); tupno++)
+	if ((connid = PgCoroConnection(interp, objv[i], &error)) == NULL)
 	{
-		Tcl_SetVar2Ex(interp, varNameString, ".tupno", Tcl_NewIntObj(tupno), 0);
+		Tcl_DecrRefCount(coro);
+		return error ? TCL_ERROR : PgExecute(cData, interp, objc, objv);
+	}
 
-		for (column = 0; column < ncols; column++)
-		{
-			Tcl_Obj    *valueObj;
+	/* no query string for a prepared statement */
+	args[2] = (preparedObj == NULL) ? objv[++i] : NULL;
+	args[3] = (i + 1 < objc) ? objv[i + 1] : NULL;
 
-			valueObj = Tcl_NewStringObj(PGgetvalue(result, connid->nullValueString, tupno, column), -1);
-			Tcl_ObjSetVar2(interp, varNameObj, columnNameObjs[column],
-						   valueObj,
-						   0);
-		}
+	if (PgQueryInit(interp, &query, args[2], preparedObj, paramsObj) != TCL_OK)
+	{
+		Tcl_DecrRefCount(coro);
+		return TCL_ERROR;
+	}
+	sent = PgQuerySend(connid, &query, PG_STATS_EXECUTE);
+	PgQueryFree(&query);
+	if (sent < 0)
+	{
+		Tcl_DecrRefCount(coro);
+		return PgExecute(cData, interp, objc, objv);
+	}
+	if (!sent)
+	{
+		Tcl_DecrRefCount(coro);
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(connid->conn), -1));
+		return TCL_ERROR;
+	}
 
-		Tcl_SetVar2(interp, varNameString, ".command", "update", 0);
+	return PgCoroWaitForResult(interp, connid, coro, PgExecuteCoroDone, 4, args);
+}
 
-		r = Tcl_EvalObjEx(interp, procStringObj, 0);
-		if ((r != TCL_OK) && (r != TCL_CONTINUE))
-		{
-			if (r == TCL_BREAK)
-				break;			/* exit loop, but return TCL_OK */
+/*
+ * pg_select, as called by the non-recursive engine
+ */
+int
+Pg_select_nr(ClientData cData, Tcl_Interp *interp, int objc,
+			 Tcl_Obj *CONST objv[])
+{
+	Pg_ConnectionId *connid;
+	Pg_Query	query;
+	Tcl_Obj    *coro;
+	Tcl_Obj    *paramsObj;
+	Tcl_Obj    *preparedObj;
+	int			i,
+				error,
+				sent;
+
+	if ((i = PgSelectArgs(interp, objc, objv, &paramsObj, &preparedObj)) < 0)
+		return TCL_ERROR;
 
-			if (r == TCL_ERROR)
-			{
-				char		msg[60];
+	if ((coro = PgCurrentCoroutine(interp)) == NULL)
+		return PgSelect(cData, interp, objc, objv);
 
-				sprintf(msg, "\n    (\"pg_select\" body line %d)",
-						interp->errorLine);
-				Tcl_AddErrorInfo(interp, msg);
-			}
+	if ((connid = PgCoroConnection(interp, objv[i], &error)) == NULL)
+	{
+		Tcl_DecrRefCount(coro);
+		return error ? TCL_ERROR : PgSelect(cData, interp, objc, objv);
+	}
 
-			retval = r;
-			break;
-		}
+	if (PgQueryInit(interp, &query, preparedObj == NULL ? objv[++i] : NULL,
+					preparedObj, paramsObj) != TCL_OK)
+	{
+		Tcl_DecrRefCount(coro);
+		return TCL_ERROR;
+	}
+	sent = PgQuerySend(connid, &query, PG_STATS_SELECT);
+	PgQueryFree(&query);
+	if (sent < 0)
+	{
+		Tcl_DecrRefCount(coro);
+		return PgSelect(cData, interp, objc, objv);
+	}
+	if (!sent)
+	{
+		Tcl_DecrRefCount(coro);
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(connid->conn), -1));
+		return TCL_ERROR;
 	}
 
-	ckfree((void *)columnNameObjs);
-	Tcl_UnsetVar(interp, varNameString, 0);
-	PQclear(result);
-	return retval;
+	return PgCoroWaitForResult(interp, connid, coro, PgSelectCoroDone, 2, objv + i + 1);
 }
+#endif   /* PGTCL_USE_NRE */
 
 /*
  * Test whether any callbacks are registered on this connection for
@@ -2957,9 +5429,11 @@ Pg_sendquery(ClientData cData, Tcl_Interp *interp, int objc,
 	if (nParams == 0) {
 #endif
 		status = PQsendQuery(conn, execString);
+		PgStatsQuery(connid, PG_STATS_ASYNC, execString, 0, NULL);
 #ifdef HAVE_PQSENDQUERYPARAMS
 	} else {
 	    status = PQsendQueryParams(conn, execString, nParams, NULL, paramValues, NULL, NULL, 1);
+	    PgStatsQuery(connid, PG_STATS_ASYNC, execString, nParams, paramValues);
 	    ckfree ((void *)paramValues);
 	}
 #endif
@@ -3053,6 +5527,7 @@ Pg_sendquery_prepared(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *C
 	statementNameString = Tcl_GetStringFromObj(objv[2], NULL);
 
 	status = PQsendQueryPrepared(conn, statementNameString, nParams, paramValues, NULL, NULL, 1);
+	PgStatsQuery(connid, PG_STATS_ASYNC, statementNameString, nParams, paramValues);
 
 	if (paramValues != (const char **)NULL) {
 	    ckfree ((void *)paramValues);
@@ -3092,6 +5567,7 @@ Pg_getresult(ClientData cData, Tcl_Interp *interp, int objc,
 	PGconn	   *conn;
 	PGresult   *result;
 	char	   *connString;
+	Tcl_WideInt start;
 
 	if (objc != 2)
 	{
@@ -3105,7 +5581,9 @@ Pg_getresult(ClientData cData, Tcl_Interp *interp, int objc,
 	if (conn == NULL)
 		return TCL_ERROR;
 
+	start = PgStatsClock();
 	result = PQgetResult(conn);
+	PgStatsResult(connid, result, PgStatsClock() - start);
 
 	/* Transfer any notify events from libpq to Tcl event queue. */
 	PgNotifyTransferEvents(connid);
@@ -3392,10 +5870,15 @@ Pg_null_value_string(ClientData cData, Tcl_Interp *interp, int objc,
  request that postgresql abandon processing of the current command
 
  syntax:
- pg_cancelrequest connection
+ pg_cancelrequest ?-background callback? connection
 
  returns nothing if the command successfully dispatched or if nothing was
  going on, otherwise an error
+
+ This also works on a connection that is busy with a -background
+ operation, which is what the operation is cancelled with.  With
+ -background, the cancel request itself is sent from a worker thread and
+ callback is called with "ok" or "error" and a message.
  **********************************/
 
 int
@@ -3404,20 +5887,56 @@ Pg_cancelrequest(ClientData cData, Tcl_Interp *interp, int objc,
 {
 	Pg_ConnectionId *connid;
 	PGconn	   *conn;
+	Tcl_Channel conn_chan;
 	char	   *connString;
+	Tcl_Obj    *callback = NULL;
+	Tcl_Obj    *tresult;
+	int         a = 1;
 
-	if (objc != 2)
+	if (objc == 4 && strcmp(Tcl_GetStringFromObj(objv[1], NULL), "-background") == 0)
 	{
-		Tcl_WrongNumArgs(interp, 1, objv, "connection");
+		callback = objv[2];
+		a = 3;
+	}
+
+	if (objc != a + 1)
+	{
+		Tcl_WrongNumArgs(interp, 1, objv, "?-background callback? connection");
 		return TCL_ERROR;
 	}
 
-	connString = Tcl_GetStringFromObj(objv[1], NULL);
+	connString = Tcl_GetStringFromObj(objv[a], NULL);
 
-	conn = PgGetConnectionId(interp, connString, &connid);
+	/* not PgGetConnectionId, that refuses connections a worker owns */
+	conn_chan = Tcl_GetChannel(interp, connString, 0);
+	if (conn_chan == NULL || Tcl_GetChannelType(conn_chan) != &Pg_ConnType)
+	{
+		tresult = Tcl_NewStringObj(connString, -1);
+		Tcl_AppendStringsToObj(tresult, " is not a valid postgresql connection", NULL);
+		Tcl_SetObjResult(interp, tresult);
+		return TCL_ERROR;
+	}
+	connid = (Pg_ConnectionId *) Tcl_GetChannelInstanceData(conn_chan);
+	conn = connid->conn;
 	if (conn == NULL)
 		return TCL_ERROR;
 
+	if (callback != NULL)
+		return PgBackgroundCancel(interp, connid, callback);
+
+	if (connid->bg_job != NULL)
+	{
+		char		errbuf[256];
+
+		/* PQrequestCancel would race with the worker */
+		if (PgBackgroundCancelNow(connid, errbuf, sizeof(errbuf)) == 0)
+		{
+			Tcl_SetObjResult(interp, Tcl_NewStringObj(errbuf, -1));
+			return TCL_ERROR;
+		}
+		return TCL_OK;
+	}
+
 	if (PQrequestCancel(conn) == 0)
 	{
 		Tcl_SetObjResult(interp,
@@ -3516,6 +6035,97 @@ Pg_on_connection_loss(ClientData cData, Tcl_Interp *interp, int objc,
 	return TCL_OK;
 }
 
+/*
+ * Is this value to be sent as NULL?  That is the case if it matches the
+ * null value string of the connection, where an empty null value string
+ * makes the empty string NULL.
+ */
+static int
+PgQuoteIsNull(Pg_ConnectionId *connid, CONST char *value, int length)
+{
+	if (connid == NULL)
+		return 0;
+
+	if (length == 0)
+		return (connid->nullValueString == NULL ||
+				*connid->nullValueString == '\0');
+
+	return (connid->nullValueString != NULL &&
+			strcmp(value, connid->nullValueString) == 0);
+}
+
+/*
+ * Append value to ds as a quoted SQL literal, or as NULL if it matches
+ * the null value string of the connection.  conn may be NULL, in which
+ * case PQescapeString's idea of the last connection is used.  The
+ * escaping is done in place in the buffer of ds.
+ */
+static int
+PgQuoteAppend(Tcl_Interp *interp, Pg_ConnectionId *connid, Tcl_DString *ds,
+			  CONST char *value, int length)
+{
+	int			oldLength = Tcl_DStringLength(ds);
+	char	   *to;
+	size_t		stringSize;
+	int			error = 0;
+
+	if (PgQuoteIsNull(connid, value, length))
+	{
+		Tcl_DStringAppend(ds, "NULL", 4);
+		return TCL_OK;
+	}
+
+	/*
+	 * The escaped string takes at most 2 * length + 1 bytes, as
+	 * documented for PQescapeString, and we add the quotes
+	 */
+	Tcl_DStringSetLength(ds, oldLength + 2 * length + 3);
+	to = Tcl_DStringValue(ds) + oldLength;
+	*to = '\'';
+
+	if (connid != NULL)
+	{
+		stringSize = PQescapeStringConn(connid->conn, to + 1, value,
+										length, &error);
+		if (error)
+		{
+			/* error returned from PQescapeStringConn, send it on up */
+			Tcl_DStringSetLength(ds, oldLength);
+			Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(connid->conn), -1));
+			return TCL_ERROR;
+		}
+	}
+	else
+	{
+		stringSize = PQescapeString(to + 1, value, length);
+	}
+
+	to[stringSize + 1] = '\'';
+	Tcl_DStringSetLength(ds, oldLength + (int)stringSize + 2);
+	return TCL_OK;
+}
+
+/*
+ * Append value to ds as a quoted identifier, like PQescapeIdentifier:
+ * in double quotes, with any double quote in it doubled.
+ */
+static void
+PgQuoteIdentAppend(Tcl_DString *ds, CONST char *value, int length)
+{
+	CONST char *end = value + length;
+	CONST char *quote;
+
+	Tcl_DStringAppend(ds, "\"", 1);
+	while ((quote = memchr(value, '"', end - value)) != NULL)
+	{
+		Tcl_DStringAppend(ds, value, (int)(quote - value) + 1);
+		Tcl_DStringAppend(ds, "\"", 1);
+		value = quote + 1;
+	}
+	Tcl_DStringAppend(ds, value, (int)(end - value));
+	Tcl_DStringAppend(ds, "\"", 1);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -3525,6 +6135,7 @@ Pg_on_connection_loss(ClientData cData, Tcl_Interp *interp, int objc,
  *
  * Syntax:
  *    pg_quote ?connection? string
+ *    pg_quote -list ?connection? stringList
  *
  * Results:
  *
@@ -3534,7 +6145,11 @@ Pg_on_connection_loss(ClientData cData, Tcl_Interp *interp, int objc,
  *
  *    If the passed in string doesn't match the null value string or if
  *    pg_quote was invoked with only one argument, the string is escaped
- *    using P
+ *    using PQescapeStringConn or PQescapeString and put in quotes.
+ *
+ *    With -list, every element of the list is quoted that way, and the
+ *    result is the list of quoted strings.  All of them are escaped into
+ *    one buffer.
  *
  *    the return result is either an error message or the passed
  *    in string after going through PQescapeString
@@ -3546,23 +6161,22 @@ Pg_quote (ClientData cData, Tcl_Interp *interp, int objc,
 		  Tcl_Obj *CONST objv[])
 {
 	char	   *fromString = NULL;
-	char	   *toString;
 	int         fromStringLen;
-	int         stringSize;
-	Pg_ConnectionId *connid;
-	PGconn	   *conn = NULL;
+	Pg_ConnectionId *connid = NULL;
 	char	   *connString;
-	int         error = 0;
-	static Tcl_Obj *nullStringObj = NULL;
+	int			listMode = 0;
+	Tcl_DString ds;
 
-	/* allocate the null string object if we don't have it and increment
-	 * its reference count so it'll never be freed.  We can use it over
-	 * and over and it'll keep using the same string object
-	 */
-	if (nullStringObj == NULL) 
+	if (objc > 1 && strcmp(Tcl_GetStringFromObj(objv[1], NULL), "-list") == 0)
 	{
-		nullStringObj = Tcl_NewStringObj ("NULL", -1);
-		Tcl_IncrRefCount (nullStringObj);
+		listMode = 1;
+		if ((objc < 3) || (objc > 4))
+		{
+			Tcl_WrongNumArgs(interp, 2, objv, "?connection? stringList");
+			return TCL_ERROR;
+		}
+		objc--;
+		objv++;
 	}
 
 	if ((objc < 2) || (objc > 3)) 
@@ -3571,90 +6185,216 @@ Pg_quote (ClientData cData, Tcl_Interp *interp, int objc,
 		return TCL_ERROR;
 	}
 
-	if (objc == 2)
-	{
-	    /*
-	     * Get the "from" string.
-	     */
-	    fromString = Tcl_GetStringFromObj(objv[1], &fromStringLen);
-	} else
+	if (objc == 3)
 	{
 	    connString = Tcl_GetStringFromObj(objv[1], NULL);
-	    conn = PgGetConnectionId(interp, connString, &connid);
-	    if (conn == NULL)
+	    if (PgGetConnectionId(interp, connString, &connid) == NULL)
 		    return TCL_ERROR;
+	}
 
-	    /*
-	     * Get the "from" string.
-	     */
-	    fromString = Tcl_GetStringFromObj(objv[2], &fromStringLen);
+	Tcl_DStringInit(&ds);
 
-	    /*
-	     * If the from string is empty, see if the null value string is also
-	     * empty and if so, return the string NULL rather than something
-	     * quoted
-	     */
-	    if (fromStringLen == 0) 
+	if (listMode)
+	{
+		Tcl_Obj   **elemObjs;
+		Tcl_Obj    *listObj;
+		int			nElems,
+				   *ends,
+					i,
+					start;
+
+		if (Tcl_ListObjGetElements(interp, objv[objc - 1], &nElems, &elemObjs) != TCL_OK)
+			return TCL_ERROR;
+
+		/* quote everything into one buffer, noting where each one ends */
+		ends = (int *)ckalloc(sizeof(int) * (nElems + 1));
+		for (i = 0; i < nElems; i++)
 		{
-		    if (connid->nullValueString == NULL 
-			  || *connid->nullValueString == '\0') 
+			fromString = Tcl_GetStringFromObj(elemObjs[i], &fromStringLen);
+			if (PgQuoteAppend(interp, connid, &ds, fromString, fromStringLen) != TCL_OK)
 			{
-			    Tcl_SetObjResult (interp, nullStringObj);
-			    return TCL_OK;
-		    }
-	    } else {
-		    /*
-		     * The from string wasn't null, see if the connection's null value
-		     * string also isn't null and if so, if they match and if so,
-		     * return the string NULL
-		     */
-		    if (connid->nullValueString != NULL)
-			{
-			    if (strcmp (fromString, connid->nullValueString) == 0)
-				{
-				    Tcl_SetObjResult (interp, nullStringObj);
-				    return TCL_OK;
-			    }
-		    }
-	    }
-	}
+				ckfree((char *)ends);
+				Tcl_DStringFree(&ds);
+				return TCL_ERROR;
+			}
+			ends[i] = Tcl_DStringLength(&ds);
+		}
 
-	/* 
-	 * It wasn't the null string or we were called with two args,
-	 * allocate the "to" string, the max size is documented in the
-	 * postgres docs as 2 * fromStringLen + 1 and we add two more
-	 * for the leading and trailing single quotes
-	 */
-	toString = (char *) ckalloc((2 * fromStringLen) + 3);
+		listObj = Tcl_NewListObj(0, NULL);
+		for (i = 0, start = 0; i < nElems; start = ends[i++])
+			Tcl_ListObjAppendElement(NULL, listObj,
+				Tcl_NewStringObj(Tcl_DStringValue(&ds) + start, ends[i] - start));
+
+		ckfree((char *)ends);
+		Tcl_DStringFree(&ds);
+		Tcl_SetObjResult(interp, listObj);
+		return TCL_OK;
+	}
 
 	/*
-	 * call the library routine to escape the string, use
-	 * Tcl_SetResult to set the command result to be that string,
-	 * with TCL_DYNAMIC, we tell Tcl to free the memory when it's
-	 * done with it 
+	 * Get the "from" string, and quote it, unless it is the null value
+	 * string
 	 */
-	 *toString = '\'';
+	fromString = Tcl_GetStringFromObj(objv[objc - 1], &fromStringLen);
+	if (PgQuoteAppend(interp, connid, &ds, fromString, fromStringLen) != TCL_OK)
+	{
+		Tcl_DStringFree(&ds);
+		return TCL_ERROR;
+	}
+
+	Tcl_DStringResult(interp, &ds);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Pg_format --
+ *
+ *    builds an SQL statement from a template and values
+ *
+ * Syntax:
+ *    pg_format connection template ?value ...?
+ *
+ * Results:
+ *
+ *    The template is copied, with each format specifier replaced by
+ *    the next value, or by the value given by position as in %2$L:
+ *
+ *      %s  the value as it is
+ *      %L  the value quoted as a literal, or NULL if it matches the
+ *          null value string of the connection, as with pg_quote
+ *      %I  the value quoted as an identifier
+ *      %%  a %
+ *
+ *    This is the format() function of the server, done on the client
+ *    side.  The statement is built in one buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+Pg_format(ClientData cData, Tcl_Interp *interp, int objc,
+		  Tcl_Obj *CONST objv[])
+{
+	Pg_ConnectionId *connid;
+	CONST char *template;
+	CONST char *p;
+	CONST char *end;
+	CONST char *value;
+	CONST char *q;
+	int			templateLen,
+				length,
+				argIndex = 0;
+	Tcl_DString ds;
+
+	if (objc < 3)
+	{
+		Tcl_WrongNumArgs(interp, 1, objv, "connection template ?value ...?");
+		return TCL_ERROR;
+	}
+
+	if (PgGetConnectionId(interp, Tcl_GetStringFromObj(objv[1], NULL), &connid) == NULL)
+		return TCL_ERROR;
+
+	template = Tcl_GetStringFromObj(objv[2], &templateLen);
+	end = template + templateLen;
+	objc -= 3;
+	objv += 3;
 
-	 if (objc == 3) 
-	 {
-		stringSize = PQescapeStringConn (conn, toString+1, fromString, 
-										 fromStringLen, &error);
-		if (error) 
+	Tcl_DStringInit(&ds);
+
+	for (p = template; p < end; p++)
+	{
+		/* copy up to the next % in one go */
+		if ((q = memchr(p, '%', end - p)) == NULL)
 		{
-			/* error returned from PQescapeStringConn, send it on up */
-			ckfree (toString);
-			Tcl_SetObjResult (interp, Tcl_NewStringObj ( PQerrorMessage (conn),
-							  -1));
-			return TCL_ERROR;
+			Tcl_DStringAppend(&ds, p, (int)(end - p));
+			break;
+		}
+		Tcl_DStringAppend(&ds, p, (int)(q - p));
+		p = q + 1;
+
+		if (p < end && *p == '%')
+		{
+			Tcl_DStringAppend(&ds, "%", 1);
+			continue;
+		}
+
+		/* an explicit position, as in %2$s */
+		if (p < end && isdigit((unsigned char)*p))
+		{
+			int			position = 0;
+
+			for (q = p; q < end && isdigit((unsigned char)*q); q++)
+				position = 10 * position + (*q - '0');
+			if (q < end && *q == '$')
+			{
+				if (position < 1)
+				{
+					Tcl_SetObjResult(interp, Tcl_NewStringObj(
+						"format specifies argument 0, but arguments are numbered from 1", -1));
+					goto error;
+				}
+				argIndex = position - 1;
+				p = q + 1;
+			}
+		}
+
+		if (p >= end)
+		{
+			Tcl_SetObjResult(interp, Tcl_NewStringObj("unterminated format specifier", -1));
+			goto error;
+		}
+
+		if (*p != 's' && *p != 'I' && *p != 'L')
+		{
+			Tcl_Obj    *tresult = Tcl_NewStringObj("unrecognized format specifier \"", -1);
+
+			Tcl_AppendToObj(tresult, p, (int)(Tcl_UtfNext(p) - p));
+			Tcl_AppendToObj(tresult, "\"", 1);
+			Tcl_SetObjResult(interp, tresult);
+			goto error;
+		}
+
+		if (argIndex >= objc)
+		{
+			Tcl_SetObjResult(interp, Tcl_NewStringObj("too few arguments for format", -1));
+			goto error;
+		}
+		value = Tcl_GetStringFromObj(objv[argIndex++], &length);
+
+		switch (*p)
+		{
+			case 's':
+				/* like format(), a NULL comes out as nothing */
+				if (!PgQuoteIsNull(connid, value, length))
+					Tcl_DStringAppend(&ds, value, length);
+				break;
+
+			case 'L':
+				if (PgQuoteAppend(interp, connid, &ds, value, length) != TCL_OK)
+					goto error;
+				break;
+
+			case 'I':
+				if (PgQuoteIsNull(connid, value, length))
+				{
+					Tcl_SetObjResult(interp, Tcl_NewStringObj(
+						"null values cannot be formatted as an SQL identifier", -1));
+					goto error;
+				}
+
+				PgQuoteIdentAppend(&ds, value, length);
+				break;
 		}
-	} else {
-		stringSize = PQescapeString (toString+1, fromString, fromStringLen);
 	}
 
-	toString[stringSize+1] = '\'';
-	toString[stringSize+2] = '\0';
-	Tcl_SetResult(interp, toString, TCL_DYNAMIC);
+	Tcl_DStringResult(interp, &ds);
 	return TCL_OK;
+
+error:
+	Tcl_DStringFree(&ds);
+	return TCL_ERROR;
 }
 
 /*
@@ -3715,6 +6455,22 @@ Pg_escapeBytea(ClientData cData, Tcl_Interp *interp, int objc,
 	     */
 	    from = Tcl_GetByteArrayFromObj(objv[2], &fromLen);
 
+#ifdef HAVE_PQSERVERVERSION
+	    /*
+	     * Servers from 9.0 on take the hex format, which we can write
+	     * straight into the result.  This is what PQescapeByteaConn
+	     * would produce.
+	     */
+	    if (PQserverVersion(conn) >= 90000)
+	    {
+		const char *std = PQparameterStatus(conn, "standard_conforming_strings");
+
+		Tcl_SetObjResult(interp, PgByteaHexObj(from, fromLen,
+			(std != NULL && strcmp(std, "on") == 0) ? "\\x" : "\\\\x"));
+		return TCL_OK;
+	    }
+#endif
+
 	    to = PQescapeByteaConn(conn, from, fromLen, &toLen);
 	}
 
@@ -3724,7 +6480,8 @@ Pg_escapeBytea(ClientData cData, Tcl_Interp *interp, int objc,
             return TCL_ERROR;
         }
 
-        Tcl_SetObjResult(interp, Tcl_NewStringObj(to, -1));
+        /* toLen counts the terminating null */
+        Tcl_SetObjResult(interp, Tcl_NewStringObj((char *)to, (int)toLen - 1));
 
         #ifdef PQfreemem
             PQfreemem(to);
@@ -3760,10 +6517,9 @@ int
 Pg_unescapeBytea(ClientData cData, Tcl_Interp *interp, int objc,
                                  Tcl_Obj *CONST objv[])
 {
-    const unsigned char  *from;
-    unsigned char        *to;
+    const char  *from;
+    Tcl_Obj     *to;
     int         fromLen;
-    size_t      toLen;
 
     if (objc != 2)
     {
@@ -3771,22 +6527,16 @@ Pg_unescapeBytea(ClientData cData, Tcl_Interp *interp, int objc,
         return TCL_ERROR;
     }
 
+    /* hex values are decoded straight into the byte array */
     from = Tcl_GetStringFromObj(objv[1], &fromLen);
-    to   = PQunescapeBytea(from, &toLen);
+    to   = PgByteaToObj(from, fromLen);
     if (! to)
     {
         Tcl_SetObjResult(interp, Tcl_NewStringObj("Failed to unquote binary string", -1));
         return TCL_ERROR;
     }
 
-    Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(to, toLen));
-
-    #ifdef PQfreemem
-        PQfreemem(to);
-    #else
-        PQfreeNotify(to);
-    #endif
-
+    Tcl_SetObjResult(interp, to);
     return TCL_OK;
 }
 
@@ -3895,7 +6645,8 @@ Pg_dbinfo(ClientData cData, Tcl_Interp *interp, int objc,
 
                 conn_chan = Tcl_GetChannel(interp, name, 0);
                 if (conn_chan != NULL && 
-                    Tcl_GetChannelType(conn_chan) == &Pg_ConnType)
+                    Tcl_GetChannelType(conn_chan) == &Pg_ConnType &&
+                    !((Pg_ConnectionId *) Tcl_GetChannelInstanceData(conn_chan))->internal)
                 {
 
                     if (Tcl_ListObjAppendElement(interp, listObj, elemPtrs[i]) != TCL_OK)
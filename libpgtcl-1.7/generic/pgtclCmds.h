@@ -46,6 +46,9 @@ typedef struct Pg_TclNotifies_s
 	char	   *conn_loss_cmd;	/* pg_on_connection_loss cmd, or NULL */
 }	Pg_TclNotifies;
 
+/* a result shared by its handle and pg_result -assign -lazy arrays */
+typedef struct Pg_LazyResult_s Pg_LazyResult;
+
 typedef struct Pg_resultid_s
 {
     int                id;
@@ -53,9 +56,55 @@ typedef struct Pg_resultid_s
     Tcl_Interp         *interp;
     Tcl_Command        cmd_token;
     char               *nullValueString;
+    int                decode;          /* PGTCL_DECODE_* bits */
     struct Pg_ConnectionId_s    *connid;
+
+    /* pg_result -index: the first row of each key, or NULL */
+    Tcl_HashTable      *index;
+    int                *indexNext;      /* next row with the same key, or -1 */
+    int                *indexColumns;   /* the key columns */
+    int                nIndexColumns;
+
+    /* set once pg_result -assign -lazy shares the result, or NULL */
+    Pg_LazyResult      *lazy;
 } Pg_resultid;
 
+/* Command families that pg_stats counts queries for */
+enum Pg_StatsFamily
+{
+	PG_STATS_EXEC,				/* pg_exec */
+	PG_STATS_PREPARED,			/* pg_exec_prepared, -prepared */
+	PG_STATS_EXECUTE,			/* pg_execute */
+	PG_STATS_SELECT,			/* pg_select */
+	PG_STATS_ASYNC,				/* pg_sendquery, pg_sendquery_prepared */
+	PG_STATS_BACKGROUND,		/* pg_exec -background */
+	PG_STATS_FAMILIES
+};
+
+/* What pg_stats reports for a connection */
+typedef struct Pg_Stats_s
+{
+	Tcl_WideInt queries[PG_STATS_FAMILIES];
+	Tcl_WideInt rows;			/* tuples in results */
+	Tcl_WideInt bytesSent;		/* query text and parameters */
+	Tcl_WideInt bytesReceived;	/* values in results, with -countbytes */
+	Tcl_WideInt waitTime;		/* microseconds waiting for results */
+	Tcl_WideInt waitMax;		/* longest wait */
+	int			resultsPeak;	/* most result handles open at once */
+	Tcl_WideInt notifies;		/* NOTIFYs received */
+	Tcl_WideInt notifiesDropped;	/* ... with nobody listening */
+	Tcl_WideInt copyBytesIn;	/* read from COPY TO STDOUT */
+	Tcl_WideInt copyBytesOut;	/* written to COPY FROM STDIN */
+	Tcl_WideInt untracked;		/* queries of shapes past the limit */
+	Tcl_HashTable *statements;	/* Pg_StatementStats by normalized text,
+								 * or NULL */
+	struct Pg_StatementStats_s *statement;	/* the statement sent last, or
+											 * NULL */
+}	Pg_Stats;
+
+/* Most query shapes pg_stats -statements keeps for a connection */
+#define PG_STATS_MAX_STATEMENTS 1000
+
 typedef struct Pg_ConnectionId_s
 {
 	char		id[32];
@@ -75,10 +124,67 @@ typedef struct Pg_ConnectionId_s
 	Tcl_Command cmd_token;               /* handle command token */
 	Tcl_Interp *interp;               /* save Interp info */
 	char       *nullValueString; /* null vals are returned as this, if set */
+	int			decode;			/* PGTCL_DECODE_* bits for new results */
 	Pg_resultid **resultids;       /* resultids (internal storage) */
+
+	int			autoreconnect;	/* reconnect after connection loss */
+	int			reconnecting;	/* reconnect in progress */
+	int			reconnect_delay;	/* current backoff delay, in ms */
+	Tcl_TimerToken reconnect_timer;	/* pending reconnect step, or NULL */
+	int			reconnect_maxretries;	/* failed attempts before giving up,
+										 * 0 to never give up */
+	int			reconnect_attempts;	/* failed attempts so far */
+	Tcl_Obj    *restore;		/* statements still to replay after a
+								 * reconnect, or NULL */
+	int			restore_next;	/* index of the next one to send */
+	Tcl_HashTable *prepared_hash;	/* PREPAREd statements to restore after
+								 * a reconnect, or NULL */
+
+	struct Pg_BgJob_s *bg_job;	/* -background operation that owns the
+								 * connection, or NULL */
+	int			coro_busy;		/* a coroutine is waiting for a query */
+	int			lo_transaction;	/* large object channels open in the
+								 * transaction pg_lo_channel began */
+	unsigned int lo_generation;	/* bumped when the transaction large
+								 * object channels were opened in ends */
+	int			lo_busy;		/* pg_lo_import or pg_lo_export is running
+								 * its -progress callback */
+	Pg_Stats	stats;			/* for pg_stats */
+	int			stats_bytes;	/* pg_stats -countbytes: add up the
+								 * bytes of the values received */
+	int			internal;		/* the synthetic results' connection,
+								 * not listed by pg_dbinfo or pg_stats */
+	struct Pg_Trace_s *trace;	/* pg_trace state, or NULL if the
+								 * connection isn't traced */
+	struct Pg_Notices_s *notices;	/* notices kept for pg_notices */
 }	Pg_ConnectionId;
 
+/* Values returned other than as the text the server sent */
+#define PGTCL_DECODE_ARRAYS 0x1	/* arrays as nested lists */
+#define PGTCL_DECODE_BYTEA 0x2	/* bytea as byte arrays */
+#define PGTCL_DECODE_USER_ARRAYS 0x4	/* and types made in the database
+										 * that parse as arrays too */
 
+#ifdef TCL_ARRAYS
+#define PGTCL_DECODE_DEFAULT PGTCL_DECODE_ARRAYS
+#else
+#define PGTCL_DECODE_DEFAULT 0
+#endif
+
+/* Backoff limits for -autoreconnect, in milliseconds */
+#define PG_RECONNECT_MIN_DELAY 100
+#define PG_RECONNECT_MAX_DELAY 30000
+#define PG_RECONNECT_POLL_INTERVAL 10
+
+
+
+/*
+ * Tcl 8.6 has the non-recursive engine, which the coroutine-aware
+ * versions of pg_exec, pg_execute and pg_select need.
+ */
+#if TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION >= 6)
+#define PGTCL_USE_NRE
+#endif
 
 /* Values of res_copyStatus */
 #define RES_COPY_NONE	0
@@ -176,6 +282,9 @@ extern int Pg_on_connection_loss(
 extern int Pg_quote(
   ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 
+extern int Pg_format(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
 extern int Pg_escapeBytea(
   ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 
@@ -188,4 +297,98 @@ extern int Pg_dbinfo(
 extern int Pg_getdata(
   ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 
+#ifdef PGTCL_USE_NRE
+extern int Pg_exec_nr(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern int Pg_execute_nr(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern int Pg_select_nr(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern int Pg_result_nr(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+#endif
+
+extern void PgResultRelease(Pg_resultid *resultid, PGresult *result);
+
+/* pgtclPool.c */
+extern int Pg_pool(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+/* pgtclLo.c */
+extern int Pg_lo_channel(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern int PgLoMode(Tcl_Interp *interp, Tcl_Obj *modeObj, int *modePtr);
+extern void PgLoTransactionCheck(Pg_ConnectionId *connid);
+
+/*
+ * A pg_lo_import or pg_lo_export in progress.  It may run on a worker
+ * thread, so there are no Tcl objects in it: progressProc, if set, is
+ * called after each chunk and stops the transfer by returning nonzero.
+ */
+typedef struct Pg_LoTransfer_s
+{
+	PGconn	   *conn;
+	int			chunkSize;		/* bytes per lo_write, lo_read, lo_put or
+								 * lo_get */
+	int			pipeline;		/* chunks in flight, 1 for one at a time */
+	Tcl_WideInt done;			/* bytes moved so far */
+	Tcl_WideInt total;			/* bytes to move, -1 if not known */
+	int			(*progressProc) (struct Pg_LoTransfer_s *xfer);
+	ClientData	clientData;		/* for progressProc */
+	char		errmsg[256];	/* why it failed */
+}	Pg_LoTransfer;
+
+#define PG_LO_CHUNK_SIZE	(1024 * 1024)
+#define PG_LO_MAX_PIPELINE	64
+
+extern Oid PgLoImportFile(Pg_LoTransfer *xfer, const char *filename);
+extern int PgLoExportFile(Pg_LoTransfer *xfer, Oid lobjId,
+  const char *filename);
+
+/* pgtclStats.c */
+extern int Pg_stats(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern Tcl_WideInt PgStatsClock(void);
+extern const char *PgStatsFamilyName(int family);
+extern void PgStatsFree(Pg_ConnectionId *connid);
+extern void PgStatsQuery(Pg_ConnectionId *connid, int family,
+  const char *query, int nParams, const char *const *paramValues);
+extern void PgStatsResult(Pg_ConnectionId *connid, PGresult *result,
+  Tcl_WideInt usec);
+
+/* pgtclTrace.c */
+extern int Pg_trace(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+extern int Pg_untrace(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern void PgTraceQuery(Pg_ConnectionId *connid, int family,
+  const char *query, int nParams);
+extern void PgTraceResult(Pg_ConnectionId *connid, PGresult *result,
+  Tcl_WideInt usec);
+extern void PgTraceStop(Pg_ConnectionId *connid);
+
+/* pgtclNotice.c */
+extern int Pg_notices(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+extern void PgNoticeInit(Pg_ConnectionId *connid);
+extern void PgNoticeFree(Pg_ConnectionId *connid);
+
+/* pgtclSynthetic.c */
+extern int Pg_synthetic_result(
+  ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+/* pgtclBytea.c */
+extern int PgHexDecode(const char *src, int len, unsigned char *dst);
+extern void PgHexEncode(const unsigned char *src, int len, char *dst);
+extern Tcl_Obj *PgByteaToObj(const char *value, int length);
+extern Tcl_Obj *PgByteaHexObj(const unsigned char *src, int len,
+  const char *prefix);
+
 #endif   /* PGTCLCMDS_H */
@@ -20,6 +20,10 @@
 
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 #include <libpq-fe.h>
 
 #include "pgtclCmds.h"
@@ -29,6 +33,10 @@
 #     define CONST84
 #endif
 
+#ifdef WIN32
+#define strncasecmp _strnicmp
+#endif
+
 static int
 PgEndCopy(Pg_ConnectionId * connid, int *errorCodePtr)
 {
@@ -92,6 +100,7 @@ PgInputProc(DRIVER_INPUT_PROTO)
 		return PgEndCopy(connid, errorCodePtr);
 	}
 
+	connid->stats.copyBytesIn += avail;
 	return avail;
 }
 
@@ -119,6 +128,7 @@ PgOutputProc(DRIVER_OUTPUT_PROTO)
 		*errorCodePtr = EIO;
 		return -1;
 	}
+	connid->stats.copyBytesOut += bufSize;
 
 	/*
 	 * This assumes Tcl script will write the terminator line in a single
@@ -161,6 +171,41 @@ Tcl_ChannelType Pg_ConnType = {
     NULL                 /* Close2Proc, Not used */
 };
 
+/*
+ * Create the channel the notifier watches for read-ready on the
+ * connection's socket.  On Unix, Tcl gets a duplicate of the descriptor,
+ * so closing the channel never closes the socket libpq is using.  That
+ * lets us drop and remake the channel when the socket changes under a
+ * PQreset (see the reconnect code below).
+ */
+static void
+PgMakeNotifierChannel(Pg_ConnectionId * connid)
+{
+	int			pqsock = PQsocket(connid->conn);
+
+	connid->notifier_channel = NULL;
+	if (pqsock < 0)
+		return;
+
+#ifndef WIN32
+	if ((pqsock = dup(pqsock)) < 0)
+		return;
+#endif
+
+	connid->notifier_channel = Tcl_MakeTcpClientChannel((ClientData)(long)pqsock);
+	/* Code  executing  outside  of  any Tcl interpreter can call
+       Tcl_RegisterChannel with interp as NULL, to indicate  that
+       it  wishes  to  hold  a  reference to this channel. Subse-
+       quently, the channel can be registered  in  a  Tcl  inter-
+       preter and it will only be closed when the matching number
+       of calls to Tcl_UnregisterChannel have  been  made.   This
+       allows code executing outside of any interpreter to safely
+       hold a reference to a channel that is also registered in a
+       Tcl interpreter.
+	*/
+	Tcl_RegisterChannel(NULL, connid->notifier_channel);
+}
+
 /*
  * Create and register a new channel for the connection
  */
@@ -192,8 +237,30 @@ PgSetConnectionId(Tcl_Interp *interp, PGconn *conn, char *chandle)
 
 	connid->notify_list = NULL;
 	connid->notifier_running = 0;
+	connid->notifier_channel = NULL;
 	connid->interp = interp;
 	connid->nullValueString = NULL;
+	connid->decode = PGTCL_DECODE_DEFAULT;
+
+	connid->autoreconnect = 0;
+	connid->reconnecting = 0;
+	connid->reconnect_delay = PG_RECONNECT_MIN_DELAY;
+	connid->reconnect_timer = NULL;
+	connid->reconnect_maxretries = 0;
+	connid->reconnect_attempts = 0;
+	connid->restore = NULL;
+	connid->restore_next = 0;
+	connid->prepared_hash = NULL;
+	connid->bg_job = NULL;
+	connid->coro_busy = 0;
+	connid->lo_transaction = 0;
+	connid->lo_generation = 0;
+	connid->lo_busy = 0;
+	memset(&connid->stats, 0, sizeof(Pg_Stats));
+	connid->stats_bytes = 0;
+	connid->internal = 0;
+	connid->trace = NULL;
+	connid->notices = NULL;
 
         nsstr = Tcl_NewStringObj("if {[namespace current] != \"::\"} {set k [namespace current]::}", -1);
 
@@ -224,18 +291,8 @@ PgSetConnectionId(Tcl_Interp *interp, PGconn *conn, char *chandle)
 	    return 0;
 	}
 	
-	connid->notifier_channel = Tcl_MakeTcpClientChannel((ClientData)(long)PQsocket(conn));
-	/* Code  executing  outside  of  any Tcl interpreter can call
-       Tcl_RegisterChannel with interp as NULL, to indicate  that
-       it  wishes  to  hold  a  reference to this channel. Subse-
-       quently, the channel can be registered  in  a  Tcl  inter-
-       preter and it will only be closed when the matching number
-       of calls to Tcl_UnregisterChannel have  been  made.   This
-       allows code executing outside of any interpreter to safely
-       hold a reference to a channel that is also registered in a
-       Tcl interpreter.
-	*/
-	Tcl_RegisterChannel(NULL, connid->notifier_channel);
+	PgNoticeInit(connid);
+	PgMakeNotifierChannel(connid);
 
 	conn_chan = Tcl_CreateChannel(&Pg_ConnType, connid->id, (ClientData) connid,
 								  TCL_READABLE | TCL_WRITABLE);
@@ -268,7 +325,6 @@ PgConnCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
     int             optIndex;
     int             objvxi;
     int             idx = 1;
-    char            *arg;
     Tcl_Obj         *objvx[25];
     Tcl_CmdInfo     info;
     Pg_ConnectionId *connid;
@@ -391,48 +447,41 @@ PgConnCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 			break;
         }
         case EXECUTE:
+        case SELECT:
         {
             /*
-             * Need a little extra mojo here, since
-             * there can be the -array and -oid options
+             * Need a little extra mojo here, since the -array, -oid,
+             * -params and -prepared options, each with a value, come
              * before the connection handle -- arrggh
              */
-            int num = 2;
-            arg = Tcl_GetStringFromObj(objvx[2], NULL);
-            if (arg[0] == '-')
-            {
-                /* see if there are 2 options on the command line */
-                arg = Tcl_GetStringFromObj(objvx[4], NULL);
-                if (arg[0] == '-')
-                {
-                    num = 4;
-                }
+            static CONST84 char *execOptions[] = {
+                "-array", "-oid", "-params", "-prepared", (char *)NULL
+            };
+            int num = 1;
+            int execOpt;
 
-                for (objvxi = 1; objvxi <= num; objvxi++)
-                {
-                    objvx[objvxi] = objv[objvxi+1];
-                }
-                objvx[objvxi++] = objv[0];
-                
-            }
-            /*  DEBUGGING
-            for (objvxi = 0; objvxi < objc; objvxi++)
+            for (objvxi = 2; objvxi + 1 < objc; objvxi += 2)
             {
-                     Tcl_GetStringFromObj(objv[objvxi], NULL), 
-                     Tcl_GetStringFromObj(objvx[objvxi], NULL));
+                if (Tcl_GetIndexFromObj(NULL, objv[objvxi], execOptions,
+                                        "option", TCL_EXACT, &execOpt) != TCL_OK)
+                    break;
+                objvx[num++] = objv[objvxi];
+                objvx[num++] = objv[objvxi + 1];
             }
-            */
-               
-            idx += num;
+
+            idx = num;
             objvx[idx] = Tcl_NewStringObj(connid->id, -1);
-            returnCode = Pg_execute(cData, interp, objc, objvx);
-			break;
-        }
-        case SELECT:
-        {
-            objvx[1] = Tcl_NewStringObj(connid->id, -1);
-            returnCode = Pg_select(cData, interp, objc, objvx);
-			break;
+            Tcl_IncrRefCount(objvx[idx]);
+            for (; objvxi < objc; objvxi++)
+            {
+                objvx[++num] = objv[objvxi];
+            }
+
+            if (optIndex == EXECUTE)
+                returnCode = Pg_execute(cData, interp, objc, objvx);
+            else
+                returnCode = Pg_select(cData, interp, objc, objvx);
+            break;
         }
         case LISTEN:
         {
@@ -607,6 +656,7 @@ PgResultCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[
 }
 
 
+static void PgReconnectReplay(Pg_ConnectionId * connid, int wait);
 
 /*
  * Get back the connection from the Id
@@ -631,12 +681,84 @@ PgGetConnectionId(Tcl_Interp *interp, CONST84 char *id, Pg_ConnectionId ** conni
 	}
 
 	connid = (Pg_ConnectionId *) Tcl_GetChannelInstanceData(conn_chan);
+
+	/*
+	 * a -background worker, a waiting coroutine or a large object
+	 * transfer has it, hands off
+	 */
+	if (connid->bg_job != NULL || connid->coro_busy || connid->lo_busy)
+	{
+		tresult = Tcl_NewStringObj(id, -1);
+		Tcl_AppendStringsToObj(tresult, connid->bg_job != NULL ?
+							   " is busy with a background operation" :
+							   connid->coro_busy ?
+							   " is busy with a query of a coroutine" :
+							   " is busy with a large object transfer", NULL);
+		Tcl_SetObjResult(interp, tresult);
+
+		if (connid_p)
+			*connid_p = NULL;
+		return NULL;
+	}
+
+	/* what the caller sends must come after the replay of a reconnect */
+	if (connid->restore != NULL)
+		PgReconnectReplay(connid, 1);
+
 	if (connid_p)
 		*connid_p = connid;
 	return connid->conn;
 }
 
 
+/*
+ * Take the PGconn away from a connection handle and close the handle,
+ * leaving the libpq connection open.  This is how a connection out of
+ * a shared pool is handed back, so that another thread can wrap it in
+ * a handle of its own.
+ */
+PGconn *
+PgDetachConnection(Tcl_Interp *interp, Pg_ConnectionId * connid)
+{
+	Tcl_Channel conn_chan;
+	PGconn	   *conn = connid->conn;
+	int			i;
+
+	conn_chan = Tcl_GetChannel(interp, connid->id, 0);
+	if (conn_chan == NULL)
+		return NULL;
+
+	for (i = 0; i < connid->res_max; i++)
+	{
+		if (connid->resultids[i] != NULL)
+			Tcl_DeleteCommandFromToken(connid->resultids[i]->interp,
+									   connid->resultids[i]->cmd_token);
+	}
+
+	PgStopNotifyEventSource(connid, 1);
+	connid->autoreconnect = 0;
+
+	/* the libpq connection must not point back at us */
+	PgTraceStop(connid);
+	PgNoticeFree(connid);
+
+#ifdef WIN32
+	/*
+	 * The notifier channel is on libpq's own socket here, so closing it
+	 * would close the connection.  Leak the channel instead.
+	 */
+	connid->notifier_channel = NULL;
+#endif
+
+	/* with conn gone, neither of these touches the libpq connection */
+	connid->conn = NULL;
+	Tcl_DeleteCommandFromToken(interp, connid->cmd_token);
+	Tcl_UnregisterChannel(interp, conn_chan);
+
+	return conn;
+}
+
+
 /*
  * Remove a connection Id from the hash table and
  * close all portals the user forgot.
@@ -654,13 +776,13 @@ PgDelConnectionId(DRIVER_DEL_PROTO)
 
 	connid = (Pg_ConnectionId *) cData;
 
+	/* get the connection back from a -background worker first */
+	PgBackgroundWait(connid);
+
 	for (i = 0; i < connid->res_max; i++)
 	{
 	    if (connid->results[i])
 		{
-			PQclear(connid->results[i]);
-
-
             resultid = connid->resultids[i];
 
 			if (resultid != NULL) {
@@ -669,7 +791,10 @@ PgDelConnectionId(DRIVER_DEL_PROTO)
 				if ((resultid->nullValueString != NULL) && (resultid->nullValueString != connid->nullValueString))
 					ckfree (resultid->nullValueString);
 
+				PgResultRelease(resultid, connid->results[i]);
 				ckfree((void *)resultid);
+			} else {
+				PQclear(connid->results[i]);
 			}
 		}
 	}
@@ -699,14 +824,42 @@ PgDelConnectionId(DRIVER_DEL_PROTO)
 	 * pending notify and connection-loss events.
 	 */
 	PgStopNotifyEventSource(connid, 1);
+
+	/* Cancel any reconnect in progress and forget tracked statements */
+	if (connid->reconnect_timer != NULL)
+	{
+		Tcl_DeleteTimerHandler(connid->reconnect_timer);
+		connid->reconnect_timer = NULL;
+	}
+	if (connid->restore != NULL)
+	{
+		Tcl_DecrRefCount(connid->restore);
+		connid->restore = NULL;
+	}
+
+	if (connid->prepared_hash != NULL)
+	{
+		for (entry = Tcl_FirstHashEntry(connid->prepared_hash, &hsearch);
+			 entry != NULL;
+			 entry = Tcl_NextHashEntry(&hsearch))
+			ckfree((char *)Tcl_GetHashValue(entry));
+		Tcl_DeleteHashTable(connid->prepared_hash);
+		ckfree((void *)connid->prepared_hash);
+		connid->prepared_hash = NULL;
+	}
  
 
+	PgTraceStop(connid);
+	PgStatsFree(connid);
+	PgNoticeFree(connid);
+
 	/* Close the libpq connection too */
 	PQfinish(connid->conn);
 	connid->conn = NULL;
 
 	if (connid->nullValueString != NULL)
 		ckfree(connid->nullValueString);
+	connid->nullValueString = NULL;
 
 	/*
 	 * Kill the notifier channel, too.	We must not do this until after
@@ -826,6 +979,8 @@ PgSetResultId(Tcl_Interp *interp, CONST84 char *connid_c, PGresult *res)
     }
 
     connid->results[resid] = res;
+    if (++connid->res_count > connid->stats.resultsPeak)
+        connid->stats.resultsPeak = connid->res_count;
 
     sprintf(buf, "%s.%d", connid_c, resid);
     cmd = Tcl_NewStringObj(buf, -1);
@@ -835,10 +990,17 @@ PgSetResultId(Tcl_Interp *interp, CONST84 char *connid_c, PGresult *res)
     resultid->interp = interp;
     resultid->id     = resid;
     resultid->str = Tcl_NewStringObj(buf, -1);
+    Tcl_IncrRefCount(resultid->str);
     resultid->cmd_token = Tcl_CreateObjCommand(interp, buf, 
         PgResultCmd, (ClientData) resultid, PgDelResultHandle);
 	resultid->connid = connid;
 	resultid->nullValueString = connid->nullValueString;
+	resultid->decode = connid->decode;
+	resultid->index = NULL;
+	resultid->indexNext = NULL;
+	resultid->indexColumns = NULL;
+	resultid->nIndexColumns = 0;
+	resultid->lazy = NULL;
 
     connid->resultids[resid] = resultid;
 
@@ -913,20 +1075,23 @@ PgGetResultId(Tcl_Interp *interp, CONST84 char *id, Pg_resultid **resultidPtr)
 
 
 /*
- * Remove a result Id from the hash tables
+ * Remove a result Id from the hash tables, and clear its result
  */
 void
 PgDelResultId(Tcl_Interp *interp, CONST84 char *id)
 {
 	Pg_ConnectionId *connid;
 	Pg_resultid     *resultid;
+	PGresult        *result;
 	int			resid;
 
 	resid = getresid(interp, id, &connid);
 	if (resid == -1)
 		return;
 
+	result = connid->results[resid];
 	connid->results[resid] = 0;
+	connid->res_count--;
 
 	resultid = connid->resultids[resid];
 
@@ -935,6 +1100,8 @@ PgDelResultId(Tcl_Interp *interp, CONST84 char *id)
 	if ((resultid->nullValueString != NULL) && (resultid->nullValueString != connid->nullValueString))
 		ckfree (resultid->nullValueString);
 
+	/* clears the result, unless lazy arrays still read it */
+	PgResultRelease(resultid, result);
 	ckfree((void *)resultid);
 	connid->resultids[resid] = 0;
 }
@@ -1021,6 +1188,7 @@ Pg_Notify_EventProc(Tcl_Event *evPtr, int flags)
 	Pg_TclNotifies *notifies;
 	char	   *callback;
 	char	   *svcallback;
+	int			delivered = 0;
 
 	/* We classify SQL notifies as Tcl file events. */
 	if (!(flags & TCL_FILE_EVENTS))
@@ -1093,6 +1261,7 @@ Pg_Notify_EventProc(Tcl_Event *evPtr, int flags)
 		/*
 		 * Execute the callback.
 		 */
+		delivered = 1;
 		Tcl_Preserve((ClientData)interp);
 		if (Tcl_GlobalEval(interp, svcallback) != TCL_OK)
 		{
@@ -1113,6 +1282,10 @@ Pg_Notify_EventProc(Tcl_Event *evPtr, int flags)
 			break;
 	}
 
+	/* pg_stats counts the notifies nobody was listening for */
+	if (event->notify && !delivered)
+		event->connid->stats.notifiesDropped++;
+
 	Tcl_Release((ClientData)event->connid);
 
 	if (event->notify)
@@ -1143,6 +1316,8 @@ PgNotifyTransferEvents(Pg_ConnectionId * connid)
 	{
 		NotifyEvent *event = (NotifyEvent *) ckalloc(sizeof(NotifyEvent));
 
+		connid->stats.notifies++;
+
 		event->header.proc = Pg_Notify_EventProc;
 		event->notify = notify;
 		event->connid = connid;
@@ -1160,6 +1335,8 @@ PgNotifyTransferEvents(Pg_ConnectionId * connid)
 		PgConnLossTransferEvents(connid);
 }
 
+static void PgStartReconnect(Pg_ConnectionId * connid);
+
 /*
  * Handle a connection-loss event
  */
@@ -1184,6 +1361,9 @@ PgConnLossTransferEvents(Pg_ConnectionId * connid)
 	 * connection-loss event.
 	 */
 	PgStopNotifyEventSource(connid, 0);
+
+	if (connid->autoreconnect)
+		PgStartReconnect(connid);
 }
 
 /*
@@ -1265,6 +1445,10 @@ Pg_Notify_FileHandler(ClientData clientData, int mask)
 	 */
 	if (PQconsumeInput(connid->conn))
 	{
+		/* Go on with the replay of a reconnect, if one is under way */
+		if (connid->restore != NULL)
+			PgReconnectReplay(connid, 0);
+
 		/* Transfer notify events from libpq to Tcl event queue. */
 		PgNotifyTransferEvents(connid);
 
@@ -1287,12 +1471,12 @@ Pg_Notify_FileHandler(ClientData clientData, int mask)
  * or pg_on_connection_loss has been executed on the connection.  Currently,
  * once started the notifier is run until the connection is closed.
  *
- * FIXME: if PQreset is executed on the underlying PGconn, the active
- * socket number could change.	How and when should we test for this
- * and update the Tcl file handler linkage?  (For that matter, we'd
- * also have to reissue LISTEN commands for active LISTENs, since the
- * new backend won't know about 'em.  I'm leaving this problem for
- * another day.)
+ * If the connection was opened with -autoreconnect, a connection loss
+ * resets the PGconn in the background (PgStartReconnect below).  Since
+ * the socket number can change across the reset, the notifier channel
+ * is dropped and remade, and the active LISTENs are reissued, since
+ * the new backend won't know about 'em.  The file handler sends them
+ * one after the other as the answers come in.
  */
 
 void
@@ -1303,7 +1487,7 @@ PgStartNotifyEventSource(Pg_ConnectionId * connid)
 	{
 		int			pqsock = PQsocket(connid->conn);
 
-		if (pqsock >= 0)
+		if (pqsock >= 0 && connid->notifier_channel != NULL)
 		{
 			Tcl_CreateChannelHandler(connid->notifier_channel,
 									 TCL_READABLE,
@@ -1314,6 +1498,21 @@ PgStartNotifyEventSource(Pg_ConnectionId * connid)
 	}
 }
 
+/*
+ * Stop watching the socket, but leave the events already queued alone.
+ * Used while a -background worker owns the connection.
+ */
+void
+PgSuspendNotifyEventSource(Pg_ConnectionId * connid)
+{
+	if (connid->notifier_running)
+	{
+		Tcl_DeleteChannelHandler(connid->notifier_channel,
+							  Pg_Notify_FileHandler, (ClientData)connid);
+		connid->notifier_running = 0;
+	}
+}
+
 void
 PgStopNotifyEventSource(Pg_ConnectionId * connid, pqbool allevents)
 {
@@ -1334,6 +1533,419 @@ PgStopNotifyEventSource(Pg_ConnectionId * connid, pqbool allevents)
 }
 
 
+/*-------------------------------------------
+  Automatic reconnect
+
+  A connection opened with pg_connect -autoreconnect is not torn down
+  when the server goes away.  PgConnLossTransferEvents calls
+  PgStartReconnect, which drops the notifier channel and schedules
+  PQresetStart on a timer.  PQresetPoll is then driven from the timer
+  until the reset completes or fails; failures are retried with an
+  exponential backoff between PG_RECONNECT_MIN_DELAY and
+  PG_RECONNECT_MAX_DELAY, up to pg_connect -maxretries times if that
+  isn't 0, after which a background error says so and the connection
+  is left lost.  Once the reset is through, the notifier channel is
+  remade on the new socket, and a LISTEN for every pg_listen callback
+  and the statements tracked by PgTrackPrepared are queued to be
+  replayed.  PgReconnectReplay sends them with PQsendQuery, one at a
+  time, from the file handler as each answer comes in.  The handle
+  name, its result handles and its callbacks all stay the same
+  throughout.
+
+  Commands issued on the handle while the reset is in progress fail
+  with libpq's usual "no connection to the server" error.  One issued
+  during the replay first waits for the rest of it, in
+  PgGetConnectionId, so it sees the session as it was.
+  ------------------------------------------*/
+
+static void PgReconnectTimerProc(ClientData cData);
+static void PgReconnectPollProc(ClientData cData);
+
+/*
+ * Turn on -autoreconnect for a new connection, giving up after
+ * maxretries failed attempts in a row, or never if that is 0.
+ */
+void
+PgSetAutoReconnect(Pg_ConnectionId * connid, int maxretries)
+{
+	connid->autoreconnect = 1;
+	connid->reconnect_maxretries = maxretries;
+
+	/* watch the socket, so we notice a loss while idle */
+	PgStartNotifyEventSource(connid);
+}
+
+/*
+ * An attempt failed: try again after the backoff, unless that was the
+ * last one allowed.
+ */
+static void
+PgScheduleReconnect(Pg_ConnectionId * connid)
+{
+	Tcl_Interp *interp = connid->interp;
+	char		buf[32];
+
+	connid->reconnect_attempts++;
+	if (connid->reconnect_maxretries > 0 &&
+		connid->reconnect_attempts >= connid->reconnect_maxretries)
+	{
+		/* stay lost, and tell the owner of the handle */
+		connid->reconnecting = 0;
+		connid->autoreconnect = 0;
+
+		sprintf(buf, "%d", connid->reconnect_attempts);
+		Tcl_Preserve((ClientData) interp);
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, connid->id, ": gave up reconnecting after ",
+						 buf, " attempts: ", PQerrorMessage(connid->conn),
+						 (char *)NULL);
+		Tcl_SetErrorCode(interp, "PGTCL", "RECONNECT", connid->id,
+						 (char *)NULL);
+		Tcl_AddErrorInfo(interp, "\n    (pg_connect -autoreconnect)");
+		Tcl_BackgroundError(interp);
+		Tcl_Release((ClientData) interp);
+		return;
+	}
+
+	connid->reconnect_timer = Tcl_CreateTimerHandler(connid->reconnect_delay,
+							 PgReconnectTimerProc, (ClientData) connid);
+
+	connid->reconnect_delay *= 2;
+	if (connid->reconnect_delay > PG_RECONNECT_MAX_DELAY)
+		connid->reconnect_delay = PG_RECONNECT_MAX_DELAY;
+}
+
+static void
+PgStartReconnect(Pg_ConnectionId * connid)
+{
+	if (connid->reconnecting || connid->conn == NULL)
+		return;
+
+	connid->reconnecting = 1;
+	connid->reconnect_delay = PG_RECONNECT_MIN_DELAY;
+	connid->reconnect_attempts = 0;
+
+	/* large object descriptors don't outlive the backend */
+	connid->lo_transaction = 0;
+	connid->lo_generation++;
+
+	/* a replay cut short is started over once the reset is through */
+	if (connid->restore != NULL)
+	{
+		Tcl_DecrRefCount(connid->restore);
+		connid->restore = NULL;
+	}
+
+	/*
+	 * The socket behind the notifier channel is about to be closed by
+	 * libpq, so let go of our duplicate of it now.  On WIN32 the channel
+	 * is libpq's own socket, which closing would close under libpq, so
+	 * it is leaked instead, as in PgDelConnectionId.
+	 */
+	if (connid->notifier_channel != NULL)
+	{
+#ifndef WIN32
+		Tcl_UnregisterChannel(NULL, connid->notifier_channel);
+#endif
+		connid->notifier_channel = NULL;
+	}
+
+	/* first attempt right away, backoff from then on */
+	connid->reconnect_timer = Tcl_CreateTimerHandler(0,
+							 PgReconnectTimerProc, (ClientData) connid);
+}
+
+/*
+ * Quote a LISTEN channel name the way it is stored in notify_hash, i.e.
+ * already case-folded, so that the server sees exactly that name.
+ */
+static void
+PgAppendQuotedIdent(Tcl_DString *dsPtr, CONST84 char *ident)
+{
+	CONST84 char *p;
+
+	Tcl_DStringAppend(dsPtr, "\"", 1);
+	for (p = ident; *p; p++)
+	{
+		if (*p == '"')
+			Tcl_DStringAppend(dsPtr, "\"", 1);
+		Tcl_DStringAppend(dsPtr, p, 1);
+	}
+	Tcl_DStringAppend(dsPtr, "\"", 1);
+}
+
+/*
+ * The reset went through: rebind the notifier, and queue the session
+ * state the new backend doesn't know about for PgReconnectReplay.
+ */
+static void
+PgReconnectRestore(Pg_ConnectionId * connid)
+{
+	Pg_TclNotifies *notifies;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch hsearch;
+	Tcl_DString cmd;
+	Tcl_Obj    *restore = Tcl_NewListObj(0, NULL);
+
+	connid->reconnecting = 0;
+	connid->reconnect_delay = PG_RECONNECT_MIN_DELAY;
+	connid->reconnect_attempts = 0;
+
+	PgMakeNotifierChannel(connid);
+
+	Tcl_DStringInit(&cmd);
+	for (notifies = connid->notify_list; notifies; notifies = notifies->next)
+	{
+		if (notifies->interp == NULL)
+			continue;			/* ignore deleted interpreter */
+
+		for (entry = Tcl_FirstHashEntry(&notifies->notify_hash, &hsearch);
+			 entry != NULL;
+			 entry = Tcl_NextHashEntry(&hsearch))
+		{
+			Tcl_DStringSetLength(&cmd, 0);
+			Tcl_DStringAppend(&cmd, "LISTEN ", -1);
+			PgAppendQuotedIdent(&cmd,
+				Tcl_GetHashKey(&notifies->notify_hash, entry));
+			Tcl_ListObjAppendElement(NULL, restore,
+				Tcl_NewStringObj(Tcl_DStringValue(&cmd), -1));
+		}
+	}
+	Tcl_DStringFree(&cmd);
+
+	if (connid->prepared_hash != NULL)
+	{
+		for (entry = Tcl_FirstHashEntry(connid->prepared_hash, &hsearch);
+			 entry != NULL;
+			 entry = Tcl_NextHashEntry(&hsearch))
+		{
+			Tcl_ListObjAppendElement(NULL, restore,
+				Tcl_NewStringObj((char *)Tcl_GetHashValue(entry), -1));
+		}
+	}
+
+	Tcl_IncrRefCount(restore);
+	connid->restore = restore;
+	connid->restore_next = 0;
+
+	/* keep watching, so we notice if we lose it again, and the answers */
+	PgStartNotifyEventSource(connid);
+	PgReconnectReplay(connid, 0);
+
+	/* LISTEN may already have let some notifies through */
+	PgNotifyTransferEvents(connid);
+}
+
+/*
+ * Send the statements queued by PgReconnectRestore one at a time, each
+ * once the answer to the one before is in.  A statement that fails is
+ * passed over, as the PREPARE of a table since dropped must be.
+ * Without wait, this stops as soon as libpq would block, to be called
+ * again by the file handler; with it, it runs the replay to the end.
+ */
+static void
+PgReconnectReplay(Pg_ConnectionId * connid, int wait)
+{
+	PGresult   *result;
+	Tcl_Obj    *sqlObj;
+	int			n;
+
+	while (connid->restore != NULL && (wait || !PQisBusy(connid->conn)))
+	{
+		if ((result = PQgetResult(connid->conn)) != NULL)
+		{
+			PQclear(result);
+			continue;
+		}
+
+		Tcl_ListObjLength(NULL, connid->restore, &n);
+		if (connid->restore_next >= n)
+		{
+			Tcl_DecrRefCount(connid->restore);
+			connid->restore = NULL;
+			break;
+		}
+
+		Tcl_ListObjIndex(NULL, connid->restore, connid->restore_next++, &sqlObj);
+		PQsendQuery(connid->conn, Tcl_GetString(sqlObj));
+	}
+}
+
+static void
+PgReconnectTimerProc(ClientData cData)
+{
+	Pg_ConnectionId *connid = (Pg_ConnectionId *) cData;
+
+	connid->reconnect_timer = NULL;
+
+	if (!PQresetStart(connid->conn))
+	{
+		PgScheduleReconnect(connid);
+		return;
+	}
+
+	connid->reconnect_timer = Tcl_CreateTimerHandler(PG_RECONNECT_POLL_INTERVAL,
+							 PgReconnectPollProc, (ClientData) connid);
+}
+
+static void
+PgReconnectPollProc(ClientData cData)
+{
+	Pg_ConnectionId *connid = (Pg_ConnectionId *) cData;
+
+	connid->reconnect_timer = NULL;
+
+	switch (PQresetPoll(connid->conn))
+	{
+		case PGRES_POLLING_OK:
+			PgReconnectRestore(connid);
+			break;
+
+		case PGRES_POLLING_FAILED:
+			PgScheduleReconnect(connid);
+			break;
+
+		default:
+			connid->reconnect_timer = Tcl_CreateTimerHandler(
+				PG_RECONNECT_POLL_INTERVAL, PgReconnectPollProc,
+				(ClientData) connid);
+			break;
+	}
+}
+
+/*
+ * Remember the PREPARE statements executed on an -autoreconnect
+ * connection so they can be reissued after a reset, and forget them
+ * again on DEALLOCATE.  Only single statements are tracked; replaying
+ * a query string that did other things besides the PREPARE would not
+ * be safe.
+ */
+
+static CONST84 char *
+PgMatchKeyword(CONST84 char *p, CONST84 char *keyword)
+{
+	int			len = strlen(keyword);
+
+	while (isspace((unsigned char)*p))
+		p++;
+	if (strncasecmp(p, keyword, len) != 0 ||
+		!(isspace((unsigned char)p[len]) || p[len] == '"'))
+		return NULL;
+	p += len;
+	while (isspace((unsigned char)*p))
+		p++;
+	return p;
+}
+
+static char *
+PgParseStatementName(CONST84 char *p)
+{
+	char	   *name;
+	char	   *q;
+	CONST84 char *end;
+
+	if (*p == '"')
+	{
+		/* quoted identifier, keep case, collapse doubled quotes */
+		name = q = ckalloc(strlen(p) + 1);
+		for (p++; *p; p++)
+		{
+			if (*p == '"')
+			{
+				if (p[1] != '"')
+					break;
+				p++;
+			}
+			*q++ = *p;
+		}
+		*q = '\0';
+		return name;
+	}
+
+	for (end = p; isalnum((unsigned char)*end) || *end == '_' || *end == '$'; end++)
+		;
+	if (end == p)
+		return NULL;
+
+	name = q = ckalloc(end - p + 1);
+	while (p < end)
+		*q++ = tolower((unsigned char)*p++);
+	*q = '\0';
+	return name;
+}
+
+void
+PgTrackPrepared(Pg_ConnectionId * connid, CONST84 char *query)
+{
+	CONST84 char *p;
+	CONST84 char *semi;
+	char	   *name;
+	char	   *sql;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch hsearch;
+	int			new;
+
+	/* Only single statements, a trailing semicolon is fine */
+	if ((semi = strchr(query, ';')) != NULL)
+	{
+		for (p = semi + 1; isspace((unsigned char)*p); p++)
+			;
+		if (*p != '\0')
+			return;
+	}
+
+	if ((p = PgMatchKeyword(query, "PREPARE")) != NULL)
+	{
+		if ((name = PgParseStatementName(p)) == NULL)
+			return;
+
+		if (connid->prepared_hash == NULL)
+		{
+			connid->prepared_hash = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+			Tcl_InitHashTable(connid->prepared_hash, TCL_STRING_KEYS);
+		}
+
+		entry = Tcl_CreateHashEntry(connid->prepared_hash, name, &new);
+		if (!new)
+			ckfree((char *)Tcl_GetHashValue(entry));
+
+		sql = ckalloc(strlen(query) + 1);
+		strcpy(sql, query);
+		Tcl_SetHashValue(entry, sql);
+		ckfree(name);
+		return;
+	}
+
+	if ((p = PgMatchKeyword(query, "DEALLOCATE")) == NULL ||
+		connid->prepared_hash == NULL)
+		return;
+
+	if ((semi = PgMatchKeyword(p, "PREPARE")) != NULL)
+		p = semi;
+
+	if (strncasecmp(p, "ALL", 3) == 0 && !isalnum((unsigned char)p[3]) && p[3] != '_')
+	{
+		for (entry = Tcl_FirstHashEntry(connid->prepared_hash, &hsearch);
+			 entry != NULL;
+			 entry = Tcl_NextHashEntry(&hsearch))
+			ckfree((char *)Tcl_GetHashValue(entry));
+		Tcl_DeleteHashTable(connid->prepared_hash);
+		Tcl_InitHashTable(connid->prepared_hash, TCL_STRING_KEYS);
+		return;
+	}
+
+	if ((name = PgParseStatementName(p)) == NULL)
+		return;
+
+	if ((entry = Tcl_FindHashEntry(connid->prepared_hash, name)) != NULL)
+	{
+		ckfree((char *)Tcl_GetHashValue(entry));
+		Tcl_DeleteHashEntry(entry);
+	}
+	ckfree(name);
+}
+
+
 void
 PgDelCmdHandle(ClientData cData)
 {
@@ -1379,16 +1991,13 @@ void
 PgDelResultHandle(ClientData cData)
 {
 
-    PGresult       *result;
     Pg_resultid    *resultid = (Pg_resultid *) cData;
     char           *resstr;
 
     resstr = Tcl_GetStringFromObj(resultid->str, NULL);
-    
-    result = PgGetResultId(resultid->interp, resstr, NULL);
 
+    /* this clears the result too */
     PgDelResultId(resultid->interp, resstr);
-    PQclear(result);
 
     return;
 }
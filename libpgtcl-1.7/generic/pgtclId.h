@@ -31,6 +31,7 @@ extern int PgSetConnectionId(Tcl_Interp *interp, PGconn *conn, char *connhandle)
 extern PGconn *PgGetConnectionId(Tcl_Interp *interp, CONST84 char *id,
 				  Pg_ConnectionId **);
 extern int	PgDelConnectionId(DRIVER_DEL_PROTO);
+extern PGconn *PgDetachConnection(Tcl_Interp *interp, Pg_ConnectionId * connid);
 extern int	PgOutputProc(DRIVER_OUTPUT_PROTO);
 extern int	PgInputProc(DRIVER_INPUT_PROTO);
 extern int	PgSetResultId(Tcl_Interp *interp, CONST84 char *connid, PGresult *res);
@@ -42,6 +43,28 @@ extern void PgStopNotifyEventSource(Pg_ConnectionId * connid, pqbool allevents);
 extern void PgNotifyTransferEvents(Pg_ConnectionId * connid);
 extern void PgConnLossTransferEvents(Pg_ConnectionId * connid);
 extern void PgNotifyInterpDelete(ClientData clientData, Tcl_Interp *interp);
+extern void PgTrackPrepared(Pg_ConnectionId * connid, CONST84 char *query);
+extern void PgSuspendNotifyEventSource(Pg_ConnectionId * connid);
+extern void PgSetAutoReconnect(Pg_ConnectionId * connid, int maxretries);
+
+/* pgtclWorker.c */
+extern int PgBackgroundConnect(Tcl_Interp *interp, Tcl_Obj *callback,
+		CONST84 char *conninfo, CONST84 char *connhandle, int autoreconnect,
+		int maxretries);
+extern int PgBackgroundExec(Tcl_Interp *interp, Pg_ConnectionId * connid,
+		Tcl_Obj *callback, CONST84 char *query, int nParams,
+		Tcl_Obj *CONST params[]);
+extern int PgBackgroundLoImport(Tcl_Interp *interp, Pg_ConnectionId * connid,
+		Tcl_Obj *callback, Pg_LoTransfer *xfer, Tcl_Obj *progress,
+		CONST84 char *filename);
+extern int PgBackgroundLoExport(Tcl_Interp *interp, Pg_ConnectionId * connid,
+		Tcl_Obj *callback, Pg_LoTransfer *xfer, Tcl_Obj *progress,
+		Oid lobjId, CONST84 char *filename);
+extern int PgBackgroundCancel(Tcl_Interp *interp, Pg_ConnectionId * connid,
+		Tcl_Obj *callback);
+extern int PgBackgroundCancelNow(Pg_ConnectionId * connid, char *errbuf,
+		int errbufsize);
+extern void PgBackgroundWait(Pg_ConnectionId * connid);
 
 extern int PgConnCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 extern void PgDelCmdHandle(ClientData cData);
@@ -0,0 +1,928 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgtclLo.c
+ *
+ *	Large objects as Tcl channels.  pg_lo_channel opens a large object
+ *	and returns a channel reading and writing it with lo_read and
+ *	lo_write, a buffer at a time, and seeking with lo_lseek64 where
+ *	libpq has it.  So gets, read, puts, seek, tell, fcopy and chan copy
+ *	work on a large object as they do on a file.
+ *
+ *	Large object descriptors only live as long as the transaction.  If
+ *	the connection isn't in one when a channel is opened, we begin one,
+ *	and commit it when the last channel opened in it is closed.
+ *
+ *	The calls block, so the channel is always ready: when Tcl wants to
+ *	know, a timer tells it so, which is enough for background copies.
+ *
+ *	pg_lo_import and pg_lo_export are done here too, in big chunks, and
+ *	pipelined where libpq and the server allow it.
+ *
+ * IDENTIFICATION
+ *	  $Id$
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <libpq-fe.h>
+
+#include "pgtclCmds.h"
+#include "pgtclId.h"
+#include "libpq/libpq-fs.h"		/* large-object interface */
+
+#ifndef CONST84
+#     define CONST84
+#endif
+
+#ifndef EOVERFLOW
+#define EOVERFLOW EINVAL
+#endif
+
+/* default size of the channel buffer, so of each lo_read and lo_write */
+#define PG_LO_BUFFER_SIZE	(256 * 1024)
+
+typedef struct Pg_LoChannel_s
+{
+	Tcl_Channel chan;
+	Pg_ConnectionId *connid;
+	int			fd;				/* large object descriptor */
+	int			validMask;		/* TCL_READABLE and/or TCL_WRITABLE */
+	int			watchMask;		/* events Tcl is interested in */
+	Tcl_TimerToken timer;		/* reports the channel ready, or NULL */
+	int			inTransaction;	/* counted in connid->lo_transaction */
+	unsigned int generation;	/* connid->lo_generation when opened */
+} Pg_LoChannel;
+
+/*
+ * Called with each query result.  Back outside a transaction, every
+ * channel open on the connection is dead, whoever ended the transaction
+ * its descriptor was opened in, and the next one is none of theirs.
+ */
+void
+PgLoTransactionCheck(Pg_ConnectionId *connid)
+{
+	if (connid->conn != NULL &&
+		PQtransactionStatus(connid->conn) == PQTRANS_IDLE)
+	{
+		connid->lo_transaction = 0;
+		connid->lo_generation++;
+	}
+}
+
+/*
+ * Parse a large object mode, "r", "w", "rw" or "wr", for lo_open.
+ */
+int
+PgLoMode(Tcl_Interp *interp, Tcl_Obj *modeObj, int *modePtr)
+{
+	char	   *modeString;
+	int			modeStringLen;
+	int			mode = 0;
+	int			i;
+
+	modeString = Tcl_GetStringFromObj(modeObj, &modeStringLen);
+	if ((modeStringLen < 1) || (modeStringLen > 2))
+		goto badMode;
+
+	for (i = 0; i < modeStringLen; i++)
+	{
+		switch (modeString[i])
+		{
+			case 'r':
+			case 'R':
+				mode |= INV_READ;
+				break;
+			case 'w':
+			case 'W':
+				mode |= INV_WRITE;
+				break;
+			default:
+				goto badMode;
+		}
+	}
+
+	*modePtr = mode;
+	return TCL_OK;
+
+badMode:
+	Tcl_SetObjResult(interp,
+		Tcl_NewStringObj("mode argument must be 'r', 'w', or 'rw'", -1));
+	return TCL_ERROR;
+}
+
+/*
+ * The connection, if the channel can still use it, else NULL with the
+ * reason in *errorCodePtr.
+ */
+static PGconn *
+PgLoConn(Pg_LoChannel *lo, int *errorCodePtr)
+{
+	Pg_ConnectionId *connid = lo->connid;
+
+	/*
+	 * The descriptor went with the transaction it was opened in, and its
+	 * number may belong to another channel by now.
+	 */
+	if (connid->conn == NULL || lo->generation != connid->lo_generation)
+	{
+		*errorCodePtr = EBADF;
+		return NULL;
+	}
+	if (connid->bg_job != NULL || connid->coro_busy || connid->lo_busy ||
+		connid->res_copyStatus != RES_COPY_NONE)
+	{
+		*errorCodePtr = EBUSY;
+		return NULL;
+	}
+	return connid->conn;
+}
+
+static int
+PgLoInputProc(ClientData instanceData, char *buf, int bufSize,
+			  int *errorCodePtr)
+{
+	Pg_LoChannel *lo = (Pg_LoChannel *) instanceData;
+	PGconn	   *conn;
+	int			nbytes;
+
+	if ((conn = PgLoConn(lo, errorCodePtr)) == NULL)
+		return -1;
+
+	if ((nbytes = lo_read(conn, lo->fd, buf, bufSize)) < 0)
+	{
+		*errorCodePtr = EIO;
+		return -1;
+	}
+	return nbytes;
+}
+
+static int
+PgLoOutputProc(ClientData instanceData, CONST84 char *buf, int toWrite,
+			   int *errorCodePtr)
+{
+	Pg_LoChannel *lo = (Pg_LoChannel *) instanceData;
+	PGconn	   *conn;
+	int			nbytes;
+
+	if ((conn = PgLoConn(lo, errorCodePtr)) == NULL)
+		return -1;
+
+	if ((nbytes = lo_write(conn, lo->fd, (char *)buf, toWrite)) < 0)
+	{
+		*errorCodePtr = EIO;
+		return -1;
+	}
+	return nbytes;
+}
+
+static Tcl_WideInt
+PgLoWideSeekProc(ClientData instanceData, Tcl_WideInt offset, int mode,
+				 int *errorCodePtr)
+{
+	Pg_LoChannel *lo = (Pg_LoChannel *) instanceData;
+	PGconn	   *conn;
+	Tcl_WideInt pos;
+
+	if ((conn = PgLoConn(lo, errorCodePtr)) == NULL)
+		return -1;
+
+#ifdef HAVE_LO_LSEEK64
+	pos = lo_lseek64(conn, lo->fd, (pg_int64) offset, mode);
+#else
+	if (offset > 0x7FFFFFFF || offset < -0x7FFFFFFF - 1)
+	{
+		*errorCodePtr = EOVERFLOW;
+		return -1;
+	}
+	pos = lo_lseek(conn, lo->fd, (int)offset, mode);
+#endif
+
+	if (pos < 0)
+	{
+		*errorCodePtr = EINVAL;
+		return -1;
+	}
+	return pos;
+}
+
+static int
+PgLoSeekProc(ClientData instanceData, long offset, int mode,
+			 int *errorCodePtr)
+{
+	Tcl_WideInt pos;
+
+	pos = PgLoWideSeekProc(instanceData, (Tcl_WideInt) offset, mode, errorCodePtr);
+	if (pos > 0x7FFFFFFF)
+	{
+		*errorCodePtr = EOVERFLOW;
+		return -1;
+	}
+	return (int)pos;
+}
+
+static void
+PgLoTimerProc(ClientData instanceData)
+{
+	Pg_LoChannel *lo = (Pg_LoChannel *) instanceData;
+
+	/* Tcl asks again through the watch proc if it is still interested */
+	lo->timer = NULL;
+	Tcl_NotifyChannel(lo->chan, lo->watchMask);
+}
+
+static void
+PgLoWatchProc(ClientData instanceData, int mask)
+{
+	Pg_LoChannel *lo = (Pg_LoChannel *) instanceData;
+
+	lo->watchMask = mask & lo->validMask;
+	if (lo->watchMask != 0)
+	{
+		if (lo->timer == NULL)
+			lo->timer = Tcl_CreateTimerHandler(0, PgLoTimerProc, (ClientData) lo);
+	}
+	else if (lo->timer != NULL)
+	{
+		Tcl_DeleteTimerHandler(lo->timer);
+		lo->timer = NULL;
+	}
+}
+
+static int
+PgLoBlockModeProc(ClientData instanceData, int mode)
+{
+	/* the calls always block, and the channel is always ready */
+	return 0;
+}
+
+static int
+PgLoGetHandleProc(ClientData instanceData, int direction,
+				  ClientData *handlePtr)
+{
+	return TCL_ERROR;
+}
+
+static int
+PgLoCloseProc(ClientData instanceData, Tcl_Interp *interp)
+{
+	Pg_LoChannel *lo = (Pg_LoChannel *) instanceData;
+	Pg_ConnectionId *connid = lo->connid;
+	int			errorCode = 0;
+	PGresult   *res;
+
+	if (lo->timer != NULL)
+		Tcl_DeleteTimerHandler(lo->timer);
+
+	if (lo->generation != connid->lo_generation)
+	{
+		/* its descriptor and transaction are gone already */
+	}
+	else if (PgLoConn(lo, &errorCode) != NULL)
+	{
+		if (lo_close(connid->conn, lo->fd) < 0)
+			errorCode = EIO;
+
+		/* the last channel in our transaction ends it */
+		if (lo->inTransaction && --connid->lo_transaction == 0)
+		{
+			res = PQexec(connid->conn,
+						 PQtransactionStatus(connid->conn) == PQTRANS_INERROR ?
+						 "ROLLBACK" : "COMMIT");
+			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+				errorCode = EIO;
+			PQclear(res);
+		}
+	}
+	else if (lo->inTransaction && connid->conn != NULL)
+	{
+		connid->lo_transaction--;
+	}
+
+	Tcl_Release((ClientData) connid);
+	ckfree((char *)lo);
+	return errorCode;
+}
+
+static Tcl_ChannelType Pg_LoChannelType = {
+	"pglo",						/* channel type */
+	TCL_CHANNEL_VERSION_2,		/* version, for wideSeekProc */
+	PgLoCloseProc,				/* closeProc */
+	PgLoInputProc,				/* inputProc */
+	PgLoOutputProc,				/* outputProc */
+	PgLoSeekProc,				/* seekProc */
+	NULL,						/* setOptionProc */
+	NULL,						/* getOptionProc */
+	PgLoWatchProc,				/* watchProc */
+	PgLoGetHandleProc,			/* getHandleProc */
+	NULL,						/* close2Proc */
+	PgLoBlockModeProc,			/* blockModeProc */
+	NULL,						/* flushProc */
+	NULL,						/* handlerProc */
+	PgLoWideSeekProc			/* wideSeekProc */
+};
+
+/**********************************
+ * pg_lo_channel
+	 open a large object as a Tcl channel
+
+ syntax:
+	 pg_lo_channel conn lobjId mode ?-buffersize size?
+
+ mode can be any OR'ing together of INV_READ, INV_WRITE,
+ as for pg_lo_open.  The channel is in binary mode, with a buffer of
+ size bytes, which is what each lo_read and lo_write moves.
+
+ Returns the name of the channel.
+ **********************************/
+int
+Pg_lo_channel(ClientData cData, Tcl_Interp *interp, int objc,
+			  Tcl_Obj *CONST objv[])
+{
+	Pg_ConnectionId *connid;
+	PGconn	   *conn;
+	Pg_LoChannel *lo;
+	Tcl_WideInt lobjId;
+	int			mode;
+	int			fd;
+	int			bufferSize = PG_LO_BUFFER_SIZE;
+	int			began = 0;
+	char		channelName[64];
+	PGresult   *res;
+	Tcl_Obj    *tresult;
+
+	if (objc != 4 && objc != 6)
+	{
+		Tcl_WrongNumArgs(interp, 1, objv,
+						 "connection lobjOid mode ?-buffersize size?");
+		return TCL_ERROR;
+	}
+
+	conn = PgGetConnectionId(interp, Tcl_GetStringFromObj(objv[1], NULL), &connid);
+	if (conn == NULL)
+		return TCL_ERROR;
+
+	if (Tcl_GetWideIntFromObj(interp, objv[2], &lobjId) != TCL_OK)
+		return TCL_ERROR;
+
+	if (PgLoMode(interp, objv[3], &mode) != TCL_OK)
+		return TCL_ERROR;
+
+	if (objc == 6)
+	{
+		if (strcmp(Tcl_GetStringFromObj(objv[4], NULL), "-buffersize") != 0)
+		{
+			tresult = Tcl_NewStringObj("bad option \"", -1);
+			Tcl_AppendStringsToObj(tresult, Tcl_GetStringFromObj(objv[4], NULL),
+								   "\": must be -buffersize", NULL);
+			Tcl_SetObjResult(interp, tresult);
+			return TCL_ERROR;
+		}
+		if (Tcl_GetIntFromObj(interp, objv[5], &bufferSize) != TCL_OK)
+			return TCL_ERROR;
+	}
+
+	if (connid->res_copyStatus != RES_COPY_NONE)
+	{
+		Tcl_SetObjResult(interp,
+			Tcl_NewStringObj("Attempt to open a large object while COPY in progress", -1));
+		return TCL_ERROR;
+	}
+
+	/* descriptors only last as long as the transaction */
+	if (PQtransactionStatus(conn) == PQTRANS_IDLE)
+	{
+		res = PQexec(conn, "BEGIN");
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			PQclear(res);
+			Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(conn), -1));
+			return TCL_ERROR;
+		}
+		PQclear(res);
+		began = 1;
+		connid->lo_transaction = 0;
+		connid->lo_generation++;
+	}
+
+	fd = lo_open(conn, (Oid) lobjId, mode);
+	if (fd < 0)
+	{
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(PQerrorMessage(conn), -1));
+		if (began)
+			PQclear(PQexec(conn, "ROLLBACK"));
+		return TCL_ERROR;
+	}
+
+	lo = (Pg_LoChannel *) ckalloc(sizeof(Pg_LoChannel));
+	lo->connid = connid;
+	lo->fd = fd;
+	lo->validMask = ((mode & INV_READ) ? TCL_READABLE : 0) |
+		((mode & INV_WRITE) ? TCL_WRITABLE : 0);
+	lo->watchMask = 0;
+	lo->timer = NULL;
+	lo->inTransaction = (began || connid->lo_transaction > 0);
+	lo->generation = connid->lo_generation;
+	if (lo->inTransaction)
+		connid->lo_transaction++;
+	Tcl_Preserve((ClientData) connid);
+
+	sprintf(channelName, "%s.lo%d", connid->id, fd);
+	lo->chan = Tcl_CreateChannel(&Pg_LoChannelType, channelName,
+								 (ClientData) lo, lo->validMask);
+	Tcl_SetChannelOption(NULL, lo->chan, "-translation", "binary");
+	Tcl_SetChannelBufferSize(lo->chan, bufferSize);
+	Tcl_RegisterChannel(interp, lo->chan);
+
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(channelName, -1));
+	return TCL_OK;
+}
+
+/*-------------------------------------------------------------------------
+ * Import and export
+ *
+ * libpq's lo_import and lo_export move 8K per round trip.  These move a
+ * chunk of xfer->chunkSize bytes per round trip, and with a pipeline of
+ * more than one, keep that many lo_put or lo_get queries in flight in
+ * libpq's pipeline mode (servers from 9.4 have those functions), so the
+ * link is never idle waiting for an answer.
+ *
+ * Everything happens in a transaction, ours if the connection isn't in
+ * one, so a failed import leaves no half-written large object behind.
+ *
+ * A -progress callback may close the connection; then progressProc
+ * sets xfer->conn to NULL and nothing here touches it again.
+ *-------------------------------------------------------------------------
+ */
+
+#if defined(LIBPQ_HAS_PIPELINING)
+#define PG_LO_PIPELINE
+#endif
+
+#define PG_LO_SERVER_VERSION 90400		/* for lo_put and lo_get */
+
+/*
+ * Record why the transfer failed, the connection's error message if
+ * what is NULL.  The first reason sticks.  Returns 0.
+ */
+static int
+PgLoFail(Pg_LoTransfer *xfer, const char *what)
+{
+	size_t		len;
+
+	if (xfer->errmsg[0] != '\0')
+		return 0;
+
+	if (what == NULL)
+		what = (xfer->conn != NULL) ? PQerrorMessage(xfer->conn) : "connection closed";
+	strncpy(xfer->errmsg, what, sizeof(xfer->errmsg) - 1);
+	xfer->errmsg[sizeof(xfer->errmsg) - 1] = '\0';
+
+	/* libpq's messages end in a newline */
+	len = strlen(xfer->errmsg);
+	while (len > 0 && xfer->errmsg[len - 1] == '\n')
+		xfer->errmsg[--len] = '\0';
+	return 0;
+}
+
+static int
+PgLoFileFail(Pg_LoTransfer *xfer, const char *what)
+{
+	char		msg[128];
+
+	sprintf(msg, "can't %s: %.80s", what, strerror(errno));
+	return PgLoFail(xfer, msg);
+}
+
+/*
+ * Count n more bytes done and report them.
+ */
+static int
+PgLoProgress(Pg_LoTransfer *xfer, int n)
+{
+	xfer->done += n;
+	if (xfer->progressProc != NULL && (*xfer->progressProc) (xfer))
+		return PgLoFail(xfer, "cancelled");
+	return 1;
+}
+
+/*
+ * Begin a transaction, unless the connection is already in one.
+ */
+static int
+PgLoBegin(Pg_LoTransfer *xfer, int *beganPtr)
+{
+	PGresult   *res;
+
+	*beganPtr = 0;
+	if (PQtransactionStatus(xfer->conn) != PQTRANS_IDLE)
+		return 1;
+
+	res = PQexec(xfer->conn, "BEGIN");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		PQclear(res);
+		return PgLoFail(xfer, NULL);
+	}
+	PQclear(res);
+	*beganPtr = 1;
+	return 1;
+}
+
+/*
+ * End the transaction PgLoBegin began: commit it if all went well, else
+ * roll it back.
+ */
+static int
+PgLoEnd(Pg_LoTransfer *xfer, int began, int ok)
+{
+	PGresult   *res;
+
+	if (!began || xfer->conn == NULL)
+		return ok;
+
+	res = PQexec(xfer->conn, ok ? "COMMIT" : "ROLLBACK");
+	if (ok && PQresultStatus(res) != PGRES_COMMAND_OK)
+		ok = PgLoFail(xfer, NULL);
+	PQclear(res);
+	return ok;
+}
+
+static Tcl_WideInt
+PgLoSeek(PGconn *conn, int fd, int whence)
+{
+#ifdef HAVE_LO_LSEEK64
+	return (Tcl_WideInt) lo_lseek64(conn, fd, 0, whence);
+#else
+	return (Tcl_WideInt) lo_lseek(conn, fd, 0, whence);
+#endif
+}
+
+/*
+ * One chunk at a time, with lo_write and lo_read.
+ */
+static int
+PgLoWriteChunks(Pg_LoTransfer *xfer, Oid lobjId, FILE *fp, char *buf)
+{
+	int			fd;
+	int			n;
+	int			ok = 1;
+
+	if ((fd = lo_open(xfer->conn, lobjId, INV_WRITE)) < 0)
+		return PgLoFail(xfer, NULL);
+
+	while (ok && (n = (int)fread(buf, 1, xfer->chunkSize, fp)) > 0)
+	{
+		if (lo_write(xfer->conn, fd, buf, n) != n)
+			ok = PgLoFail(xfer, NULL);
+		else
+			ok = PgLoProgress(xfer, n);
+	}
+	if (ok && ferror(fp))
+		ok = PgLoFileFail(xfer, "read file");
+
+	if (xfer->conn != NULL && lo_close(xfer->conn, fd) < 0 && ok)
+		ok = PgLoFail(xfer, NULL);
+	return ok;
+}
+
+static int
+PgLoReadChunks(Pg_LoTransfer *xfer, int fd, FILE *fp, char *buf)
+{
+	int			n;
+	int			ok = 1;
+
+	while (ok && (n = lo_read(xfer->conn, fd, buf, xfer->chunkSize)) > 0)
+	{
+		if ((int)fwrite(buf, 1, n, fp) != n)
+			ok = PgLoFileFail(xfer, "write file");
+		else
+			ok = PgLoProgress(xfer, n);
+	}
+	if (ok && n < 0)
+		ok = PgLoFail(xfer, NULL);
+	return ok;
+}
+
+#ifdef PG_LO_PIPELINE
+/*
+ * Wait for the result of the oldest query in the pipeline.
+ */
+static PGresult *
+PgLoPipelineResult(Pg_LoTransfer *xfer)
+{
+	PGresult   *res;
+
+	/* the server holds results back until asked to flush them */
+	if (PQsendFlushRequest(xfer->conn) == 0 || PQflush(xfer->conn) != 0)
+	{
+		PgLoFail(xfer, NULL);
+		return NULL;
+	}
+
+	if ((res = PQgetResult(xfer->conn)) == NULL)
+	{
+		PgLoFail(xfer, NULL);
+		return NULL;
+	}
+
+	/* each query's results end with a NULL */
+	PQclear(PQgetResult(xfer->conn));
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		PgLoFail(xfer, PQresultErrorMessage(res));
+		PQclear(res);
+		return NULL;
+	}
+	return res;
+}
+
+/*
+ * Leave pipeline mode, throwing away the results of queries still in
+ * flight after a failure.
+ */
+static int
+PgLoPipelineEnd(Pg_LoTransfer *xfer, int ok)
+{
+	PGresult   *res;
+	ExecStatusType status;
+
+	if (xfer->conn == NULL)
+		return ok;
+
+	if (PQpipelineSync(xfer->conn) == 0)
+		return PgLoFail(xfer, NULL);
+
+	for (;;)
+	{
+		if ((res = PQgetResult(xfer->conn)) == NULL)
+		{
+			if (PQstatus(xfer->conn) == CONNECTION_BAD)
+				return PgLoFail(xfer, NULL);
+			continue;
+		}
+		status = PQresultStatus(res);
+		PQclear(res);
+		if (status == PGRES_PIPELINE_SYNC)
+			break;
+	}
+
+	if (PQexitPipelineMode(xfer->conn) == 0)
+		ok = PgLoFail(xfer, NULL);
+	return ok;
+}
+
+/*
+ * Up to xfer->pipeline chunks in flight, with lo_put and lo_get.
+ */
+static int
+PgLoPutChunks(Pg_LoTransfer *xfer, Oid lobjId, FILE *fp, char *buf)
+{
+	static const Oid types[3] = {26, 20, 17};	/* oid, int8, bytea */
+	const int	formats[3] = {0, 0, 1};
+	int			lengths[3] = {0, 0, 0};
+	const char *values[3];
+	char		oidString[32];
+	char		offsetString[32];
+	int			sizes[PG_LO_MAX_PIPELINE];
+	int			sent = 0;
+	int			received = 0;
+	int			eof = 0;
+	int			ok = 1;
+	int			n;
+	Tcl_WideInt offset = 0;
+	PGresult   *res;
+
+	if (PQenterPipelineMode(xfer->conn) == 0)
+		return PgLoFail(xfer, NULL);
+
+	sprintf(oidString, "%u", lobjId);
+	values[0] = oidString;
+	values[1] = offsetString;
+	values[2] = buf;
+
+	while (ok)
+	{
+		/* libpq copies the chunk, so buf can take the next one */
+		while (!eof && sent - received < xfer->pipeline)
+		{
+			if ((n = (int)fread(buf, 1, xfer->chunkSize, fp)) == 0)
+			{
+				if (ferror(fp))
+					ok = PgLoFileFail(xfer, "read file");
+				eof = 1;
+				break;
+			}
+			sprintf(offsetString, "%" TCL_LL_MODIFIER "d", offset);
+			lengths[2] = n;
+			if (PQsendQueryParams(xfer->conn,
+								  "SELECT pg_catalog.lo_put($1, $2, $3)",
+								  3, types, values, lengths, formats, 0) == 0)
+			{
+				ok = PgLoFail(xfer, NULL);
+				break;
+			}
+			sizes[sent % PG_LO_MAX_PIPELINE] = n;
+			offset += n;
+			sent++;
+		}
+		if (!ok || sent == received)
+			break;
+
+		if ((res = PgLoPipelineResult(xfer)) == NULL)
+			ok = 0;
+		else
+		{
+			PQclear(res);
+			ok = PgLoProgress(xfer, sizes[received % PG_LO_MAX_PIPELINE]);
+			received++;
+		}
+	}
+
+	return PgLoPipelineEnd(xfer, ok);
+}
+
+static int
+PgLoGetChunks(Pg_LoTransfer *xfer, Oid lobjId, FILE *fp)
+{
+	static const Oid types[3] = {26, 20, 23};	/* oid, int8, int4 */
+	const char *values[3];
+	char		oidString[32];
+	char		offsetString[32];
+	char		lengthString[32];
+	int			sent = 0;
+	int			received = 0;
+	int			ok = 1;
+	int			n;
+	Tcl_WideInt offset = 0;
+	PGresult   *res;
+
+	if (PQenterPipelineMode(xfer->conn) == 0)
+		return PgLoFail(xfer, NULL);
+
+	sprintf(oidString, "%u", lobjId);
+	values[0] = oidString;
+	values[1] = offsetString;
+	values[2] = lengthString;
+
+	while (ok)
+	{
+		while (offset < xfer->total && sent - received < xfer->pipeline)
+		{
+			n = (xfer->total - offset < xfer->chunkSize) ?
+				(int)(xfer->total - offset) : xfer->chunkSize;
+			sprintf(offsetString, "%" TCL_LL_MODIFIER "d", offset);
+			sprintf(lengthString, "%d", n);
+			/* the chunk comes back as raw bytes */
+			if (PQsendQueryParams(xfer->conn,
+								  "SELECT pg_catalog.lo_get($1, $2, $3)",
+								  3, types, values, NULL, NULL, 1) == 0)
+			{
+				ok = PgLoFail(xfer, NULL);
+				break;
+			}
+			offset += n;
+			sent++;
+		}
+		if (!ok || sent == received)
+			break;
+
+		if ((res = PgLoPipelineResult(xfer)) == NULL)
+			ok = 0;
+		else
+		{
+			n = PQgetlength(res, 0, 0);
+			if ((int)fwrite(PQgetvalue(res, 0, 0), 1, n, fp) != n)
+				ok = PgLoFileFail(xfer, "write file");
+			else
+				ok = PgLoProgress(xfer, n);
+			PQclear(res);
+			received++;
+		}
+	}
+
+	return PgLoPipelineEnd(xfer, ok);
+}
+#endif   /* PG_LO_PIPELINE */
+
+/*
+ * Import a file into a new large object.  Returns its OID, or InvalidOid
+ * with the reason in xfer->errmsg.
+ */
+Oid
+PgLoImportFile(Pg_LoTransfer *xfer, const char *filename)
+{
+	FILE	   *fp;
+	struct stat st;
+	char	   *buf;
+	Oid			lobjId = InvalidOid;
+	int			began;
+	int			ok;
+
+	xfer->errmsg[0] = '\0';
+	xfer->done = 0;
+	xfer->total = -1;
+
+	if ((fp = fopen(filename, "rb")) == NULL)
+	{
+		PgLoFileFail(xfer, "open file");
+		return InvalidOid;
+	}
+	if (fstat(fileno(fp), &st) == 0)
+		xfer->total = (Tcl_WideInt) st.st_size;
+
+	if ((buf = malloc(xfer->chunkSize)) == NULL)
+	{
+		PgLoFail(xfer, "out of memory");
+		fclose(fp);
+		return InvalidOid;
+	}
+
+	ok = PgLoBegin(xfer, &began);
+	if (ok && (lobjId = lo_creat(xfer->conn, INV_READ | INV_WRITE)) == InvalidOid)
+		ok = PgLoFail(xfer, NULL);
+
+	if (ok)
+	{
+#ifdef PG_LO_PIPELINE
+		if (xfer->pipeline > 1 && PQserverVersion(xfer->conn) >= PG_LO_SERVER_VERSION)
+			ok = PgLoPutChunks(xfer, lobjId, fp, buf);
+		else
+#endif
+			ok = PgLoWriteChunks(xfer, lobjId, fp, buf);
+	}
+
+	ok = PgLoEnd(xfer, began, ok);
+
+	/* in the caller's transaction, clean up if it is still usable */
+	if (!ok && !began && lobjId != InvalidOid && xfer->conn != NULL &&
+		PQtransactionStatus(xfer->conn) == PQTRANS_INTRANS)
+		lo_unlink(xfer->conn, lobjId);
+
+	free(buf);
+	fclose(fp);
+	return ok ? lobjId : InvalidOid;
+}
+
+/*
+ * Export a large object into a file.  Returns 0 with the reason in
+ * xfer->errmsg if that fails.
+ */
+int
+PgLoExportFile(Pg_LoTransfer *xfer, Oid lobjId, const char *filename)
+{
+	FILE	   *fp = NULL;
+	char	   *buf = NULL;
+	int			fd = -1;
+	int			began;
+	int			ok;
+
+	xfer->errmsg[0] = '\0';
+	xfer->done = 0;
+	xfer->total = -1;
+
+	ok = PgLoBegin(xfer, &began);
+	if (ok && (fd = lo_open(xfer->conn, lobjId, INV_READ)) < 0)
+		ok = PgLoFail(xfer, NULL);
+
+	if (ok && ((xfer->total = PgLoSeek(xfer->conn, fd, SEEK_END)) < 0 ||
+			   PgLoSeek(xfer->conn, fd, SEEK_SET) != 0))
+		ok = PgLoFail(xfer, NULL);
+
+	if (ok && (fp = fopen(filename, "wb")) == NULL)
+		ok = PgLoFileFail(xfer, "create file");
+
+	if (ok)
+	{
+#ifdef PG_LO_PIPELINE
+		if (xfer->pipeline > 1 && PQserverVersion(xfer->conn) >= PG_LO_SERVER_VERSION)
+		{
+			lo_close(xfer->conn, fd);
+			fd = -1;
+			ok = PgLoGetChunks(xfer, lobjId, fp);
+		}
+		else
+#endif
+		if ((buf = malloc(xfer->chunkSize)) == NULL)
+			ok = PgLoFail(xfer, "out of memory");
+		else
+			ok = PgLoReadChunks(xfer, fd, fp, buf);
+	}
+
+	if (fd >= 0 && xfer->conn != NULL && lo_close(xfer->conn, fd) < 0 && ok)
+		ok = PgLoFail(xfer, NULL);
+	if (fp != NULL && fclose(fp) != 0 && ok)
+		ok = PgLoFileFail(xfer, "write file");
+
+	ok = PgLoEnd(xfer, began, ok);
+
+	if (buf != NULL)
+		free(buf);
+	return ok;
+}
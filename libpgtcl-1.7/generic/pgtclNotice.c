@@ -0,0 +1,495 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgtclNotice.c
+ *
+ *	Notices and warnings from the server.  libpq's default receiver
+ *	writes them to stderr as they come, which blocks when stderr is a
+ *	full pipe.  Instead each connection gets a receiver that keeps them
+ *	in a ring buffer, which pg_notices reads, and can also pass them to
+ *	a callback through the event queue.  pg_notices -discard drops them
+ *	and -stderr gives them back to libpq.
+ *
+ *	The receiver runs in whichever thread is using the connection, the
+ *	worker thread of a -background query too, so the buffer is kept as
+ *	plain strings under a mutex, and callbacks are queued to the thread
+ *	that opened the connection.
+ *
+ * IDENTIFICATION
+ *	  $Id$
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libpq-fe.h>
+
+#include "pgtclCmds.h"
+#include "pgtclId.h"
+
+#ifndef CONST84
+#     define CONST84
+#endif
+
+/* notices kept by default */
+#define PG_NOTICE_BUFFER_SIZE	100
+
+enum
+{
+	NOTICE_SEVERITY, NOTICE_SQLSTATE, NOTICE_MESSAGE, NOTICE_DETAIL,
+	NOTICE_HINT, NOTICE_FIELDS
+};
+
+static const char *const noticeNames[NOTICE_FIELDS] = {
+	"severity", "sqlstate", "message", "detail", "hint"
+};
+
+/* A notice, allocated with its strings in one piece */
+typedef struct Pg_Notice_s
+{
+	char	   *fields[NOTICE_FIELDS];
+} Pg_Notice;
+
+enum Pg_NoticeMode
+{
+	NOTICE_BUFFER, NOTICE_DISCARD, NOTICE_STDERR
+};
+
+typedef struct Pg_Notices_s
+{
+	Tcl_Mutex	mutex;			/* the rest can be used by a worker */
+	Tcl_ThreadId owner;			/* where callbacks are run */
+	int			mode;
+	Pg_Notice **ring;			/* the last size notices, or NULL */
+	int			size;
+	int			next;			/* slot for the next notice */
+	int			count;			/* notices in the ring */
+	char	   *callback;		/* command prefix, or NULL */
+	PQnoticeReceiver defaultReceiver;	/* libpq's, for -stderr; it
+										 * takes no argument */
+} Pg_Notices;
+
+typedef struct
+{
+	Tcl_Event	header;
+	Pg_ConnectionId *connid;	/* NULL if the connection was closed */
+	Pg_Notice  *notice;
+} NoticeEvent;
+
+static Pg_Notice *
+PgNoticeNew(const char *fields[])
+{
+	Pg_Notice  *notice;
+	size_t		lengths[NOTICE_FIELDS];
+	size_t		total = sizeof(Pg_Notice);
+	char	   *p;
+	int			i;
+
+	for (i = 0; i < NOTICE_FIELDS; i++)
+	{
+		lengths[i] = fields[i] != NULL ? strlen(fields[i]) : 0;
+		total += lengths[i] + 1;
+	}
+
+	notice = (Pg_Notice *) ckalloc(total);
+	p = (char *)(notice + 1);
+	for (i = 0; i < NOTICE_FIELDS; i++)
+	{
+		notice->fields[i] = p;
+		if (lengths[i] > 0)
+			memcpy(p, fields[i], lengths[i]);
+		p[lengths[i]] = '\0';
+		p += lengths[i] + 1;
+	}
+	return notice;
+}
+
+static Tcl_Obj *
+PgNoticeObj(Pg_Notice *notice)
+{
+	Tcl_Obj    *listObj = Tcl_NewListObj(0, NULL);
+	int			i;
+
+	for (i = 0; i < NOTICE_FIELDS; i++)
+	{
+		Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj(noticeNames[i], -1));
+		Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj(notice->fields[i], -1));
+	}
+	return listObj;
+}
+
+static int
+PgNoticeEventProc(Tcl_Event *evPtr, int flags)
+{
+	NoticeEvent *event = (NoticeEvent *) evPtr;
+	Pg_ConnectionId *connid = event->connid;
+	Tcl_Interp *interp;
+	Tcl_Obj    *cmd;
+	char	   *callback = NULL;
+
+	/* like notifies, these count as file events */
+	if (!(flags & TCL_FILE_EVENTS))
+		return 0;
+
+	if (connid != NULL && connid->notices != NULL)
+	{
+		Tcl_MutexLock(&connid->notices->mutex);
+		if (connid->notices->callback != NULL)
+		{
+			callback = ckalloc(strlen(connid->notices->callback) + 1);
+			strcpy(callback, connid->notices->callback);
+		}
+		Tcl_MutexUnlock(&connid->notices->mutex);
+	}
+
+	if (callback != NULL && Tcl_InterpDeleted(connid->interp))
+	{
+		ckfree(callback);
+		callback = NULL;
+	}
+
+	if (callback != NULL)
+	{
+		interp = connid->interp;
+		cmd = Tcl_NewStringObj(callback, -1);
+		Tcl_IncrRefCount(cmd);
+		Tcl_ListObjAppendElement(NULL, cmd, PgNoticeObj(event->notice));
+
+		Tcl_Preserve((ClientData) connid);
+		Tcl_Preserve((ClientData) interp);
+		if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK)
+		{
+			Tcl_AddErrorInfo(interp, "\n    (\"pg_notices\" callback)");
+			Tcl_BackgroundError(interp);
+		}
+		Tcl_Release((ClientData) interp);
+		Tcl_Release((ClientData) connid);
+
+		Tcl_DecrRefCount(cmd);
+		ckfree(callback);
+	}
+
+	ckfree((char *)event->notice);
+	return 1;
+}
+
+/*
+ * The notice receiver of a connection in buffer mode.
+ */
+static void
+PgNoticeReceiver(void *arg, const PGresult *res)
+{
+	Pg_ConnectionId *connid = (Pg_ConnectionId *) arg;
+	Pg_Notices *notices = connid->notices;
+	Pg_Notice  *notice;
+	NoticeEvent *event = NULL;
+	const char *fields[NOTICE_FIELDS];
+
+#ifdef PG_DIAG_SEVERITY_NONLOCALIZED
+	fields[NOTICE_SEVERITY] = PQresultErrorField(res, PG_DIAG_SEVERITY_NONLOCALIZED);
+	if (fields[NOTICE_SEVERITY] == NULL)
+#endif
+		fields[NOTICE_SEVERITY] = PQresultErrorField(res, PG_DIAG_SEVERITY);
+	fields[NOTICE_SQLSTATE] = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+	fields[NOTICE_MESSAGE] = PQresultErrorField(res, PG_DIAG_MESSAGE_PRIMARY);
+	fields[NOTICE_DETAIL] = PQresultErrorField(res, PG_DIAG_MESSAGE_DETAIL);
+	fields[NOTICE_HINT] = PQresultErrorField(res, PG_DIAG_MESSAGE_HINT);
+
+	/* libpq's own notices only have the message */
+	if (fields[NOTICE_MESSAGE] == NULL)
+		fields[NOTICE_MESSAGE] = PQresultErrorMessage(res);
+
+	notice = PgNoticeNew(fields);
+
+	Tcl_MutexLock(&notices->mutex);
+	if (notices->ring == NULL)
+	{
+		notices->ring = (Pg_Notice **) ckalloc(notices->size * sizeof(Pg_Notice *));
+		memset(notices->ring, 0, notices->size * sizeof(Pg_Notice *));
+	}
+	if (notices->ring[notices->next] != NULL)
+		ckfree((char *)notices->ring[notices->next]);
+	else
+		notices->count++;
+	notices->ring[notices->next] = notice;
+	notices->next = (notices->next + 1) % notices->size;
+
+	if (notices->callback != NULL)
+	{
+		event = (NoticeEvent *) ckalloc(sizeof(NoticeEvent));
+		event->header.proc = PgNoticeEventProc;
+		event->connid = connid;
+		event->notice = PgNoticeNew((const char **) notice->fields);
+	}
+	Tcl_MutexUnlock(&notices->mutex);
+
+	if (event != NULL)
+	{
+		if (Tcl_GetCurrentThread() == notices->owner)
+			Tcl_QueueEvent((Tcl_Event *) event, TCL_QUEUE_TAIL);
+		else
+		{
+			Tcl_ThreadQueueEvent(notices->owner, (Tcl_Event *) event,
+								 TCL_QUEUE_TAIL);
+			Tcl_ThreadAlert(notices->owner);
+		}
+	}
+}
+
+static void
+PgNoticeDiscard(void *arg, const PGresult *res)
+{
+}
+
+/*
+ * Empty the ring, and resize it if size isn't 0, which frees it until
+ * the next notice.  Called with the mutex held.
+ */
+static void
+PgNoticeClear(Pg_Notices *notices, int size)
+{
+	int			i;
+
+	if (notices->ring != NULL)
+	{
+		for (i = 0; i < notices->size; i++)
+			if (notices->ring[i] != NULL)
+				ckfree((char *)notices->ring[i]);
+		if (size == 0)
+			memset(notices->ring, 0, notices->size * sizeof(Pg_Notice *));
+		else
+		{
+			ckfree((char *)notices->ring);
+			notices->ring = NULL;
+		}
+	}
+	if (size != 0)
+		notices->size = size;
+	notices->next = 0;
+	notices->count = 0;
+}
+
+/*
+ * Take over the notices of a new connection.
+ */
+void
+PgNoticeInit(Pg_ConnectionId *connid)
+{
+	Pg_Notices *notices;
+
+	notices = (Pg_Notices *) ckalloc(sizeof(Pg_Notices));
+	memset(notices, 0, sizeof(Pg_Notices));
+	notices->owner = Tcl_GetCurrentThread();
+	notices->mode = NOTICE_BUFFER;
+	notices->size = PG_NOTICE_BUFFER_SIZE;
+	connid->notices = notices;
+
+	notices->defaultReceiver = PQsetNoticeReceiver(connid->conn,
+												   PgNoticeReceiver, connid);
+}
+
+/*
+ * Used by Tcl_DeleteEvents to mark the notices of a closed connection
+ * dead, as NotifyEventDeleteProc does.
+ */
+static int
+NoticeEventDeleteProc(Tcl_Event *evPtr, ClientData clientData)
+{
+	if (evPtr->proc == PgNoticeEventProc &&
+		((NoticeEvent *) evPtr)->connid == (Pg_ConnectionId *) clientData)
+		((NoticeEvent *) evPtr)->connid = NULL;
+	return 0;
+}
+
+/*
+ * Forget the notices of a connection that is being closed or detached,
+ * and give its notices back to libpq.
+ */
+void
+PgNoticeFree(Pg_ConnectionId *connid)
+{
+	Pg_Notices *notices = connid->notices;
+
+	if (notices == NULL)
+		return;
+
+	/* the connection may live on, in a pool */
+	if (connid->conn != NULL)
+		PQsetNoticeReceiver(connid->conn, notices->defaultReceiver, NULL);
+	Tcl_DeleteEvents(NoticeEventDeleteProc, (ClientData) connid);
+	connid->notices = NULL;
+
+	PgNoticeClear(notices, notices->size);
+	if (notices->callback != NULL)
+		ckfree(notices->callback);
+	Tcl_MutexFinalize(&notices->mutex);
+	ckfree((char *)notices);
+}
+
+/**********************************
+ * pg_notices
+	 return the notices and warnings received on a connection
+
+ syntax:
+	 pg_notices connection ?-clear? ?-buffer n|-discard|-stderr?
+		 ?-callback command?
+
+ Each notice is a list of names and values: severity, sqlstate,
+ message, detail and hint.  The last 100 are kept by default; -buffer
+ changes that, emptying the buffer.  -clear empties it after returning
+ it.  -callback runs the command from the event loop with each notice
+ appended, "" to stop.  -discard drops the notices, and -stderr lets
+ libpq print them as it would by default.
+ **********************************/
+int
+Pg_notices(ClientData cData, Tcl_Interp *interp, int objc,
+		   Tcl_Obj *CONST objv[])
+{
+	static CONST84 char *options[] = {
+		"-clear", "-buffer", "-discard", "-stderr", "-callback", (char *)NULL
+	};
+	enum options
+	{
+		OPT_CLEAR, OPT_BUFFER, OPT_DISCARD, OPT_STDERR, OPT_CALLBACK
+	};
+	Pg_ConnectionId *connid;
+	Pg_Notices *notices;
+	Tcl_Channel conn_chan;
+	Tcl_Obj    *listObj;
+	Tcl_Obj    *callbackObj = NULL;
+	char	   *connString;
+	int			clear = 0;
+	int			size = 0;
+	int			mode = -1;
+	int			optIndex;
+	int			slot;
+	int			i;
+
+	if (objc < 2)
+	{
+		Tcl_WrongNumArgs(interp, 1, objv,
+						 "connection ?-clear? ?-buffer n|-discard|-stderr? ?-callback command?");
+		return TCL_ERROR;
+	}
+
+	for (i = 2; i < objc; i++)
+	{
+		if (Tcl_GetIndexFromObj(interp, objv[i], options, "option",
+								TCL_EXACT, &optIndex) != TCL_OK)
+			return TCL_ERROR;
+
+		switch ((enum options) optIndex)
+		{
+			case OPT_CLEAR:
+				clear = 1;
+				break;
+
+			case OPT_BUFFER:
+				if (++i >= objc)
+				{
+					Tcl_SetResult(interp, "-buffer requires a count", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				if (Tcl_GetIntFromObj(interp, objv[i], &size) != TCL_OK)
+					return TCL_ERROR;
+				if (size < 1)
+				{
+					Tcl_SetResult(interp, "-buffer must be at least 1", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				mode = NOTICE_BUFFER;
+				break;
+
+			case OPT_DISCARD:
+				mode = NOTICE_DISCARD;
+				break;
+
+			case OPT_STDERR:
+				mode = NOTICE_STDERR;
+				break;
+
+			case OPT_CALLBACK:
+				if (++i >= objc)
+				{
+					Tcl_SetResult(interp, "-callback requires a command", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				callbackObj = objv[i];
+				break;
+		}
+	}
+
+	/* as with pg_stats, a busy connection can still be looked at */
+	connString = Tcl_GetStringFromObj(objv[1], NULL);
+	conn_chan = Tcl_GetChannel(interp, connString, 0);
+	if (conn_chan == NULL || Tcl_GetChannelType(conn_chan) != &Pg_ConnType)
+	{
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, connString,
+						 " is not a valid postgresql connection", (char *)NULL);
+		return TCL_ERROR;
+	}
+	connid = (Pg_ConnectionId *) Tcl_GetChannelInstanceData(conn_chan);
+	notices = connid->notices;
+
+	/* a -background worker may be using the connection */
+	if (mode >= 0 && mode != notices->mode && connid->bg_job != NULL)
+	{
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, "connection ", connString,
+						 " is busy with a background operation", (char *)NULL);
+		return TCL_ERROR;
+	}
+
+	listObj = Tcl_NewListObj(0, NULL);
+
+	Tcl_MutexLock(&notices->mutex);
+	if (notices->ring != NULL)
+	{
+		slot = notices->next - notices->count;
+		if (slot < 0)
+			slot += notices->size;
+		for (i = 0; i < notices->count; i++)
+		{
+			Tcl_ListObjAppendElement(NULL, listObj, PgNoticeObj(notices->ring[slot]));
+			slot = (slot + 1) % notices->size;
+		}
+	}
+	if (clear || size != 0)
+		PgNoticeClear(notices, size);
+
+	if (callbackObj != NULL)
+	{
+		if (notices->callback != NULL)
+			ckfree(notices->callback);
+		notices->callback = NULL;
+		if (Tcl_GetCharLength(callbackObj) > 0)
+		{
+			notices->callback = ckalloc(strlen(Tcl_GetString(callbackObj)) + 1);
+			strcpy(notices->callback, Tcl_GetString(callbackObj));
+		}
+	}
+	Tcl_MutexUnlock(&notices->mutex);
+
+	if (mode >= 0 && mode != notices->mode)
+	{
+		switch (mode)
+		{
+			case NOTICE_BUFFER:
+				PQsetNoticeReceiver(connid->conn, PgNoticeReceiver, connid);
+				break;
+
+			case NOTICE_DISCARD:
+				PQsetNoticeReceiver(connid->conn, PgNoticeDiscard, NULL);
+				break;
+
+			case NOTICE_STDERR:
+				PQsetNoticeReceiver(connid->conn, notices->defaultReceiver, NULL);
+				break;
+		}
+		notices->mode = mode;
+	}
+
+	Tcl_SetObjResult(interp, listObj);
+	return TCL_OK;
+}
@@ -0,0 +1,1716 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgtclPool.c
+ *
+ *	Connection pools.  A pool keeps a set of open connection handles
+ *	in one interpreter and lends them out, so that code which would
+ *	otherwise pg_connect/pg_disconnect for every unit of work pays for
+ *	the connection startup only once.
+ *
+ *	Pooled connections are ordinary connection handles, created with
+ *	PQconnectStart and driven to completion from the event loop, so
+ *	that refilling the pool never blocks the interpreter.  The health
+ *	check's round trip is sent with PQsendQuery and its result picked up
+ *	by the same timer.  A blocking acquire polls those connections
+ *	itself, between short sleeps, rather than running the event loop,
+ *	so no other script runs while it waits.
+ *
+ *	A pool created with -shared is process-wide: every thread that
+ *	creates a pool of the same name gets the same set of PGconns.  Idle
+ *	connections are kept as bare PGconns under sharedPoolMutex; acquire
+ *	wraps one in a handle of the calling interpreter and release takes
+ *	it out of the handle again with PgDetachConnection.
+ *
+ * IDENTIFICATION
+ *	  $Id$
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <libpq-fe.h>
+
+#include "pgtclCmds.h"
+#include "pgtclId.h"
+
+#ifndef CONST84
+#     define CONST84
+#endif
+
+#define POOL_ASSOC_KEY "pgtcl_pools"
+
+/* defaults for pg_pool create */
+#define POOL_DEFAULT_MIN 1
+#define POOL_DEFAULT_MAX 10
+#define POOL_DEFAULT_RESET "DISCARD ALL"
+#define POOL_DEFAULT_HEALTHCHECK 30000
+#define POOL_DEFAULT_TIMEOUT 30000
+
+/* how often to poll connections that are still starting up, in ms */
+#define POOL_POLL_INTERVAL 10
+
+/* how long a health check may take before the connection is closed */
+#define POOL_CHECK_TIMEOUT 10000
+
+/* A connection being started up with PQconnectStart */
+typedef struct Pg_PoolPending_s
+{
+	struct Pg_PoolPending_s *next;
+	PGconn	   *conn;
+} Pg_PoolPending;
+
+/* An idle connection handle having its health checked */
+typedef struct Pg_PoolCheck_s
+{
+	struct Pg_PoolCheck_s *next;
+	char	   *handle;
+	Tcl_Time	start;			/* when the check was sent */
+} Pg_PoolCheck;
+
+/* An idle connection handle */
+typedef struct Pg_PoolIdle_s
+{
+	char	   *handle;
+	Tcl_Time	since;			/* when it was last released */
+} Pg_PoolIdle;
+
+/* Someone waiting in pg_pool acquire */
+typedef struct Pg_PoolWaiter_s
+{
+	struct Pg_PoolWaiter_s *next;
+	struct Pg_Pool_s *pool;
+	Tcl_Obj    *callback;		/* -command callback, or NULL if blocking */
+	char	   *handle;			/* the handle handed over, once we have one */
+	int			done;			/* got a handle or timed out */
+	Tcl_TimerToken timer;		/* timeout, or NULL */
+	Tcl_Time	start;			/* for the wait time statistics */
+} Pg_PoolWaiter;
+
+/* A process-wide pool, shared by the threads that attach to it */
+typedef struct Pg_SharedPool_s
+{
+	struct Pg_SharedPool_s *next;
+	char	   *name;
+	char	   *conninfo;
+	int			min;
+	int			max;
+	int			refCount;		/* interpreters attached */
+	PGconn	  **idle;			/* idle connections, most recently used last */
+	int			nidle;
+	int			busy;			/* checked out */
+	int			connecting;		/* being opened, by any thread */
+	Tcl_Condition cond;			/* signalled when idle or connecting changes */
+
+	/* statistics */
+	long		acquires;
+	long		releases;
+	long		waits;
+	long		timeouts;
+	long		created;
+	long		closed;
+	long		failed;
+	int			peakBusy;
+	double		waitMs;
+	double		maxWaitMs;
+} Pg_SharedPool;
+
+/* everything in a Pg_SharedPool is protected by sharedPoolMutex */
+TCL_DECLARE_MUTEX(sharedPoolMutex)
+static Pg_SharedPool *sharedPools = NULL;
+
+typedef struct Pg_Pool_s
+{
+	char	   *name;
+	Tcl_Interp *interp;
+	char	   *conninfo;
+	char	   *resetSql;		/* run on release, NULL for none */
+	int			min;
+	int			max;
+	int			healthcheck;	/* ms between idle checks, 0 for none */
+	int			destroyed;		/* pg_pool destroy happened */
+	int			serial;			/* to name the handles */
+	Pg_SharedPool *shared;		/* process-wide pool, or NULL */
+
+	Pg_PoolIdle *idle;			/* idle handles, most recently used last */
+	int			nidle;
+	int			idleMax;		/* allocated size of idle */
+	Tcl_HashTable busy;			/* handles lent out */
+	Pg_PoolPending *pending;	/* connections still starting up */
+	int			npending;
+	Pg_PoolCheck *checking;		/* idle handles being checked */
+	int			nchecking;
+	Pg_PoolWaiter *waiters;		/* acquire requests in arrival order */
+	int			nwaiters;
+
+	Tcl_TimerToken pollTimer;
+	Tcl_TimerToken healthTimer;
+
+	/* statistics */
+	long		acquires;
+	long		releases;
+	long		waits;			/* acquires that had to wait */
+	long		timeouts;
+	long		exhausted;		/* blocking acquires refused at once, with
+								 * nothing that could come free */
+	long		created;
+	long		closed;
+	long		failed;			/* connection attempts that failed */
+	int			peakBusy;
+	double		waitMs;			/* total time spent waiting */
+	double		maxWaitMs;
+} Pg_Pool;
+
+static void PgPoolPollProc(ClientData cData);
+static void PgPoolHealthProc(ClientData cData);
+static void PgPoolDispatch(Pg_Pool *pool);
+static void PgPoolFree(char *cData);
+
+static double
+PgPoolElapsedMs(Tcl_Time *start)
+{
+	Tcl_Time	now;
+
+	Tcl_GetTime(&now);
+	return (now.sec - start->sec) * 1000.0 + (now.usec - start->usec) / 1000.0;
+}
+
+static Tcl_HashTable *
+PgPoolTable(Tcl_Interp *interp)
+{
+	return (Tcl_HashTable *) Tcl_GetAssocData(interp, POOL_ASSOC_KEY, NULL);
+}
+
+static int
+PgPoolSize(Pg_Pool *pool)
+{
+	Pg_SharedPool *shared = pool->shared;
+	int			size;
+
+	if (shared == NULL)
+		return pool->nidle + pool->busy.numEntries + pool->npending +
+			pool->nchecking;
+
+	Tcl_MutexLock(&sharedPoolMutex);
+	size = shared->nidle + shared->busy + shared->connecting;
+	Tcl_MutexUnlock(&sharedPoolMutex);
+	return size;
+}
+
+/*
+ * Count a connection about to be opened against a shared pool's
+ * maximum.  Returns 0 if the pool is full.
+ */
+static int
+PgSharedReserve(Pg_SharedPool *shared)
+{
+	int			ok = 0;
+
+	Tcl_MutexLock(&sharedPoolMutex);
+	if (shared->nidle + shared->busy + shared->connecting < shared->max)
+	{
+		shared->connecting++;
+		ok = 1;
+	}
+	Tcl_MutexUnlock(&sharedPoolMutex);
+	return ok;
+}
+
+static void
+PgSharedPushIdle(Pg_SharedPool *shared, PGconn *conn)
+{
+	/* idle + busy never exceeds max, so this can't overflow */
+	shared->idle[shared->nidle++] = conn;
+	Tcl_ConditionNotify(&shared->cond);
+}
+
+/*
+ * A reserved connection finished opening, or failed to (conn is NULL).
+ */
+static void
+PgSharedConnected(Pg_SharedPool *shared, PGconn *conn)
+{
+	Tcl_MutexLock(&sharedPoolMutex);
+	shared->connecting--;
+	if (conn != NULL)
+	{
+		shared->created++;
+		PgSharedPushIdle(shared, conn);
+	}
+	else
+	{
+		shared->failed++;
+		Tcl_ConditionNotify(&shared->cond);
+	}
+	Tcl_MutexUnlock(&sharedPoolMutex);
+}
+
+/*
+ * Give a checked out connection back.  If it isn't fit for reuse, it is
+ * closed instead.
+ */
+static void
+PgSharedCheckin(Pg_SharedPool *shared, PGconn *conn, int ok)
+{
+	Tcl_MutexLock(&sharedPoolMutex);
+	shared->busy--;
+	shared->releases++;
+	if (ok && conn != NULL)
+		PgSharedPushIdle(shared, conn);
+	else
+	{
+		shared->closed++;
+		Tcl_ConditionNotify(&shared->cond);
+	}
+	Tcl_MutexUnlock(&sharedPoolMutex);
+
+	if (!ok && conn != NULL)
+		PQfinish(conn);
+}
+
+/*
+ * Find the shared pool called name, or make one, and attach to it.
+ * conninfo may be NULL when attaching to an existing pool.
+ */
+static Pg_SharedPool *
+PgSharedAttach(Tcl_Interp *interp, CONST84 char *name, CONST84 char *conninfo,
+			   int min, int max)
+{
+	Pg_SharedPool *shared;
+
+	Tcl_MutexLock(&sharedPoolMutex);
+	for (shared = sharedPools; shared != NULL; shared = shared->next)
+	{
+		if (strcmp(shared->name, name) == 0)
+		{
+			shared->refCount++;
+			Tcl_MutexUnlock(&sharedPoolMutex);
+			return shared;
+		}
+	}
+
+	if (conninfo == NULL)
+	{
+		Tcl_MutexUnlock(&sharedPoolMutex);
+		Tcl_SetResult(interp, "pg_pool create: -conninfo is required", TCL_STATIC);
+		return NULL;
+	}
+
+	shared = (Pg_SharedPool *) ckalloc(sizeof(Pg_SharedPool));
+	memset(shared, 0, sizeof(Pg_SharedPool));
+	shared->name = ckalloc(strlen(name) + 1);
+	strcpy(shared->name, name);
+	shared->conninfo = ckalloc(strlen(conninfo) + 1);
+	strcpy(shared->conninfo, conninfo);
+	shared->min = min;
+	shared->max = max;
+	shared->refCount = 1;
+	shared->idle = (PGconn **) ckalloc(sizeof(PGconn *) * max);
+	shared->next = sharedPools;
+	sharedPools = shared;
+	Tcl_MutexUnlock(&sharedPoolMutex);
+
+	return shared;
+}
+
+/*
+ * Detach from a shared pool.  The last one out closes the connections.
+ */
+static void
+PgSharedDetach(Pg_SharedPool *shared)
+{
+	Pg_SharedPool **link;
+	int			i;
+
+	Tcl_MutexLock(&sharedPoolMutex);
+	if (--shared->refCount > 0)
+	{
+		Tcl_MutexUnlock(&sharedPoolMutex);
+		return;
+	}
+
+	for (link = &sharedPools; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == shared)
+		{
+			*link = shared->next;
+			break;
+		}
+	}
+	Tcl_MutexUnlock(&sharedPoolMutex);
+
+	for (i = 0; i < shared->nidle; i++)
+		PQfinish(shared->idle[i]);
+
+	Tcl_ConditionFinalize(&shared->cond);
+	ckfree(shared->name);
+	ckfree(shared->conninfo);
+	ckfree((char *)shared->idle);
+	ckfree((char *)shared);
+}
+
+/*
+ * Start one more connection, unless the pool is already at its maximum.
+ */
+static void
+PgPoolStartConnection(Pg_Pool *pool)
+{
+	Pg_PoolPending *pending;
+	PGconn	   *conn;
+
+	if (pool->shared != NULL)
+	{
+		if (!PgSharedReserve(pool->shared))
+			return;
+	}
+	else if (PgPoolSize(pool) >= pool->max)
+		return;
+
+	conn = PQconnectStart(pool->conninfo);
+	if (conn == NULL || PQstatus(conn) == CONNECTION_BAD)
+	{
+		pool->failed++;
+		if (pool->shared != NULL)
+			PgSharedConnected(pool->shared, NULL);
+		if (conn != NULL)
+			PQfinish(conn);
+		return;
+	}
+
+	pending = (Pg_PoolPending *) ckalloc(sizeof(Pg_PoolPending));
+	pending->conn = conn;
+	pending->next = pool->pending;
+	pool->pending = pending;
+	pool->npending++;
+
+	if (pool->pollTimer == NULL)
+		pool->pollTimer = Tcl_CreateTimerHandler(POOL_POLL_INTERVAL,
+							PgPoolPollProc, (ClientData) pool);
+}
+
+/*
+ * Bring the pool up to its minimum size.
+ */
+static void
+PgPoolFill(Pg_Pool *pool)
+{
+	while (PgPoolSize(pool) < pool->min)
+	{
+		int			size = PgPoolSize(pool);
+
+		PgPoolStartConnection(pool);
+		if (PgPoolSize(pool) == size)
+			break;				/* couldn't even start one */
+	}
+}
+
+static void
+PgPoolPushIdle(Pg_Pool *pool, CONST84 char *handle)
+{
+	Pg_PoolIdle *idle;
+
+	if (pool->nidle == pool->idleMax)
+	{
+		pool->idleMax = pool->idleMax ? pool->idleMax * 2 : 8;
+		pool->idle = (Pg_PoolIdle *) ckrealloc((char *)pool->idle,
+									 sizeof(Pg_PoolIdle) * pool->idleMax);
+	}
+
+	idle = &pool->idle[pool->nidle++];
+	idle->handle = ckalloc(strlen(handle) + 1);
+	strcpy(idle->handle, handle);
+	Tcl_GetTime(&idle->since);
+}
+
+/*
+ * Close a pooled connection handle, just like pg_disconnect does.
+ */
+static void
+PgPoolCloseHandle(Pg_Pool *pool, CONST84 char *handle)
+{
+	Pg_ConnectionId *connid;
+	Tcl_Channel conn_chan;
+
+	pool->closed++;
+
+	conn_chan = Tcl_GetChannel(pool->interp, handle, 0);
+	if (conn_chan == NULL || Tcl_GetChannelType(conn_chan) != &Pg_ConnType)
+		return;
+
+	connid = (Pg_ConnectionId *) Tcl_GetChannelInstanceData(conn_chan);
+	if (connid->conn != NULL && connid->cmd_token != NULL)
+		Tcl_DeleteCommandFromToken(pool->interp, connid->cmd_token);
+}
+
+/*
+ * Take the most recently used idle handle that is still a valid
+ * connection.  Returns a ckalloc'ed handle name, or NULL.
+ */
+static char *
+PgPoolPopIdle(Pg_Pool *pool)
+{
+	while (pool->nidle > 0)
+	{
+		Pg_ConnectionId *connid;
+		char	   *handle = pool->idle[--pool->nidle].handle;
+
+		if (PgGetConnectionId(pool->interp, handle, &connid) != NULL &&
+			PQstatus(connid->conn) == CONNECTION_OK)
+			return handle;
+
+		/* somebody closed it behind our back, or it went bad */
+		Tcl_ResetResult(pool->interp);
+		PgPoolCloseHandle(pool, handle);
+		ckfree(handle);
+	}
+	return NULL;
+}
+
+static void
+PgPoolMarkBusy(Pg_Pool *pool, CONST84 char *handle)
+{
+	int			new;
+
+	Tcl_CreateHashEntry(&pool->busy, handle, &new);
+	pool->acquires++;
+	if (pool->busy.numEntries > pool->peakBusy)
+		pool->peakBusy = pool->busy.numEntries;
+}
+
+/*
+ * Turn a PGconn that finished starting up into a connection handle.
+ */
+static void
+PgPoolAdopt(Pg_Pool *pool, PGconn *conn)
+{
+	Tcl_SavedResult saved;
+	char		handle[64];
+
+	sprintf(handle, "%.40s_conn%d", pool->name, ++pool->serial);
+
+	Tcl_SaveResult(pool->interp, &saved);
+	if (PgSetConnectionId(pool->interp, conn, handle))
+	{
+		PgPoolPushIdle(pool, Tcl_GetStringResult(pool->interp));
+		pool->created++;
+	}
+	else
+	{
+		PQfinish(conn);
+		pool->failed++;
+	}
+	Tcl_RestoreResult(pool->interp, &saved);
+}
+
+/*
+ * Pick up the result of a health check, if it is in.  Returns 1 when the
+ * connection is fit to go back to the idle ones, 0 if it is not, and -1
+ * if the check isn't done yet.
+ */
+static int
+PgPoolCheckDone(Pg_Pool *pool, Pg_PoolCheck *check)
+{
+	Pg_ConnectionId *connid;
+	PGresult   *result;
+	int			ok = 1;
+
+	if (PgGetConnectionId(pool->interp, check->handle, &connid) == NULL)
+	{
+		Tcl_ResetResult(pool->interp);
+		return 0;
+	}
+	if (!PQconsumeInput(connid->conn))
+		return 0;
+	if (PQisBusy(connid->conn))
+		return (PgPoolElapsedMs(&check->start) >= POOL_CHECK_TIMEOUT) ? 0 : -1;
+
+	while ((result = PQgetResult(connid->conn)) != NULL)
+	{
+		if (PQresultStatus(result) != PGRES_EMPTY_QUERY)
+			ok = 0;
+		PQclear(result);
+	}
+	PgNotifyTransferEvents(connid);
+	return ok;
+}
+
+/*
+ * Drive PQconnectPoll for the connections starting up, and pick up the
+ * health checks that came back.  The caller dispatches what became idle.
+ */
+static void
+PgPoolPoll(Pg_Pool *pool)
+{
+	Pg_PoolPending **link = &pool->pending;
+	Pg_PoolCheck **checkLink = &pool->checking;
+
+	while (*link != NULL)
+	{
+		Pg_PoolPending *pending = *link;
+
+		switch (PQconnectPoll(pending->conn))
+		{
+			case PGRES_POLLING_OK:
+				*link = pending->next;
+				pool->npending--;
+				if (pool->shared != NULL)
+					PgSharedConnected(pool->shared, pending->conn);
+				else
+					PgPoolAdopt(pool, pending->conn);
+				ckfree((char *)pending);
+				break;
+
+			case PGRES_POLLING_FAILED:
+				*link = pending->next;
+				pool->npending--;
+				pool->failed++;
+				if (pool->shared != NULL)
+					PgSharedConnected(pool->shared, NULL);
+				PQfinish(pending->conn);
+				ckfree((char *)pending);
+				break;
+
+			default:
+				link = &pending->next;
+				break;
+		}
+	}
+
+	while (*checkLink != NULL)
+	{
+		Pg_PoolCheck *check = *checkLink;
+		int			ok = PgPoolCheckDone(pool, check);
+
+		if (ok < 0)
+		{
+			checkLink = &check->next;
+			continue;
+		}
+
+		*checkLink = check->next;
+		pool->nchecking--;
+		if (ok)
+			PgPoolPushIdle(pool, check->handle);
+		else
+			PgPoolCloseHandle(pool, check->handle);
+		ckfree(check->handle);
+		ckfree((char *)check);
+	}
+}
+
+/*
+ * Timer proc polling the connections starting up or being checked.
+ */
+static void
+PgPoolPollProc(ClientData cData)
+{
+	Pg_Pool    *pool = (Pg_Pool *) cData;
+
+	pool->pollTimer = NULL;
+
+	PgPoolPoll(pool);
+
+	if (pool->pending != NULL || pool->checking != NULL)
+		pool->pollTimer = Tcl_CreateTimerHandler(POOL_POLL_INTERVAL,
+							PgPoolPollProc, (ClientData) pool);
+
+	/* hand out what came in, and top up after a failed check */
+	PgPoolDispatch(pool);
+}
+
+/*
+ * Run a -command callback with the handle it was given, or with an
+ * empty string if it timed out.
+ */
+static void
+PgPoolRunCallback(ClientData cData)
+{
+	Pg_PoolWaiter *waiter = (Pg_PoolWaiter *) cData;
+	Tcl_Interp *interp = waiter->pool->interp;
+	Tcl_Obj    *cmd;
+
+	cmd = Tcl_DuplicateObj(waiter->callback);
+	Tcl_IncrRefCount(cmd);
+	Tcl_ListObjAppendElement(NULL, cmd,
+		Tcl_NewStringObj(waiter->handle ? waiter->handle : "", -1));
+
+	Tcl_Preserve((ClientData) interp);
+	if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK)
+	{
+		Tcl_AddErrorInfo(interp, "\n    (\"pg_pool acquire\" callback)");
+		Tcl_BackgroundError(interp);
+	}
+	Tcl_Release((ClientData) interp);
+
+	Tcl_DecrRefCount(cmd);
+	Tcl_DecrRefCount(waiter->callback);
+	Tcl_Release((ClientData) waiter->pool);
+	if (waiter->handle)
+		ckfree(waiter->handle);
+	ckfree((char *)waiter);
+}
+
+static void
+PgPoolUnlinkWaiter(Pg_Pool *pool, Pg_PoolWaiter *waiter)
+{
+	Pg_PoolWaiter **link;
+
+	for (link = &pool->waiters; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == waiter)
+		{
+			*link = waiter->next;
+			pool->nwaiters--;
+			break;
+		}
+	}
+
+	if (waiter->timer != NULL)
+	{
+		Tcl_DeleteTimerHandler(waiter->timer);
+		waiter->timer = NULL;
+	}
+}
+
+/*
+ * A waiter got its handle or ran out of time.  Blocking waiters are
+ * picked up by the loop in PgPoolAcquire; callbacks run from the idle
+ * loop, so that a release never runs somebody else's script.
+ */
+static void
+PgPoolFinishWaiter(Pg_Pool *pool, Pg_PoolWaiter *waiter)
+{
+	double		ms = PgPoolElapsedMs(&waiter->start);
+
+	PgPoolUnlinkWaiter(pool, waiter);
+	waiter->done = 1;
+
+	pool->waitMs += ms;
+	if (ms > pool->maxWaitMs)
+		pool->maxWaitMs = ms;
+
+	if (waiter->callback != NULL)
+		Tcl_DoWhenIdle(PgPoolRunCallback, (ClientData) waiter);
+}
+
+static void
+PgPoolTimeoutProc(ClientData cData)
+{
+	Pg_PoolWaiter *waiter = (Pg_PoolWaiter *) cData;
+
+	waiter->timer = NULL;
+	waiter->pool->timeouts++;
+	PgPoolFinishWaiter(waiter->pool, waiter);
+}
+
+/*
+ * Hand idle connections to waiters, first come first served, and
+ * start new connections if there are still waiters left.
+ */
+static void
+PgPoolDispatch(Pg_Pool *pool)
+{
+	int			starting;
+
+	while (pool->waiters != NULL)
+	{
+		Pg_PoolWaiter *waiter = pool->waiters;
+		char	   *handle = PgPoolPopIdle(pool);
+
+		if (handle == NULL)
+			break;
+
+		PgPoolMarkBusy(pool, handle);
+		waiter->handle = handle;
+		PgPoolFinishWaiter(pool, waiter);
+	}
+
+	/* one new connection for every waiter not already covered */
+	for (starting = pool->npending; starting < pool->nwaiters; starting++)
+	{
+		int			size = PgPoolSize(pool);
+
+		PgPoolStartConnection(pool);
+		if (PgPoolSize(pool) == size)
+			break;
+	}
+
+	PgPoolFill(pool);
+}
+
+/*
+ * Health check of idle connections.  Connections that went bad are
+ * closed and the pool is topped up again.  Ones that have been idle for
+ * a whole check interval are sent an empty query and set aside until
+ * PgPoolPoll sees the answer, so that a server that went away is
+ * noticed before somebody acquires the connection, without waiting for
+ * it here.
+ */
+static void
+PgPoolHealthProc(ClientData cData)
+{
+	Pg_Pool    *pool = (Pg_Pool *) cData;
+	int			i,
+				kept = 0;
+
+	pool->healthTimer = NULL;
+
+	for (i = 0; i < pool->nidle; i++)
+	{
+		Pg_PoolIdle *idle = &pool->idle[i];
+		Pg_ConnectionId *connid;
+		Pg_PoolCheck *check;
+
+		if (PgGetConnectionId(pool->interp, idle->handle, &connid) == NULL ||
+			PQstatus(connid->conn) != CONNECTION_OK)
+		{
+			Tcl_ResetResult(pool->interp);
+			PgPoolCloseHandle(pool, idle->handle);
+			ckfree(idle->handle);
+			continue;
+		}
+
+		if (PgPoolElapsedMs(&idle->since) < pool->healthcheck)
+		{
+			pool->idle[kept++] = *idle;
+			continue;
+		}
+
+		if (!PQsendQuery(connid->conn, ""))
+		{
+			PgPoolCloseHandle(pool, idle->handle);
+			ckfree(idle->handle);
+			continue;
+		}
+
+		check = (Pg_PoolCheck *) ckalloc(sizeof(Pg_PoolCheck));
+		check->handle = idle->handle;
+		Tcl_GetTime(&check->start);
+		check->next = pool->checking;
+		pool->checking = check;
+		pool->nchecking++;
+	}
+	pool->nidle = kept;
+
+	if (pool->checking != NULL && pool->pollTimer == NULL)
+		pool->pollTimer = Tcl_CreateTimerHandler(POOL_POLL_INTERVAL,
+							PgPoolPollProc, (ClientData) pool);
+
+	PgPoolFill(pool);
+
+	if (pool->healthcheck > 0)
+		pool->healthTimer = Tcl_CreateTimerHandler(pool->healthcheck,
+							  PgPoolHealthProc, (ClientData) pool);
+}
+
+/*
+ * Get rid of a pool and all of its connections.  The struct itself is
+ * freed through Tcl_EventuallyFree, since a blocking acquire may still
+ * be looking at it.
+ */
+static void
+PgPoolDestroy(Pg_Pool *pool, int closeHandles)
+{
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch hsearch;
+	int			i;
+
+	pool->destroyed = 1;
+
+	if (pool->pollTimer != NULL)
+		Tcl_DeleteTimerHandler(pool->pollTimer);
+	if (pool->healthTimer != NULL)
+		Tcl_DeleteTimerHandler(pool->healthTimer);
+	pool->pollTimer = pool->healthTimer = NULL;
+
+	while (pool->pending != NULL)
+	{
+		Pg_PoolPending *pending = pool->pending;
+
+		pool->pending = pending->next;
+		PQfinish(pending->conn);
+		ckfree((char *)pending);
+		if (pool->shared != NULL)
+		{
+			Tcl_MutexLock(&sharedPoolMutex);
+			pool->shared->connecting--;
+			Tcl_MutexUnlock(&sharedPoolMutex);
+		}
+	}
+	pool->npending = 0;
+
+	while (pool->checking != NULL)
+	{
+		Pg_PoolCheck *check = pool->checking;
+
+		pool->checking = check->next;
+		if (closeHandles)
+			PgPoolCloseHandle(pool, check->handle);
+		ckfree(check->handle);
+		ckfree((char *)check);
+	}
+	pool->nchecking = 0;
+
+	/* time out everybody still waiting */
+	while (pool->waiters != NULL)
+		PgPoolFinishWaiter(pool, pool->waiters);
+
+	for (i = 0; i < pool->nidle; i++)
+	{
+		if (closeHandles)
+			PgPoolCloseHandle(pool, pool->idle[i].handle);
+		ckfree(pool->idle[i].handle);
+	}
+	pool->nidle = 0;
+
+	for (entry = Tcl_FirstHashEntry(&pool->busy, &hsearch);
+		 entry != NULL;
+		 entry = Tcl_NextHashEntry(&hsearch))
+	{
+		CONST84 char *handle = Tcl_GetHashKey(&pool->busy, entry);
+		Pg_ConnectionId *connid;
+
+		if (!closeHandles)
+		{
+			/* the handles go with the interpreter; just uncount them */
+			if (pool->shared != NULL)
+				PgSharedCheckin(pool->shared, NULL, 0);
+		}
+		else if (pool->shared == NULL)
+			PgPoolCloseHandle(pool, handle);
+		else if (PgGetConnectionId(pool->interp, handle, &connid) != NULL)
+			PgSharedCheckin(pool->shared,
+							PgDetachConnection(pool->interp, connid), 0);
+		else
+		{
+			Tcl_ResetResult(pool->interp);
+			PgSharedCheckin(pool->shared, NULL, 0);
+		}
+	}
+	Tcl_DeleteHashTable(&pool->busy);
+
+	if (pool->shared != NULL)
+		PgSharedDetach(pool->shared);
+
+	Tcl_EventuallyFree((ClientData) pool, PgPoolFree);
+}
+
+/*
+ * Free the parts of a destroyed pool, once nobody looks at it anymore.
+ */
+static void
+PgPoolFree(char *cData)
+{
+	Pg_Pool    *pool = (Pg_Pool *) cData;
+
+	ckfree(pool->name);
+	ckfree(pool->conninfo);
+	if (pool->resetSql)
+		ckfree(pool->resetSql);
+	if (pool->idle)
+		ckfree((char *)pool->idle);
+	ckfree((char *)pool);
+}
+
+static void
+PgPoolInterpDelete(ClientData cData, Tcl_Interp *interp)
+{
+	Tcl_HashTable *pools = (Tcl_HashTable *) cData;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch hsearch;
+
+	/* the handles go away with the interpreter's channels */
+	for (entry = Tcl_FirstHashEntry(pools, &hsearch);
+		 entry != NULL;
+		 entry = Tcl_NextHashEntry(&hsearch))
+		PgPoolDestroy((Pg_Pool *) Tcl_GetHashValue(entry), 0);
+
+	Tcl_DeleteHashTable(pools);
+	ckfree((char *)pools);
+}
+
+static Pg_Pool *
+PgPoolLookup(Tcl_Interp *interp, Tcl_Obj *nameObj)
+{
+	Tcl_HashTable *pools = PgPoolTable(interp);
+	Tcl_HashEntry *entry = NULL;
+	Tcl_Obj    *tresult;
+
+	if (pools != NULL)
+		entry = Tcl_FindHashEntry(pools, Tcl_GetStringFromObj(nameObj, NULL));
+
+	if (entry == NULL)
+	{
+		tresult = Tcl_NewStringObj(Tcl_GetStringFromObj(nameObj, NULL), -1);
+		Tcl_AppendStringsToObj(tresult, " is not a valid connection pool", NULL);
+		Tcl_SetObjResult(interp, tresult);
+		return NULL;
+	}
+
+	return (Pg_Pool *) Tcl_GetHashValue(entry);
+}
+
+static char *
+PgPoolStrdup(Tcl_Obj *obj)
+{
+	int			len;
+	char	   *str = Tcl_GetStringFromObj(obj, &len);
+	char	   *copy = ckalloc(len + 1);
+
+	memcpy(copy, str, len + 1);
+	return copy;
+}
+
+/*
+ * pg_pool create name -conninfo string ?-min n? ?-max n?
+ *     ?-reset sql? ?-healthcheck ms? ?-shared bool?
+ */
+static int
+PgPoolCreate(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	Tcl_HashTable *pools;
+	Tcl_HashEntry *entry;
+	Pg_Pool    *pool;
+	Tcl_Obj    *conninfoObj = NULL;
+	Tcl_Obj    *resetObj = NULL;
+	int			min = POOL_DEFAULT_MIN;
+	int			max = POOL_DEFAULT_MAX;
+	int			healthcheck = POOL_DEFAULT_HEALTHCHECK;
+	int			isShared = 0;
+	Pg_SharedPool *shared = NULL;
+	int			i,
+				optIndex,
+				new;
+
+	static CONST84 char *options[] = {
+		"-conninfo", "-min", "-max", "-reset", "-healthcheck", "-shared",
+		(char *)NULL
+	};
+
+	enum options
+	{
+		OPT_CONNINFO, OPT_MIN, OPT_MAX, OPT_RESET, OPT_HEALTHCHECK,
+		OPT_SHARED
+	};
+
+	if (objc < 3 || (objc % 2) != 1)
+	{
+		Tcl_WrongNumArgs(interp, 2, objv,
+			"name -conninfo conninfoString ?-min n? ?-max n? ?-reset sql? ?-healthcheck ms? ?-shared bool?");
+		return TCL_ERROR;
+	}
+
+	for (i = 3; i < objc; i += 2)
+	{
+		if (Tcl_GetIndexFromObj(interp, objv[i], options, "option",
+								TCL_EXACT, &optIndex) != TCL_OK)
+			return TCL_ERROR;
+
+		switch ((enum options) optIndex)
+		{
+			case OPT_CONNINFO:
+				conninfoObj = objv[i + 1];
+				break;
+			case OPT_MIN:
+				if (Tcl_GetIntFromObj(interp, objv[i + 1], &min) != TCL_OK)
+					return TCL_ERROR;
+				break;
+			case OPT_MAX:
+				if (Tcl_GetIntFromObj(interp, objv[i + 1], &max) != TCL_OK)
+					return TCL_ERROR;
+				break;
+			case OPT_RESET:
+				resetObj = objv[i + 1];
+				break;
+			case OPT_HEALTHCHECK:
+				if (Tcl_GetIntFromObj(interp, objv[i + 1], &healthcheck) != TCL_OK)
+					return TCL_ERROR;
+				break;
+			case OPT_SHARED:
+				if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &isShared) != TCL_OK)
+					return TCL_ERROR;
+				break;
+		}
+	}
+
+	/* attaching to an existing shared pool needs nothing but the name */
+	if (conninfoObj == NULL && !isShared)
+	{
+		Tcl_SetResult(interp, "pg_pool create: -conninfo is required", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if (min < 0 || max < 1 || min > max)
+	{
+		Tcl_SetResult(interp, "pg_pool create: need 0 <= min <= max and max >= 1", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if ((pools = PgPoolTable(interp)) == NULL)
+	{
+		pools = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+		Tcl_InitHashTable(pools, TCL_STRING_KEYS);
+		Tcl_SetAssocData(interp, POOL_ASSOC_KEY, PgPoolInterpDelete,
+						 (ClientData) pools);
+	}
+
+	if (Tcl_FindHashEntry(pools, Tcl_GetStringFromObj(objv[2], NULL)) != NULL)
+	{
+		Tcl_Obj    *tresult = Tcl_NewStringObj("connection pool ", -1);
+
+		Tcl_AppendStringsToObj(tresult, Tcl_GetStringFromObj(objv[2], NULL),
+							   " already exists", NULL);
+		Tcl_SetObjResult(interp, tresult);
+		return TCL_ERROR;
+	}
+
+	if (isShared)
+	{
+		if (!PQisthreadsafe())
+		{
+			Tcl_SetResult(interp, "pg_pool create: libpq is not thread-safe, can't share connections", TCL_STATIC);
+			return TCL_ERROR;
+		}
+
+		shared = PgSharedAttach(interp, Tcl_GetStringFromObj(objv[2], NULL),
+				conninfoObj ? Tcl_GetStringFromObj(conninfoObj, NULL) : NULL,
+								min, max);
+		if (shared == NULL)
+			return TCL_ERROR;
+
+		/* the pool's first creator decides its size */
+		min = shared->min;
+		max = shared->max;
+		healthcheck = 0;
+	}
+
+	entry = Tcl_CreateHashEntry(pools, Tcl_GetStringFromObj(objv[2], NULL), &new);
+
+	pool = (Pg_Pool *) ckalloc(sizeof(Pg_Pool));
+	memset(pool, 0, sizeof(Pg_Pool));
+	pool->name = PgPoolStrdup(objv[2]);
+	pool->interp = interp;
+	if (shared != NULL)
+	{
+		pool->conninfo = ckalloc(strlen(shared->conninfo) + 1);
+		strcpy(pool->conninfo, shared->conninfo);
+	}
+	else
+		pool->conninfo = PgPoolStrdup(conninfoObj);
+	pool->shared = shared;
+	pool->min = min;
+	pool->max = max;
+	pool->healthcheck = healthcheck;
+
+	if (resetObj == NULL)
+	{
+		pool->resetSql = ckalloc(strlen(POOL_DEFAULT_RESET) + 1);
+		strcpy(pool->resetSql, POOL_DEFAULT_RESET);
+	}
+	else if (Tcl_GetCharLength(resetObj) > 0)
+		pool->resetSql = PgPoolStrdup(resetObj);
+
+	Tcl_InitHashTable(&pool->busy, TCL_STRING_KEYS);
+	Tcl_SetHashValue(entry, pool);
+
+	/* pre-warm */
+	PgPoolFill(pool);
+
+	if (pool->healthcheck > 0)
+		pool->healthTimer = Tcl_CreateTimerHandler(pool->healthcheck,
+							  PgPoolHealthProc, (ClientData) pool);
+
+	Tcl_SetObjResult(interp, objv[2]);
+	return TCL_OK;
+}
+
+/*
+ * Acquire from a shared pool.  This blocks the calling thread (and not
+ * just the interpreter) until a connection is free, opening a new one
+ * itself if the pool isn't at its maximum yet.
+ */
+static int
+PgSharedAcquire(Tcl_Interp *interp, Pg_Pool *pool, int timeout)
+{
+	Pg_SharedPool *shared = pool->shared;
+	PGconn	   *conn = NULL;
+	PGconn	   *bad;
+	Tcl_Obj    *tresult;
+	Tcl_Time	start,
+				wait;
+	double		ms;
+	int			waited = 0;
+	char		handle[64];
+
+	Tcl_GetTime(&start);
+	Tcl_MutexLock(&sharedPoolMutex);
+
+	while (conn == NULL)
+	{
+		if (shared->nidle > 0)
+		{
+			conn = shared->idle[--shared->nidle];
+			if (PQstatus(conn) == CONNECTION_OK)
+				break;
+
+			bad = conn;
+			conn = NULL;
+			shared->closed++;
+			Tcl_MutexUnlock(&sharedPoolMutex);
+			PQfinish(bad);
+			Tcl_MutexLock(&sharedPoolMutex);
+			continue;
+		}
+
+		if (shared->nidle + shared->busy + shared->connecting < shared->max)
+		{
+			shared->connecting++;
+			Tcl_MutexUnlock(&sharedPoolMutex);
+			conn = PQconnectdb(shared->conninfo);
+			Tcl_MutexLock(&sharedPoolMutex);
+			shared->connecting--;
+
+			if (PQstatus(conn) == CONNECTION_OK)
+			{
+				shared->created++;
+				break;
+			}
+
+			shared->failed++;
+			Tcl_ConditionNotify(&shared->cond);
+			Tcl_MutexUnlock(&sharedPoolMutex);
+			tresult = Tcl_NewStringObj("Connection to database failed\n", -1);
+			Tcl_AppendStringsToObj(tresult, PQerrorMessage(conn), NULL);
+			Tcl_SetObjResult(interp, tresult);
+			PQfinish(conn);
+			return TCL_ERROR;
+		}
+
+		if (!waited)
+		{
+			shared->waits++;
+			waited = 1;
+		}
+
+		if (timeout > 0)
+		{
+			ms = timeout - PgPoolElapsedMs(&start);
+			if (ms <= 0)
+				break;
+			wait.sec = (long) (ms / 1000);
+			wait.usec = (long) ((ms - wait.sec * 1000.0) * 1000);
+			Tcl_ConditionWait(&shared->cond, &sharedPoolMutex, &wait);
+		}
+		else
+			Tcl_ConditionWait(&shared->cond, &sharedPoolMutex, NULL);
+	}
+
+	if (waited)
+	{
+		ms = PgPoolElapsedMs(&start);
+		shared->waitMs += ms;
+		if (ms > shared->maxWaitMs)
+			shared->maxWaitMs = ms;
+	}
+
+	if (conn == NULL)
+	{
+		shared->timeouts++;
+		Tcl_MutexUnlock(&sharedPoolMutex);
+		tresult = Tcl_NewStringObj("timed out waiting for a connection from pool ", -1);
+		Tcl_AppendStringsToObj(tresult, pool->name, NULL);
+		Tcl_SetObjResult(interp, tresult);
+		return TCL_ERROR;
+	}
+
+	shared->busy++;
+	shared->acquires++;
+	if (shared->busy > shared->peakBusy)
+		shared->peakBusy = shared->busy;
+	Tcl_MutexUnlock(&sharedPoolMutex);
+
+	/* bind the connection to this thread's interpreter */
+	sprintf(handle, "%.40s_conn%d", pool->name, ++pool->serial);
+	if (!PgSetConnectionId(interp, conn, handle))
+	{
+		PgSharedCheckin(shared, conn, 0);
+		return TCL_ERROR;
+	}
+	PgPoolMarkBusy(pool, Tcl_GetStringResult(interp));
+
+	return TCL_OK;
+}
+
+/*
+ * pg_pool acquire name ?-timeout ms? ?-command callback?
+ */
+static int
+PgPoolAcquire(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	Pg_Pool    *pool;
+	Pg_PoolWaiter *waiter;
+	Pg_PoolWaiter **link;
+	Tcl_Obj    *callback = NULL;
+	char	   *handle;
+	int			timeout = POOL_DEFAULT_TIMEOUT;
+	int			i,
+				optIndex;
+	int			full = 0;
+	int			rc;
+
+	static CONST84 char *options[] = {
+		"-timeout", "-command", (char *)NULL
+	};
+
+	enum options
+	{
+		OPT_TIMEOUT, OPT_COMMAND
+	};
+
+	if (objc < 3 || (objc % 2) != 1)
+	{
+		Tcl_WrongNumArgs(interp, 2, objv, "name ?-timeout ms? ?-command callback?");
+		return TCL_ERROR;
+	}
+
+	if ((pool = PgPoolLookup(interp, objv[2])) == NULL)
+		return TCL_ERROR;
+
+	for (i = 3; i < objc; i += 2)
+	{
+		if (Tcl_GetIndexFromObj(interp, objv[i], options, "option",
+								TCL_EXACT, &optIndex) != TCL_OK)
+			return TCL_ERROR;
+
+		if ((enum options) optIndex == OPT_TIMEOUT)
+		{
+			if (Tcl_GetIntFromObj(interp, objv[i + 1], &timeout) != TCL_OK)
+				return TCL_ERROR;
+		}
+		else
+			callback = objv[i + 1];
+	}
+
+	if (pool->shared != NULL)
+	{
+		if (callback != NULL)
+		{
+			Tcl_SetResult(interp, "pg_pool acquire: -command can't be used with a shared pool", TCL_STATIC);
+			return TCL_ERROR;
+		}
+		return PgSharedAcquire(interp, pool, timeout);
+	}
+
+	/* the easy case: there's an idle connection and nobody ahead of us */
+	if (pool->waiters == NULL && (handle = PgPoolPopIdle(pool)) != NULL)
+	{
+		PgPoolMarkBusy(pool, handle);
+		PgPoolFill(pool);
+
+		if (callback == NULL)
+		{
+			Tcl_SetObjResult(interp, Tcl_NewStringObj(handle, -1));
+			ckfree(handle);
+			return TCL_OK;
+		}
+
+		/* callbacks always run from the event loop */
+		waiter = (Pg_PoolWaiter *) ckalloc(sizeof(Pg_PoolWaiter));
+		waiter->pool = pool;
+		waiter->callback = callback;
+		waiter->handle = handle;
+		Tcl_IncrRefCount(callback);
+		Tcl_Preserve((ClientData) pool);
+		Tcl_DoWhenIdle(PgPoolRunCallback, (ClientData) waiter);
+		return TCL_OK;
+	}
+
+	/* get in line */
+	pool->waits++;
+	waiter = (Pg_PoolWaiter *) ckalloc(sizeof(Pg_PoolWaiter));
+	waiter->next = NULL;
+	waiter->pool = pool;
+	waiter->callback = callback;
+	waiter->handle = NULL;
+	waiter->done = 0;
+	waiter->timer = NULL;
+	Tcl_GetTime(&waiter->start);
+
+	for (link = &pool->waiters; *link != NULL; link = &(*link)->next)
+		;
+	*link = waiter;
+	pool->nwaiters++;
+
+	Tcl_Preserve((ClientData) pool);
+
+	if (callback != NULL)
+	{
+		if (timeout > 0)
+			waiter->timer = Tcl_CreateTimerHandler(timeout, PgPoolTimeoutProc,
+												   (ClientData) waiter);
+		Tcl_IncrRefCount(callback);
+		PgPoolDispatch(pool);
+		return TCL_OK;
+	}
+
+	/*
+	 * Blocking acquire.  No other script runs while we wait, so only the
+	 * connections starting up or being checked can come free: poll those
+	 * between short sleeps.  With none of them, a release would have to
+	 * come from this very interpreter, and no wait will bring one.
+	 */
+	PgPoolDispatch(pool);
+	while (!waiter->done)
+	{
+		if (pool->pending == NULL && pool->checking == NULL)
+		{
+			full = 1;
+			pool->exhausted++;
+		}
+		else if (timeout <= 0 || PgPoolElapsedMs(&waiter->start) < timeout)
+		{
+			Tcl_Sleep(POOL_POLL_INTERVAL);
+			PgPoolPoll(pool);
+			PgPoolDispatch(pool);
+			continue;
+		}
+		else
+			pool->timeouts++;
+		PgPoolFinishWaiter(pool, waiter);
+	}
+
+	if (waiter->handle != NULL)
+	{
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(waiter->handle, -1));
+		ckfree(waiter->handle);
+		rc = TCL_OK;
+	}
+	else
+	{
+		Tcl_Obj    *tresult = Tcl_NewStringObj(full ?
+			"no connection is free, nor can one be opened, in pool " :
+			"timed out waiting for a connection from pool ", -1);
+
+		Tcl_AppendStringsToObj(tresult, Tcl_GetStringFromObj(objv[2], NULL), NULL);
+		Tcl_SetObjResult(interp, tresult);
+		rc = TCL_ERROR;
+	}
+
+	Tcl_Release((ClientData) pool);
+	ckfree((char *)waiter);
+	return rc;
+}
+
+/*
+ * pg_pool release name handle
+ *
+ * A connection still busy with a background query, a coroutine's query
+ * or a large object transfer can't be released; that is an error and
+ * the connection stays acquired.
+ *
+ * The connection is cleaned up for the next user: its result handles
+ * are cleared, an open transaction is rolled back, the reset statement
+ * is run and the null value string is forgotten.  A connection that
+ * doesn't survive that is closed instead.
+ */
+static int
+PgPoolRelease(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	Pg_Pool    *pool;
+	Pg_ConnectionId *connid;
+	Tcl_HashEntry *entry;
+	PGresult   *result;
+	char	   *handle;
+	int			i,
+				ok;
+
+	if (objc != 4)
+	{
+		Tcl_WrongNumArgs(interp, 2, objv, "name connection");
+		return TCL_ERROR;
+	}
+
+	if ((pool = PgPoolLookup(interp, objv[2])) == NULL)
+		return TCL_ERROR;
+
+	handle = Tcl_GetStringFromObj(objv[3], NULL);
+	if ((entry = Tcl_FindHashEntry(&pool->busy, handle)) == NULL)
+	{
+		Tcl_Obj    *tresult = Tcl_NewStringObj(handle, -1);
+
+		Tcl_AppendStringsToObj(tresult, " is not a connection acquired from pool ",
+							   pool->name, NULL);
+		Tcl_SetObjResult(interp, tresult);
+		return TCL_ERROR;
+	}
+
+	if (PgGetConnectionId(interp, handle, &connid) == NULL &&
+		Tcl_GetChannel(interp, handle, NULL) != NULL)
+	{
+		/* still busy, it stays lent out and the error says with what */
+		return TCL_ERROR;
+	}
+	Tcl_DeleteHashEntry(entry);
+	pool->releases++;
+
+	if (connid == NULL)
+	{
+		/* closed while it was lent out */
+		Tcl_ResetResult(interp);
+		pool->closed++;
+		if (pool->shared != NULL)
+			PgSharedCheckin(pool->shared, NULL, 0);
+		else
+			PgPoolDispatch(pool);
+		return TCL_OK;
+	}
+
+	for (i = 0; i < connid->res_max; i++)
+	{
+		if (connid->resultids[i] != NULL)
+			Tcl_DeleteCommandFromToken(connid->resultids[i]->interp,
+									   connid->resultids[i]->cmd_token);
+	}
+
+	ok = (PQstatus(connid->conn) == CONNECTION_OK &&
+		  connid->res_copyStatus == RES_COPY_NONE &&
+		  PQisBusy(connid->conn) == 0);
+
+	if (ok && PQtransactionStatus(connid->conn) != PQTRANS_IDLE)
+	{
+		result = PQexec(connid->conn, "ROLLBACK");
+		ok = (PQresultStatus(result) == PGRES_COMMAND_OK);
+		PQclear(result);
+	}
+
+	if (ok && pool->resetSql != NULL)
+	{
+		result = PQexec(connid->conn, pool->resetSql);
+		ok = (PQresultStatus(result) == PGRES_COMMAND_OK ||
+			  PQresultStatus(result) == PGRES_TUPLES_OK);
+		PQclear(result);
+	}
+	PgNotifyTransferEvents(connid);
+
+	if (connid->nullValueString != NULL)
+	{
+		ckfree(connid->nullValueString);
+		connid->nullValueString = NULL;
+	}
+
+	if (pool->shared != NULL)
+	{
+		/* back to the shared pool, for any thread to pick up */
+		PgSharedCheckin(pool->shared, PgDetachConnection(interp, connid), ok);
+		return TCL_OK;
+	}
+
+	if (ok)
+		PgPoolPushIdle(pool, handle);
+	else
+		PgPoolCloseHandle(pool, handle);
+
+	PgPoolDispatch(pool);
+	return TCL_OK;
+}
+
+#define POOL_STAT(name, obj) \
+	Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj(name, -1)); \
+	Tcl_ListObjAppendElement(NULL, listObj, obj)
+
+/*
+ * Statistics of a shared pool cover all threads.
+ */
+static int
+PgSharedStats(Tcl_Interp *interp, Pg_SharedPool *shared)
+{
+	Tcl_Obj    *listObj = Tcl_NewListObj(0, NULL);
+
+	Tcl_MutexLock(&sharedPoolMutex);
+	POOL_STAT("min", Tcl_NewIntObj(shared->min));
+	POOL_STAT("max", Tcl_NewIntObj(shared->max));
+	POOL_STAT("size", Tcl_NewIntObj(shared->nidle + shared->busy + shared->connecting));
+	POOL_STAT("idle", Tcl_NewIntObj(shared->nidle));
+	POOL_STAT("busy", Tcl_NewIntObj(shared->busy));
+	POOL_STAT("pending", Tcl_NewIntObj(shared->connecting));
+	POOL_STAT("shared", Tcl_NewIntObj(shared->refCount));
+	POOL_STAT("peak_busy", Tcl_NewIntObj(shared->peakBusy));
+	POOL_STAT("utilization", Tcl_NewDoubleObj((double)shared->busy / shared->max));
+	POOL_STAT("acquires", Tcl_NewLongObj(shared->acquires));
+	POOL_STAT("releases", Tcl_NewLongObj(shared->releases));
+	POOL_STAT("waits", Tcl_NewLongObj(shared->waits));
+	POOL_STAT("timeouts", Tcl_NewLongObj(shared->timeouts));
+	POOL_STAT("created", Tcl_NewLongObj(shared->created));
+	POOL_STAT("closed", Tcl_NewLongObj(shared->closed));
+	POOL_STAT("failed", Tcl_NewLongObj(shared->failed));
+	POOL_STAT("wait_ms_total", Tcl_NewDoubleObj(shared->waitMs));
+	POOL_STAT("wait_ms_max", Tcl_NewDoubleObj(shared->maxWaitMs));
+	Tcl_MutexUnlock(&sharedPoolMutex);
+
+	Tcl_SetObjResult(interp, listObj);
+	return TCL_OK;
+}
+
+/*
+ * pg_pool stats name
+ */
+static int
+PgPoolStats(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	Pg_Pool    *pool;
+	Tcl_Obj    *listObj;
+	int			busy;
+
+	if (objc != 3)
+	{
+		Tcl_WrongNumArgs(interp, 2, objv, "name");
+		return TCL_ERROR;
+	}
+
+	if ((pool = PgPoolLookup(interp, objv[2])) == NULL)
+		return TCL_ERROR;
+
+	if (pool->shared != NULL)
+		return PgSharedStats(interp, pool->shared);
+
+	busy = pool->busy.numEntries;
+	listObj = Tcl_NewListObj(0, NULL);
+
+	POOL_STAT("min", Tcl_NewIntObj(pool->min));
+	POOL_STAT("max", Tcl_NewIntObj(pool->max));
+	POOL_STAT("size", Tcl_NewIntObj(PgPoolSize(pool)));
+	POOL_STAT("idle", Tcl_NewIntObj(pool->nidle));
+	POOL_STAT("busy", Tcl_NewIntObj(busy));
+	POOL_STAT("pending", Tcl_NewIntObj(pool->npending));
+	POOL_STAT("waiting", Tcl_NewIntObj(pool->nwaiters));
+	POOL_STAT("peak_busy", Tcl_NewIntObj(pool->peakBusy));
+	POOL_STAT("utilization", Tcl_NewDoubleObj((double)busy / pool->max));
+	POOL_STAT("acquires", Tcl_NewLongObj(pool->acquires));
+	POOL_STAT("releases", Tcl_NewLongObj(pool->releases));
+	POOL_STAT("waits", Tcl_NewLongObj(pool->waits));
+	POOL_STAT("timeouts", Tcl_NewLongObj(pool->timeouts));
+	POOL_STAT("exhausted", Tcl_NewLongObj(pool->exhausted));
+	POOL_STAT("created", Tcl_NewLongObj(pool->created));
+	POOL_STAT("closed", Tcl_NewLongObj(pool->closed));
+	POOL_STAT("failed", Tcl_NewLongObj(pool->failed));
+	POOL_STAT("wait_ms_total", Tcl_NewDoubleObj(pool->waitMs));
+	POOL_STAT("wait_ms_max", Tcl_NewDoubleObj(pool->maxWaitMs));
+
+	Tcl_SetObjResult(interp, listObj);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Pg_pool --
+ *
+ *    manages pools of connection handles
+ *
+ * Syntax:
+ *    pg_pool create name -conninfo conninfoString ?-min n? ?-max n?
+ *        ?-reset sql? ?-healthcheck ms? ?-shared bool?
+ *    pg_pool acquire name ?-timeout ms? ?-command callback?
+ *    pg_pool release name connection
+ *    pg_pool stats name
+ *    pg_pool destroy name
+ *    pg_pool names
+ *
+ *    With -shared, the pool is shared by every thread that creates a pool
+ *    of that name; later creators only need to give the name.  Handles
+ *    acquired from a shared pool belong to the acquiring interpreter,
+ *    and acquire blocks the thread rather than running the event loop.
+ *
+ * Results:
+ *    create returns the pool name.  acquire returns a connection handle,
+ *    or, with -command, arranges for the callback to be called with the
+ *    handle appended (or an empty string, if -timeout expired first).
+ *    A blocking acquire doesn't run the event loop: it waits only for
+ *    connections being opened or checked, and raises an error on timeout,
+ *    or at once if every connection is lent out and the pool is at its
+ *    maximum, since only this interpreter could give one back, which
+ *    stats counts as exhausted rather than as a timeout.  Use -command
+ *    to wait for a release.  A -timeout of 0 waits forever.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Pg_pool(ClientData cData, Tcl_Interp *interp, int objc,
+		Tcl_Obj *CONST objv[])
+{
+	int			optIndex;
+
+	static CONST84 char *options[] = {
+		"create", "acquire", "release", "stats", "destroy", "names",
+		(char *)NULL
+	};
+
+	enum options
+	{
+		OPT_CREATE, OPT_ACQUIRE, OPT_RELEASE, OPT_STATS, OPT_DESTROY,
+		OPT_NAMES
+	};
+
+	if (objc < 2)
+	{
+		Tcl_WrongNumArgs(interp, 1, objv, "create|acquire|release|stats|destroy|names ?arg ...?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj(interp, objv[1], options, "subcommand",
+							TCL_EXACT, &optIndex) != TCL_OK)
+		return TCL_ERROR;
+
+	switch ((enum options) optIndex)
+	{
+		case OPT_CREATE:
+			return PgPoolCreate(interp, objc, objv);
+
+		case OPT_ACQUIRE:
+			return PgPoolAcquire(interp, objc, objv);
+
+		case OPT_RELEASE:
+			return PgPoolRelease(interp, objc, objv);
+
+		case OPT_STATS:
+			return PgPoolStats(interp, objc, objv);
+
+		case OPT_DESTROY:
+		{
+			Pg_Pool    *pool;
+
+			if (objc != 3)
+			{
+				Tcl_WrongNumArgs(interp, 2, objv, "name");
+				return TCL_ERROR;
+			}
+			if ((pool = PgPoolLookup(interp, objv[2])) == NULL)
+				return TCL_ERROR;
+
+			Tcl_DeleteHashEntry(Tcl_FindHashEntry(PgPoolTable(interp), pool->name));
+			PgPoolDestroy(pool, 1);
+			return TCL_OK;
+		}
+
+		case OPT_NAMES:
+		{
+			Tcl_HashTable *pools = PgPoolTable(interp);
+			Tcl_HashEntry *entry;
+			Tcl_HashSearch hsearch;
+			Tcl_Obj    *listObj = Tcl_NewListObj(0, NULL);
+
+			if (pools != NULL)
+			{
+				for (entry = Tcl_FirstHashEntry(pools, &hsearch);
+					 entry != NULL;
+					 entry = Tcl_NextHashEntry(&hsearch))
+					Tcl_ListObjAppendElement(NULL, listObj,
+						Tcl_NewStringObj(Tcl_GetHashKey(pools, entry), -1));
+			}
+			Tcl_SetObjResult(interp, listObj);
+			return TCL_OK;
+		}
+	}
+
+	return TCL_ERROR;
+}
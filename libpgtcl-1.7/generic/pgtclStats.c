@@ -0,0 +1,1022 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgtclStats.c
+ *
+ *	Per-connection counters, and pg_stats to read them.  The counters
+ *	live in the Pg_ConnectionId and are always on: the commands that
+ *	run queries call PgStatsQuery when they send one and PgStatsResult
+ *	when its result is in, which costs a clock read and some additions.
+ *
+ *	Bytes sent are the query text and parameters handed to libpq, and
+ *	bytes received the values in the results, not what went over the
+ *	socket, which libpq doesn't tell.  Time waiting is wall-clock time
+ *	in PQexec and PQgetResult, or for a query of a coroutine or of
+ *	-background, from sending it until its result was in.
+ *
+ *	The times are also kept for each shape of query: the text with its
+ *	literals replaced by ? and its comments and extra spaces dropped,
+ *	or EXECUTE and the name for a prepared statement.  Each shape has a
+ *	log-linear histogram of its times, as HdrHistogram keeps, so that
+ *	pg_stats -statements can report percentiles within about 6%.
+ *
+ * IDENTIFICATION
+ *	  $Id$
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libpq-fe.h>
+
+#include "pgtclCmds.h"
+#include "pgtclId.h"
+
+#ifndef CONST84
+#     define CONST84
+#endif
+
+static CONST84 char *familyNames[PG_STATS_FAMILIES] = {
+	"exec", "prepared", "execute", "select", "async", "background"
+};
+
+/* The counters after the queries, in the order pg_stats reports them */
+enum
+{
+	STAT_ROWS, STAT_SENT, STAT_RECEIVED, STAT_WAIT, STAT_WAIT_MAX,
+	STAT_RESULTS, STAT_RESULTS_PEAK, STAT_NOTIFIES, STAT_DROPPED,
+	STAT_COPY_IN, STAT_COPY_OUT, STAT_UNTRACKED, STAT_COUNT
+};
+
+static const struct
+{
+	const char *name;			/* in the list */
+	const char *metric;			/* for Prometheus */
+	const char *type;
+	const char *help;
+	int			max;			/* -all takes the largest, not the sum */
+	int			usec;			/* Prometheus wants seconds */
+}			statFields[STAT_COUNT] = {
+	{"rows", "pgtcl_rows_total", "counter",
+	"Rows in query results.", 0, 0},
+	{"bytes_sent", "pgtcl_sent_bytes_total", "counter",
+	"Bytes of query text and parameters sent.", 0, 0},
+	{"bytes_received", "pgtcl_received_bytes_total", "counter",
+	"Bytes of values received in query results.", 0, 0},
+	{"wait_usec", "pgtcl_wait_seconds_total", "counter",
+	"Time spent waiting for query results.", 0, 1},
+	{"wait_max_usec", "pgtcl_wait_seconds_max", "gauge",
+	"Longest wait for a query result.", 1, 1},
+	{"results", "pgtcl_results", "gauge",
+	"Result handles open.", 0, 0},
+	{"results_peak", "pgtcl_results_peak", "gauge",
+	"Most result handles open at once.", 1, 0},
+	{"notifies", "pgtcl_notifies_total", "counter",
+	"Notifications received.", 0, 0},
+	{"notifies_dropped", "pgtcl_notifies_dropped_total", "counter",
+	"Notifications received with no pg_listen for them.", 0, 0},
+	{"copy_bytes_in", "pgtcl_copy_in_bytes_total", "counter",
+	"Bytes read from COPY TO STDOUT.", 0, 0},
+	{"copy_bytes_out", "pgtcl_copy_out_bytes_total", "counter",
+	"Bytes written to COPY FROM STDIN.", 0, 0},
+	{"statements_untracked", "pgtcl_statements_untracked_total", "counter",
+	"Queries of shapes beyond those pg_stats -statements keeps.", 0, 0}
+};
+
+/*
+ * The histogram buckets: times under 16 microseconds have one each, and
+ * every power of two above that is split in 16, up to 2^36 microseconds.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BIT	36
+#define HIST_BUCKETS	((HIST_MAX_BIT - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct Pg_StatementStats_s
+{
+	Tcl_HashEntry *entry;		/* in Pg_Stats.statements, keyed by text */
+	int			family;			/* that sent it first */
+	Tcl_WideInt calls;			/* results */
+	Tcl_WideInt rows;			/* returned or affected */
+	Tcl_WideInt totalTime;		/* microseconds */
+	Tcl_WideInt maxTime;
+	unsigned int hist[HIST_BUCKETS];
+} Pg_StatementStats;
+
+/* the percentiles pg_stats -statements reports */
+static const struct
+{
+	const char *name;
+	const char *quantile;
+	double		fraction;
+}			percentiles[] = {
+	{"p50_usec", "0.5", 0.50},
+	{"p95_usec", "0.95", 0.95},
+	{"p99_usec", "0.99", 0.99}
+};
+
+#define PERCENTILE_COUNT ((int) (sizeof(percentiles) / sizeof(percentiles[0])))
+
+/*
+ * Microseconds since the epoch.
+ */
+Tcl_WideInt
+PgStatsClock(void)
+{
+	Tcl_Time	now;
+
+	Tcl_GetTime(&now);
+	return (Tcl_WideInt) now.sec * 1000000 + now.usec;
+}
+
+const char *
+PgStatsFamilyName(int family)
+{
+	return familyNames[family];
+}
+
+static int
+PgHistBucket(Tcl_WideInt usec)
+{
+	int			bit = HIST_SUB_BITS;
+
+	if (usec < HIST_SUB_COUNT)
+		return usec < 0 ? 0 : (int) usec;
+	if (usec >> HIST_MAX_BIT)
+		return HIST_BUCKETS - 1;
+	while (usec >> (bit + 1))
+		bit++;
+	return (bit - HIST_SUB_BITS + 1) * HIST_SUB_COUNT +
+		(int) ((usec >> (bit - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/*
+ * The largest time that falls in a bucket.
+ */
+static Tcl_WideInt
+PgHistValue(int bucket)
+{
+	int			shift;
+
+	if (bucket < HIST_SUB_COUNT)
+		return bucket;
+	shift = bucket / HIST_SUB_COUNT - 1;
+	return ((Tcl_WideInt) (HIST_SUB_COUNT + bucket % HIST_SUB_COUNT) << shift) +
+		((Tcl_WideInt) 1 << shift) - 1;
+}
+
+static int
+PgIsIdentChar(int c)
+{
+	return isalnum((unsigned char) c) || c == '_' || c == '$' ||
+		(unsigned char) c >= 0x80;
+}
+
+/*
+ * Append the shape of a query to ds: literals become ?, comments go, and
+ * runs of white space become one space.  Strings, numbers and dollar
+ * quotes are literals; identifiers and $n parameters are left alone.
+ */
+static void
+PgStatsNormalize(const char *q, Tcl_DString *ds)
+{
+	int			prevIdent = 0;
+	int			space = 0;
+	int			depth;
+	const char *tag;
+	int			tagLen;
+	char	   *out;
+	int			len;
+
+	while (*q != '\0')
+	{
+		/* white space and comments */
+		if (isspace((unsigned char) *q))
+		{
+			q++;
+			space = 1;
+			continue;
+		}
+		if (q[0] == '-' && q[1] == '-')
+		{
+			while (*q != '\0' && *q != '\n')
+				q++;
+			space = 1;
+			continue;
+		}
+		if (q[0] == '/' && q[1] == '*')
+		{
+			for (depth = 0; *q != '\0'; q++)
+			{
+				if (q[0] == '/' && q[1] == '*')
+					depth++, q++;
+				else if (q[0] == '*' && q[1] == '/' && --depth == 0)
+				{
+					q += 2;
+					break;
+				}
+			}
+			space = 1;
+			continue;
+		}
+		if (space)
+		{
+			if (Tcl_DStringLength(ds) > 0)
+				Tcl_DStringAppend(ds, " ", 1);
+			space = 0;
+			prevIdent = 0;
+		}
+
+		if (*q == '\'')
+		{
+			int			escapes = 0;
+
+			/* E'', B'', X'' and U&'': the prefix is part of the literal */
+			out = Tcl_DStringValue(ds);
+			len = Tcl_DStringLength(ds);
+			if (len >= 1 && prevIdent && strchr("EeBbXx", out[len - 1]) &&
+				(len == 1 || !PgIsIdentChar(out[len - 2])))
+			{
+				escapes = (out[len - 1] == 'E' || out[len - 1] == 'e');
+				Tcl_DStringSetLength(ds, len - 1);
+			}
+			else if (len >= 2 && out[len - 1] == '&' &&
+					 (out[len - 2] == 'U' || out[len - 2] == 'u') &&
+					 (len == 2 || !PgIsIdentChar(out[len - 3])))
+				Tcl_DStringSetLength(ds, len - 2);
+
+			for (q++; *q != '\0'; q++)
+			{
+				if (escapes && *q == '\\' && q[1] != '\0')
+					q++;
+				else if (*q == '\'')
+				{
+					if (q[1] != '\'')
+						break;
+					q++;
+				}
+			}
+			if (*q != '\0')
+				q++;
+			Tcl_DStringAppend(ds, "?", 1);
+			prevIdent = 0;
+			continue;
+		}
+
+		if (*q == '"')
+		{
+			const char *start = q;
+
+			for (q++; *q != '\0'; q++)
+			{
+				if (*q == '"')
+				{
+					if (q[1] != '"')
+						break;
+					q++;
+				}
+			}
+			if (*q != '\0')
+				q++;
+			Tcl_DStringAppend(ds, start, (int) (q - start));
+			prevIdent = 1;
+			continue;
+		}
+
+		if (*q == '$' && !prevIdent && !isdigit((unsigned char) q[1]))
+		{
+			/* $tag$...$tag$ */
+			tag = q + 1;
+			for (tagLen = 0; PgIsIdentChar(tag[tagLen]) && tag[tagLen] != '$';
+				 tagLen++)
+				;
+			if (tag[tagLen] == '$' &&
+				(tagLen == 0 || !isdigit((unsigned char) tag[0])))
+			{
+				for (q = tag + tagLen + 1; *q != '\0'; q++)
+				{
+					if (*q == '$' && strncmp(q + 1, tag, tagLen) == 0 &&
+						q[tagLen + 1] == '$')
+					{
+						q += tagLen + 2;
+						break;
+					}
+				}
+				Tcl_DStringAppend(ds, "?", 1);
+				prevIdent = 0;
+				continue;
+			}
+		}
+
+		if (!prevIdent && (isdigit((unsigned char) *q) ||
+						   (*q == '.' && isdigit((unsigned char) q[1]))))
+		{
+			while (isalnum((unsigned char) *q) || *q == '.' || *q == '_' ||
+				   ((*q == '+' || *q == '-') && (q[-1] == 'e' || q[-1] == 'E')))
+				q++;
+			Tcl_DStringAppend(ds, "?", 1);
+			prevIdent = 0;
+			continue;
+		}
+
+		prevIdent = PgIsIdentChar(*q);
+		Tcl_DStringAppend(ds, q, 1);
+		q++;
+	}
+}
+
+/*
+ * Find the statistics of the shape of a query, adding them if there is
+ * room.
+ */
+static Pg_StatementStats *
+PgStatsStatement(Pg_Stats *stats, int family, const char *query)
+{
+	Pg_StatementStats *stmt;
+	Tcl_HashEntry *entry;
+	Tcl_DString ds;
+	int			isNew;
+
+	Tcl_DStringInit(&ds);
+	if (family == PG_STATS_PREPARED)
+	{
+		Tcl_DStringAppend(&ds, "EXECUTE ", -1);
+		Tcl_DStringAppend(&ds, query, -1);
+	}
+	else
+		PgStatsNormalize(query, &ds);
+
+	if (stats->statements == NULL)
+	{
+		stats->statements = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+		Tcl_InitHashTable(stats->statements, TCL_STRING_KEYS);
+	}
+
+	entry = Tcl_FindHashEntry(stats->statements, Tcl_DStringValue(&ds));
+	if (entry != NULL)
+		stmt = (Pg_StatementStats *) Tcl_GetHashValue(entry);
+	else if (stats->statements->numEntries >= PG_STATS_MAX_STATEMENTS)
+	{
+		stats->untracked++;
+		stmt = NULL;
+	}
+	else
+	{
+		entry = Tcl_CreateHashEntry(stats->statements, Tcl_DStringValue(&ds),
+									&isNew);
+		stmt = (Pg_StatementStats *) ckalloc(sizeof(Pg_StatementStats));
+		memset(stmt, 0, sizeof(Pg_StatementStats));
+		stmt->entry = entry;
+		stmt->family = family;
+		Tcl_SetHashValue(entry, (ClientData) stmt);
+	}
+	Tcl_DStringFree(&ds);
+	return stmt;
+}
+
+/*
+ * Forget the statistics of the query shapes.
+ */
+void
+PgStatsFree(Pg_ConnectionId *connid)
+{
+	Pg_Stats   *stats = &connid->stats;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch hsearch;
+
+	stats->statement = NULL;
+	if (stats->statements == NULL)
+		return;
+
+	for (entry = Tcl_FirstHashEntry(stats->statements, &hsearch);
+		 entry != NULL;
+		 entry = Tcl_NextHashEntry(&hsearch))
+		ckfree((char *)Tcl_GetHashValue(entry));
+	Tcl_DeleteHashTable(stats->statements);
+	ckfree((char *)stats->statements);
+	stats->statements = NULL;
+}
+
+/*
+ * Count a query as it is sent.  paramValues may hold NULLs.
+ */
+void
+PgStatsQuery(Pg_ConnectionId *connid, int family, const char *query,
+			 int nParams, const char *const *paramValues)
+{
+	Pg_Stats   *stats = &connid->stats;
+	int			i;
+
+	if (connid->trace != NULL)
+		PgTraceQuery(connid, family, query, nParams);
+
+	stats->queries[family]++;
+	stats->statement = PgStatsStatement(stats, family, query);
+	stats->bytesSent += strlen(query);
+	for (i = 0; i < nParams; i++)
+		if (paramValues[i] != NULL)
+			stats->bytesSent += strlen(paramValues[i]);
+}
+
+/*
+ * Count a result, which may be NULL, that took usec to arrive.
+ */
+void
+PgStatsResult(Pg_ConnectionId *connid, PGresult *result, Tcl_WideInt usec)
+{
+	Pg_Stats   *stats = &connid->stats;
+	Pg_StatementStats *stmt = stats->statement;
+	int			ntuples,
+				nfields,
+				tupno,
+				field;
+	Tcl_WideInt bytes = 0;
+	char	   *tuples;
+
+	if (connid->trace != NULL)
+		PgTraceResult(connid, result, usec);
+
+	/* a COMMIT or ROLLBACK by hand ends pg_lo_channel's transaction too */
+	PgLoTransactionCheck(connid);
+
+	stats->waitTime += usec;
+	if (usec > stats->waitMax)
+		stats->waitMax = usec;
+
+	/* each result is a call, the NULL after them isn't */
+	if (stmt != NULL && result != NULL)
+	{
+		stmt->calls++;
+		stmt->totalTime += usec;
+		if (usec > stmt->maxTime)
+			stmt->maxTime = usec;
+		stmt->hist[PgHistBucket(usec)]++;
+		if (PQresultStatus(result) != PGRES_TUPLES_OK &&
+			(tuples = PQcmdTuples(result)) != NULL && *tuples != '\0')
+			stmt->rows += strtol(tuples, NULL, 10);
+		else
+			stmt->rows += PQntuples(result);
+	}
+
+	if (result == NULL || PQresultStatus(result) != PGRES_TUPLES_OK)
+		return;
+
+	ntuples = PQntuples(result);
+	stats->rows += ntuples;
+
+	/* a look at every value, so only if asked for */
+	if (!connid->stats_bytes)
+		return;
+	nfields = PQnfields(result);
+	for (tupno = 0; tupno < ntuples; tupno++)
+		for (field = 0; field < nfields; field++)
+			bytes += PQgetlength(result, tupno, field);
+	stats->bytesReceived += bytes;
+}
+
+/*
+ * Add a connection's counters to queries and values, which -all sums
+ * over the connections.
+ */
+static void
+PgStatsAdd(Pg_ConnectionId *connid, Tcl_WideInt queries[],
+		   Tcl_WideInt values[])
+{
+	Pg_Stats   *stats = &connid->stats;
+	Tcl_WideInt v[STAT_COUNT];
+	int			i;
+
+	for (i = 0; i < PG_STATS_FAMILIES; i++)
+		queries[i] += stats->queries[i];
+
+	v[STAT_ROWS] = stats->rows;
+	v[STAT_SENT] = stats->bytesSent;
+	v[STAT_RECEIVED] = stats->bytesReceived;
+	v[STAT_WAIT] = stats->waitTime;
+	v[STAT_WAIT_MAX] = stats->waitMax;
+	v[STAT_RESULTS] = connid->res_count;
+	v[STAT_RESULTS_PEAK] = stats->resultsPeak;
+	v[STAT_NOTIFIES] = stats->notifies;
+	v[STAT_DROPPED] = stats->notifiesDropped;
+	v[STAT_COPY_IN] = stats->copyBytesIn;
+	v[STAT_COPY_OUT] = stats->copyBytesOut;
+	v[STAT_UNTRACKED] = stats->untracked;
+
+	for (i = 0; i < STAT_COUNT; i++)
+	{
+		if (!statFields[i].max)
+			values[i] += v[i];
+		else if (v[i] > values[i])
+			values[i] = v[i];
+	}
+}
+
+static void
+PgStatsReset(Pg_ConnectionId *connid)
+{
+	PgStatsFree(connid);
+	memset(&connid->stats, 0, sizeof(Pg_Stats));
+	connid->stats.resultsPeak = connid->res_count;
+}
+
+static Tcl_Obj *
+PgStatsList(Tcl_WideInt queries[], Tcl_WideInt values[], int connections)
+{
+	Tcl_Obj    *listObj = Tcl_NewListObj(0, NULL);
+	Tcl_Obj    *queriesObj = Tcl_NewListObj(0, NULL);
+	int			i;
+
+	for (i = 0; i < PG_STATS_FAMILIES; i++)
+	{
+		Tcl_ListObjAppendElement(NULL, queriesObj,
+								 Tcl_NewStringObj(familyNames[i], -1));
+		Tcl_ListObjAppendElement(NULL, queriesObj, Tcl_NewWideIntObj(queries[i]));
+	}
+
+	if (connections >= 0)
+	{
+		Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj("connections", -1));
+		Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewIntObj(connections));
+	}
+	Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj("queries", -1));
+	Tcl_ListObjAppendElement(NULL, listObj, queriesObj);
+	for (i = 0; i < STAT_COUNT; i++)
+	{
+		Tcl_ListObjAppendElement(NULL, listObj,
+								 Tcl_NewStringObj(statFields[i].name, -1));
+		Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewWideIntObj(values[i]));
+	}
+	return listObj;
+}
+
+static void
+PgStatsMetric(Tcl_Obj *textObj, const char *metric, const char *labels,
+			  const char *extra, Tcl_WideInt value, int usec)
+{
+	char		buf[64];
+
+	Tcl_AppendToObj(textObj, metric, -1);
+	if (labels[0] != '\0' || extra != NULL)
+	{
+		Tcl_AppendToObj(textObj, "{", 1);
+		Tcl_AppendToObj(textObj, labels, -1);
+		if (labels[0] != '\0' && extra != NULL)
+			Tcl_AppendToObj(textObj, ",", 1);
+		if (extra != NULL)
+			Tcl_AppendToObj(textObj, extra, -1);
+		Tcl_AppendToObj(textObj, "}", 1);
+	}
+	if (usec)
+		sprintf(buf, " %.6f\n", (double) value / 1000000.0);
+	else
+		sprintf(buf, " %" TCL_LL_MODIFIER "d\n", value);
+	Tcl_AppendToObj(textObj, buf, -1);
+}
+
+static void
+PgStatsHeader(Tcl_Obj *textObj, const char *metric, const char *type,
+			  const char *help)
+{
+	Tcl_AppendStringsToObj(textObj, "# HELP ", metric, " ", help, "\n",
+						   "# TYPE ", metric, " ", type, "\n", NULL);
+}
+
+/*
+ * The Prometheus text format, with a conn label unless it is the
+ * aggregate.
+ */
+static Tcl_Obj *
+PgStatsPrometheus(Tcl_WideInt queries[], Tcl_WideInt values[],
+				  int connections, const char *connName)
+{
+	Tcl_Obj    *textObj = Tcl_NewObj();
+	char		labels[64];
+	char		family[48];
+	int			i;
+
+	labels[0] = '\0';
+	if (connName != NULL)
+		sprintf(labels, "conn=\"%.40s\"", connName);
+
+	if (connections >= 0)
+	{
+		PgStatsHeader(textObj, "pgtcl_connections", "gauge",
+					  "Connections open.");
+		PgStatsMetric(textObj, "pgtcl_connections", labels, NULL,
+					  connections, 0);
+	}
+
+	PgStatsHeader(textObj, "pgtcl_queries_total", "counter",
+				  "Queries executed, by command family.");
+	for (i = 0; i < PG_STATS_FAMILIES; i++)
+	{
+		sprintf(family, "family=\"%s\"", familyNames[i]);
+		PgStatsMetric(textObj, "pgtcl_queries_total", labels, family,
+					  queries[i], 0);
+	}
+
+	for (i = 0; i < STAT_COUNT; i++)
+	{
+		PgStatsHeader(textObj, statFields[i].metric, statFields[i].type,
+					  statFields[i].help);
+		PgStatsMetric(textObj, statFields[i].metric, labels, NULL,
+					  values[i], statFields[i].usec);
+	}
+	return textObj;
+}
+
+/* busiest first */
+static int
+PgStatsCompare(const void *a, const void *b)
+{
+	Tcl_WideInt ta = (*(Pg_StatementStats * const *) a)->totalTime;
+	Tcl_WideInt tb = (*(Pg_StatementStats * const *) b)->totalTime;
+
+	return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+/*
+ * Gather the query shapes of the connections, adding up those they
+ * share, into merged, and return them busiest first: a ckalloc'd array
+ * of the count put in countPtr.
+ */
+static Pg_StatementStats **
+PgStatsCollect(Pg_ConnectionId **connids, int nconn, Tcl_HashTable *merged,
+			   int *countPtr)
+{
+	Pg_StatementStats **stmts;
+	Pg_StatementStats *stmt;
+	Pg_StatementStats *from;
+	Tcl_HashEntry *entry;
+	Tcl_HashEntry *to;
+	Tcl_HashSearch hsearch;
+	int			isNew;
+	int			count = 0;
+	int			i,
+				j;
+
+	Tcl_InitHashTable(merged, TCL_STRING_KEYS);
+	for (i = 0; i < nconn; i++)
+	{
+		if (connids[i]->stats.statements == NULL)
+			continue;
+		for (entry = Tcl_FirstHashEntry(connids[i]->stats.statements, &hsearch);
+			 entry != NULL;
+			 entry = Tcl_NextHashEntry(&hsearch))
+		{
+			from = (Pg_StatementStats *) Tcl_GetHashValue(entry);
+			to = Tcl_CreateHashEntry(merged,
+						Tcl_GetHashKey(connids[i]->stats.statements, entry),
+									 &isNew);
+			if (isNew)
+			{
+				stmt = (Pg_StatementStats *) ckalloc(sizeof(Pg_StatementStats));
+				memcpy(stmt, from, sizeof(Pg_StatementStats));
+				stmt->entry = to;
+				Tcl_SetHashValue(to, (ClientData) stmt);
+				continue;
+			}
+			stmt = (Pg_StatementStats *) Tcl_GetHashValue(to);
+			stmt->calls += from->calls;
+			stmt->rows += from->rows;
+			stmt->totalTime += from->totalTime;
+			if (from->maxTime > stmt->maxTime)
+				stmt->maxTime = from->maxTime;
+			for (j = 0; j < HIST_BUCKETS; j++)
+				stmt->hist[j] += from->hist[j];
+		}
+	}
+
+	stmts = (Pg_StatementStats **) ckalloc((merged->numEntries + 1) *
+										   sizeof(Pg_StatementStats *));
+	for (entry = Tcl_FirstHashEntry(merged, &hsearch);
+		 entry != NULL;
+		 entry = Tcl_NextHashEntry(&hsearch))
+		stmts[count++] = (Pg_StatementStats *) Tcl_GetHashValue(entry);
+	qsort(stmts, count, sizeof(Pg_StatementStats *), PgStatsCompare);
+	*countPtr = count;
+	return stmts;
+}
+
+static Tcl_WideInt
+PgStatsPercentile(Pg_StatementStats *stmt, double fraction)
+{
+	Tcl_WideInt target = (Tcl_WideInt) (fraction * stmt->calls + 0.999999);
+	Tcl_WideInt seen = 0;
+	Tcl_WideInt value;
+	int			i;
+
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += stmt->hist[i];
+		if (seen >= target)
+			break;
+	}
+	value = PgHistValue(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+	return value < stmt->maxTime ? value : stmt->maxTime;
+}
+
+/*
+ * A hash of the shape of a query, FNV-1a, to name it by.
+ */
+static void
+PgStatsFingerprint(Pg_StatementStats *stmt, Tcl_HashTable *table,
+				   char *buf)
+{
+	const unsigned char *p;
+	Tcl_WideUInt hash = (Tcl_WideUInt) 0xcbf29ce484222325LL;
+
+	for (p = (const unsigned char *) Tcl_GetHashKey(table, stmt->entry);
+		 *p != '\0'; p++)
+	{
+		hash ^= *p;
+		hash *= (Tcl_WideUInt) 0x100000001b3LL;
+	}
+	sprintf(buf, "%016" TCL_LL_MODIFIER "x", hash);
+}
+
+/*
+ * The query shapes, at most limit of them if it isn't 0, as a list of
+ * lists of names and values, or in the Prometheus text format.
+ */
+static Tcl_Obj *
+PgStatsStatements(Pg_ConnectionId **connids, int nconn, int limit,
+				  int prometheus, const char *connName)
+{
+	Pg_StatementStats **stmts;
+	Pg_StatementStats *stmt;
+	Tcl_HashTable merged;
+	Tcl_Obj    *resultObj;
+	Tcl_Obj    *stmtObj;
+	char		fingerprint[24];
+	char		labels[64];
+	char		extra[96];
+	int			count;
+	int			i,
+				j;
+
+	stmts = PgStatsCollect(connids, nconn, &merged, &count);
+	if (limit > 0 && count > limit)
+		count = limit;
+
+	if (prometheus)
+	{
+		resultObj = Tcl_NewObj();
+		labels[0] = '\0';
+		if (connName != NULL)
+			sprintf(labels, "conn=\"%.40s\"", connName);
+
+		PgStatsHeader(resultObj, "pgtcl_statement_seconds", "summary",
+					  "Time waiting for the results of a query shape.");
+		for (i = 0; i < count; i++)
+		{
+			stmt = stmts[i];
+			PgStatsFingerprint(stmt, &merged, fingerprint);
+			for (j = 0; j < PERCENTILE_COUNT; j++)
+			{
+				sprintf(extra, "fingerprint=\"%s\",quantile=\"%s\"",
+						fingerprint, percentiles[j].quantile);
+				PgStatsMetric(resultObj, "pgtcl_statement_seconds", labels,
+							  extra,
+							  PgStatsPercentile(stmt, percentiles[j].fraction), 1);
+			}
+			sprintf(extra, "fingerprint=\"%s\"", fingerprint);
+			PgStatsMetric(resultObj, "pgtcl_statement_seconds_sum", labels,
+						  extra, stmt->totalTime, 1);
+			PgStatsMetric(resultObj, "pgtcl_statement_seconds_count", labels,
+						  extra, stmt->calls, 0);
+		}
+
+		PgStatsHeader(resultObj, "pgtcl_statement_rows_total", "counter",
+					  "Rows returned or affected by a query shape.");
+		for (i = 0; i < count; i++)
+		{
+			PgStatsFingerprint(stmts[i], &merged, fingerprint);
+			sprintf(extra, "fingerprint=\"%s\"", fingerprint);
+			PgStatsMetric(resultObj, "pgtcl_statement_rows_total", labels,
+						  extra, stmts[i]->rows, 0);
+		}
+	}
+	else
+	{
+		resultObj = Tcl_NewListObj(0, NULL);
+		for (i = 0; i < count; i++)
+		{
+			stmt = stmts[i];
+			PgStatsFingerprint(stmt, &merged, fingerprint);
+			stmtObj = Tcl_NewListObj(0, NULL);
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewStringObj("fingerprint", -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewStringObj(fingerprint, -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewStringObj("statement", -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj,
+					Tcl_NewStringObj(Tcl_GetHashKey(&merged, stmt->entry), -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewStringObj("family", -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj,
+							Tcl_NewStringObj(familyNames[stmt->family], -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewStringObj("calls", -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewWideIntObj(stmt->calls));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewStringObj("rows", -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewWideIntObj(stmt->rows));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewStringObj("total_usec", -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewWideIntObj(stmt->totalTime));
+			for (j = 0; j < PERCENTILE_COUNT; j++)
+			{
+				Tcl_ListObjAppendElement(NULL, stmtObj,
+									Tcl_NewStringObj(percentiles[j].name, -1));
+				Tcl_ListObjAppendElement(NULL, stmtObj,
+					Tcl_NewWideIntObj(PgStatsPercentile(stmt, percentiles[j].fraction)));
+			}
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewStringObj("max_usec", -1));
+			Tcl_ListObjAppendElement(NULL, stmtObj, Tcl_NewWideIntObj(stmt->maxTime));
+			Tcl_ListObjAppendElement(NULL, resultObj, stmtObj);
+		}
+	}
+
+	for (i = 0; i < merged.numEntries; i++)
+		ckfree((char *)stmts[i]);
+	ckfree((char *)stmts);
+	Tcl_DeleteHashTable(&merged);
+	return resultObj;
+}
+
+/**********************************
+ * pg_stats
+	 report the counters of a connection, or of all of them
+
+ syntax:
+	 pg_stats connection|-all ?-reset? ?-format list|prometheus?
+		 ?-statements n? ?-countbytes boolean?
+
+ The list format is a list of names and values, with the queries as a
+ sublist of command families and counts.  -all adds up the connections
+ open in this interpreter, taking the largest of the maximums.  -reset
+ zeroes the counters after reporting them.
+
+ -statements reports the n query shapes that took the most time
+ instead, all of them if n is 0, each a list of names and values.
+
+ bytes_received stays 0 unless -countbytes turns it on for the
+ connections, as it costs a look at every value of every result.
+ **********************************/
+int
+Pg_stats(ClientData cData, Tcl_Interp *interp, int objc,
+		 Tcl_Obj *CONST objv[])
+{
+	static CONST84 char *options[] = {
+		"-reset", "-format", "-statements", "-countbytes", (char *)NULL
+	};
+	enum options
+	{
+		OPT_RESET, OPT_FORMAT, OPT_STATEMENTS, OPT_COUNTBYTES
+	};
+	static CONST84 char *formats[] = {"list", "prometheus", (char *)NULL};
+	enum formats
+	{
+		FORMAT_LIST, FORMAT_PROMETHEUS
+	};
+	Tcl_WideInt queries[PG_STATS_FAMILIES];
+	Tcl_WideInt values[STAT_COUNT];
+	Pg_ConnectionId *connid;
+	Pg_ConnectionId **connids = NULL;
+	Tcl_Obj    *namesObj;
+	Tcl_Obj   **names;
+	Tcl_Channel conn_chan;
+	char	   *connString;
+	int			all;
+	int			reset = 0;
+	int			format = FORMAT_LIST;
+	int			statements = -1;
+	int			countBytes = -1;
+	int			optIndex;
+	int			nconn = 0;
+	int			count;
+	int			i;
+
+	if (objc < 2)
+	{
+		Tcl_WrongNumArgs(interp, 1, objv,
+						 "connection|-all ?-reset? ?-format list|prometheus? ?-statements n? ?-countbytes boolean?");
+		return TCL_ERROR;
+	}
+
+	for (i = 2; i < objc; i++)
+	{
+		if (Tcl_GetIndexFromObj(interp, objv[i], options, "option",
+								TCL_EXACT, &optIndex) != TCL_OK)
+			return TCL_ERROR;
+
+		switch ((enum options) optIndex)
+		{
+			case OPT_RESET:
+				reset = 1;
+				break;
+
+			case OPT_FORMAT:
+				if (++i >= objc)
+				{
+					Tcl_SetResult(interp, "-format requires list or prometheus", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				if (Tcl_GetIndexFromObj(interp, objv[i], formats, "format",
+										TCL_EXACT, &format) != TCL_OK)
+					return TCL_ERROR;
+				break;
+
+			case OPT_STATEMENTS:
+				if (++i >= objc)
+				{
+					Tcl_SetResult(interp, "-statements requires a count", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				if (Tcl_GetIntFromObj(interp, objv[i], &statements) != TCL_OK)
+					return TCL_ERROR;
+				if (statements < 0)
+				{
+					Tcl_SetResult(interp, "-statements can't be negative", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				break;
+
+			case OPT_COUNTBYTES:
+				if (++i >= objc)
+				{
+					Tcl_SetResult(interp, "-countbytes requires a boolean", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				if (Tcl_GetBooleanFromObj(interp, objv[i], &countBytes) != TCL_OK)
+					return TCL_ERROR;
+				break;
+		}
+	}
+
+	connString = Tcl_GetStringFromObj(objv[1], NULL);
+	all = (strcmp(connString, "-all") == 0);
+
+	if (all)
+	{
+		/* the connections are the Pg_ConnType channels, as in pg_dbinfo */
+		Tcl_GetChannelNames(interp);
+		namesObj = Tcl_GetObjResult(interp);
+		Tcl_IncrRefCount(namesObj);
+		Tcl_ListObjGetElements(interp, namesObj, &count, &names);
+		connids = (Pg_ConnectionId **) ckalloc((count + 1) * sizeof(Pg_ConnectionId *));
+		for (i = 0; i < count; i++)
+		{
+			conn_chan = Tcl_GetChannel(interp, Tcl_GetString(names[i]), 0);
+			if (conn_chan != NULL && Tcl_GetChannelType(conn_chan) == &Pg_ConnType)
+			{
+				connid = (Pg_ConnectionId *) Tcl_GetChannelInstanceData(conn_chan);
+				if (connid->conn != NULL && !connid->internal)
+					connids[nconn++] = connid;
+			}
+		}
+		Tcl_DecrRefCount(namesObj);
+	}
+	else
+	{
+		/* a busy connection can still be looked at */
+		conn_chan = Tcl_GetChannel(interp, connString, 0);
+		if (conn_chan == NULL || Tcl_GetChannelType(conn_chan) != &Pg_ConnType)
+		{
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, connString,
+							 " is not a valid postgresql connection", (char *)NULL);
+			return TCL_ERROR;
+		}
+		connids = (Pg_ConnectionId **) ckalloc(sizeof(Pg_ConnectionId *));
+		connids[nconn++] = (Pg_ConnectionId *) Tcl_GetChannelInstanceData(conn_chan);
+	}
+
+	if (countBytes >= 0)
+		for (i = 0; i < nconn; i++)
+			connids[i]->stats_bytes = countBytes;
+
+	if (statements >= 0)
+		Tcl_SetObjResult(interp, PgStatsStatements(connids, nconn, statements,
+												   format == FORMAT_PROMETHEUS,
+												   all ? NULL : connString));
+	else
+	{
+		memset(queries, 0, sizeof(queries));
+		memset(values, 0, sizeof(values));
+		for (i = 0; i < nconn; i++)
+			PgStatsAdd(connids[i], queries, values);
+
+		if (format == FORMAT_PROMETHEUS)
+			Tcl_SetObjResult(interp, PgStatsPrometheus(queries, values,
+													   all ? nconn : -1,
+													   all ? NULL : connString));
+		else
+			Tcl_SetObjResult(interp, PgStatsList(queries, values, all ? nconn : -1));
+	}
+
+	if (reset)
+		for (i = 0; i < nconn; i++)
+			PgStatsReset(connids[i]);
+	ckfree((char *)connids);
+	return TCL_OK;
+}
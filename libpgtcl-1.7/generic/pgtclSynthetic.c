@@ -0,0 +1,429 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgtclSynthetic.c
+ *
+ *	::pg::internal::synthetic_result, for tests and benchmarks that
+ *	don't need a server.  It builds a PGresult of a given shape with
+ *	PQmakeEmptyPGresult, PQsetResultAttrs and PQsetvalue, and makes a
+ *	result handle of it with PgSetResultId, so pg_result and everything
+ *	else that takes a handle work on it as on a real one.
+ *
+ *	The handles belong to a connection that never reached a server,
+ *	made once per interpreter, unless -connection names a real one.
+ *	pg_dbinfo connections and pg_stats -all leave it out.
+ *	Values come from a seeded generator, so a shape always gives the
+ *	same result.
+ *
+ * IDENTIFICATION
+ *	  $Id$
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libpq-fe.h>
+
+#include "pgtclCmds.h"
+#include "pgtclId.h"
+
+#ifndef CONST84
+#     define CONST84
+#endif
+
+/* the handle of the connection the synthetic results belong to */
+#define PG_SYNTHETIC_CONN	"pgsynthetic"
+#define PG_SYNTHETIC_ASSOC	"pgtcl_synthetic"
+
+/* Nothing listens there, so PQconnectStart fails at once */
+#define PG_SYNTHETIC_CONNINFO \
+	"host=/nonexistent/pgtcl-synthetic port=1 dbname=synthetic user=synthetic"
+
+enum Pg_SyntheticKind
+{
+	SYN_TEXT, SYN_INT4, SYN_INT8, SYN_FLOAT8, SYN_NUMERIC, SYN_BOOL,
+	SYN_BYTEA, SYN_INT4_ARRAY, SYN_TEXT_ARRAY, SYN_TIMESTAMPTZ, SYN_USER
+};
+
+static const struct
+{
+	const char *name;
+	Oid			oid;
+	int			typlen;
+	int			kind;
+}			synTypes[] = {
+	{"text", 25, -1, SYN_TEXT},
+	{"varchar", 1043, -1, SYN_TEXT},
+	{"int4", 23, 4, SYN_INT4},
+	{"int8", 20, 8, SYN_INT8},
+	{"float8", 701, 8, SYN_FLOAT8},
+	{"numeric", 1700, -1, SYN_NUMERIC},
+	{"bool", 16, 1, SYN_BOOL},
+	{"bytea", 17, -1, SYN_BYTEA},
+	{"int4[]", 1007, -1, SYN_INT4_ARRAY},
+	{"text[]", 1009, -1, SYN_TEXT_ARRAY},
+	{"timestamptz", 1184, 8, SYN_TIMESTAMPTZ},
+	{"user", 16384, -1, SYN_USER},
+	{NULL, 0, 0, 0}
+};
+
+static void PgSynDeleteAssoc(ClientData clientData, Tcl_Interp *interp);
+
+/*
+ * The next number of a 64-bit xorshift, which is all the randomness a
+ * benchmark needs.
+ */
+static Tcl_WideUInt
+PgSynRandom(Tcl_WideUInt *state)
+{
+	Tcl_WideUInt x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+/*
+ * Put a value of the kind in ds, of about size bytes where that means
+ * anything.
+ */
+static void
+PgSynValue(Tcl_DString *ds, int kind, int size, Tcl_WideUInt *state)
+{
+	static const char hex[] = "0123456789abcdef";
+	char		buf[64];
+	Tcl_WideUInt r = PgSynRandom(state);
+	int			i,
+				n;
+
+	Tcl_DStringSetLength(ds, 0);
+	switch (kind)
+	{
+		case SYN_TEXT:
+		case SYN_USER:
+			/* the user type is text in braces, which isn't an array */
+			n = (kind == SYN_USER) ? 1 : 0;
+			Tcl_DStringSetLength(ds, size + 2 * n);
+			for (i = 0; i < size; i++)
+			{
+				if (i % 8 == 0)
+					r = PgSynRandom(state);
+				Tcl_DStringValue(ds)[n + i] = 'a' + (char) ((r >> (i % 8 * 8)) % 26);
+			}
+			if (n)
+			{
+				Tcl_DStringValue(ds)[0] = '{';
+				Tcl_DStringValue(ds)[size + 1] = '}';
+			}
+			break;
+
+		case SYN_INT4:
+			sprintf(buf, "%d", (int) (r & 0x7fffffff) - 0x40000000);
+			Tcl_DStringAppend(ds, buf, -1);
+			break;
+
+		case SYN_INT8:
+			sprintf(buf, "%" TCL_LL_MODIFIER "d", (Tcl_WideInt) (r >> 1));
+			Tcl_DStringAppend(ds, buf, -1);
+			break;
+
+		case SYN_FLOAT8:
+			sprintf(buf, "%.15g", (double) (r >> 11) / 9007199254740992.0 * 1e6);
+			Tcl_DStringAppend(ds, buf, -1);
+			break;
+
+		case SYN_NUMERIC:
+			sprintf(buf, "%u.%02u", (unsigned) (r % 1000000), (unsigned) (r >> 32) % 100);
+			Tcl_DStringAppend(ds, buf, -1);
+			break;
+
+		case SYN_BOOL:
+			Tcl_DStringAppend(ds, (r & 1) ? "t" : "f", 1);
+			break;
+
+		case SYN_BYTEA:
+			Tcl_DStringSetLength(ds, 2 + 2 * size);
+			Tcl_DStringValue(ds)[0] = '\\';
+			Tcl_DStringValue(ds)[1] = 'x';
+			for (i = 0; i < size; i++)
+			{
+				if (i % 8 == 0)
+					r = PgSynRandom(state);
+				n = (int) ((r >> (i % 8 * 8)) & 0xff);
+				Tcl_DStringValue(ds)[2 + 2 * i] = hex[n >> 4];
+				Tcl_DStringValue(ds)[3 + 2 * i] = hex[n & 0xf];
+			}
+			break;
+
+		case SYN_INT4_ARRAY:
+		case SYN_TEXT_ARRAY:
+			/* an element for every four bytes */
+			n = size / 4 > 0 ? size / 4 : 1;
+			Tcl_DStringAppend(ds, "{", 1);
+			for (i = 0; i < n; i++)
+			{
+				r = PgSynRandom(state);
+				if (kind == SYN_INT4_ARRAY)
+					sprintf(buf, "%s%d", i > 0 ? "," : "", (int) (r % 100000));
+				else
+					sprintf(buf, "%s\"e %c\"", i > 0 ? "," : "", 'a' + (int) (r % 26));
+				Tcl_DStringAppend(ds, buf, -1);
+			}
+			Tcl_DStringAppend(ds, "}", 1);
+			break;
+
+		case SYN_TIMESTAMPTZ:
+			sprintf(buf, "20%02u-%02u-%02u %02u:%02u:%02u.%06u+00",
+					(unsigned) (r % 30), (unsigned) (r >> 8) % 12 + 1,
+					(unsigned) (r >> 16) % 28 + 1, (unsigned) (r >> 24) % 24,
+					(unsigned) (r >> 32) % 60, (unsigned) (r >> 40) % 60,
+					(unsigned) (r >> 44) % 1000000);
+			Tcl_DStringAppend(ds, buf, -1);
+			break;
+	}
+}
+
+/*
+ * The synthetic connection of the interpreter, made if need be.
+ */
+static Pg_ConnectionId *
+PgSynConnection(Tcl_Interp *interp)
+{
+	Pg_ConnectionId *connid;
+	Tcl_Channel conn_chan;
+	PGconn	   *conn;
+	Tcl_Obj    *idObj;
+
+	idObj = (Tcl_Obj *) Tcl_GetAssocData(interp, PG_SYNTHETIC_ASSOC, NULL);
+	if (idObj != NULL)
+	{
+		conn_chan = Tcl_GetChannel(interp, Tcl_GetString(idObj), 0);
+		if (conn_chan != NULL && Tcl_GetChannelType(conn_chan) == &Pg_ConnType)
+			return (Pg_ConnectionId *) Tcl_GetChannelInstanceData(conn_chan);
+		Tcl_DeleteAssocData(interp, PG_SYNTHETIC_ASSOC);
+	}
+
+	conn = PQconnectStart(PG_SYNTHETIC_CONNINFO);
+	if (conn == NULL)
+	{
+		Tcl_SetResult(interp, "Could not allocate connection", TCL_STATIC);
+		return NULL;
+	}
+	if (!PgSetConnectionId(interp, conn, PG_SYNTHETIC_CONN))
+	{
+		PQfinish(conn);
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, PG_SYNTHETIC_CONN, " is already in use",
+						 (char *)NULL);
+		return NULL;
+	}
+
+	/* the connection's name, with any namespace, is the result */
+	idObj = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
+	Tcl_IncrRefCount(idObj);
+	Tcl_SetAssocData(interp, PG_SYNTHETIC_ASSOC, PgSynDeleteAssoc,
+					 (ClientData) idObj);
+	Tcl_ResetResult(interp);
+
+	PgGetConnectionId(interp, Tcl_GetString(idObj), &connid);
+	connid->internal = 1;
+	return connid;
+}
+
+static void
+PgSynDeleteAssoc(ClientData clientData, Tcl_Interp *interp)
+{
+	Tcl_DecrRefCount((Tcl_Obj *) clientData);
+}
+
+/**********************************
+ * ::pg::internal::synthetic_result
+	 make a result handle of a generated result, without a server
+
+ syntax:
+	 ::pg::internal::synthetic_result ?-connection conn? ?-rows n? ?-columns n?
+		 ?-size bytes? ?-nulls fraction? ?-types list? ?-seed n?
+
+ The columns are named c1, c2 and so on, and take their types from the
+ list in turn: text, varchar, int4, int8, float8, numeric, bool, bytea,
+ int4[], text[], timestamptz or user, a type created in the database
+ whose values are text in braces, like {abc}, but aren't arrays.  -size
+ is the length of text and user values, the bytes of bytea ones, and
+ four times the elements of arrays.  A -nulls fraction of the values
+ are NULL.  The defaults are 10 rows of 3 text columns of 8 bytes,
+ without NULLs.
+
+ Not documented for users: it is for the test suite and benchmarks.
+ **********************************/
+int
+Pg_synthetic_result(ClientData cData, Tcl_Interp *interp, int objc,
+					Tcl_Obj *CONST objv[])
+{
+	static CONST84 char *options[] = {
+		"-connection", "-rows", "-columns", "-size", "-nulls", "-types",
+		"-seed", (char *)NULL
+	};
+	enum options
+	{
+		OPT_CONNECTION, OPT_ROWS, OPT_COLUMNS, OPT_SIZE, OPT_NULLS,
+		OPT_TYPES, OPT_SEED
+	};
+	Pg_ConnectionId *connid = NULL;
+	PGresult   *res;
+	PGresAttDesc *attrs;
+	Tcl_Obj   **typeObjs;
+	Tcl_Obj    *defaultType = NULL;
+	Tcl_DString value;
+	Tcl_WideUInt state;
+	Tcl_WideInt seed = 1;
+	double		nulls = 0;
+	int		   *kinds;
+	int			rows = 10;
+	int			columns = 3;
+	int			size = 8;
+	int			ntypes = 0;
+	int			optIndex;
+	int			type;
+	int			tupno,
+				field,
+				i;
+	char		name[32];
+
+	for (i = 1; i < objc; i++)
+	{
+		if (Tcl_GetIndexFromObj(interp, objv[i], options, "option",
+								TCL_EXACT, &optIndex) != TCL_OK)
+			return TCL_ERROR;
+		if (++i >= objc)
+		{
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, options[optIndex], " requires a value",
+							 (char *)NULL);
+			return TCL_ERROR;
+		}
+
+		switch ((enum options) optIndex)
+		{
+			case OPT_CONNECTION:
+				if (PgGetConnectionId(interp, Tcl_GetString(objv[i]), &connid) == NULL)
+					return TCL_ERROR;
+				break;
+
+			case OPT_ROWS:
+				if (Tcl_GetIntFromObj(interp, objv[i], &rows) != TCL_OK)
+					return TCL_ERROR;
+				break;
+
+			case OPT_COLUMNS:
+				if (Tcl_GetIntFromObj(interp, objv[i], &columns) != TCL_OK)
+					return TCL_ERROR;
+				break;
+
+			case OPT_SIZE:
+				if (Tcl_GetIntFromObj(interp, objv[i], &size) != TCL_OK)
+					return TCL_ERROR;
+				break;
+
+			case OPT_NULLS:
+				if (Tcl_GetDoubleFromObj(interp, objv[i], &nulls) != TCL_OK)
+					return TCL_ERROR;
+				if (nulls < 0 || nulls > 1)
+				{
+					Tcl_SetResult(interp, "-nulls must be between 0 and 1", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				break;
+
+			case OPT_TYPES:
+				if (Tcl_ListObjGetElements(interp, objv[i], &ntypes, &typeObjs) != TCL_OK)
+					return TCL_ERROR;
+				break;
+
+			case OPT_SEED:
+				if (Tcl_GetWideIntFromObj(interp, objv[i], &seed) != TCL_OK)
+					return TCL_ERROR;
+				break;
+		}
+	}
+
+	if (rows < 0 || columns < 1 || size < 0)
+	{
+		Tcl_SetResult(interp, "-rows and -size can't be negative, and -columns must be at least 1", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if (ntypes == 0)
+	{
+		defaultType = Tcl_NewStringObj("text", -1);
+		typeObjs = &defaultType;
+		ntypes = 1;
+	}
+
+	kinds = (int *) ckalloc(ntypes * sizeof(int));
+	for (i = 0; i < ntypes; i++)
+	{
+		if (Tcl_GetIndexFromObjStruct(interp, typeObjs[i], synTypes,
+									  sizeof(synTypes[0]), "type", TCL_EXACT,
+									  &type) != TCL_OK)
+		{
+			ckfree((char *)kinds);
+			if (defaultType != NULL)
+				Tcl_DecrRefCount(defaultType);
+			return TCL_ERROR;
+		}
+		kinds[i] = type;
+	}
+	if (defaultType != NULL)
+		Tcl_DecrRefCount(defaultType);
+
+	if (connid == NULL && (connid = PgSynConnection(interp)) == NULL)
+	{
+		ckfree((char *)kinds);
+		return TCL_ERROR;
+	}
+
+	res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+	attrs = (PGresAttDesc *) ckalloc(columns * sizeof(PGresAttDesc));
+	for (field = 0; field < columns; field++)
+	{
+		type = kinds[field % ntypes];
+		sprintf(name, "c%d", field + 1);
+		attrs[field].name = ckalloc(strlen(name) + 1);
+		strcpy(attrs[field].name, name);
+		attrs[field].tableid = 0;
+		attrs[field].columnid = 0;
+		attrs[field].format = 0;
+		attrs[field].typid = synTypes[type].oid;
+		attrs[field].typlen = synTypes[type].typlen;
+		attrs[field].atttypmod = -1;
+	}
+	PQsetResultAttrs(res, columns, attrs);
+	for (field = 0; field < columns; field++)
+		ckfree(attrs[field].name);
+	ckfree((char *)attrs);
+
+	state = (Tcl_WideUInt) seed * 0x9e3779b97f4a7c15ULL + 1;
+	Tcl_DStringInit(&value);
+	for (tupno = 0; tupno < rows; tupno++)
+	{
+		for (field = 0; field < columns; field++)
+		{
+			if (nulls > 0 &&
+				(double) (PgSynRandom(&state) >> 11) / 9007199254740992.0 < nulls)
+			{
+				PQsetvalue(res, tupno, field, NULL, -1);
+				continue;
+			}
+			PgSynValue(&value, synTypes[kinds[field % ntypes]].kind, size, &state);
+			PQsetvalue(res, tupno, field, Tcl_DStringValue(&value),
+					   Tcl_DStringLength(&value));
+		}
+	}
+	Tcl_DStringFree(&value);
+	ckfree((char *)kinds);
+
+	PgSetResultId(interp, connid->id, res);
+	return TCL_OK;
+}
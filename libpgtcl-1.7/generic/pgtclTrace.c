@@ -0,0 +1,516 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgtclTrace.c
+ *
+ *	Statement tracing: pg_trace and pg_untrace.  While a connection is
+ *	traced, every statement its commands run is recorded with its text,
+ *	or the name of the prepared statement, the number of parameters,
+ *	how long the result took, the rows and the result status.  The
+ *	records go to a Tcl channel, one per line, or into a ring buffer
+ *	that pg_trace -records reads.
+ *
+ *	The hooks are PgStatsQuery and PgStatsResult, so tracing sees the
+ *	same statements and the same times as pg_stats.  When a connection
+ *	isn't traced its trace pointer is NULL, and that test is all the
+ *	hooks cost.
+ *
+ *	Statements slower than -slow can have their plan captured with a
+ *	plain EXPLAIN, run after the result is in, outside transactions.
+ *	-protocol hands a file to PQtrace, for libpq's own dump of the
+ *	messages exchanged.
+ *
+ * IDENTIFICATION
+ *	  $Id$
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libpq-fe.h>
+
+#include "pgtclCmds.h"
+#include "pgtclId.h"
+
+#ifndef CONST84
+#     define CONST84
+#endif
+
+/* ring buffer size when no -channel or -buffer is given */
+#define PG_TRACE_BUFFER_SIZE	1000
+
+typedef struct Pg_Trace_s
+{
+	Tcl_Channel channel;		/* records are written here, or NULL */
+	Tcl_Obj   **ring;			/* the last ringSize records, or NULL */
+	int			ringSize;
+	int			ringNext;		/* slot for the next record */
+	int			ringCount;		/* records in the ring */
+	Tcl_WideInt slow;			/* microseconds, 0 to record everything */
+	double		sample;			/* fraction of statements recorded */
+	unsigned int seed;			/* for sampling */
+	int			explain;		/* EXPLAIN the slow statements */
+	FILE	   *protocol;		/* handed to PQtrace, or NULL */
+
+	/* the statement sent last, for the results that come back */
+	int			family;
+	char	   *statement;
+	int			nParams;
+} Pg_Trace;
+
+/*
+ * Stop tracing a connection and free what the trace held.
+ */
+void
+PgTraceStop(Pg_ConnectionId *connid)
+{
+	Pg_Trace   *trace = connid->trace;
+	int			i;
+
+	if (trace == NULL)
+		return;
+	connid->trace = NULL;
+
+	if (trace->protocol != NULL)
+	{
+		if (connid->conn != NULL)
+			PQuntrace(connid->conn);
+		fclose(trace->protocol);
+	}
+	if (trace->channel != NULL)
+	{
+		Tcl_Flush(trace->channel);
+		Tcl_UnregisterChannel(NULL, trace->channel);
+	}
+	if (trace->ring != NULL)
+	{
+		for (i = 0; i < trace->ringSize; i++)
+			if (trace->ring[i] != NULL)
+				Tcl_DecrRefCount(trace->ring[i]);
+		ckfree((char *)trace->ring);
+	}
+	if (trace->statement != NULL)
+		ckfree(trace->statement);
+	ckfree((char *)trace);
+}
+
+/*
+ * Remember a statement as it is sent.
+ */
+void
+PgTraceQuery(Pg_ConnectionId *connid, int family, const char *query,
+			 int nParams)
+{
+	Pg_Trace   *trace = connid->trace;
+	size_t		len = strlen(query);
+
+	if (trace->statement != NULL)
+		ckfree(trace->statement);
+	trace->statement = ckalloc(len + 1);
+	memcpy(trace->statement, query, len + 1);
+	trace->family = family;
+	trace->nParams = nParams;
+}
+
+/*
+ * Whether EXPLAIN can be put in front of a statement: one that plans
+ * a query, with no parameters we'd have to supply.
+ */
+static int
+PgTraceExplainable(Pg_Trace *trace)
+{
+	static const char *const verbs[] = {
+		"select", "with", "insert", "update", "delete", "values", "table",
+		"merge", NULL
+	};
+	const char *p = trace->statement;
+	char		word[8];
+	int			len = 0;
+	int			i;
+
+	if (trace->family == PG_STATS_PREPARED || trace->nParams > 0)
+		return 0;
+
+	while (isspace((unsigned char) *p) || *p == '(')
+		p++;
+	while (isalpha((unsigned char) p[len]) && len < (int) sizeof(word) - 1)
+	{
+		word[len] = tolower((unsigned char) p[len]);
+		len++;
+	}
+	word[len] = '\0';
+	if (isalpha((unsigned char) p[len]))
+		return 0;
+
+	for (i = 0; verbs[i] != NULL; i++)
+		if (strcmp(word, verbs[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Plan the traced statement with EXPLAIN, returning its lines, or NULL
+ * if that can't be done now.  The EXPLAIN goes by PQexecParams, whose
+ * extended protocol refuses a string of several statements, so one
+ * that held more than the statement we look at is never run again.
+ * It is only done outside a transaction block, where a failing
+ * EXPLAIN can't abort the script's transaction.
+ */
+static Tcl_Obj *
+PgTraceExplain(Pg_ConnectionId *connid, Pg_Trace *trace)
+{
+	PGconn	   *conn = connid->conn;
+	PGresult   *res;
+	Tcl_DString query;
+	Tcl_Obj    *planObj = NULL;
+	int			tupno;
+
+	/* only when the connection is idle, and done with the statement */
+	if (PQtransactionStatus(conn) != PQTRANS_IDLE || PQisBusy(conn))
+		return NULL;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF)
+		return NULL;
+#endif
+
+	Tcl_DStringInit(&query);
+	Tcl_DStringAppend(&query, "EXPLAIN ", -1);
+	Tcl_DStringAppend(&query, trace->statement, -1);
+	res = PQexecParams(conn, Tcl_DStringValue(&query), 0, NULL, NULL, NULL,
+					   NULL, 0);
+	Tcl_DStringFree(&query);
+
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQnfields(res) == 1)
+	{
+		planObj = Tcl_NewListObj(0, NULL);
+		for (tupno = 0; tupno < PQntuples(res); tupno++)
+			Tcl_ListObjAppendElement(NULL, planObj,
+							Tcl_NewStringObj(PQgetvalue(res, tupno, 0), -1));
+	}
+	PQclear(res);
+	return planObj;
+}
+
+static void
+PgTraceAppend(Tcl_Obj *recordObj, const char *name, Tcl_Obj *valueObj)
+{
+	Tcl_ListObjAppendElement(NULL, recordObj, Tcl_NewStringObj(name, -1));
+	Tcl_ListObjAppendElement(NULL, recordObj, valueObj);
+}
+
+/*
+ * Record a result, which may be NULL, that took usec to arrive.
+ */
+void
+PgTraceResult(Pg_ConnectionId *connid, PGresult *result, Tcl_WideInt usec)
+{
+	Pg_Trace   *trace = connid->trace;
+	Tcl_Obj    *recordObj;
+	Tcl_Obj    *planObj;
+	ExecStatusType status;
+	const char *message;
+	char	   *tuples;
+	Tcl_WideInt rows = 0;
+
+	/* the NULL that ends the results of pg_getresult isn't one */
+	if (result == NULL || trace->statement == NULL || usec < trace->slow)
+		return;
+
+	if (trace->sample < 1.0)
+	{
+		/* a xorshift is plenty, and leaves rand() alone */
+		trace->seed ^= trace->seed << 13;
+		trace->seed ^= trace->seed >> 17;
+		trace->seed ^= trace->seed << 5;
+		if ((double) trace->seed / 4294967296.0 >= trace->sample)
+			return;
+	}
+
+	status = PQresultStatus(result);
+	if (status == PGRES_TUPLES_OK)
+		rows = PQntuples(result);
+	else if ((tuples = PQcmdTuples(result)) != NULL && *tuples != '\0')
+		rows = strtol(tuples, NULL, 10);
+
+	recordObj = Tcl_NewListObj(0, NULL);
+	PgTraceAppend(recordObj, "time", Tcl_NewWideIntObj(PgStatsClock()));
+	PgTraceAppend(recordObj, "conn", Tcl_NewStringObj(connid->id, -1));
+	PgTraceAppend(recordObj, "family",
+				  Tcl_NewStringObj(PgStatsFamilyName(trace->family), -1));
+	PgTraceAppend(recordObj, "statement",
+				  Tcl_NewStringObj(trace->statement, -1));
+	PgTraceAppend(recordObj, "params", Tcl_NewIntObj(trace->nParams));
+	PgTraceAppend(recordObj, "usec", Tcl_NewWideIntObj(usec));
+	PgTraceAppend(recordObj, "rows", Tcl_NewWideIntObj(rows));
+	PgTraceAppend(recordObj, "status",
+				  Tcl_NewStringObj(PQresStatus(status), -1));
+
+	message = PQresultErrorField(result, PG_DIAG_MESSAGE_PRIMARY);
+	if (message != NULL)
+		PgTraceAppend(recordObj, "error", Tcl_NewStringObj(message, -1));
+
+	if (trace->explain &&
+		(status == PGRES_TUPLES_OK || status == PGRES_COMMAND_OK) &&
+		PgTraceExplainable(trace) &&
+		(planObj = PgTraceExplain(connid, trace)) != NULL)
+		PgTraceAppend(recordObj, "plan", planObj);
+
+	if (trace->channel != NULL)
+	{
+		Tcl_IncrRefCount(recordObj);
+		Tcl_WriteObj(trace->channel, recordObj);
+		Tcl_WriteChars(trace->channel, "\n", 1);
+		Tcl_DecrRefCount(recordObj);
+	}
+	else
+	{
+		if (trace->ring[trace->ringNext] != NULL)
+			Tcl_DecrRefCount(trace->ring[trace->ringNext]);
+		else
+			trace->ringCount++;
+		Tcl_IncrRefCount(recordObj);
+		trace->ring[trace->ringNext] = recordObj;
+		trace->ringNext = (trace->ringNext + 1) % trace->ringSize;
+	}
+}
+
+/**********************************
+ * pg_trace
+	 record the statements run on a connection
+
+ syntax:
+	 pg_trace connection ?-channel channel|-buffer n? ?-slow ms?
+		 ?-sample rate? ?-explain? ?-protocol file?
+	 pg_trace connection -records
+
+ Each statement becomes a list of names and values: time, conn, family,
+ statement, params, usec, rows, status, error if it failed, and plan if
+ it was EXPLAINed.  These are written to the channel a line each, or
+ kept in a ring buffer of the last n, 1000 by default, that -records
+ returns oldest first.  Only statements taking at least -slow
+ milliseconds are recorded, and of those, a -sample fraction.  -explain
+ adds the plans of the recorded statements that can be EXPLAINed, run
+ outside a transaction block and alone in their query string; it costs
+ a round trip for each.  -protocol appends libpq's trace of the
+ protocol to the file.
+
+ Tracing again replaces the trace a connection had.
+ **********************************/
+int
+Pg_trace(ClientData cData, Tcl_Interp *interp, int objc,
+		 Tcl_Obj *CONST objv[])
+{
+	static CONST84 char *options[] = {
+		"-channel", "-buffer", "-slow", "-sample", "-explain", "-protocol",
+		"-records", (char *)NULL
+	};
+	enum options
+	{
+		OPT_CHANNEL, OPT_BUFFER, OPT_SLOW, OPT_SAMPLE, OPT_EXPLAIN,
+		OPT_PROTOCOL, OPT_RECORDS
+	};
+	Pg_ConnectionId *connid;
+	Pg_Trace   *trace;
+	PGconn	   *conn;
+	Tcl_Channel channel = NULL;
+	Tcl_Obj    *listObj;
+	FILE	   *protocol = NULL;
+	char	   *protocolFile = NULL;
+	int			bufferSize = 0;
+	double		slow = 0;
+	double		sample = 1.0;
+	int			explain = 0;
+	int			mode;
+	int			optIndex;
+	int			i;
+
+	if (objc < 2)
+	{
+		Tcl_WrongNumArgs(interp, 1, objv,
+						 "connection ?-channel channel|-buffer n? ?-slow ms? ?-sample rate? ?-explain? ?-protocol file?");
+		return TCL_ERROR;
+	}
+
+	conn = PgGetConnectionId(interp, Tcl_GetStringFromObj(objv[1], NULL), &connid);
+	if (conn == NULL)
+		return TCL_ERROR;
+
+	for (i = 2; i < objc; i++)
+	{
+		if (Tcl_GetIndexFromObj(interp, objv[i], options, "option",
+								TCL_EXACT, &optIndex) != TCL_OK)
+			return TCL_ERROR;
+
+		if (optIndex == OPT_RECORDS)
+		{
+			if (objc != 3)
+			{
+				Tcl_WrongNumArgs(interp, 1, objv, "connection -records");
+				return TCL_ERROR;
+			}
+			listObj = Tcl_NewListObj(0, NULL);
+			trace = connid->trace;
+			if (trace != NULL && trace->ring != NULL)
+			{
+				int			slot = trace->ringNext - trace->ringCount;
+
+				if (slot < 0)
+					slot += trace->ringSize;
+				for (i = 0; i < trace->ringCount; i++)
+				{
+					Tcl_ListObjAppendElement(NULL, listObj, trace->ring[slot]);
+					slot = (slot + 1) % trace->ringSize;
+				}
+			}
+			Tcl_SetObjResult(interp, listObj);
+			return TCL_OK;
+		}
+
+		if (optIndex != OPT_EXPLAIN && ++i >= objc)
+		{
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, options[optIndex], " requires a value",
+							 (char *)NULL);
+			return TCL_ERROR;
+		}
+
+		switch ((enum options) optIndex)
+		{
+			case OPT_CHANNEL:
+				channel = Tcl_GetChannel(interp, Tcl_GetString(objv[i]), &mode);
+				if (channel == NULL)
+					return TCL_ERROR;
+				if (!(mode & TCL_WRITABLE))
+				{
+					Tcl_ResetResult(interp);
+					Tcl_AppendResult(interp, "channel \"", Tcl_GetString(objv[i]),
+									 "\" wasn't opened for writing", (char *)NULL);
+					return TCL_ERROR;
+				}
+				break;
+
+			case OPT_BUFFER:
+				if (Tcl_GetIntFromObj(interp, objv[i], &bufferSize) != TCL_OK)
+					return TCL_ERROR;
+				if (bufferSize < 1)
+				{
+					Tcl_SetResult(interp, "-buffer must be at least 1", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				break;
+
+			case OPT_SLOW:
+				if (Tcl_GetDoubleFromObj(interp, objv[i], &slow) != TCL_OK)
+					return TCL_ERROR;
+				if (slow < 0)
+				{
+					Tcl_SetResult(interp, "-slow can't be negative", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				break;
+
+			case OPT_SAMPLE:
+				if (Tcl_GetDoubleFromObj(interp, objv[i], &sample) != TCL_OK)
+					return TCL_ERROR;
+				if (sample < 0 || sample > 1)
+				{
+					Tcl_SetResult(interp, "-sample must be between 0 and 1", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				break;
+
+			case OPT_EXPLAIN:
+				explain = 1;
+				break;
+
+			case OPT_PROTOCOL:
+				protocolFile = Tcl_GetString(objv[i]);
+				break;
+
+			case OPT_RECORDS:
+				break;
+		}
+	}
+
+	if (channel != NULL && bufferSize > 0)
+	{
+		Tcl_SetResult(interp, "-channel and -buffer can't both be given", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if (protocolFile != NULL)
+	{
+		Tcl_DString native;
+
+		protocol = fopen(Tcl_TranslateFileName(interp, protocolFile, &native), "a");
+		Tcl_DStringFree(&native);
+		if (protocol == NULL)
+		{
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, "couldn't open \"", protocolFile, "\": ",
+							 Tcl_PosixError(interp), (char *)NULL);
+			return TCL_ERROR;
+		}
+	}
+
+	PgTraceStop(connid);
+
+	trace = (Pg_Trace *) ckalloc(sizeof(Pg_Trace));
+	memset(trace, 0, sizeof(Pg_Trace));
+	trace->slow = (Tcl_WideInt) (slow * 1000.0);
+	trace->sample = sample;
+	trace->seed = (unsigned int) PgStatsClock() | 1;
+	trace->explain = explain;
+
+	if (channel != NULL)
+	{
+		/* our reference keeps it open if the script closes it */
+		Tcl_RegisterChannel(NULL, channel);
+		trace->channel = channel;
+	}
+	else
+	{
+		if (bufferSize == 0)
+			bufferSize = PG_TRACE_BUFFER_SIZE;
+		trace->ringSize = bufferSize;
+		trace->ring = (Tcl_Obj **) ckalloc(bufferSize * sizeof(Tcl_Obj *));
+		memset(trace->ring, 0, bufferSize * sizeof(Tcl_Obj *));
+	}
+
+	if (protocol != NULL)
+	{
+		trace->protocol = protocol;
+		PQtrace(conn, protocol);
+	}
+
+	connid->trace = trace;
+	return TCL_OK;
+}
+
+/**********************************
+ * pg_untrace
+	 stop recording the statements run on a connection
+
+ syntax:
+	 pg_untrace connection
+ **********************************/
+int
+Pg_untrace(ClientData cData, Tcl_Interp *interp, int objc,
+		   Tcl_Obj *CONST objv[])
+{
+	Pg_ConnectionId *connid;
+
+	if (objc != 2)
+	{
+		Tcl_WrongNumArgs(interp, 1, objv, "connection");
+		return TCL_ERROR;
+	}
+
+	if (PgGetConnectionId(interp, Tcl_GetStringFromObj(objv[1], NULL), &connid) == NULL)
+		return TCL_ERROR;
+
+	PgTraceStop(connid);
+	return TCL_OK;
+}
@@ -0,0 +1,804 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgtclWorker.c
+ *
+ *	Background execution of the libpq calls that have no asynchronous
+ *	variant: PQconnectdb, PQexec, lo_import, lo_export and cancelling.
+ *	Each operation runs on a thread of its own, and its outcome is
+ *	queued back to the thread that asked for it with
+ *	Tcl_ThreadQueueEvent, where the callback is run.
+ *
+ *	While an operation is in flight the worker owns the connection:
+ *	PgGetConnectionId refuses the handle, and the notifier stops
+ *	watching its socket.  Only pg_cancelrequest and pg_disconnect can
+ *	still get at it; disconnecting cancels the query and waits for the
+ *	worker to finish.
+ *
+ *	The worker thread never touches a Tcl_Obj, nor the connection while
+ *	the owning thread might.  Everything it needs is set up by the
+ *	owning thread first, the connection's PGcancel too, so that
+ *	cancelling a worker's query is only a PQcancel on that; error
+ *	messages come back malloc'ed.  The only thing it allocates with
+ *	ckalloc is a progress event for pg_lo_import and pg_lo_export, at
+ *	most one queued at a time, which the owning thread turns into a
+ *	-progress callback.
+ *
+ *	Each thread keeps a list of the jobs it started that haven't come
+ *	back.  If it exits first, its exit handler waits for their workers
+ *	and throws away the events they queued, which it would never run.
+ *
+ * IDENTIFICATION
+ *	  $Id$
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libpq-fe.h>
+
+#include "pgtclCmds.h"
+#include "pgtclId.h"
+
+#ifndef CONST84
+#     define CONST84
+#endif
+
+#ifdef WIN32
+#define strdup _strdup
+#endif
+
+enum Pg_BgType
+{
+	BG_CONNECT, BG_EXEC, BG_LO_IMPORT, BG_LO_EXPORT, BG_CANCEL
+};
+
+/*
+ * A connection's PGcancel, made by the owning thread before a worker
+ * takes the connection, and shared with a pg_cancelrequest -background
+ * worker.  The count only changes on the owning thread.
+ */
+typedef struct Pg_BgCancel_s
+{
+	PGcancel   *cancel;
+	int			refCount;
+} Pg_BgCancel;
+
+typedef struct Pg_BgJob_s
+{
+	Tcl_Event	header;			/* must be first, see Tcl_QueueEvent */
+	enum Pg_BgType type;
+	Tcl_ThreadId owner;			/* thread to report back to */
+	Tcl_ThreadId thread;		/* the worker */
+	int			joined;
+	Tcl_Interp *interp;
+	Tcl_Obj    *callback;
+	Pg_ConnectionId *connid;	/* NULL for BG_CONNECT and BG_CANCEL */
+	PGconn	   *conn;
+	Pg_BgCancel *cancel;		/* to cancel conn's query, or NULL */
+	struct Pg_BgJob_s *next;	/* in the owning thread's jobs */
+
+	/* input, read-only for the worker */
+	char	   *arg;			/* query, filename or conninfo */
+	int			nParams;
+	char	  **params;
+	Oid			lobjId;
+	char	   *connhandle;		/* BG_CONNECT: -connhandle, or NULL */
+	int			autoreconnect;	/* BG_CONNECT: -autoreconnect */
+	int			maxretries;		/* BG_CONNECT: -maxretries */
+	Pg_LoTransfer xfer;			/* BG_LO_IMPORT and BG_LO_EXPORT */
+	Tcl_Obj    *progress;		/* their -progress callback, or NULL */
+
+	/* shared with the worker under mutex */
+	Tcl_Mutex	mutex;
+	Tcl_WideInt progressDone;
+	Tcl_WideInt progressTotal;
+	int			progressQueued;	/* a progress event is on its way */
+	int			abort;			/* stop the transfer, the connection is
+								 * being closed */
+
+	/* output */
+	Tcl_WideInt usec;			/* BG_EXEC: time to the result */
+	PGresult   *result;
+	Oid			oid;
+	int			ok;
+	char	   *errmsg;			/* malloc'ed by the worker, or NULL */
+} Pg_BgJob;
+
+typedef struct Pg_BgProgress_s
+{
+	Tcl_Event	header;			/* must be first */
+	Pg_BgJob   *job;
+} Pg_BgProgress;
+
+/* the jobs a thread started that haven't come back to it */
+typedef struct ThreadSpecificData
+{
+	int			initialized;
+	Pg_BgJob   *jobs;
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+static int	PgBgEventProc(Tcl_Event *evPtr, int flags);
+static int	PgBgProgressEventProc(Tcl_Event *evPtr, int flags);
+static void PgBgThreadExit(ClientData cData);
+
+static Pg_BgCancel *
+PgBgCancelNew(PGconn *conn)
+{
+	Pg_BgCancel *cancel;
+	PGcancel   *pgcancel = PQgetCancel(conn);
+
+	if (pgcancel == NULL)
+		return NULL;
+	cancel = (Pg_BgCancel *) ckalloc(sizeof(Pg_BgCancel));
+	cancel->cancel = pgcancel;
+	cancel->refCount = 1;
+	return cancel;
+}
+
+static void
+PgBgCancelRelease(Pg_BgCancel *cancel)
+{
+	if (--cancel->refCount > 0)
+		return;
+	PQfreeCancel(cancel->cancel);
+	ckfree((char *)cancel);
+}
+
+static void
+PgBgForget(Pg_BgJob *job)
+{
+	ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+		Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+	Pg_BgJob  **jobPtr;
+
+	for (jobPtr = &tsdPtr->jobs; *jobPtr != NULL; jobPtr = &(*jobPtr)->next)
+	{
+		if (*jobPtr == job)
+		{
+			*jobPtr = job->next;
+			break;
+		}
+	}
+}
+
+/*
+ * The worker's progressProc: tell the owning thread how far the transfer
+ * is, unless it hasn't caught up with the last report yet.
+ */
+static int
+PgBgProgress(Pg_LoTransfer *xfer)
+{
+	Pg_BgJob   *job = (Pg_BgJob *) xfer->clientData;
+	Pg_BgProgress *ev;
+	int			abort;
+
+	Tcl_MutexLock(&job->mutex);
+	job->progressDone = xfer->done;
+	job->progressTotal = xfer->total;
+	if (job->progress != NULL && !job->progressQueued)
+	{
+		job->progressQueued = 1;
+		ev = (Pg_BgProgress *) ckalloc(sizeof(Pg_BgProgress));
+		ev->header.proc = PgBgProgressEventProc;
+		ev->job = job;
+		Tcl_ThreadQueueEvent(job->owner, (Tcl_Event *) ev, TCL_QUEUE_TAIL);
+		Tcl_ThreadAlert(job->owner);
+	}
+	abort = job->abort;
+	Tcl_MutexUnlock(&job->mutex);
+	return abort;
+}
+
+/*
+ * The worker: do the blocking call, then post the job back.
+ */
+static		Tcl_ThreadCreateType
+PgBgThreadProc(ClientData cData)
+{
+	Pg_BgJob   *job = (Pg_BgJob *) cData;
+	char		errbuf[256];
+
+	switch (job->type)
+	{
+		case BG_CONNECT:
+			job->conn = PQconnectdb(job->arg);
+			job->ok = (job->conn != NULL && PQstatus(job->conn) == CONNECTION_OK);
+			if (!job->ok && job->conn != NULL)
+				job->errmsg = strdup(PQerrorMessage(job->conn));
+			break;
+
+		case BG_EXEC:
+			job->usec = PgStatsClock();
+#ifdef HAVE_PQEXECPARAMS
+			if (job->nParams > 0)
+				job->result = PQexecParams(job->conn, job->arg, job->nParams,
+								NULL, (const char **)job->params, NULL, NULL, 0);
+			else
+#endif
+				job->result = PQexec(job->conn, job->arg);
+			job->usec = PgStatsClock() - job->usec;
+			job->ok = (job->result != NULL);
+			if (!job->ok)
+				job->errmsg = strdup(PQerrorMessage(job->conn));
+			break;
+
+		case BG_LO_IMPORT:
+			job->xfer.conn = job->conn;
+			job->oid = PgLoImportFile(&job->xfer, job->arg);
+			job->ok = (job->oid != InvalidOid);
+			if (!job->ok)
+				job->errmsg = strdup(job->xfer.errmsg);
+			break;
+
+		case BG_LO_EXPORT:
+			job->xfer.conn = job->conn;
+			job->ok = PgLoExportFile(&job->xfer, job->lobjId, job->arg);
+			if (!job->ok)
+				job->errmsg = strdup(job->xfer.errmsg);
+			break;
+
+		case BG_CANCEL:
+			job->ok = PQcancel(job->cancel->cancel, errbuf, sizeof(errbuf));
+			if (!job->ok)
+				job->errmsg = strdup(errbuf);
+			break;
+	}
+
+	job->header.proc = PgBgEventProc;
+	Tcl_ThreadQueueEvent(job->owner, (Tcl_Event *) job, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(job->owner);
+
+	TCL_THREAD_CREATE_RETURN;
+}
+
+static void
+PgBgJoin(Pg_BgJob *job)
+{
+	int			state;
+
+	if (!job->joined)
+	{
+		Tcl_JoinThread(job->thread, &state);
+		job->joined = 1;
+	}
+}
+
+/*
+ * Give the connection back to the owning thread.
+ */
+static void
+PgBgReleaseConnection(Pg_BgJob *job)
+{
+	Pg_ConnectionId *connid = job->connid;
+
+	if (connid == NULL)
+		return;
+
+	if (connid->bg_job == job)
+	{
+		connid->bg_job = NULL;
+		if (connid->conn != NULL)
+		{
+			PgStartNotifyEventSource(connid);
+			PgNotifyTransferEvents(connid);
+		}
+	}
+	Tcl_Release((ClientData) connid);
+}
+
+static void
+PgBgFreeJob(Pg_BgJob *job)
+{
+	int			i;
+
+	ckfree(job->arg);
+	for (i = 0; i < job->nParams; i++)
+		if (job->params[i] != NULL)
+			ckfree(job->params[i]);
+	if (job->params != NULL)
+		ckfree((char *)job->params);
+	if (job->connhandle != NULL)
+		ckfree(job->connhandle);
+	if (job->cancel != NULL)
+		PgBgCancelRelease(job->cancel);
+	if (job->errmsg != NULL)
+		free(job->errmsg);
+	if (job->progress != NULL)
+		Tcl_DecrRefCount(job->progress);
+	Tcl_MutexFinalize(&job->mutex);
+	Tcl_DecrRefCount(job->callback);
+	Tcl_Release((ClientData) job->interp);
+	/* the job itself is the event, Tcl frees that */
+}
+
+/*
+ * Back on the owning thread: turn the outcome into "ok value" or
+ * "error message" and run the callback with it.
+ */
+static int
+PgBgEventProc(Tcl_Event *evPtr, int flags)
+{
+	Pg_BgJob   *job = (Pg_BgJob *) evPtr;
+	Tcl_Interp *interp = job->interp;
+	Pg_ConnectionId *connid = job->connid;
+	Tcl_Obj    *value = NULL;
+	Tcl_Obj    *cmd;
+	int			dead;
+
+	/* like notifies, these count as file events */
+	if (!(flags & TCL_FILE_EVENTS))
+		return 0;
+
+	PgBgForget(job);
+	PgBgJoin(job);
+	PgBgReleaseConnection(job);
+
+	dead = Tcl_InterpDeleted(interp) ||
+		(connid != NULL && connid->conn == NULL);
+
+	if (dead)
+	{
+		if (job->result != NULL)
+			PQclear(job->result);
+		if (job->type == BG_CONNECT && job->conn != NULL)
+			PQfinish(job->conn);
+		PgBgFreeJob(job);
+		return 1;
+	}
+
+	Tcl_Preserve((ClientData) interp);
+
+	switch (job->type)
+	{
+		case BG_CONNECT:
+			if (job->ok && PgSetConnectionId(interp, job->conn, job->connhandle))
+			{
+				value = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
+				if (job->autoreconnect)
+				{
+					Pg_ConnectionId *newid;
+
+					PgGetConnectionId(interp, Tcl_GetString(value), &newid);
+					PgSetAutoReconnect(newid, job->maxretries);
+				}
+			}
+			else
+			{
+				job->ok = 0;
+				value = Tcl_NewStringObj("Connection to database failed\n", -1);
+				if (job->conn == NULL)
+					Tcl_AppendToObj(value, "Could not allocate connection", -1);
+				else if (PQstatus(job->conn) != CONNECTION_OK)
+					Tcl_AppendToObj(value, job->errmsg ? job->errmsg : "", -1);
+				else
+					Tcl_AppendToObj(value, "handle already exists", -1);
+				if (job->conn != NULL)
+					PQfinish(job->conn);
+			}
+			break;
+
+		case BG_EXEC:
+			PgStatsQuery(connid, PG_STATS_BACKGROUND, job->arg, job->nParams,
+						 (const char *const *) job->params);
+			PgStatsResult(connid, job->result, job->usec);
+			if (job->ok)
+			{
+				ExecStatusType rStat = PQresultStatus(job->result);
+				int			rId;
+
+				if (connid->autoreconnect && rStat == PGRES_COMMAND_OK)
+					PgTrackPrepared(connid, job->arg);
+
+				rId = PgSetResultId(interp, connid->id, job->result);
+				if (rStat == PGRES_COPY_IN || rStat == PGRES_COPY_OUT)
+				{
+					connid->res_copyStatus = RES_COPY_INPROGRESS;
+					connid->res_copy = rId;
+				}
+				value = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
+			}
+			else
+				value = Tcl_NewStringObj(job->errmsg ? job->errmsg : "", -1);
+			break;
+
+		case BG_LO_IMPORT:
+			if (job->ok)
+				value = Tcl_NewLongObj((long)job->oid);
+			else
+			{
+				value = Tcl_NewStringObj("import of '", -1);
+				Tcl_AppendStringsToObj(value, job->arg, "' failed: ",
+									   job->errmsg, NULL);
+			}
+			break;
+
+		case BG_LO_EXPORT:
+			value = Tcl_NewStringObj(job->ok ? "" : "export failed: ", -1);
+			if (!job->ok)
+				Tcl_AppendToObj(value, job->errmsg, -1);
+			break;
+
+		case BG_CANCEL:
+			value = Tcl_NewStringObj(job->ok ? "" : job->errmsg, -1);
+			break;
+	}
+
+	cmd = Tcl_DuplicateObj(job->callback);
+	Tcl_IncrRefCount(cmd);
+	Tcl_ListObjAppendElement(NULL, cmd,
+							 Tcl_NewStringObj(job->ok ? "ok" : "error", -1));
+	Tcl_ListObjAppendElement(NULL, cmd, value);
+
+	if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK)
+	{
+		Tcl_AddErrorInfo(interp, "\n    (\"-background\" callback)");
+		Tcl_BackgroundError(interp);
+	}
+	Tcl_DecrRefCount(cmd);
+
+	Tcl_Release((ClientData) interp);
+	PgBgFreeJob(job);
+	return 1;
+}
+
+/*
+ * Back on the owning thread: run the -progress callback with the bytes
+ * done so far and the total.  The job is still there, its own event is
+ * queued after this one.
+ */
+static int
+PgBgProgressEventProc(Tcl_Event *evPtr, int flags)
+{
+	Pg_BgJob   *job = ((Pg_BgProgress *) evPtr)->job;
+	Tcl_Interp *interp = job->interp;
+	Tcl_WideInt done;
+	Tcl_WideInt total;
+	Tcl_Obj    *cmd;
+
+	if (!(flags & TCL_FILE_EVENTS))
+		return 0;
+
+	Tcl_MutexLock(&job->mutex);
+	done = job->progressDone;
+	total = job->progressTotal;
+	job->progressQueued = 0;
+	Tcl_MutexUnlock(&job->mutex);
+
+	if (Tcl_InterpDeleted(interp) || job->connid->conn == NULL)
+		return 1;
+
+	Tcl_Preserve((ClientData) interp);
+
+	cmd = Tcl_DuplicateObj(job->progress);
+	Tcl_IncrRefCount(cmd);
+	Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewWideIntObj(done));
+	Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewWideIntObj(total));
+
+	if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK)
+	{
+		Tcl_AddErrorInfo(interp, "\n    (\"-progress\" callback)");
+		Tcl_BackgroundError(interp);
+	}
+	Tcl_DecrRefCount(cmd);
+
+	Tcl_Release((ClientData) interp);
+	return 1;
+}
+
+static Pg_BgJob *
+PgBgNewJob(Tcl_Interp *interp, enum Pg_BgType type, Tcl_Obj *callback,
+		   CONST84 char *arg)
+{
+	Pg_BgJob   *job = (Pg_BgJob *) ckalloc(sizeof(Pg_BgJob));
+
+	memset(job, 0, sizeof(Pg_BgJob));
+	job->type = type;
+	job->owner = Tcl_GetCurrentThread();
+	job->interp = interp;
+	job->callback = callback;
+	Tcl_IncrRefCount(callback);
+	Tcl_Preserve((ClientData) interp);
+	job->arg = ckalloc(strlen(arg) + 1);
+	strcpy(job->arg, arg);
+	return job;
+}
+
+/*
+ * Hand a job to a new worker thread.  If the job works on a connection,
+ * the worker owns it until the job comes back.
+ */
+static int
+PgBgStart(Tcl_Interp *interp, Pg_BgJob *job, Pg_ConnectionId *connid)
+{
+	ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+		Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+
+	if (connid != NULL)
+	{
+		job->connid = connid;
+		job->conn = connid->conn;
+		Tcl_Preserve((ClientData) connid);
+		connid->bg_job = job;
+
+		/* made now, while no other thread uses the connection */
+		job->cancel = PgBgCancelNew(job->conn);
+
+		/* the notifier mustn't read from the socket behind libpq's back */
+		PgSuspendNotifyEventSource(connid);
+	}
+
+	if (Tcl_CreateThread(&job->thread, PgBgThreadProc, (ClientData) job,
+						 TCL_THREAD_STACK_DEFAULT,
+						 TCL_THREAD_JOINABLE) != TCL_OK)
+	{
+		job->joined = 1;
+		PgBgReleaseConnection(job);
+		PgBgFreeJob(job);
+		ckfree((char *)job);
+		Tcl_SetResult(interp, "can't create a background thread", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if (!tsdPtr->initialized)
+	{
+		tsdPtr->initialized = 1;
+		Tcl_CreateThreadExitHandler(PgBgThreadExit, NULL);
+	}
+	job->next = tsdPtr->jobs;
+	tsdPtr->jobs = job;
+
+	Tcl_ResetResult(interp);
+	return TCL_OK;
+}
+
+/*
+ * pg_connect ... -background callback
+ */
+int
+PgBackgroundConnect(Tcl_Interp *interp, Tcl_Obj *callback,
+					CONST84 char *conninfo, CONST84 char *connhandle,
+					int autoreconnect, int maxretries)
+{
+	Pg_BgJob   *job = PgBgNewJob(interp, BG_CONNECT, callback, conninfo);
+
+	if (connhandle != NULL)
+	{
+		job->connhandle = ckalloc(strlen(connhandle) + 1);
+		strcpy(job->connhandle, connhandle);
+	}
+	job->autoreconnect = autoreconnect;
+	job->maxretries = maxretries;
+
+	return PgBgStart(interp, job, NULL);
+}
+
+/*
+ * pg_exec -background callback connection query ?parm...?
+ *
+ * A parameter with the value NULL is sent as an SQL NULL, as pg_exec
+ * does.
+ */
+int
+PgBackgroundExec(Tcl_Interp *interp, Pg_ConnectionId * connid,
+				 Tcl_Obj *callback, CONST84 char *query,
+				 int nParams, Tcl_Obj *CONST params[])
+{
+	Pg_BgJob   *job = PgBgNewJob(interp, BG_EXEC, callback, query);
+	int			i;
+
+	if (nParams > 0)
+	{
+		job->nParams = nParams;
+		job->params = (char **)ckalloc(nParams * sizeof(char *));
+		for (i = 0; i < nParams; i++)
+		{
+			int			len;
+			char	   *param = Tcl_GetStringFromObj(params[i], &len);
+
+			if (strcmp(param, "NULL") == 0)
+				job->params[i] = NULL;
+			else
+			{
+				job->params[i] = ckalloc(len + 1);
+				memcpy(job->params[i], param, len + 1);
+			}
+		}
+	}
+
+	return PgBgStart(interp, job, connid);
+}
+
+/*
+ * Take the options of a large object transfer, and the -progress
+ * callback, which may be NULL.
+ */
+static void
+PgBgLoTransfer(Pg_BgJob *job, Pg_LoTransfer *xfer, Tcl_Obj *progress)
+{
+	job->xfer = *xfer;
+	job->xfer.progressProc = PgBgProgress;
+	job->xfer.clientData = (ClientData) job;
+	job->progress = progress;
+	if (progress != NULL)
+		Tcl_IncrRefCount(progress);
+}
+
+/*
+ * pg_lo_import ?options? -background callback conn filename
+ */
+int
+PgBackgroundLoImport(Tcl_Interp *interp, Pg_ConnectionId * connid,
+					 Tcl_Obj *callback, Pg_LoTransfer *xfer,
+					 Tcl_Obj *progress, CONST84 char *filename)
+{
+	Pg_BgJob   *job = PgBgNewJob(interp, BG_LO_IMPORT, callback, filename);
+
+	PgBgLoTransfer(job, xfer, progress);
+	return PgBgStart(interp, job, connid);
+}
+
+/*
+ * pg_lo_export ?options? -background callback conn lobjId filename
+ */
+int
+PgBackgroundLoExport(Tcl_Interp *interp, Pg_ConnectionId * connid,
+					 Tcl_Obj *callback, Pg_LoTransfer *xfer,
+					 Tcl_Obj *progress, Oid lobjId, CONST84 char *filename)
+{
+	Pg_BgJob   *job = PgBgNewJob(interp, BG_LO_EXPORT, callback, filename);
+
+	PgBgLoTransfer(job, xfer, progress);
+	job->lobjId = lobjId;
+	return PgBgStart(interp, job, connid);
+}
+
+/*
+ * pg_cancelrequest -background callback connection
+ *
+ * This doesn't take the connection, it only needs its cancel key, so it
+ * can cancel a background operation that is in flight.  That one's
+ * PGcancel is shared, the connection can't be asked for another.
+ */
+int
+PgBackgroundCancel(Tcl_Interp *interp, Pg_ConnectionId * connid,
+				   Tcl_Obj *callback)
+{
+	Pg_BgJob   *job;
+	Pg_BgCancel *cancel;
+
+	if (connid->bg_job != NULL)
+	{
+		cancel = connid->bg_job->cancel;
+		if (cancel != NULL)
+			cancel->refCount++;
+	}
+	else
+		cancel = PgBgCancelNew(connid->conn);
+
+	if (cancel == NULL)
+	{
+		Tcl_SetResult(interp, "can't get the cancel key of the connection",
+					  TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	job = PgBgNewJob(interp, BG_CANCEL, callback, "");
+	job->cancel = cancel;
+	return PgBgStart(interp, job, NULL);
+}
+
+/*
+ * Cancel the query of a connection's background operation from this
+ * thread, with the PGcancel made before the worker took it.  Returns 0
+ * and leaves a message in errbuf on failure.
+ */
+int
+PgBackgroundCancelNow(Pg_ConnectionId * connid, char *errbuf, int errbufsize)
+{
+	Pg_BgJob   *job = connid->bg_job;
+
+	if (job == NULL || job->cancel == NULL)
+	{
+		strncpy(errbuf, "can't get the cancel key of the connection",
+				errbufsize - 1);
+		errbuf[errbufsize - 1] = '\0';
+		return 0;
+	}
+	return PQcancel(job->cancel->cancel, errbuf, errbufsize);
+}
+
+/*
+ * The connection is being closed.  If a worker has it, cancel what it
+ * is doing and wait for it to let go.  The queued event then finds the
+ * connection gone and just cleans up.
+ */
+void
+PgBackgroundWait(Pg_ConnectionId * connid)
+{
+	Pg_BgJob   *job = connid->bg_job;
+	char		errbuf[256];
+
+	if (job == NULL)
+		return;
+
+	if (job->type == BG_EXEC)
+		PgBackgroundCancelNow(connid, errbuf, sizeof(errbuf));
+	else if (job->type == BG_LO_IMPORT || job->type == BG_LO_EXPORT)
+	{
+		/* it stops after the chunk in hand */
+		Tcl_MutexLock(&job->mutex);
+		job->abort = 1;
+		Tcl_MutexUnlock(&job->mutex);
+	}
+
+	PgBgJoin(job);
+	connid->bg_job = NULL;
+}
+
+/*
+ * Tcl_DeleteEvents proc: throw away the events of jobs that come back
+ * to a thread that is exiting, cleaning up after the job as
+ * PgBgEventProc would for a dead interpreter.
+ */
+static int
+PgBgDiscardEvent(Tcl_Event *evPtr, ClientData cData)
+{
+	Pg_BgJob   *job;
+
+	if (evPtr->proc == PgBgProgressEventProc)
+		return 1;
+	if (evPtr->proc != PgBgEventProc)
+		return 0;
+
+	job = (Pg_BgJob *) evPtr;
+	PgBgJoin(job);
+	if (job->connid != NULL)
+	{
+		/* no notifier to give the connection back to */
+		if (job->connid->bg_job == job)
+			job->connid->bg_job = NULL;
+		Tcl_Release((ClientData) job->connid);
+	}
+	if (job->result != NULL)
+		PQclear(job->result);
+	if (job->type == BG_CONNECT && job->conn != NULL)
+		PQfinish(job->conn);
+	PgBgFreeJob(job);
+	return 1;
+}
+
+/*
+ * The thread is exiting with jobs out.  Stop the transfers, wait for
+ * every worker to finish, which queues its event here, then throw the
+ * events away, as they would never be run.
+ */
+static void
+PgBgThreadExit(ClientData cData)
+{
+	ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+		Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+	Pg_BgJob   *job;
+
+	for (job = tsdPtr->jobs; job != NULL; job = job->next)
+	{
+		if (job->type == BG_LO_IMPORT || job->type == BG_LO_EXPORT)
+		{
+			Tcl_MutexLock(&job->mutex);
+			job->abort = 1;
+			Tcl_MutexUnlock(&job->mutex);
+		}
+		else if (job->type == BG_EXEC && job->cancel != NULL)
+		{
+			char		errbuf[256];
+
+			PQcancel(job->cancel->cancel, errbuf, sizeof(errbuf));
+		}
+		PgBgJoin(job);
+	}
+	tsdPtr->jobs = NULL;
+
+	Tcl_DeleteEvents(PgBgDiscardEvent, NULL);
+}
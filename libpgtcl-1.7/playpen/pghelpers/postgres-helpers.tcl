@@ -34,13 +34,7 @@ namespace eval sc_pg {
 #  the code body against it.
 #
 proc foreach_tuple {res arrayName body} {
-    upvar $arrayName $arrayName
-
-    set numTuples [pg_result $res -numTuples]
-    for {set i 0} {$i < $numTuples} {incr i} {
-	pg_result $res -tupleArray $i $arrayName
-	uplevel 1 $body
-    }
+    uplevel 1 [list pg_result $res -foreach -array $arrayName $body]
 }
 
 #
@@ -0,0 +1,532 @@
+#
+# program to benchmark Pgtcl end to end against a private PostgreSQL
+#  cluster, writing the results as JSON so runs can be compared.
+#
+# usage: tclsh bench.tcl ?-out file? ?-scale n? ?-iterations n?
+#            ?-only pattern? ?-label text? ?-pgbin dir? ?-conninfo string?
+#            ?-keep? ?-rtt list? ?-jitter ms? ?-bandwidth bytes?
+#
+# Unless -conninfo names a server to use, it runs initdb and starts a
+# cluster listening only on a Unix socket in a temporary directory, and
+# removes it afterwards.  The initdb and pg_ctl used are those in -pgbin,
+# $PG_BIN, "pg_config --bindir" or the PATH, in that order.
+#
+# The sample data set, tests/sampledata.txt, is loaded -scale times.
+# -iterations is the number of round trips the latency benchmarks make;
+# the bulk ones scale with the data instead.  -only runs the benchmarks
+# whose names match a glob pattern.  "make bench" runs this with
+# BENCHFLAGS.
+#
+# -rtt is a list of round-trip times in milliseconds, such as
+# {0.1 1 10}.  For each, the round trip, pipelining and COPY benchmarks
+# run again through latency_proxy.tcl, with that delay, -jitter and
+# -bandwidth, and their names get a suffix such as _rtt1ms.  The cluster
+# then listens on 127.0.0.1 too; a -conninfo server must be reached over
+# TCP, by host and port.  An -rtt of 0 measures what the proxy itself
+# costs.
+#
+# $Id$
+#
+
+set tmpDir /tmp
+if {[info exists env(TMPDIR)]} {
+    set tmpDir $env(TMPDIR)
+}
+
+array set opt {
+    out        ""
+    scale      10
+    iterations 2000
+    only       *
+    label      ""
+    pgbin      ""
+    conninfo   ""
+    keep       0
+    rtt        ""
+    jitter     0
+    bandwidth  0
+}
+
+proc usage {} {
+    puts stderr "usage: [file tail [info script]] ?-out file? ?-scale n? ?-iterations n? ?-only pattern? ?-label text? ?-pgbin dir? ?-conninfo string? ?-keep? ?-rtt list? ?-jitter ms? ?-bandwidth bytes?"
+    exit 1
+}
+
+for {set i 0} {$i < [llength $argv]} {incr i} {
+    set arg [lindex $argv $i]
+    switch -- $arg {
+        -keep {
+            set opt(keep) 1
+        }
+        -out - -scale - -iterations - -only - -label - -pgbin - -conninfo -
+        -rtt - -jitter - -bandwidth {
+            if {[incr i] >= [llength $argv]} usage
+            set opt([string range $arg 1 end]) [lindex $argv $i]
+        }
+        default usage
+    }
+}
+
+source [file join [file dirname [info script]] benchlib.tcl]
+
+#
+# the throwaway cluster
+#
+proc pgbin {program} {
+    global opt env
+
+    set dirs {}
+    if {$opt(pgbin) ne ""} {
+        lappend dirs $opt(pgbin)
+    }
+    if {[info exists env(PG_BIN)]} {
+        lappend dirs $env(PG_BIN)
+    }
+    if {![catch {exec pg_config --bindir} dir]} {
+        lappend dirs $dir
+    }
+    foreach dir $dirs {
+        set path [file join $dir $program]
+        if {[file executable $path]} {
+            return $path
+        }
+    }
+    set path [auto_execok $program]
+    if {$path eq ""} {
+        error "can't find $program; use -pgbin or -conninfo"
+    }
+    return [lindex $path 0]
+}
+
+# With a port, the cluster listens on it on 127.0.0.1 as well
+proc cluster_start {{port ""}} {
+    global tmpDir
+
+    # short, since the socket path is limited to about 100 bytes
+    set dir [file join $tmpDir pgtcl-bench-[pid]]
+    file delete -force $dir
+    file mkdir $dir
+
+    exec [pgbin initdb] -D [file join $dir data] -A trust -U postgres \
+        -E UTF8 -N >& [file join $dir initdb.log]
+    if {$port eq ""} {
+        set listen "-c listen_addresses="
+    } else {
+        set listen "-c listen_addresses=127.0.0.1 -p $port"
+    }
+    exec [pgbin pg_ctl] -D [file join $dir data] -l [file join $dir server.log] \
+        -w -o "-k $dir $listen -c fsync=off" start \
+        >& [file join $dir pg_ctl.log]
+    return $dir
+}
+
+proc cluster_stop {dir} {
+    global opt
+
+    catch {exec [pgbin pg_ctl] -D [file join $dir data] -m fast -w stop \
+        >& [file join $dir pg_ctl.log]}
+    if {!$opt(keep)} {
+        file delete -force $dir
+    } else {
+        puts stderr "cluster kept in $dir"
+    }
+}
+
+#
+# the latency proxy, a process of its own since pg_exec blocks
+#
+proc free_port {} {
+    set sock [socket -server {} -myaddr 127.0.0.1 0]
+    set port [lindex [fconfigure $sock -sockname] 2]
+    close $sock
+    return $port
+}
+
+proc proxy_start {target rtt} {
+    global opt benchDir
+
+    set chan [open |[list [info nameofexecutable] \
+        [file join $benchDir latency_proxy.tcl] -target $target \
+        -delay [expr {$rtt / 2.0}] -jitter $opt(jitter) \
+        -bandwidth $opt(bandwidth)] r]
+    if {[gets $chan port] <= 0} {
+        catch {close $chan}
+        error "latency_proxy.tcl didn't start"
+    }
+    return [list $chan $port]
+}
+
+proc proxy_stop {proxy} {
+    set chan [lindex $proxy 0]
+    catch {exec kill [pid $chan]}
+    catch {close $chan}
+}
+
+proc check {res {status PGRES_COMMAND_OK}} {
+    if {[pg_result $res -status] ne $status} {
+        set err [pg_result $res -error]
+        pg_result $res -clear
+        error $err
+    }
+    pg_result $res -clear
+}
+
+proc bench_head {conn rows} {
+    global opt
+
+    set server ""
+    catch {
+        pg_select $conn {SHOW server_version} r {set server $r(server_version)}
+    }
+    return [json_head [dict create server $server scale $opt(scale) rows $rows]]
+}
+
+#
+# the data: sampledata.txt, scale times over, with unique emails
+#
+proc copy_line {fields} {
+    set map {\\ \\\\ \t \\t \n \\n \r \\r}
+    set out {}
+    foreach f $fields {
+        lappend out [string map $map $f]
+    }
+    return [join $out \t]
+}
+
+proc copy_in {conn table lines} {
+    # the result has to stay until the copy is done
+    set res [pg_exec $conn "COPY $table FROM STDIN"]
+    if {[pg_result $res -status] ne "PGRES_COPY_IN"} {
+        check $res PGRES_COPY_IN
+    }
+    set batch {}
+    foreach line $lines {
+        lappend batch $line
+        if {[llength $batch] == 1000} {
+            puts $conn [join $batch \n]
+            set batch {}
+        }
+    }
+    if {[llength $batch] > 0} {
+        puts $conn [join $batch \n]
+    }
+    puts $conn "\\."
+    check $res
+}
+
+proc load_data {conn} {
+    global opt benchDir
+
+    check [pg_exec $conn {
+        CREATE TABLE pgtest_people (
+            email varchar, name varchar, address varchar,
+            city varchar, state varchar, zip varchar)
+    }]
+    check [pg_exec $conn {CREATE TABLE pgtest_copy (LIKE pgtest_people)}]
+
+    set f [open [file join [file dirname $benchDir] sampledata.txt]]
+    set sample [split [string trimright [read $f] \n] \n]
+    close $f
+
+    set lines {}
+    for {set i 0} {$i < $opt(scale)} {incr i} {
+        foreach rec $sample {
+            lappend lines [copy_line [lreplace $rec 0 0 "$i.[lindex $rec 0]"]]
+        }
+    }
+    copy_in $conn pgtest_people $lines
+    check [pg_exec $conn {ANALYZE pgtest_people}]
+    return $lines
+}
+
+#
+# the benchmarks
+#
+proc run {conn conn2 lines} {
+    global opt tmpDir
+
+    set n $opt(iterations)
+    set rows [llength $lines]
+
+    # round trips
+    measure exec_select1 $n {
+        pg_result [pg_exec $conn {SELECT 1}] -clear
+    }
+    measure exec_params $n {
+        pg_result [pg_exec $conn {SELECT $1::int} 1] -clear
+    }
+    check [pg_exec $conn {PREPARE bench_q (int) AS SELECT $1}]
+    measure exec_prepared $n {
+        pg_result [pg_exec_prepared $conn bench_q 1] -clear
+    }
+    measure sendquery_getresult $n {
+        pg_sendquery $conn {SELECT 1}
+        while {[set res [pg_getresult $conn]] ne ""} {
+            pg_result $res -clear
+        }
+    }
+
+    # materializing a result of all the rows
+    set bulk 5
+    set res [pg_exec $conn {SELECT * FROM pgtest_people}]
+    measure result_list $bulk {
+        pg_result $res -list
+    } $rows rows
+    measure result_llist $bulk {
+        pg_result $res -llist
+    } $rows rows
+    measure result_dict $bulk {
+        pg_result $res -dict
+    } $rows rows
+    measure result_assign $bulk {
+        pg_result $res -assign people
+        unset people
+    } $rows rows
+    pg_result $res -clear
+
+    # running a script for each row
+    measure execute_loop $bulk {
+        pg_execute -array row $conn {SELECT * FROM pgtest_people} {incr seen}
+    } $rows rows
+    measure select_loop $bulk {
+        pg_select $conn {SELECT * FROM pgtest_people} row {incr seen}
+    } $rows rows
+
+    # and for wide rows, where setting the variables is most of the cost
+    foreach cols {10 100} {
+        set fields {}
+        for {set c 1} {$c <= $cols} {incr c} {
+            lappend fields "repeat('x', 16) AS c$c"
+        }
+        set wide "SELECT [join $fields ", "] FROM generate_series(1, 1000)"
+        measure execute_loop_cols$cols $bulk {
+            pg_execute $conn $wide {incr seen}
+        } 1000 rows
+        measure execute_loop_array_cols$cols $bulk {
+            pg_execute -array row $conn $wide {incr seen}
+        } 1000 rows
+        measure select_loop_cols$cols $bulk {
+            pg_select $conn $wide row {incr seen}
+        } 1000 rows
+    }
+
+    # quoting and bytea
+    set text [string repeat "it's a \\ test " 16]
+    measure quote [expr {$n * 10}] {
+        pg_quote $text
+    } [string length $text] bytes
+    set blob {}
+    for {set i 0} {$i < 65536} {incr i} {
+        append blob [format %c [expr {$i % 256}]]
+    }
+    set blob [encoding convertto iso8859-1 $blob]
+    measure bytea_escape 200 {
+        set escaped [pg_escape_bytea $blob]
+    } 65536 bytes
+    measure bytea_unescape 200 {
+        pg_unescape_bytea $escaped
+    } 65536 bytes
+
+    # COPY through the connection channel
+    measure copy_in $bulk {
+        check [pg_exec $conn {TRUNCATE pgtest_copy}]
+        copy_in $conn pgtest_copy $lines
+    } $rows rows
+    measure copy_out $bulk {
+        set res [pg_exec $conn {COPY pgtest_people TO STDOUT}]
+        # gets can come up empty before the end, which changes the status
+        while {[pg_result $res -status] eq "PGRES_COPY_OUT"} {
+            gets $conn line
+        }
+        check $res
+    } $rows rows
+
+    # large objects, through files and channels
+    set size [expr {32 * 1024 * 1024}]
+    set file [file join $tmpDir pgtcl-bench-[pid].bin]
+    set f [open $file w]
+    fconfigure $f -translation binary
+    for {set i 0} {$i < $size / 65536} {incr i} {
+        puts -nonewline $f $blob
+    }
+    close $f
+    set oids {}
+    measure lo_import 3 {
+        lappend oids [pg_lo_import $conn $file]
+    } $size bytes
+    measure lo_import_pipelined 3 {
+        lappend oids [pg_lo_import -pipeline 8 $conn $file]
+    } $size bytes
+    set oid [lindex $oids 0]
+    measure lo_export 3 {
+        pg_lo_export $conn $oid $file
+    } $size bytes
+    measure lo_export_pipelined 3 {
+        pg_lo_export -pipeline 8 $conn $oid $file
+    } $size bytes
+    measure lo_channel_read 3 {
+        set chan [pg_lo_channel $conn $oid r]
+        while {![eof $chan]} {
+            read $chan 1048576
+        }
+        close $chan
+    } $size bytes
+    check [pg_exec $conn BEGIN]
+    foreach oid $oids {
+        pg_lo_unlink $conn $oid
+    }
+    check [pg_exec $conn COMMIT]
+    file delete $file
+
+    # notifications from another connection
+    set count [expr {$n * 10}]
+    pg_listen $conn bench_notify {incr ::notified}
+    measure notify 3 {
+        set ::notified 0
+        check [pg_exec $conn2 "SELECT pg_notify('bench_notify', g::text) FROM generate_series(1, $count) g"] PGRES_TUPLES_OK
+        while {$::notified < $count} {
+            vwait ::notified
+        }
+    } $count notifies
+    pg_listen $conn bench_notify
+}
+
+#
+# What network latency does to round trips, pipelining and COPY, on a
+# connection through the latency proxy.  Fewer round trips the longer
+# they take, so that a run takes about as long at each rtt.
+#
+proc run_rtt {conn lines rtt} {
+    global opt tmpDir
+
+    set ::resultTags [dict create rtt_ms $rtt]
+    set suffix _rtt${rtt}ms
+    set n [expr {max(20, int($opt(iterations) / (1.0 + $rtt)))}]
+    set rows [llength $lines]
+
+    measure exec_select1$suffix $n {
+        pg_result [pg_exec $conn {SELECT 1}] -clear
+    }
+    check [pg_exec $conn {PREPARE bench_q (int) AS SELECT $1}]
+    measure exec_prepared$suffix $n {
+        pg_result [pg_exec_prepared $conn bench_q 1] -clear
+    }
+    measure sendquery_getresult$suffix $n {
+        pg_sendquery $conn {SELECT 1}
+        while {[set res [pg_getresult $conn]] ne ""} {
+            pg_result $res -clear
+        }
+    }
+    # ten statements for one round trip
+    set batch [join [lrepeat 10 {SELECT 1}] {; }]
+    measure sendquery_batch10$suffix $n {
+        pg_sendquery $conn $batch
+        while {[set res [pg_getresult $conn]] ne ""} {
+            pg_result $res -clear
+        }
+    } 10 queries
+
+    # a table of its own, since a -conninfo run keeps the data in pg_temp
+    check [pg_exec $conn {
+        CREATE TEMP TABLE pgtest_rtt (
+            email varchar, name varchar, address varchar,
+            city varchar, state varchar, zip varchar)
+    }]
+    copy_in $conn pgtest_rtt $lines
+    measure copy_in$suffix 3 {
+        check [pg_exec $conn {TRUNCATE pgtest_rtt}]
+        copy_in $conn pgtest_rtt $lines
+    } $rows rows
+    measure copy_out$suffix 3 {
+        set res [pg_exec $conn {COPY pgtest_rtt TO STDOUT}]
+        while {[pg_result $res -status] eq "PGRES_COPY_OUT"} {
+            gets $conn line
+        }
+        check $res
+    } $rows rows
+
+    # large objects move in chunks of a round trip each, unless pipelined
+    set size [expr {4 * 1024 * 1024}]
+    set file [file join $tmpDir pgtcl-bench-[pid].bin]
+    set f [open $file w]
+    fconfigure $f -translation binary
+    puts -nonewline $f [string repeat [binary format c* {0 1 2 3}] [expr {$size / 4}]]
+    close $f
+    set oids {}
+    measure lo_import$suffix 3 {
+        lappend oids [pg_lo_import $conn $file]
+    } $size bytes
+    measure lo_import_pipelined$suffix 3 {
+        lappend oids [pg_lo_import -pipeline 8 $conn $file]
+    } $size bytes
+    check [pg_exec $conn BEGIN]
+    foreach oid $oids {
+        pg_lo_unlink $conn $oid
+    }
+    check [pg_exec $conn COMMIT]
+    file delete $file
+
+    set ::resultTags {}
+}
+
+#
+# main
+#
+set cluster ""
+set proxy ""
+set code [catch {
+    if {$opt(conninfo) ne ""} {
+        set conninfo $opt(conninfo)
+        if {$opt(rtt) ne ""} {
+            if {![regexp {(?:^|\s)host=([^/\s]\S*)} $conninfo -> host]} {
+                error "-rtt needs a -conninfo with a host= to reach over TCP"
+            }
+            set port 5432
+            regexp {(?:^|\s)port=(\d+)} $conninfo -> port
+            set target $host:$port
+        }
+    } else {
+        set port ""
+        if {$opt(rtt) ne ""} {
+            set port [free_port]
+            set target 127.0.0.1:$port
+        }
+        set cluster [cluster_start $port]
+        set conninfo "host=$cluster dbname=postgres user=postgres"
+        if {$port ne ""} {
+            append conninfo " port=$port"
+        }
+    }
+
+    set conn [pg_connect -conninfo $conninfo]
+    set conn2 [pg_connect -conninfo $conninfo]
+    if {$opt(conninfo) ne ""} {
+        # somebody else's database: keep to a temporary schema
+        check [pg_exec $conn {SET search_path = pg_temp}]
+    }
+    set lines [load_data $conn]
+    run $conn $conn2 $lines
+    foreach rtt $opt(rtt) {
+        set proxy [proxy_start $target $rtt]
+        set rttConn [pg_connect -conninfo \
+            "$conninfo host=127.0.0.1 hostaddr=127.0.0.1 port=[lindex $proxy 1]"]
+        run_rtt $rttConn $lines $rtt
+        pg_disconnect $rttConn
+        proxy_stop $proxy
+        set proxy ""
+    }
+    write_json [bench_head $conn [llength $lines]]
+    pg_disconnect $conn2
+    pg_disconnect $conn
+} err opts]
+
+if {$proxy ne ""} {
+    proxy_stop $proxy
+}
+if {$cluster ne ""} {
+    cluster_stop $cluster
+}
+if {$code} {
+    puts stderr [dict get $opts -errorinfo]
+    exit 1
+}
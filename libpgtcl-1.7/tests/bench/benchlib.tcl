@@ -0,0 +1,148 @@
+#
+# what bench.tcl and micro.tcl share: loading the package, timing a
+# benchmark and writing the results as JSON.  The script sourcing it sets
+# opt(only), the glob pattern of the benchmarks to run, and opt(out),
+# the file for the JSON or "" for stdout.
+#
+# $Id$
+#
+
+set benchDir [file dirname [file normalize [info script]]]
+set srcDir [file dirname [file dirname $benchDir]]
+
+#
+# the package: installed, or the one just built, as pgtcl.test finds it
+#
+if {[catch {package require Pgtcl}]} {
+    set flist [glob -nocomplain libpgtcl*[info sharedlibextension]]
+    set flist [concat $flist [glob -nocomplain -dir .. libpgtcl*[info sharedlibextension]]]
+    if {[llength $flist] == 0} {
+        puts stderr "Can not find a shared lib file"
+        exit 1
+    }
+    load [file normalize [lindex $flist 0]]
+}
+
+#
+# measuring
+#
+set results {}
+
+# fields added to the results of the benchmarks being run, as {rtt_ms 1}
+set resultTags {}
+
+#
+# Run body count times, after a few to warm up, timing each run.  A body
+# that handles items of some unit each time, rows or bytes, also gets a
+# rate of those.
+#
+proc measure {name count body {items 0} {unit ""}} {
+    global opt results
+
+    if {![string match $opt(only) $name]} {
+        return
+    }
+
+    set warmup [expr {$count >= 20 ? $count / 10 : 1}]
+    if {$warmup > 10} {
+        set warmup 10
+    }
+    for {set i 0} {$i < $warmup} {incr i} {
+        uplevel 1 $body
+    }
+
+    set times {}
+    set start [clock microseconds]
+    for {set i 0} {$i < $count} {incr i} {
+        set t [clock microseconds]
+        uplevel 1 $body
+        lappend times [expr {[clock microseconds] - $t}]
+    }
+    set total [expr {[clock microseconds] - $start}]
+    set times [lsort -integer $times]
+    set seconds [expr {$total / 1e6}]
+
+    set r [dict merge [dict create name $name] $::resultTags [dict create \
+        ops $count seconds [format %.6f $seconds] \
+        ops_per_sec [format %.1f [expr {$count / $seconds}]] \
+        p50_usec [percentile $times 0.50] \
+        p95_usec [percentile $times 0.95] \
+        p99_usec [percentile $times 0.99] \
+        max_usec [lindex $times end]]]
+    if {$items > 0} {
+        dict set r unit $unit
+        dict set r items [expr {wide($items) * $count}]
+        dict set r items_per_sec [format %.1f [expr {$items * $count / $seconds}]]
+    }
+    lappend results $r
+    puts stderr [format "%-28s %10s ops/s  p50 %8s us  p99 %8s us%s" $name \
+        [dict get $r ops_per_sec] [dict get $r p50_usec] [dict get $r p99_usec] \
+        [expr {$items > 0 ? "  [dict get $r items_per_sec] $unit/s" : ""}]]
+}
+
+proc percentile {sorted fraction} {
+    set n [llength $sorted]
+    set i [expr {int(ceil($fraction * $n)) - 1}]
+    if {$i < 0} {
+        set i 0
+    }
+    return [lindex $sorted $i]
+}
+
+#
+# JSON, for the few types we write: these fields are strings even when
+# they look like numbers, the rest are numbers
+#
+set jsonStrings {label commit date tcl pgtcl server name unit}
+
+proc json_string {s} {
+    set map {\" \\\" \\ \\\\ \n \\n \r \\r \t \\t}
+    return "\"[string map $map $s]\""
+}
+
+
+proc json_object {d {indent "    "}} {
+    set fields {}
+    dict for {k v} $d {
+        if {$k ni $::jsonStrings} {
+            lappend fields "$indent[json_string $k]: $v"
+        } else {
+            lappend fields "$indent[json_string $k]: [json_string $v]"
+        }
+    }
+    return "\{\n[join $fields ",\n"]\n[string range $indent 4 end]\}"
+}
+
+#
+# The head of the results: the label, the commit, the date and the
+# versions, then the fields in extra.
+#
+proc json_head {extra} {
+    global opt srcDir
+
+    set commit ""
+    catch {set commit [exec git -C $srcDir rev-parse --short HEAD 2>/dev/null]}
+
+    return [dict merge [dict create label $opt(label) commit $commit \
+        date [clock format [clock seconds] -format %Y-%m-%dT%H:%M:%SZ -gmt 1] \
+        tcl [info patchlevel] pgtcl [package present Pgtcl]] $extra]
+}
+
+proc write_json {head} {
+    global opt results
+
+    set items {}
+    foreach r $results {
+        lappend items "    [json_object $r {        }]"
+    }
+    set json [string range [json_object $head] 0 end-2]
+    append json ",\n    \"results\": \[\n[join $items ",\n"]\n    \]\n\}\n"
+
+    if {$opt(out) eq ""} {
+        puts -nonewline $json
+    } else {
+        set f [open $opt(out) w]
+        puts -nonewline $f $json
+        close $f
+    }
+}
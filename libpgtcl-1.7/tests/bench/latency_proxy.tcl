@@ -0,0 +1,173 @@
+#
+# program to relay TCP connections to a PostgreSQL server, delaying
+#  what passes through as a network would, so round trips cost what they
+#  do between machines rather than over a local socket.
+#
+# usage: tclsh latency_proxy.tcl -target host:port ?-listen port?
+#            ?-delay ms? ?-jitter ms? ?-bandwidth bytes? ?-seed n?
+#
+# Each read from either side, up to 64k, is a packet.  It is sent on
+# -delay milliseconds later, plus up to -jitter more at random, so a
+# round trip takes twice the delay.  -bandwidth limits each direction of
+# each connection to that many bytes a second, and packets wait for the
+# link as they would for a slow one.  Packets are never reordered, as
+# TCP doesn't, and the delays can be fractions of a millisecond: those
+# under 2ms are waited for by polling, which costs a CPU.
+#
+# It listens on 127.0.0.1, on -listen or any free port, and writes the
+# port to stdout when it is ready.  bench.tcl runs it for -rtt; to use it
+# by hand:
+#
+#     tclsh latency_proxy.tcl -target 127.0.0.1:5432 -listen 6432 -delay 0.5
+#     psql -h 127.0.0.1 -p 6432
+#
+# $Id$
+#
+
+array set opt {
+    target    ""
+    listen    0
+    delay     0
+    jitter    0
+    bandwidth 0
+    seed      ""
+}
+
+proc usage {} {
+    puts stderr "usage: [file tail [info script]] -target host:port ?-listen port? ?-delay ms? ?-jitter ms? ?-bandwidth bytes? ?-seed n?"
+    exit 1
+}
+
+for {set i 0} {$i < [llength $argv]} {incr i} {
+    set arg [lindex $argv $i]
+    switch -- $arg {
+        -target - -listen - -delay - -jitter - -bandwidth - -seed {
+            if {[incr i] >= [llength $argv]} usage
+            set opt([string range $arg 1 end]) [lindex $argv $i]
+        }
+        default usage
+    }
+}
+
+if {![regexp {^(.+):(\d+)$} $opt(target) -> targetHost targetPort]} usage
+foreach o {delay jitter bandwidth} {
+    if {![string is double -strict $opt($o)] || $opt($o) < 0} usage
+}
+if {$opt(seed) ne ""} {
+    expr {srand($opt(seed))}
+}
+
+# in microseconds, as the clock is read
+set delay [expr {$opt(delay) * 1000.0}]
+set jitter [expr {$opt(jitter) * 1000.0}]
+
+#
+# A pipe is one direction of a connection, id,up or id,down.  What it
+# has read waits in queue($pipe) as {due data} pairs, data "" meaning the
+# sender closed.  free($pipe) is when the link is next free and last($pipe)
+# when the last packet is due, both in microseconds.
+#
+proc accept {sock addr port} {
+    global targetHost targetPort
+
+    if {[catch {socket $targetHost $targetPort} peer]} {
+        puts stderr "can't connect to $targetHost:$targetPort: $peer"
+        close $sock
+        return
+    }
+    set id [incr ::connections]
+    foreach chan [list $sock $peer] {
+        fconfigure $chan -blocking 0 -translation binary -buffering none
+    }
+    set ::sockets($id) [list $sock $peer]
+    pipe $id,up $sock $peer
+    pipe $id,down $peer $sock
+}
+
+proc pipe {pipe from to} {
+    set ::queue($pipe) {}
+    set ::free($pipe) 0
+    set ::last($pipe) 0
+    set ::timer($pipe) ""
+    fileevent $from readable [list forward $pipe $from $to]
+}
+
+proc forward {pipe from to} {
+    global opt delay jitter
+
+    if {[catch {read $from 65536} data]} {
+        set data ""
+        set closed 1
+    } else {
+        set closed [expr {$data eq "" && [eof $from]}]
+    }
+    if {$data eq "" && !$closed} {
+        return
+    }
+    if {$closed} {
+        fileevent $from readable {}
+    }
+
+    # the link is busy while earlier packets go, then while this one does
+    set now [clock microseconds]
+    set start [expr {max($now, $::free($pipe))}]
+    if {$opt(bandwidth) > 0} {
+        set start [expr {$start + [string length $data] * 1e6 / $opt(bandwidth)}]
+    }
+    set ::free($pipe) $start
+
+    set due [expr {$start + $delay + rand() * $jitter}]
+    set due [expr {max($due, $::last($pipe))}]
+    set ::last($pipe) $due
+    lappend ::queue($pipe) [list $due $data]
+    if {$::timer($pipe) eq ""} {
+        pump $pipe $to
+    }
+}
+
+proc pump {pipe to} {
+    set ::timer($pipe) ""
+    set now [clock microseconds]
+    while {[llength $::queue($pipe)] > 0} {
+        lassign [lindex $::queue($pipe) 0] due data
+        if {$due > $now} {
+            break
+        }
+        set ::queue($pipe) [lrange $::queue($pipe) 1 end]
+        if {$data eq "" || [catch {puts -nonewline $to $data}]} {
+            hangup [lindex [split $pipe ,] 0]
+            return
+        }
+    }
+    if {[llength $::queue($pipe)] == 0} {
+        return
+    }
+
+    # timers only have milliseconds; poll for the rest
+    set wait [expr {$due - $now}]
+    if {$wait >= 2000} {
+        set ::timer($pipe) [after [expr {int($wait / 1000) - 1}] [list pump $pipe $to]]
+    } else {
+        set ::timer($pipe) [after 0 [list pump $pipe $to]]
+    }
+}
+
+# One side closed and all it sent has gone: close the other too
+proc hangup {id} {
+    if {![info exists ::sockets($id)]} {
+        return
+    }
+    foreach pipe [list $id,up $id,down] {
+        after cancel $::timer($pipe)
+        unset ::queue($pipe) ::free($pipe) ::last($pipe) ::timer($pipe)
+    }
+    foreach chan $::sockets($id) {
+        catch {close $chan}
+    }
+    unset ::sockets($id)
+}
+
+set server [socket -server accept -myaddr 127.0.0.1 $opt(listen)]
+puts [lindex [fconfigure $server -sockname] 2]
+flush stdout
+vwait forever
@@ -0,0 +1,216 @@
+#
+# program to benchmark the parts of Pgtcl that don't talk to a server:
+#  turning results into Tcl values, looking up handles, quoting and
+#  bytea.  The results are made by ::pg::internal::synthetic_result, so
+#  no PostgreSQL is needed, and the runs are short and steady enough to
+#  profile:
+#
+#      perf record -g tclsh micro.tcl -only result_llist*
+#
+# usage: tclsh micro.tcl ?-out file? ?-rows n? ?-columns n? ?-size bytes?
+#            ?-iterations n? ?-only pattern? ?-label text?
+#
+# -rows, -columns and -size give the shape of the results, 1000 rows of
+# 8 columns of 16 bytes by default.  -iterations is how many times each
+# benchmark runs.  "make microbench" runs this with BENCHFLAGS.
+#
+# $Id$
+#
+
+array set opt {
+    out        ""
+    rows       1000
+    columns    8
+    size       16
+    iterations 200
+    only       *
+    label      ""
+}
+
+proc usage {} {
+    puts stderr "usage: [file tail [info script]] ?-out file? ?-rows n? ?-columns n? ?-size bytes? ?-iterations n? ?-only pattern? ?-label text?"
+    exit 1
+}
+
+for {set i 0} {$i < [llength $argv]} {incr i} {
+    set arg [lindex $argv $i]
+    switch -- $arg {
+        -out - -rows - -columns - -size - -iterations - -only - -label {
+            if {[incr i] >= [llength $argv]} usage
+            set opt([string range $arg 1 end]) [lindex $argv $i]
+        }
+        default usage
+    }
+}
+
+source [file join [file dirname [info script]] benchlib.tcl]
+
+#
+# the benchmarks
+#
+proc run {} {
+    global opt
+
+    set n $opt(iterations)
+    set rows $opt(rows)
+    set shape [list -rows $rows -columns $opt(columns) -size $opt(size)]
+
+    # a result of text, one of all the types there are, and one with NULLs
+    set text [::pg::internal::synthetic_result {*}$shape]
+    set mixed [::pg::internal::synthetic_result {*}$shape -types \
+        {text int4 int8 float8 numeric bool timestamptz varchar}]
+    set nulls [::pg::internal::synthetic_result {*}$shape -nulls 0.2]
+    set bytea [::pg::internal::synthetic_result {*}$shape -types bytea]
+    set arrays [::pg::internal::synthetic_result {*}$shape -types {int4[] text[]}]
+
+    measure synthetic_result $n {
+        pg_result [::pg::internal::synthetic_result {*}$shape] -clear
+    } $rows rows
+
+    foreach {name res} [list text $text mixed $mixed nulls $nulls] {
+        measure result_list_$name $n {
+            pg_result $res -list
+        } $rows rows
+        measure result_llist_$name $n {
+            pg_result $res -llist
+        } $rows rows
+        measure result_dict_$name $n {
+            pg_result $res -dict
+        } $rows rows
+        measure result_columnar_$name $n {
+            pg_result $res -columnar
+        } $rows rows
+        measure result_assign_$name $n {
+            pg_result $res -assign a
+            unset a
+        } $rows rows
+        measure result_assign_lazy_$name $n {
+            pg_result $res -assign a -lazy
+            set a(0,c1)
+            unset a
+        } $rows rows
+        measure result_getTuple_$name $n {
+            for {set t 0} {$t < $rows} {incr t} {
+                pg_result $res -getTuple $t
+            }
+        } $rows rows
+        measure result_tupleArray_$name $n {
+            for {set t 0} {$t < $rows} {incr t} {
+                pg_result $res -tupleArray $t a
+            }
+        } $rows rows
+        measure result_foreach_$name $n {
+            pg_result $res -foreach {c1 c2 c3} {}
+        } $rows rows
+        measure result_foreach_array_$name $n {
+            pg_result $res -foreach -array a {}
+        } $rows rows
+    }
+
+    measure result_columnar_typed_mixed $n {
+        pg_result $mixed -columnar -typed
+    } $rows rows
+
+    # wide rows, whatever -columns says, setting a variable per column
+    foreach cols {10 100} {
+        set wide [::pg::internal::synthetic_result -rows $rows -columns $cols -size $opt(size)]
+        measure result_assign_cols$cols $n {
+            pg_result $wide -assign a
+            unset a
+        } $rows rows
+        measure result_assign_lazy_cols$cols $n {
+            pg_result $wide -assign a -lazy
+            set a(0,c1)
+            unset a
+        } $rows rows
+        measure result_tupleArray_cols$cols $n {
+            for {set t 0} {$t < $rows} {incr t} {
+                pg_result $wide -tupleArray $t a
+            }
+        } $rows rows
+        pg_result $wide -clear
+    }
+
+    # a page of 100 rows of a result 100 times as big, as a grid shows it
+    set big [::pg::internal::synthetic_result -rows [expr {$rows * 100}] \
+        -columns $opt(columns) -size $opt(size)]
+    set middle [expr {$rows * 50}]
+    measure result_llist_page100 $n {
+        pg_result $big -llist -rows $middle 100
+    } 100 rows
+    measure result_llist_page100_columns2 $n {
+        pg_result $big -llist -rows $middle 100 -columns {c1 c2}
+    } 100 rows
+    measure result_column $n {
+        pg_result $big -column c1 -rows $middle $rows
+    } $rows rows
+    pg_result $big -clear
+
+    # joining by key: indexing the first column, then 1000 lookups, and
+    # the same through -assignbyidx, which copies the whole result
+    set keys [pg_result $mixed -column c1 -rows 0 1000]
+    measure result_index $n {
+        pg_result $mixed -index c2
+        pg_result $mixed -index c1
+    } [expr {$rows * 2}] rows
+    pg_result $mixed -index c1
+    measure result_lookup $n {
+        foreach key $keys {
+            pg_result $mixed -lookup $key
+        }
+    } [llength $keys] lookups
+    measure result_assignbyidx_lookup $n {
+        pg_result $mixed -assignbyidx byKey
+        foreach key $keys {
+            set byKey($key,c2)
+        }
+        unset byKey
+    } [llength $keys] lookups
+
+    pg_result $bytea -bytea binary
+    measure result_llist_bytea $n {
+        pg_result $bytea -llist
+    } [expr {$rows * $opt(columns) * $opt(size)}] bytes
+
+    pg_result $arrays -arrays list
+    measure result_llist_arrays $n {
+        pg_result $arrays -llist
+    } $rows rows
+
+    # the cost of finding a result from its handle, and of a command,
+    # too small to time one at a time
+    measure result_handle $n {
+        for {set c 0} {$c < 1000} {incr c} {
+            pg_result $text -numTuples
+        }
+    } 1000 calls
+    measure result_handle_command $n {
+        for {set c 0} {$c < 1000} {incr c} {
+            $text -numTuples
+        }
+    } 1000 calls
+
+    set value [string repeat "it's \\ a value " [expr {$opt(size) / 8 + 1}]]
+    measure quote $n {
+        for {set c 0} {$c < 1000} {incr c} {
+            pg_quote $value
+        }
+    } [expr {[string length $value] * 1000}] bytes
+
+    set blob [string repeat [binary format c* {0 1 2 39 92 255}] [expr {$opt(size) * 64}]]
+    set escaped [pg_escape_bytea $blob]
+    measure escape_bytea [expr {$n * 10}] {
+        pg_escape_bytea $blob
+    } [string length $blob] bytes
+    measure unescape_bytea [expr {$n * 10}] {
+        pg_unescape_bytea $escaped
+    } [string length $blob] bytes
+
+    foreach res [list $text $mixed $nulls $bytea $arrays] {
+        pg_result $res -clear
+    }
+}
+
+run
+write_json [json_head [dict create rows $opt(rows) columns $opt(columns) \
+    size $opt(size)]]
@@ -0,0 +1,87 @@
+#
+# program to measure query throughput from several threads sharing one
+#  process-wide connection pool (pg_pool create -shared).
+#
+# usage: tclsh thread_pool_bench.tcl ?maxThreads? ?seconds?
+#
+# Runs the same workload with 1, 2, 4, ... maxThreads worker threads and
+# prints the queries per second for each, which should go up roughly
+# with the number of cores until the server becomes the bottleneck.
+#
+# $Id$
+#
+
+package require Thread
+package require Pgtcl
+
+if {[file exists conninfo.tcl]} {
+    source conninfo.tcl
+}
+
+set maxThreads [expr {[llength $argv] > 0 ? [lindex $argv 0] : 8}]
+set seconds [expr {[llength $argv] > 1 ? [lindex $argv 1] : 5}]
+
+if {[info exists ::conninfo]} {
+    set conninfo ""
+    foreach {k v} [array get ::conninfo] {
+        append conninfo "$k='$v' "
+    }
+} else {
+    set conninfo ""
+}
+
+# the main thread creates the pool, the workers attach to it by name
+pg_pool create bench -shared 1 -conninfo $conninfo -min 1 -max $maxThreads
+
+set worker {
+    package require Pgtcl
+    pg_pool create bench -shared 1
+
+    proc run {seconds} {
+        set n 0
+        set end [expr {[clock milliseconds] + $seconds * 1000}]
+        while {[clock milliseconds] < $end} {
+            set conn [pg_pool acquire bench -timeout 0]
+            set res [pg_exec $conn "SELECT count(*) FROM generate_series(1, 100)"]
+            pg_result $res -clear
+            pg_pool release bench $conn
+            incr n
+        }
+        return $n
+    }
+    thread::wait
+}
+
+puts [format "%8s %12s %12s" threads queries q/sec]
+
+for {set nthreads 1} {$nthreads <= $maxThreads} {set nthreads [expr {$nthreads * 2}]} {
+    set tids {}
+    for {set i 0} {$i < $nthreads} {incr i} {
+        lappend tids [thread::create $worker]
+    }
+
+    unset -nocomplain done
+    foreach tid $tids {
+        thread::send -async $tid [list run $seconds] done($tid)
+    }
+
+    set total 0
+    foreach tid $tids {
+        if {![info exists done($tid)]} {
+            vwait done($tid)
+        }
+        incr total $done($tid)
+    }
+
+    puts [format "%8d %12d %12.1f" $nthreads $total [expr {double($total) / $seconds}]]
+
+    foreach tid $tids {
+        thread::release $tid
+    }
+}
+
+puts ""
+foreach {k v} [pg_pool stats bench] {
+    puts [format "%-14s %s" $k $v]
+}
+pg_pool destroy bench